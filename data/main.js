@@ -1,11 +1,16 @@
 const JOYSTICK_CLIP_RANGE = 0.2;
-const GAMMA = 1.5;
 const JOINT_SPEED = 0.02; // range/s
-const IK_SPEED = 4; // mm/s
+const JOG_SPEED = 100; // mm/s of the end of the arm, at most KINEMATICS_JOG_SPEED_MAX_MM_S in kinematics.h
 const ACTIVE_TIMEOUT = 1; // s to send drive and/or arm commands after their joysticks are released, must be at least 2 * COMMAND_INTERVAL
 const COMMAND_INTERVAL = 0.1; // s
+const TELEMETRY_RATE_AUTHORIZED = 50; // Hz of telemetry requested while unlocked, at most TELEMETRY_MAX_RATE in web.h
+const TELEMETRY_RATE_SPECTATOR = 2; // Hz of telemetry requested while locked
 const LCD_WIDTH = 320;
 const LCD_HEIGHT = 240;
+const UPLOAD_PALETTED = true; // Send uploaded images as compact paletted images instead of raw RGB565
+const UPLOAD_MAGIC = "MRIU"; // See image_upload_header in image.h
+const IMAGE_ENCODING_RAW = 0;
+const IMAGE_ENCODING_RLE = 1;
 
 function lerp(x, x0, x1, y0, y1) {
     return (y0 * (x1 - x) + y1 * (x - x0)) / (x1 - x0);
@@ -19,19 +24,171 @@ function lerpClamp(x, x0, x1, y1, y2) {
     return clamp(lerp(x, x0, x1, y1, y2), y1, y2);
 }
 
-function arcadeDrive(rotate, drive) {
-    // Convert to polar.
-    let r = Math.hypot(rotate, drive);
-    let t = Math.atan2(drive, rotate);
-    // Rotate by 45 degrees.
-    t -= Math.PI / 4;
-    // Convert to cartesian, rescale and clamp.
+// Compress packed pixels as decoded by image_rle_decode in image.c. A control
+// byte c < 0x80 is followed by c + 1 literal bytes, c >= 0x80 by one byte
+// repeated (c & 0x7f) + 2 times.
+function rleEncode(data) {
+    const encoded = [];
+    let literalStart = 0;
+    const flushLiteral = end => {
+        for (let start = literalStart; start < end; start += 128) {
+            const length = Math.min(128, end - start);
+            encoded.push(length - 1);
+            for (let i = start; i < start + length; i++) encoded.push(data[i]);
+        }
+    };
+    let i = 0;
+    while (i < data.length) {
+        let run = 1;
+        while (i + run < data.length && run < 129 && data[i + run] === data[i]) run++;
+        // A run of 2 costs as much as 2 literals but would split a literal.
+        if (run >= 3) {
+            flushLiteral(i);
+            encoded.push(0x80 | (run - 2), data[i]);
+            i += run;
+            literalStart = i;
+        } else {
+            i++;
+        }
+    }
+    flushLiteral(i);
+    return Uint8Array.from(encoded);
+}
+
+// Split the two bytes of an RGB565 pixel as sent to the display into 8 bit
+// channels.
+function unpackRGB565(color) {
     return [
-        r * Math.cos(t) * 2 / Math.SQRT2,
-        r * Math.sin(t) * 2 / Math.SQRT2
+        (color >> 8) & 0b11111000,
+        (color >> 3) & 0b11111100,
+        (color << 3) & 0b11111000,
     ];
 }
 
+// Pick at most 256 colors for pixels, the average colors of the most common
+// buckets of 4 bits per channel.
+function quantize(histogram) {
+    const buckets = new Map();
+    for (const [color, count] of histogram) {
+        const [r, g, b] = unpackRGB565(color);
+        const key = (r >> 4) << 8 | (g >> 4) << 4 | (b >> 4);
+        const bucket = buckets.get(key) || [0, 0, 0, 0];
+        bucket[0] += r * count;
+        bucket[1] += g * count;
+        bucket[2] += b * count;
+        bucket[3] += count;
+        buckets.set(key, bucket);
+    }
+    return [...buckets.values()]
+        .sort((a, b) => b[3] - a[3])
+        .slice(0, 256)
+        .map(([r, g, b, count]) => {
+            r = Math.round(r / count);
+            g = Math.round(g / count);
+            b = Math.round(b / count);
+            return ((r & 0b11111000) | (g >> 5)) << 8 | ((g << 3) & 0b11100000) | (b >> 3);
+        });
+}
+
+// Encode RGB565 pixels, 2 bytes each, in the image_upload_header format of
+// image.h: the fewest bits per pixel that fit the palette, run-length encoded
+// if that is smaller.
+function encodeCompactUpload(pixels) {
+    const pixelCount = pixels.length / 2;
+    const histogram = new Map();
+    for (let i = 0; i < pixelCount; i++) {
+        const color = pixels[i * 2] << 8 | pixels[i * 2 + 1];
+        histogram.set(color, (histogram.get(color) || 0) + 1);
+    }
+    const palette = histogram.size <= 256 ? [...histogram.keys()] : quantize(histogram);
+    const paletteRGB = palette.map(unpackRGB565);
+    const indices = new Map();
+    palette.forEach((color, i) => indices.set(color, i));
+    const nearest = color => {
+        let index = indices.get(color);
+        if (index === undefined) {
+            const [r, g, b] = unpackRGB565(color);
+            let best = Infinity;
+            paletteRGB.forEach(([pr, pg, pb], i) => {
+                const distance = (r - pr) ** 2 + (g - pg) ** 2 + (b - pb) ** 2;
+                if (distance < best) {
+                    best = distance;
+                    index = i;
+                }
+            });
+            indices.set(color, index);
+        }
+        return index;
+    };
+
+    const bpp = palette.length <= 4 ? 2 : (palette.length <= 16 ? 4 : 8);
+    const pixelsPerByte = 8 / bpp;
+    let packed = new Uint8Array(pixelCount / pixelsPerByte);
+    for (let i = 0; i < pixelCount; i++) {
+        packed[Math.floor(i / pixelsPerByte)] |= nearest(pixels[i * 2] << 8 | pixels[i * 2 + 1]) << (i % pixelsPerByte * bpp);
+    }
+    let encoding = IMAGE_ENCODING_RAW;
+    const compressed = rleEncode(packed);
+    if (compressed.length < packed.length) {
+        encoding = IMAGE_ENCODING_RLE;
+        packed = compressed;
+    }
+
+    const encoded = new Uint8Array(8 + palette.length * 2 + packed.length);
+    const data = new DataView(encoded.buffer);
+    for (let i = 0; i < UPLOAD_MAGIC.length; i++) data.setUint8(i, UPLOAD_MAGIC.charCodeAt(i));
+    data.setUint8(4, bpp);
+    data.setUint8(5, encoding);
+    data.setUint16(6, palette.length, true);
+    palette.forEach((color, i) => {
+        encoded[8 + i * 2] = color >> 8;
+        encoded[8 + i * 2 + 1] = color & 0xff;
+    });
+    encoded.set(packed, 8 + palette.length * 2);
+    return encoded;
+}
+
+// Encodes a single command frame. name is a key of COMMAND_PAYLOADS in protocol.js and values its payload fields.
+function encodeCommand(name, override, values = {}) {
+    const buffer = new ArrayBuffer(COMMAND.size);
+    const data = new DataView(buffer);
+    writeStruct(COMMAND, data, { id: COMMAND_PAYLOADS[name].id, override });
+    writeStruct(COMMAND_PAYLOADS[name], data, values, COMMAND_PAYLOAD_OFFSET);
+    return buffer;
+}
+
+// Packs several commands into one WebSocket frame, see COMMAND_BATCH in protocol.h.
+class CommandBatch {
+    constructor(override) {
+        this.buffer = new ArrayBuffer(COMMAND_FRAME_MAX);
+        this.data = new DataView(this.buffer);
+        this.length = 2;
+        this.count = 0;
+        this.data.setUint8(0, COMMAND_BATCH);
+        this.data.setUint8(1, override);
+    }
+
+    // Adds a command like encodeCommand.
+    add(name, values = {}) {
+        const payload = COMMAND_PAYLOADS[name];
+        this.data.setUint8(this.length, payload.id);
+        this.data.setUint8(this.length + 1, payload.size);
+        writeStruct(payload, this.data, values, this.length + 2);
+        this.length += 2 + payload.size;
+        this.count++;
+    }
+
+    // Adds a header so the batch is dropped if it arrives out of order or late. Must be added first.
+    header(seq) {
+        this.add("header", { seq, client_ms: performance.now() >>> 0 });
+        this.count--;
+    }
+
+    send(socket) {
+        if (this.count > 0) socket.send(this.buffer.slice(0, this.length));
+    }
+}
+
 class Joystick {
     dom;
     x;
@@ -174,16 +331,15 @@ window.onload = () => {
     socket.binaryType = "arraybuffer";
 
     let authorized = false;
+    let fd = -1;
+    let seq = 0;
+    // Smallest difference between the time the rover received a header and the client time in it, see check_header in web.c.
+    let minUplinkOffset = Infinity;
     let targetAngles = {
         x: 0,
         j2: 0,
         j3: 0
     };
-    let targetIK = {
-        x: 0,
-        y: 0,
-        z: 0,
-    };
     let ik = false;
     let lastTime = performance.now();
     let driveActiveUntil = 0;
@@ -193,7 +349,15 @@ window.onload = () => {
     const drive = new Joystick("drive");
     const armLeft = new Joystick("arm-left");
     const armRight = new Joystick("arm-right");
-    const dom = ["lock", "on", "off", "ik", "override", "speed", "setSpeed", "telemetry", "display", "upload"].reduce((a, v) => ({ ...a, [v]: document.getElementById(v) }), {});
+    const sendTelemetryRate = () => {
+        if (socket.readyState === WebSocket.OPEN) {
+            const rate = authorized ? TELEMETRY_RATE_AUTHORIZED : TELEMETRY_RATE_SPECTATOR;
+            socket.send(encodeCommand("telemetry_rate", override, { rate }));
+        }
+    };
+    socket.addEventListener("open", sendTelemetryRate);
+
+    const dom = ["lock", "on", "off", "ik", "override", "speed", "setSpeed", "telemetry", "display", "upload", "ae"].reduce((a, v) => ({ ...a, [v]: document.getElementById(v) }), {});
 
     dom.ik.style.backgroundColor = "#008";
     dom.ik.addEventListener("click", _ => {
@@ -205,12 +369,7 @@ window.onload = () => {
     dom.setSpeed.disabled = true;
     dom.setSpeed.addEventListener("click", _ => {
         if (authorized && socket.readyState === WebSocket.OPEN) {
-            const buffer = new ArrayBuffer(8);
-            const data = new DataView(buffer);
-            data.setUint8(0, 6, true);
-            data.setUint8(1, override, true);
-            data.setUint16(2, dom.speed.valueAsNumber * 0x10000, true);
-            socket.send(buffer);
+            socket.send(encodeCommand("drive_speed", override, { speed: Math.round(dom.speed.valueAsNumber * 0xffff) }));
         }
     });
     dom.override.disabled = true;
@@ -227,6 +386,7 @@ window.onload = () => {
         dom.speed.disabled = !authorized;
         dom.override.disabled = !authorized;
         dom.setSpeed.disabled = !authorized;
+        sendTelemetryRate();
         if (authorized) {
             dom.lock.children[0].style.display = "none"; dom.lock.children[1].style.display = "initial";
         } else {
@@ -236,20 +396,12 @@ window.onload = () => {
     dom.lock.children[1].style.display = "none";
     dom.on.addEventListener("click", _ => {
         if (authorized && socket.readyState === WebSocket.OPEN) {
-            const buffer = new ArrayBuffer(8);
-            const data = new DataView(buffer);
-            data.setUint8(0, 1, true);
-            data.setUint8(1, override, true);
-            socket.send(buffer);
+            socket.send(encodeCommand("on", override));
         }
     });
     dom.off.addEventListener("click", _ => {
         if (socket.readyState === WebSocket.OPEN) {
-            const buffer = new ArrayBuffer(8);
-            const data = new DataView(buffer);
-            data.setUint8(0, 0, true);
-            data.setUint8(1, override, true);
-            socket.send(buffer);
+            socket.send(encodeCommand("off", override));
         }
     });
 
@@ -259,15 +411,12 @@ window.onload = () => {
     dom.display.addEventListener("change", _ => {
         if (dom.display.selectedIndex < IMAGE_NAMES.length) {
             if (socket.readyState === WebSocket.OPEN) {
-                const buffer = new ArrayBuffer(8);
-                const data = new DataView(buffer);
-                data.setUint8(0, 5, true);
-                data.setUint8(1, override, true);
-                data.setUint8(2, dom.display.selectedIndex, true);
-                socket.send(buffer);
+                socket.send(encodeCommand("display", override, { idx: dom.display.selectedIndex }));
             }
         } else {
-            fetch("/display", { method: "POST", body: uploadedImages[dom.display.selectedIndex - IMAGE_NAMES.length] });
+            fetch("/display", { method: "POST", body: uploadedImages[dom.display.selectedIndex - IMAGE_NAMES.length] })
+                .then(response => response.text())
+                .then(console.log);
         }
     });
 
@@ -324,7 +473,7 @@ window.onload = () => {
                     convertedImageData[i * 2 + 1] = ((g << 3) & 0b11100000) | ((b >> 3) & 0b00011111);
                 }
 
-                uploadedImages[idx] = convertedImageData;
+                uploadedImages[idx] = UPLOAD_PALETTED ? encodeCompactUpload(convertedImageData) : convertedImageData;
             }
         }
         uploadedImageNames[idx] = dom.upload.files[0].name;
@@ -353,11 +502,26 @@ window.onload = () => {
 
     socket.addEventListener("message", event => {
         let data = new DataView(event.data);
+        // Sent once before the first telemetry frame, see telemetry in web.c.
+        if (data.byteLength === TELEMETRY_FD.size) {
+            fd = readStruct(TELEMETRY_FD, data).fd;
+            return;
+        }
+        // Echo of the last header sent.
+        if (data.byteLength === TELEMETRY_ECHO.size) {
+            const now = performance.now() >>> 0;
+            const echo = readStruct(TELEMETRY_ECHO, data);
+            const rtt = ((now - echo.client_ms) >>> 0) - ((echo.sent_ms - echo.received_ms) >>> 0);
+            const uplinkOffset = (echo.received_ms - echo.client_ms) | 0;
+            minUplinkOffset = Math.min(minUplinkOffset, uplinkOffset);
+            dom.telemetry.title = `RTT ${rtt} ms, uplink delay ${uplinkOffset - minUplinkOffset} ms over best, ${echo.dropped} batches dropped`;
+            return;
+        }
+        const t = readStruct(TELEMETRY, data);
 
-        let fd = data.getInt32(0, true);
-        let drivePriorityFD = data.getInt32(4, true);
-        let armPriorityFD = data.getInt32(8, true);
-        let overrideFD = data.getInt32(12, true);
+        let drivePriorityFD = t.drive_priority_fd;
+        let armPriorityFD = t.arm_priority_fd;
+        let overrideFD = t.override_fd;
         if (overrideFD !== -1) {
             if (overrideFD === fd) {
                 drive.dom.className = "joystick override";
@@ -383,20 +547,20 @@ window.onload = () => {
             }
         }
 
-        telemetry.bv.update(data.getFloat32(20, true) + data.getFloat32(24, true) + data.getFloat32(28, true));
-        telemetry.ea.update(data.getFloat32(16, true));
-        telemetry.c1.update(data.getFloat32(20, true));
-        telemetry.c2.update(data.getFloat32(24, true));
-        telemetry.c3.update(data.getFloat32(28, true));
-        telemetry.dl.update(Math.abs(data.getInt16(32, true) / 0x7000 * 100));
-        telemetry.dr.update(Math.abs(data.getInt16(34, true) / 0x7000 * 100));
-        let ax = data.getUint16(36, true) / 0x10000;
-        let aj2 = data.getUint16(38, true) / 0x10000;
-        let aj3 = data.getUint16(40, true) / 0x10000;
-        let aex = data.getInt16(42, true);
-        let aey = data.getInt16(44, true);
-        let aez = data.getInt16(46, true);
-        if (!authorized) dom.speed.valueAsNumber = data.getUint16(48, true) / 0x10000;
+        telemetry.bv.update(t.cell1 + t.cell2 + t.cell3);
+        telemetry.ea.update(t.esc_current);
+        telemetry.c1.update(t.cell1);
+        telemetry.c2.update(t.cell2);
+        telemetry.c3.update(t.cell3);
+        telemetry.dl.update(Math.abs(t.l / 0x7000 * 100));
+        telemetry.dr.update(Math.abs(t.r / 0x7000 * 100));
+        let ax = t.ax / 0xffff;
+        let aj2 = t.j2 / 0xffff;
+        let aj3 = t.j3 / 0xffff;
+        let aex = t.x;
+        let aey = t.y;
+        let aez = t.z;
+        if (!authorized) dom.speed.valueAsNumber = t.drive_speed / 0xffff;
 
         telemetry.ax.update(ax * 100);
         telemetry.aj2.update(aj2 * 100);
@@ -404,16 +568,14 @@ window.onload = () => {
         telemetry.aex.update(aex);
         telemetry.aey.update(aey);
         telemetry.aez.update(aez);
+        // The rover got as close to the last IK target as the arm allows, or is jogging without being held back.
+        dom.ae.className = t.ik_reachable ? "" : "unreachable";
 
-        // Set the non-controlled target values from telemetry.
+        // The rover moves the joints while jogging, so angle control picks up from where it left them.
         if (ik) {
             targetAngles.x = ax;
-            targetAngles.j2 = j2;
-            targetAngles.j3 = j3;
-        } else {
-            targetIK.x = aex;
-            targetIK.y = aey;
-            targetIK.z = aez;
+            targetAngles.j2 = aj2;
+            targetAngles.j3 = aj3;
         }
     });
 
@@ -422,52 +584,41 @@ window.onload = () => {
         let deltaT = (now - lastTime) * 1000;
         lastTime = now;
 
-        let driveSpeed = dom.speed.valueAsNumber;
-        let driveX = drive.x;
-        let driveY = drive.y;
-        // Scale exponentially.
-        driveX = driveX < 0 ? -Math.pow(-driveX, GAMMA) : Math.pow(driveX, GAMMA);
-        driveY = driveY < 0 ? -Math.pow(-driveY, GAMMA) : Math.pow(driveY, GAMMA);
-        let [leftSpeed, rightSpeed] = arcadeDrive(driveX, driveY);
-        leftSpeed = lerpClamp(leftSpeed, -1, 1, -driveSpeed, driveSpeed);
-        rightSpeed = lerpClamp(rightSpeed, -1, 1, -driveSpeed, driveSpeed);
-
-        let buffer = new ArrayBuffer(8);
-        let data = new DataView(buffer);
+        // Drive and arm are sent together in one frame.
+        const batch = new CommandBatch(override);
+        batch.header(seq);
 
         if (drive.active) driveActiveUntil = now + ACTIVE_TIMEOUT * 1000;
         if (socket.readyState === WebSocket.OPEN && driveActiveUntil > now) {
-            data.setUint8(0, 2, true);
-            data.setUint8(1, override, true);
-            data.setInt16(2, leftSpeed * 0x7000, true);
-            data.setInt16(4, rightSpeed * 0x7000, true);
-            socket.send(buffer);
+            // The rover mixes the joystick into wheel speeds, see mixer.h.
+            batch.add("drive_axes", { x: Math.round(drive.x * 0x7fff), y: Math.round(drive.y * 0x7fff) });
         }
 
         if (armLeft.active || armRight.active) armActiveUntil = now + ACTIVE_TIMEOUT * 1000;
         if (socket.readyState === WebSocket.OPEN && armActiveUntil > now) {
             if (ik) {
-                targetAngles.x = clamp(targetAngles.x + armRight.x * IK_SPEED * deltaT, 0, 500);
-                targetAngles.j2 = clamp(targetAngles.j2 + armLeft.x * IK_SPEED * deltaT, 0, 500);
-                targetAngles.j3 = clamp(targetAngles.j3 + armLeft.y * IK_SPEED * deltaT, 0, 500);
-
-                data.setUint8(0, 4, true);
-                data.setUint8(1, override, true);
-                data.setInt16(2, targetIK.x, true);
-                data.setInt16(4, targetIK.y, true);
-                data.setInt16(6, targetIK.z, true);
+                // The rover integrates the velocity, see kinematics.h. The left joystick moves the end of the arm forward
+                // and sideways, the right one up and down.
+                batch.add("arm_jog", {
+                    x: Math.round(-armLeft.y * JOG_SPEED),
+                    y: Math.round(-armLeft.x * JOG_SPEED),
+                    z: Math.round(-armRight.y * JOG_SPEED),
+                });
             } else {
                 targetAngles.x = clamp(targetAngles.x + armLeft.x * JOINT_SPEED * deltaT, 0, 1);
                 targetAngles.j2 = clamp(targetAngles.j2 + armRight.x * JOINT_SPEED * deltaT, 0, 1);
                 targetAngles.j3 = clamp(targetAngles.j3 + armRight.y * JOINT_SPEED * deltaT, 0, 1);
 
-                data.setUint8(0, 3, true);
-                data.setUint8(1, override, true);
-                data.setUint16(2, targetAngles.x * 0x10000, true);
-                data.setUint16(4, targetAngles.j2 * 0x10000, true);
-                data.setUint16(6, targetAngles.j3 * 0x10000, true);
+                batch.add("arm_angles", {
+                    x: Math.round(targetAngles.x * 0xffff),
+                    j2: Math.round(targetAngles.j2 * 0xffff),
+                    j3: Math.round(targetAngles.j3 * 0xffff),
+                });
             }
-            socket.send(buffer);
+        }
+        if (socket.readyState === WebSocket.OPEN && batch.count > 0) {
+            batch.send(socket);
+            seq = (seq + 1) & 0xffff;
         }
     }, COMMAND_INTERVAL * 1000);
 };
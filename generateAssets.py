@@ -0,0 +1,120 @@
+#!/bin/python3
+import gzip
+import os
+
+# Files in data that are not served by root_handler.
+EXCLUDED = {"images.bin", "assets.bin"}
+# Aliases served as another asset.
+ALIASES = {"/": "/index.html"}
+# MIME type and whether gzip is worth trying, by extension.
+TYPES = {
+    ".html": ("text/html", True),
+    ".js": ("text/javascript", True),
+    ".css": ("text/css", True),
+    ".json": ("application/json", True),
+    ".svg": ("image/svg+xml", True),
+    ".txt": ("text/plain", True),
+    ".woff2": ("font/woff2", False),
+    ".png": ("image/png", False),
+    ".jpg": ("image/jpeg", False),
+    ".ico": ("image/x-icon", True),
+}
+
+
+def fnv1a(data: bytes, seed: int = 0) -> int:
+    """FNV-1a with a seed, as asset_hash in src/web.c."""
+    hash = 2166136261 ^ seed
+    for byte in data:
+        hash = ((hash ^ byte) * 16777619) & 0xFFFFFFFF
+    return hash
+
+
+def c_string(value: str) -> str:
+    return '"' + value.replace("\\", "\\\\").replace('"', '\\"') + '"'
+
+
+assets = []
+bundle = bytearray()
+for name in sorted(os.listdir("data")):
+    if name in EXCLUDED or name.endswith(".gz") or not os.path.isfile(f"data/{name}"):
+        continue
+    mime, compressible = TYPES.get(os.path.splitext(name)[1], ("application/octet-stream", False))
+    with open(f"data/{name}", "rb") as f:
+        data = f.read()
+    encoding = None
+    if compressible:
+        # mtime=0 keeps the output, and so the ETag, stable between builds.
+        compressed = gzip.compress(data, compresslevel=9, mtime=0)
+        if len(compressed) < len(data):
+            encoding = "gzip"
+            print(
+                f"{name}: {len(compressed)} / {len(data)} bytes, "
+                f"ratio {len(data) / len(compressed):.2f}"
+            )
+            data = compressed
+    # Keep every asset word aligned in flash.
+    bundle += bytes(-len(bundle) % 4)
+    assets.append(
+        {
+            "path": f"/{name}",
+            "type": mime,
+            "encoding": encoding,
+            "etag": f'"{fnv1a(data):08x}"',
+            "offset": len(bundle),
+            "length": len(data),
+        }
+    )
+    bundle += data
+
+# Find the smallest power of two table and a seed that map every path and alias
+# to a different slot.
+paths = [asset["path"] for asset in assets]
+index = {path: i for i, path in enumerate(paths)}
+keys = paths + list(ALIASES)
+for alias, target in ALIASES.items():
+    index[alias] = index[target]
+slots = 1
+while slots < len(keys):
+    slots *= 2
+seed = 0
+while True:
+    used = {fnv1a(key.encode(), seed) & (slots - 1) for key in keys}
+    if len(used) == len(keys):
+        break
+    seed += 1
+    if seed == 1 << 16:
+        seed = 0
+        slots *= 2
+table = [None] * slots
+for key in keys:
+    table[fnv1a(key.encode(), seed) & (slots - 1)] = key
+
+with open("data/assets.bin", "wb") as f:
+    f.write(bundle)
+
+with open("src/assets.c", "w") as f:
+    f.write("// Generated by generateAssets.py from the data folder, do not edit.\n")
+    f.write('#include "assets.h"\n\n')
+    f.write("const asset assets[] = {\n")
+    for asset in assets:
+        f.write("    {\n")
+        f.write(f"        .path = {c_string(asset['path'])},\n")
+        f.write(f"        .type = {c_string(asset['type'])},\n")
+        encoding = c_string(asset["encoding"]) if asset["encoding"] else "NULL"
+        f.write(f"        .encoding = {encoding},\n")
+        f.write(f"        .etag = {c_string(asset['etag'])},\n")
+        f.write(f"        .start = FILE_ASSETS_START + {asset['offset']},\n")
+        f.write(f"        .end = FILE_ASSETS_START + {asset['offset'] + asset['length']},\n")
+        f.write("    },\n")
+    f.write("};\n\n")
+    f.write(f"const uint32_t assetHashSeed = {seed};\n")
+    f.write(f"const uint32_t assetSlotMask = {slots - 1};\n")
+    f.write("const asset_slot assetSlots[] = {\n")
+    for key in table:
+        if key is None:
+            f.write("    {.path = NULL, .asset = -1},\n")
+        else:
+            f.write(f"    {{.path = {c_string(key)}, .asset = {index[key]}}},\n")
+    f.write("};\n")
+
+print(f"assets.bin: {len(bundle)} bytes, {len(assets)} assets, {slots} slots, seed {seed}")
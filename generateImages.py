@@ -1,7 +1,13 @@
 #!/bin/python3
+import argparse
 import os
+import struct
 from PIL import Image
 
+IMAGE_BUNDLE_MAGIC = b"MRIB"
+IMAGE_ENCODING_RAW = 0
+IMAGE_ENCODING_RLE = 1
+
 
 def get_define_value(header: str, name: str) -> str:
     location = header.find(f"#define {name} ")
@@ -11,6 +17,50 @@ def get_define_value(header: str, name: str) -> str:
     return header[location + len(name) + 9 : end]
 
 
+def rle_encode(data: bytes) -> bytes:
+    """Compress packed pixels as decoded by image_rle_decode in src/image.c.
+
+    A control byte c < 0x80 is followed by c + 1 literal bytes, c >= 0x80 by one
+    byte repeated (c & 0x7f) + 2 times.
+    """
+    encoded = bytearray()
+    literal = bytearray()
+
+    def flush_literal():
+        for start in range(0, len(literal), 128):
+            chunk = literal[start : start + 128]
+            encoded.append(len(chunk) - 1)
+            encoded.extend(chunk)
+        literal.clear()
+
+    i = 0
+    while i < len(data):
+        run = 1
+        while i + run < len(data) and run < 129 and data[i + run] == data[i]:
+            run += 1
+        # A run of 2 costs as much as 2 literals but would split a literal.
+        if run >= 3:
+            flush_literal()
+            encoded.append(0x80 | (run - 2))
+            encoded.append(data[i])
+            i += run
+        else:
+            literal.append(data[i])
+            i += 1
+    flush_literal()
+    return bytes(encoded)
+
+
+parser = argparse.ArgumentParser(
+    description="Pack the images folder into data/images.bin and data/images.js."
+)
+parser.add_argument(
+    "--raw",
+    action="store_true",
+    help="store every image as uncompressed 2bpp pixels",
+)
+args = parser.parse_args()
+
 # Get expected image information from header file.
 with open("include/tft.h", "r") as f:
     tft_h = f.read()
@@ -25,7 +75,7 @@ with open("data/images.js", "w") as f:
         f"const IMAGE_NAMES = [{", ".join([f'"{image_name}"' for image_name in image_names])}];"
     )
 
-packed_data = bytearray()
+images = []
 for image_name in image_names:
     image = Image.open(f"images/{image_name}")
 
@@ -43,18 +93,56 @@ for image_name in image_names:
     palette = quantized.getpalette()
     assert len(palette) == PALATTE_SIZE * 3
 
+    packed_palette = bytearray()
     for i in range(PALATTE_SIZE):
         r = palette[i * 3]
         g = palette[i * 3 + 1]
         b = palette[i * 3 + 2]
-        packed_data.append((r & 0b11111000) | ((g >> 5) & 0b00000111))
-        packed_data.append(((g << 3) & 0b11100000) | ((b >> 3) & 0b00011111))
+        packed_palette.append((r & 0b11111000) | ((g >> 5) & 0b00000111))
+        packed_palette.append(((g << 3) & 0b11100000) | ((b >> 3) & 0b00011111))
 
+    packed_pixels = bytearray()
     data = quantized.getdata()
     for i in range(0, LCD_WIDTH * LCD_HEIGHT, 4):
-        packed_data.append(
+        packed_pixels.append(
             data[i] | (data[i + 1] << 2) | (data[i + 2] << 4) | (data[i + 3] << 6)
         )
 
+    encoding = IMAGE_ENCODING_RAW
+    if not args.raw:
+        compressed = rle_encode(packed_pixels)
+        if len(compressed) < len(packed_pixels):
+            encoding = IMAGE_ENCODING_RLE
+            packed_pixels = compressed
+    raw_bytes = len(packed_palette) + LCD_WIDTH * LCD_HEIGHT // 4
+    packed_bytes = len(packed_palette) + len(packed_pixels)
+    print(
+        f"{image_name}: {packed_bytes} / {raw_bytes} bytes, "
+        f"ratio {raw_bytes / packed_bytes:.2f}"
+        f"{' (rle)' if encoding == IMAGE_ENCODING_RLE else ''}"
+    )
+    images.append((encoding, packed_palette + packed_pixels))
+
+# See image_bundle_header and image_bundle_entry in include/image.h.
+header_bytes = 8 + 12 * len(images)
+packed_data = bytearray(IMAGE_BUNDLE_MAGIC + struct.pack("<HH", len(images), 0))
+offset = header_bytes
+entries = []
+for encoding, image in images:
+    # Keep images word aligned for image_unpack_2bpp.
+    offset = (offset + 3) & ~3
+    entries.append((offset, image))
+    packed_data += struct.pack("<IIB3x", offset, len(image), encoding)
+    offset += len(image)
+for offset, image in entries:
+    packed_data += bytes(offset - len(packed_data))
+    packed_data += image
+
+total_raw = len(images) * (PALATTE_SIZE * 2 + LCD_WIDTH * LCD_HEIGHT // 4)
+print(
+    f"images.bin: {len(packed_data)} bytes, {total_raw} uncompressed"
+    + (f", ratio {total_raw / len(packed_data):.2f}" if packed_data else "")
+)
+
 with open("data/images.bin", "wb") as f:
     f.write(packed_data)
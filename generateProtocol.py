@@ -0,0 +1,142 @@
+#!/bin/python3
+import re
+
+# DataView accessor and size of every field type used in protocol.h.
+TYPES = {
+    "bool": ("Uint8", 1),
+    "uint8_t": ("Uint8", 1),
+    "int8_t": ("Int8", 1),
+    "uint16_t": ("Uint16", 2),
+    "int16_t": ("Int16", 2),
+    "uint32_t": ("Uint32", 4),
+    "int32_t": ("Int32", 4),
+    "float": ("Float32", 4),
+}
+
+TYPES_BY_ACCESSOR = {accessor: size for accessor, size in TYPES.values()}
+
+
+def parse_structs(header: str) -> dict:
+    """Return the layout of every packed typedef struct in header.
+
+    A layout is a dict with the size and the fields of the struct, each field
+    an (offset, DataView type) tuple. Members of an anonymous union are
+    returned as nested layouts with offsets from the start of the struct. The
+    offset in the comment of every field is checked.
+    """
+    structs = {}
+    # Stack of [layout, offset, is_union, union_size].
+    stack = []
+    for number, line in enumerate(header.splitlines(), 1):
+        line = line.strip()
+        if re.match(r"(typedef )?struct __attribute__\(\(__packed__\)\) \{$", line):
+            offset = stack[-1][1] if stack else 0
+            stack.append([{"size": 0, "fields": {}}, offset, False, 0])
+        elif line == "union {":
+            stack.append([{}, stack[-1][1], True, 0])
+        elif stack and (match := re.match(r"(\w+) (\w+);\s*// (\d+)", line)):
+            kind, name, comment = match.groups()
+            accessor, size = TYPES[kind]
+            layout, offset = stack[-1][0], stack[-1][1]
+            assert int(comment) == offset, f"line {number}: {name} is at {offset}"
+            layout["fields"][name] = (offset, accessor)
+            stack[-1][1] += size
+        elif stack and (match := re.match(r"\} ?(\w*);", line)):
+            layout, offset, is_union, union_size = stack.pop()
+            name = match.group(1)
+            if is_union:
+                # Members are nested layouts, the union takes its largest.
+                stack[-1][0]["fields"].update(layout)
+                stack[-1][1] += union_size
+            elif stack and stack[-1][2]:
+                # Member of a union.
+                layout["size"] = offset - stack[-1][1]
+                stack[-1][0][name] = layout
+                stack[-1][3] = max(stack[-1][3], layout["size"])
+            else:
+                layout["size"] = offset
+                structs[name] = layout
+    return structs
+
+
+def parse_defines(header: str) -> dict:
+    """Return the numeric defines in header."""
+    return {
+        name: int(value, 0)
+        for name, value in re.findall(r"^#define (\w+) (0x[0-9a-fA-F]+|\d+)$", header, re.M)
+    }
+
+
+def parse_command_ids(header: str) -> dict:
+    """Return the command_id values in header."""
+    return {name: int(value) for name, value in re.findall(r"^  (COMMAND_\w+) = (\d+),", header, re.M)}
+
+
+def command_payload_offset(command: dict) -> int:
+    """Return the offset of the payload union, which follows the plain fields of command."""
+    return max(
+        offset + TYPES_BY_ACCESSOR[accessor] for offset, accessor in (f for f in command["fields"].values() if isinstance(f, tuple))
+    )
+
+
+def js_layout(layout: dict, base: int = 0) -> str:
+    """Return the size and fields of layout as JS object members, with offsets from base."""
+    # Union members are nested layouts, not fields.
+    fields = ", ".join(
+        f'{name}: [{field[0] - base}, "{field[1]}"]'
+        for name, field in layout["fields"].items()
+        if isinstance(field, tuple)
+    )
+    return f"size: {layout['size']}, fields: {{{' ' + fields + ' ' if fields else ''}}}"
+
+
+def main():
+    with open("include/protocol.h") as f:
+        header = f.read()
+    structs = parse_structs(header)
+    defines = parse_defines(header)
+    command_ids = parse_command_ids(header)
+
+    command = structs["command"]
+    payload_offset = command_payload_offset(command)
+
+    with open("data/protocol.js", "w") as f:
+        f.write("// Generated by generateProtocol.py from include/protocol.h, do not edit.\n")
+        for name, value in {**defines, **command_ids}.items():
+            f.write(f"const {name} = {hex(value) if value >= 0x80 else value};\n")
+        f.write("\n// Layouts of the structs in protocol.h: size and [offset, DataView type] of every field.\n")
+        for name in ("command", "telemetry", "telemetry_fd", "telemetry_echo"):
+            f.write(f"const {name.upper()} = {{ {js_layout(structs[name])} }};\n")
+        f.write("// Payload of every command, after override, by the name of its command_id in lower case.\n")
+        f.write("const COMMAND_PAYLOADS = {\n")
+        for name in command_ids:
+            member = name[len("COMMAND_") :].lower()
+            layout = command["fields"].get(member, {"size": 0, "fields": {}})
+            f.write(f"    {member}: {{ id: {name}, {js_layout(layout, payload_offset)} }},\n")
+        f.write("};\n")
+        f.write(f"const COMMAND_PAYLOAD_OFFSET = {payload_offset};\n")
+        f.write(
+            """
+// Read every field of layout from view into an object.
+function readStruct(layout, view, offset = 0) {
+    const values = {};
+    for (const [name, [fieldOffset, type]] of Object.entries(layout.fields)) {
+        values[name] = view[`get${type}`](offset + fieldOffset, true);
+    }
+    return values;
+}
+
+// Write the fields of layout in values to view. Missing fields are left as they are.
+function writeStruct(layout, view, values, offset = 0) {
+    for (const [name, [fieldOffset, type]] of Object.entries(layout.fields)) {
+        if (name in values) view[`set${type}`](offset + fieldOffset, values[name], true);
+    }
+}
+"""
+        )
+
+    print(f"protocol.js: {len(structs)} structs, {len(command_ids)} commands")
+
+
+if __name__ == "__main__":
+    main()
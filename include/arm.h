@@ -0,0 +1,69 @@
+#ifndef _ARM_H_
+#define _ARM_H_
+
+#include <stdint.h>
+
+static const char *TAG_ARM = "arm.c";
+
+// Position control of the arm joints, run by the control task every tick.
+// Every joint has a single channel encoder, whose rising edges a hardware
+// pulse counter counts. That gives no direction, so edges are counted in the
+// direction the joint was driven when it last started moving. This holds for
+// gearmotors that their load cannot back drive; a joint pushed the other way
+// is counted wrong. Positions are in edges from the pose at power on, which
+// must be the low end of the range of every joint.
+
+typedef enum {
+  ARM_X,
+  ARM_J2,
+  ARM_J3,
+  ARM_JOINTS,
+} arm_joint_index;
+
+// Gains are in 1 / (1 << ARM_GAIN_SHIFT).
+#define ARM_GAIN_SHIFT 8
+// Velocity is the edges counted every tick through a low pass filter, with a
+// time constant of 1 << ARM_VELOCITY_FILTER_SHIFT ticks.
+#define ARM_VELOCITY_FILTER_SHIFT 3
+
+typedef struct {
+  int32_t rangeEdges; // Edges from setpoint 0 to UINT16_MAX
+  int32_t kp;         // Effort per edge of error
+  int32_t ki;         // Effort per edge of error and second
+  int32_t kd;         // Effort per edge per second of velocity
+  int16_t effortMax;  // Most effort either way, up to INT16_MAX
+} arm_joint_config;
+
+// Configuration of every joint, copied by arm_init.
+extern const arm_joint_config armJointConfigs[ARM_JOINTS];
+
+typedef struct {
+  arm_joint_config config;
+  uint32_t edges;   // Counter reading at the last step
+  int32_t position; // Edges from the pose at power on
+  int32_t velocity; // Edges per second
+  int32_t error;    // Setpoint less position at the last step, in edges
+  int64_t integral; // In effort << ARM_GAIN_SHIFT
+  int16_t effort;   // Output of the last step
+  int8_t direction; // Direction edges are counted in, 1 or -1
+} arm_joint;
+
+typedef struct {
+  arm_joint joints[ARM_JOINTS];
+} arm_state;
+
+// Start at the pose at power on, with the counters reading edges.
+void arm_init(arm_state *arm, const uint32_t edges[ARM_JOINTS]);
+
+// Move every joint towards its setpoint, from 0 to UINT16_MAX over its range,
+// for one control period, and return its effort, from -effortMax to
+// effortMax.
+void arm_step(arm_state *arm, const uint16_t setpoints[ARM_JOINTS],
+              const uint32_t edges[ARM_JOINTS], int16_t efforts[ARM_JOINTS]);
+
+// Keep track of the joints without driving them, as when the ESC is disabled,
+// and clear their integrals so they start again from rest. efforts are all 0.
+void arm_stop(arm_state *arm, const uint16_t setpoints[ARM_JOINTS],
+              const uint32_t edges[ARM_JOINTS], int16_t efforts[ARM_JOINTS]);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef _ASSETS_H_
+#define _ASSETS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Every file in the data folder, as served by root_handler, packed into
+// data/assets.bin by generateAssets.py.
+extern const char FILE_ASSETS_START[] asm("_binary_assets_bin_start");
+extern const char FILE_ASSETS_END[] asm("_binary_assets_bin_end");
+
+typedef struct {
+  const char *path;     // URI, such as "/main.js"
+  const char *type;     // MIME type
+  const char *encoding; // Content-Encoding of the data, or NULL
+  const char *etag;     // Quoted hash of the data
+  const char *start;    // Data within FILE_ASSETS_START
+  const char *end;
+} asset;
+
+typedef struct {
+  const char *path; // Only path that hashes to this slot, or NULL
+  int8_t asset;     // Index in assets served for path
+} asset_slot;
+
+// Generated into src/assets.c by generateAssets.py. A path is looked up by
+// hashing it with assetHashSeed; assetSlots[hash & assetSlotMask] is the only
+// path with that hash, so one comparison confirms it. Aliases such as "/" have
+// their own slots pointing to the same asset.
+extern const asset assets[];
+extern const uint32_t assetHashSeed;
+extern const uint32_t assetSlotMask;
+extern const asset_slot assetSlots[];
+
+#endif
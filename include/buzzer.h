@@ -0,0 +1,40 @@
+#ifndef _BUZZER_H_
+#define _BUZZER_H_
+
+#include <stdint.h>
+
+static const char *TAG_BUZZER = "buzzer.c";
+
+// Beep patterns played on PIN_BUZZER, timed by a hal_timer so every step has
+// its exact length however busy the caller is. Patterns repeat until another
+// is played.
+typedef enum {
+  BUZZER_OFF,
+  BUZZER_LOW_VOLTAGE, // Three beeps every 3 s
+  BUZZER_OVERCURRENT, // Fast continuous beeping
+  BUZZER_COMMS_LOSS,  // One long beep every 2 s
+  BUZZER_PATTERNS,
+} buzzer_pattern;
+
+// Most on and off steps in a pattern.
+#define BUZZER_STEPS_MAX 8
+
+typedef struct {
+  const char *name;
+  // Lengths in ms of alternating on and off steps, starting on. Ends at the
+  // first 0, then starts over.
+  uint16_t stepsMs[BUZZER_STEPS_MAX];
+} buzzer_pattern_info;
+
+extern const buzzer_pattern_info buzzerPatterns[BUZZER_PATTERNS];
+
+// Create the step timer. pins_init must be called first.
+void buzzer_init(void);
+
+// Play pattern from its start, or keep playing it if it already is, so this
+// can be called every control tick. BUZZER_OFF drives the buzzer low.
+void buzzer_play(buzzer_pattern pattern);
+
+buzzer_pattern buzzer_playing(void);
+
+#endif
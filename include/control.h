@@ -0,0 +1,77 @@
+#ifndef _CONTROL_H_
+#define _CONTROL_H_
+
+#include "arm.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+static const char *TAG_CONTROL = "control.c";
+
+// Rate in Hz of the control task, which reads the e-stop, drives the ESC and
+// motor outputs, and runs the arm position loops. Must divide
+// CONFIG_FREERTOS_HZ. Can be overridden with a build flag.
+#ifndef CONTROL_RATE_HZ
+#define CONTROL_RATE_HZ 500
+#endif
+#define CONTROL_PERIOD_US (1000000 / CONTROL_RATE_HZ)
+
+// Above the httpd and lwIP tasks so web traffic cannot delay a tick, below the
+// Wi-Fi task.
+#define CONTROL_TASK_PRIORITY 20
+#define CONTROL_TASK_STACK 3072
+
+// Period jitter, the difference between the measured and nominal period, is
+// counted in buckets of CONTROL_JITTER_BUCKET_US. The last bucket counts
+// everything beyond.
+#define CONTROL_JITTER_BUCKETS 8
+#define CONTROL_JITTER_BUCKET_US 50
+
+// Outputs requested by the web interface, applied by the control task unless
+// stopped.
+typedef struct {
+  int16_t left;
+  int16_t right;
+  // Changed with every accepted drive command, see drive_setpoint
+  uint16_t driveSeq;
+  uint16_t x; // Arm joint positions, see arm_step
+  uint16_t j2;
+  uint16_t j3;
+  // Jog the arm from where it is instead, at jog, x, y and z in mm/s, until
+  // jogUntilUs; see kinematics_jog_step.
+  bool jogging;
+  int16_t jog[3];
+  int64_t jogUntilUs;
+} control_setpoint;
+
+typedef struct {
+  uint32_t ticks;         // Control ticks run
+  uint32_t overruns;      // Ticks that took longer than a period
+  int64_t worstOverrunUs; // Longest tick beyond CONTROL_PERIOD_US
+  int64_t worstTickUs;    // Longest time spent in one tick
+  int64_t worstJitterUs;  // Largest absolute period jitter
+  // Ticks by absolute period jitter
+  uint32_t jitter[CONTROL_JITTER_BUCKETS];
+} control_stats;
+
+// Arm joints after the last tick.
+typedef struct {
+  uint16_t setpoint[ARM_JOINTS]; // Including while jogging
+  int32_t position[ARM_JOINTS];  // Edges from the pose at power on
+  int32_t error[ARM_JOINTS];     // Setpoint less position, in edges
+  bool jogHeld; // Whether the jog box or a joint limit held the last jog back
+} control_arm_status;
+
+// Start the control task. pins_init, buzzer_init, motor_control_init, and
+// estop_init must be called first.
+void control_init(void);
+
+// Replace the setpoint applied from the next tick. Never blocks, but must
+// only be called from one task, the httpd task.
+void control_set(const control_setpoint *setpoint);
+
+// Copy the timing statistics since boot into stats.
+void control_stats_get(control_stats *stats);
+
+void control_arm_get(control_arm_status *status);
+
+#endif
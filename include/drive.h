@@ -0,0 +1,70 @@
+#ifndef _DRIVE_H_
+#define _DRIVE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+static const char *TAG_DRIVE = "drive.c";
+
+// Drive output stage, run by the control task every tick. The left and right
+// setpoints from the web interface arrive about every COMMAND_INTERVAL, so
+// each side ramps linearly from the current point of its ramp to the new
+// setpoint over the time since the previous one, and the output follows that
+// ramp with limited acceleration and jerk. Speeds are in setpoint units,
+// INT16_MIN to INT16_MAX.
+
+// Most acceleration in units per second, and most change of acceleration in
+// units per second squared. Can be overridden with build flags.
+#ifndef DRIVE_ACCEL_MAX
+#define DRIVE_ACCEL_MAX 65536 // Full reverse to full forward in 1 s
+#endif
+#ifndef DRIVE_JERK_MAX
+#define DRIVE_JERK_MAX 524288 // Full acceleration in 125 ms
+#endif
+// Longest a setpoint is ramped over, so the first setpoint after a pause is
+// not spread over the whole pause.
+#define DRIVE_RAMP_MAX_US 200000
+
+// Speeds and acceleration are kept in units shifted left by this.
+#define DRIVE_FRACTION_BITS 8
+
+#define DRIVE_WHEELS 6
+
+typedef enum {
+  DRIVE_LEFT,
+  DRIVE_RIGHT,
+  DRIVE_SIDES,
+} drive_side_index;
+
+typedef struct {
+  int32_t rampFrom;  // Speed at the start of the ramp
+  int32_t rampTo;    // Setpoint at the end of the ramp
+  int64_t rampStartUs;
+  int64_t rampUs;    // Length of the ramp, 0 once reached
+  int32_t speed;     // Output speed
+  int32_t accel;     // Output acceleration per second
+} drive_side;
+
+typedef struct {
+  drive_side sides[DRIVE_SIDES];
+  uint16_t seq;           // Of the last setpoint taken or skipped
+  int64_t lastSetpointUs; // Time of the last drive_setpoint, 0 if none
+  int64_t lastStepUs;     // Time of the last drive_step
+} drive_state;
+
+// Stop both sides at once, without limits, as when the ESC is disabled, and
+// skip the setpoint numbered seq.
+void drive_reset(drive_state *drive, uint16_t seq, int64_t nowUs);
+
+// Start ramping towards the setpoint numbered seq, received at nowUs, unless
+// it was already taken. The same setpoint may be passed every tick; only a
+// change of seq starts a ramp, so the ramp is timed by the drive commands and
+// not by whatever else makes the setpoint be passed again.
+void drive_setpoint(drive_state *drive, int16_t left, int16_t right,
+                    uint16_t seq, int64_t nowUs);
+
+// Advance to nowUs and return the speed of both sides, for mixer_wheels.
+void drive_step(drive_state *drive, int64_t nowUs,
+                int16_t speeds[DRIVE_SIDES]);
+
+#endif
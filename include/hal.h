@@ -0,0 +1,99 @@
+#ifndef _HAL_H_
+#define _HAL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+static const char *TAG_HAL = "hal.c";
+
+// Thin layer over the peripherals the firmware drives, so every module above
+// it also builds for the host. src/hal.c implements it with the ESP-IDF
+// drivers, sim/hal_sim.c with recorded timelines and an in-memory framebuffer.
+
+// Time in us since boot.
+int64_t hal_time_us(void);
+
+// One-shot timer. Callbacks run one at a time on a timer task, so they must be
+// short and must not block.
+typedef struct hal_timer *hal_timer_handle;
+typedef void (*hal_timer_callback)(void *arg);
+
+hal_timer_handle hal_timer_create(const char *name, hal_timer_callback callback,
+                                  void *arg);
+// Call the callback once, delayUs from now, replacing any pending call. A
+// call that is already running is not cancelled.
+void hal_timer_once(hal_timer_handle timer, int64_t delayUs);
+void hal_timer_stop(hal_timer_handle timer);
+
+// mask: bit n set for GPIO n
+void hal_gpio_output(uint64_t mask);
+void hal_gpio_input(uint64_t mask, bool pullUp);
+void hal_gpio_set(int pin, bool level);
+bool hal_gpio_get(int pin);
+
+typedef enum {
+  HAL_GPIO_EDGE_FALLING,
+  HAL_GPIO_EDGE_RISING,
+  HAL_GPIO_EDGE_ANY,
+} hal_gpio_edge;
+
+// Called in interrupt context, so it must not block. hal_gpio_set,
+// hal_pwm_stop, hal_pwm_set_isr, hal_time_us, and portENTER_CRITICAL_ISR are
+// safe to use.
+typedef void (*hal_gpio_isr)(void *arg);
+
+// Call isr with arg on every edge of input pin. One handler per pin.
+void hal_gpio_interrupt(int pin, hal_gpio_edge edge, hal_gpio_isr isr,
+                        void *arg);
+
+// Every PWM channel runs at HAL_PWM_FREQ_HZ, with duties from 0 to
+// HAL_PWM_DUTY_MAX. The ESP32-S2 has only HAL_PWM_LEDC_CHANNELS LEDC channels,
+// all off one timer, so the channels after them loop one period out of an RMT
+// channel instead, which gives the same waveform in finer steps.
+#define HAL_PWM_FREQ_HZ 4000
+#define HAL_PWM_BITS 14
+#define HAL_PWM_DUTY_MAX ((1 << HAL_PWM_BITS) - 1)
+#define HAL_PWM_LEDC_CHANNELS 8
+#define HAL_PWM_CHANNELS 9
+
+// Start the PWM timer. Must be called before hal_pwm_channel_init.
+void hal_pwm_init(void);
+// Output channel on pin, starting at a duty of 0.
+void hal_pwm_channel_init(uint8_t channel, int pin);
+void hal_pwm_set(uint8_t channel, uint32_t duty);
+// Set count channels from first on to duties, taking effect together at the
+// start of the same PWM period. LEDC channels only.
+void hal_pwm_set_many(uint8_t first, uint8_t count, const uint32_t *duties);
+// Drive the output of channel low now rather than at the end of its period,
+// and leave it low until the next hal_pwm_set. Safe in interrupt context.
+void hal_pwm_stop(uint8_t channel);
+// hal_pwm_set for interrupt context, taking effect at the start of the next
+// period. Errors are ignored rather than aborting.
+void hal_pwm_set_isr(uint8_t channel, uint32_t duty);
+
+// Pulse counters, counting the rising edges on an input pin in hardware, so no
+// edge is missed however late they are read. Pulses shorter than
+// HAL_COUNTER_GLITCH_NS are ignored.
+#define HAL_COUNTERS 4
+#define HAL_COUNTER_GLITCH_NS 1000
+
+void hal_counter_init(uint8_t counter, int pin);
+// Edges counted since hal_counter_init, wrapping at 32 bits.
+uint32_t hal_counter_get(uint8_t counter);
+
+// LCD on the SPI bus, with the D/C line driven for every transfer. Pins and
+// sizes are the ones in tft.h.
+void hal_lcd_init(void);
+// Send a command or its data, waiting for the transfer to finish.
+void hal_lcd_cmd(uint8_t cmd);
+void hal_lcd_data(const uint8_t *data, size_t length);
+// Queue the w * h pixels row by row in pixels to be drawn at x, y, and return
+// without waiting. At most BAND_BUFFERS rectangles can be queued, and pixels
+// must stay untouched until the matching hal_lcd_wait_rect returns.
+void hal_lcd_queue_rect(uint16_t x, uint16_t y, uint16_t w, uint16_t h,
+                        const uint16_t *pixels);
+// Wait for the oldest queued rectangle to be drawn.
+void hal_lcd_wait_rect(void);
+
+#endif
@@ -25,17 +25,60 @@
 #define PIN_CURRENT_CELL_2 2
 #define PIN_CURRENT_CELL_3 3
 
+// Drive PWM channels, numbered as the suffixes of PIN_DRIVE_*.
+#define DRIVE_CHANNEL_FIRST 1
+#define DRIVE_CHANNEL_LAST 6
+
+// Arm PWM channels: the two LEDC channels the drive leaves free, and an RMT
+// one. The encoder of every joint has the pulse counter of the
+// same number as its joint in arm_joint_index.
+#define ARM_CHANNEL_X 0
+#define ARM_CHANNEL_J2 7
+#define ARM_CHANNEL_J3 8
+
+// Time in us the e-stop must read released before a latched fault clears, so
+// contact bounce cannot restart the motors.
+#define ESTOP_RELEASE_US 100000
+
+typedef struct
+{
+  uint32_t trips;         // Faults latched by the e-stop interrupt
+  int64_t lastTripUs;     // hal_time_us of the last one, 0 if none
+  int64_t lastLatencyUs;  // Time from ISR entry to the outputs being stopped
+  int64_t worstLatencyUs; // Longest of those since boot
+  // Time from ISR entry to the control task first seeing the fault
+  int64_t worstControlUs;
+} estop_stats;
+
+// Whether the e-stop is pressed right now.
 bool estop_get(void);
 
-void buzzer_set(bool on);
+// Take the e-stop interrupt, which drops PIN_ESC_ENABLE, stops every drive
+// PWM output, sets every arm output to neutral, and latches a fault the moment
+// the e-stop is pressed. Must be called after pins_init and motor_control_init.
+void estop_init(void);
+
+// Return whether a fault is latched, latching one if the e-stop is pressed
+// and clearing it once the e-stop has read released for ESTOP_RELEASE_US.
+// Called by the control task every tick.
+bool estop_fault_update(void);
+
+void estop_stats_get(estop_stats *stats);
 
 void pins_init();
 
+// Enabling is refused while an e-stop fault is latched.
 void esc_enabled_set(bool enabled);
 
+// Also starts counting the arm encoders.
 void motor_control_init(void);
-void motor_control_set(int16_t left, int16_t right, uint16_t x, uint16_t j2,
-                       uint16_t j3);
+// wheels: speed of every drive channel from DRIVE_CHANNEL_FIRST on, all
+// updated at once
+// joints: effort of every arm joint from ARM_X on
+void motor_control_set(const int16_t *wheels, const int16_t *joints);
+
+// edges: rising edges counted by the encoder of every arm joint from ARM_X on
+void encoder_edges_get(uint32_t *edges);
 
 void current_sense_get(float *esc, float *cell1, float *cell2, float *cell3);
 
@@ -0,0 +1,83 @@
+#ifndef _IMAGE_H_
+#define _IMAGE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Pixels per byte of 2 bit per pixel palette indices.
+#define IMAGE_2BPP_PIXELS_PER_BYTE 4
+// Most pixels a packed byte expands to, at 2 bits per pixel.
+#define IMAGE_MAX_PIXELS_PER_BYTE IMAGE_2BPP_PIXELS_PER_BYTE
+// Most palette colors, at 8 bits per pixel.
+#define IMAGE_MAX_COLORS 256
+
+// Image bundle as written by generateImages.py:
+// image_bundle_header, count image_bundle_entry, then every image at its
+// offset as a palette of 4 RGB565 colors followed by the encoded pixels.
+#define IMAGE_BUNDLE_MAGIC "MRIB"
+
+typedef struct __attribute__((__packed__)) {
+  char magic[4];   // 0 IMAGE_BUNDLE_MAGIC
+  uint16_t count;  // 4
+  uint16_t unused; // 6
+} image_bundle_header; // 8 bytes
+
+typedef enum {
+  IMAGE_ENCODING_RAW = 0, // Packed pixels
+  IMAGE_ENCODING_RLE = 1, // Packed pixels compressed by image_rle_decode
+} image_encoding;
+
+typedef struct __attribute__((__packed__)) {
+  uint32_t offset;   // 0 from start of bundle to palette, multiple of 4
+  uint32_t length;   // 4 of palette and pixels
+  uint8_t encoding;  // 8 image_encoding
+  uint8_t unused[3]; // 9
+} image_bundle_entry; // 12 bytes
+
+// Compact image accepted by POST /display in place of raw RGB565 pixels:
+// image_upload_header, colors RGB565 palette colors, then the LCD_WIDTH *
+// LCD_HEIGHT palette indices packed into bytes as described by bpp and
+// encoding.
+#define IMAGE_UPLOAD_MAGIC "MRIU"
+
+typedef struct __attribute__((__packed__)) {
+  char magic[4];    // 0 IMAGE_UPLOAD_MAGIC
+  uint8_t bpp;      // 4 bits per palette index, 2, 4 or 8
+  uint8_t encoding; // 5 image_encoding
+  uint16_t colors;  // 6 palette colors, at most 1 << bpp
+} image_upload_header; // 8 bytes
+
+// Maps every packed byte to the RGB565 pixels it expands to, so a whole byte
+// is decoded with one lookup. Pixel 0 of a byte is in its lowest bits.
+typedef struct {
+  uint16_t pixels[256][IMAGE_MAX_PIXELS_PER_BYTE] __attribute__((aligned(8)));
+  uint16_t palette[IMAGE_MAX_COLORS]; // palette pixels was built from
+  uint16_t colors;                    // Colors in palette
+  uint8_t bpp;                        // Bits per palette index, 2, 4 or 8
+  uint8_t pixelsPerByte;              // 8 / bpp
+  bool valid;
+} image_lut;
+
+// Position within an RLE stream, kept between calls to image_rle_decode so a
+// stream can be decoded one band at a time.
+typedef struct {
+  uint8_t mode;       // Control byte, literal or run next
+  uint8_t value;      // Byte repeated by the current run
+  uint16_t remaining; // Bytes left in the current literal or run
+} image_rle_state;
+
+bool image_lut_build(image_lut *lut, const uint16_t *palette, uint16_t colors,
+                     uint8_t bpp);
+void image_unpack(const image_lut *lut, const uint8_t *src, uint16_t *dst,
+                  size_t bytes);
+
+const image_bundle_entry *image_bundle_find(const uint8_t *bundle,
+                                            size_t bundleLength, uint8_t idx);
+
+void image_rle_begin(image_rle_state *state);
+size_t image_rle_decode(image_rle_state *state, const image_lut *lut,
+                        const uint8_t **src, const uint8_t *srcEnd,
+                        uint16_t *dst, size_t bytes);
+
+#endif
@@ -1,12 +1,138 @@
 #ifndef _KINEMATICS_H_
 #define _KINEMATICS_H_
 
+#include "arm.h"
+#include <stdbool.h>
 #include <stdint.h>
 
+static const char *TAG_KINEMATICS = "kinematics.c";
+
+// Forward and inverse kinematics of the arm, closed form in fixed point. The
+// trig tables are built by the compiler.
+//
+// Positions are in mm, x forward, y left and z up, from the base of the arm
+// on the axis of joint X. X turns the arm about that vertical axis, 0 facing
+// forward and positive to the left. J2 raises the upper arm from horizontal,
+// and J3 bends the forearm from the line of the upper arm, negative downwards,
+// so the elbow is above the line from the shoulder to the end. Joint setpoints
+// from 0 to UINT16_MAX cover the range of each joint from its min to its max
+// angle.
+
+// Arm geometry in mm: the height of the shoulder, J2, above the base, and the
+// lengths from J2 to the elbow, J3, and from J3 to the end of the arm. Can be
+// overridden with build flags.
+#ifndef KINEMATICS_SHOULDER_MM
+#define KINEMATICS_SHOULDER_MM 50
+#endif
+#ifndef KINEMATICS_UPPER_ARM_MM
+#define KINEMATICS_UPPER_ARM_MM 220
+#endif
+#ifndef KINEMATICS_FOREARM_MM
+#define KINEMATICS_FOREARM_MM 220
+#endif
+
+// Angle of every joint in degrees at setpoints 0 and UINT16_MAX, between -180
+// and 180. Setpoint 0 is the pose at power on. Can be overridden with build
+// flags.
+#ifndef KINEMATICS_X_MIN_DEG
+#define KINEMATICS_X_MIN_DEG -90
+#endif
+#ifndef KINEMATICS_X_MAX_DEG
+#define KINEMATICS_X_MAX_DEG 90
+#endif
+#ifndef KINEMATICS_J2_MIN_DEG
+#define KINEMATICS_J2_MIN_DEG 0
+#endif
+#ifndef KINEMATICS_J2_MAX_DEG
+#define KINEMATICS_J2_MAX_DEG 150
+#endif
+#ifndef KINEMATICS_J3_MIN_DEG
+#define KINEMATICS_J3_MIN_DEG -160
+#endif
+#ifndef KINEMATICS_J3_MAX_DEG
+#define KINEMATICS_J3_MAX_DEG 0
+#endif
+
+// Jogging moves the end of the arm at a velocity from the web interface,
+// integrated every control tick through the Jacobian. Damped least squares
+// keep the joints from racing near the poses where the arm loses a direction
+// of motion, stretched out or over the axis of X, at the cost of a little
+// tracking error everywhere. Can be overridden with a build flag.
+#ifndef KINEMATICS_JOG_DAMPING_MM
+#define KINEMATICS_JOG_DAMPING_MM 10
+#endif
+
+// Fastest jog on each axis, and fastest any joint turns while jogging, which
+// slows the whole jog down. Can be overridden with build flags.
+#ifndef KINEMATICS_JOG_SPEED_MAX_MM_S
+#define KINEMATICS_JOG_SPEED_MAX_MM_S 200
+#endif
+#ifndef KINEMATICS_JOG_JOINT_SPEED_MAX_DEG_S
+#define KINEMATICS_JOG_JOINT_SPEED_MAX_DEG_S 90
+#endif
+
+// Jogging keeps the end of the arm in this box, in mm, such as above the
+// ground. Can be overridden with build flags.
+#ifndef KINEMATICS_JOG_X_MIN_MM
+#define KINEMATICS_JOG_X_MIN_MM -500
+#endif
+#ifndef KINEMATICS_JOG_X_MAX_MM
+#define KINEMATICS_JOG_X_MAX_MM 500
+#endif
+#ifndef KINEMATICS_JOG_Y_MIN_MM
+#define KINEMATICS_JOG_Y_MIN_MM -500
+#endif
+#ifndef KINEMATICS_JOG_Y_MAX_MM
+#define KINEMATICS_JOG_Y_MAX_MM 500
+#endif
+#ifndef KINEMATICS_JOG_Z_MIN_MM
+#define KINEMATICS_JOG_Z_MIN_MM -100
+#endif
+#ifndef KINEMATICS_JOG_Z_MAX_MM
+#define KINEMATICS_JOG_Z_MAX_MM 500
+#endif
+
+// Angles are in 1 / KINEMATICS_TURN of a turn, and sines and cosines in
+// 1 / KINEMATICS_ONE.
+#define KINEMATICS_TURN (1 << 16)
+#define KINEMATICS_ONE (1 << 15)
+
+int32_t kinematics_sin(int32_t angle);
+int32_t kinematics_cos(int32_t angle);
+
+// Angle of (x, y) from the x axis, from -KINEMATICS_TURN / 2 to
+// KINEMATICS_TURN / 2. 0 for (0, 0).
+int32_t kinematics_atan2(int32_t y, int32_t x);
+
+// Position of the end of the arm for the joint setpoints. The last result is
+// kept, so calling again with the same setpoints is cheap. Only called from the
+// webserver task.
 void fk_calculate_position(uint16_t ax, uint16_t j2, uint16_t j3, int16_t *x,
                            int16_t *y, int16_t *z);
 
-void ik_calculate_angles(int16_t x, int16_t y, int16_t z, uint16_t *ax,
+// Joint setpoints that put the end of the arm at (x, y, z). Returns whether it
+// can get there; if not, the setpoints get it as close as its reach and joint
+// limits allow.
+bool ik_calculate_angles(int16_t x, int16_t y, int16_t z, uint16_t *ax,
                          uint16_t *j2, uint16_t *j3);
 
+// A jog keeps the joint angles with KINEMATICS_JOG_SHIFT more bits than
+// setpoints have, so slow jogs still move the joints every tick.
+#define KINEMATICS_JOG_SHIFT 8
+
+typedef struct {
+  // Joint angles in 1 / (KINEMATICS_TURN << KINEMATICS_JOG_SHIFT) of a turn
+  int32_t angles[ARM_JOINTS];
+} kinematics_jog;
+
+// Start jogging from the joint setpoints.
+void kinematics_jog_start(kinematics_jog *jog,
+                          const uint16_t setpoints[ARM_JOINTS]);
+
+// Move the end of the arm at velocity, x, y and z in mm/s, for one control
+// period, and return the joint setpoints. Returns whether the jog was held
+// back by the jog box or a joint limit.
+bool kinematics_jog_step(kinematics_jog *jog, const int16_t velocity[3],
+                         uint16_t setpoints[ARM_JOINTS]);
+
 #endif
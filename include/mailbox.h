@@ -0,0 +1,36 @@
+#ifndef _MAILBOX_H_
+#define _MAILBOX_H_
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Passes the latest of a stream of values from one writer task to one reader
+// task through a triple buffer. The writer fills its own buffer and swaps it
+// with the spare one; the reader swaps the spare for its own only if it holds
+// a newer value. Neither side ever waits, which matters on a single core: a
+// seqlock reader in a higher priority task would spin forever on a writer it
+// preempted. Values in between may be skipped, but the reader always gets
+// the newest one whole.
+typedef struct {
+  uint8_t *buffers; // Three values of size bytes
+  size_t size;
+  uint8_t writeIndex; // Only used by the writer
+  uint8_t readIndex;  // Only used by the reader
+  atomic_uint_fast8_t spareIndex;
+} mailbox;
+
+// Static initializer for a mailbox over buffers, an array of three values
+// that all start out the same.
+#define MAILBOX_INIT(buffers)                                                 \
+  {(uint8_t *)(buffers), sizeof((buffers)[0]), 0, 1, 2}
+
+// Replace the value the reader gets next with the size bytes at value. Must
+// only be called from one task.
+void mailbox_write(mailbox *box, const void *value);
+
+// Return the newest value written, all zero or as initialized if none. Stays
+// valid until the next call. Must only be called from one task.
+const void *mailbox_read(mailbox *box);
+
+#endif
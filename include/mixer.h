@@ -0,0 +1,71 @@
+#ifndef _MIXER_H_
+#define _MIXER_H_
+
+#include "drive.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+static const char *TAG_MIXER = "mixer.c";
+
+// Skid-steer mixer. mixer_sides turns the drive joystick into left and right
+// setpoints for the drive stage, so every client drives the same way, and
+// mixer_wheels spreads the output of the drive stage over the six wheels with
+// a trim per wheel and a curvature correction. Integer only; the tables are
+// built by the compiler.
+
+// Response curve: each joystick axis is raised to this power, keeping its
+// sign, for finer control at low speed. Can be overridden with a build flag.
+#ifndef MIXER_GAMMA
+#define MIXER_GAMMA 1.5
+#endif
+
+// Fastest side setpoint, at full drive speed, leaving headroom for the trim
+// and curvature correction. Can be overridden with a build flag.
+#ifndef MIXER_SPEED_MAX
+#define MIXER_SPEED_MAX 0x7000
+#endif
+
+// Wheel geometry in mm: the distance between the left and right wheels, and
+// of the front and back wheels ahead of and behind the middle ones. Can be
+// overridden with build flags.
+#ifndef MIXER_TRACK_MM
+#define MIXER_TRACK_MM 190
+#endif
+#ifndef MIXER_CORNER_OFFSET_MM
+#define MIXER_CORNER_OFFSET_MM 95
+#endif
+
+// In a turn the front and back wheels are further from its centre than the
+// middle ones, so they turn faster by up to this share in percent of the
+// difference in distance. Less than 100 as they also slip sideways. Can be
+// overridden with a build flag.
+#ifndef MIXER_CURVATURE_PERCENT
+#define MIXER_CURVATURE_PERCENT 25
+#endif
+
+// Speed of every wheel in permille, by PWM channel from DRIVE_CHANNEL_FIRST,
+// to even out motors. Can be overridden with a build flag.
+#ifndef MIXER_TRIM_PERMILLE
+#define MIXER_TRIM_PERMILLE {1000, 1000, 1000, 1000, 1000, 1000}
+#endif
+
+typedef struct {
+  drive_side_index side;
+  bool corner; // Front or back wheel
+} mixer_wheel;
+
+// Every wheel, by PWM channel from DRIVE_CHANNEL_FIRST.
+extern const mixer_wheel mixerWheels[DRIVE_WHEELS];
+
+// Left and right setpoints for the joystick at x, to the right, and y, down,
+// from -INT16_MAX to INT16_MAX, at speed out of UINT16_MAX. Both sides are
+// within MIXER_SPEED_MAX.
+void mixer_sides(int16_t x, int16_t y, uint16_t speed,
+                 int16_t sides[DRIVE_SIDES]);
+
+// Speed of every wheel, by PWM channel from DRIVE_CHANNEL_FIRST, for the side
+// speeds from drive_step. Cheap enough for every control tick.
+void mixer_wheels(const int16_t sides[DRIVE_SIDES],
+                  int16_t wheels[DRIVE_WHEELS]);
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef _PROTOCOL_H_
+#define _PROTOCOL_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// WebSocket protocol between the web interface and the rover.
+// generateProtocol.py reads the defines, command ids, and packed structs in
+// this file to generate the matching DataView accessors in data/protocol.js,
+// so keep every struct field on its own line with its offset in a comment.
+
+// Longest WebSocket frame accepted, which limits the size of a command batch.
+#define COMMAND_FRAME_MAX 64
+
+// A frame is either one command, or a batch of commands that starts with
+// COMMAND_BATCH, which is not a command id:
+// [u8 COMMAND_BATCH, bool override, {u8 id, u8 length, payload}...]
+// payload is the length bytes of a command after override, at most
+// COMMAND_PAYLOAD_MAX. A batch that starts with a header command is dropped if
+// its sequence number is not newer than the last from the client, or if it was
+// delayed more than COMMAND_MAX_AGE_MS. A header anywhere else in a batch makes
+// it invalid, as the commands before it would be applied before it is checked.
+#define COMMAND_BATCH 0x80
+#define COMMAND_PAYLOAD_MAX 6
+
+// The payload of every command is the member of the union in command named
+// after it in lower case, if any.
+typedef enum {
+  COMMAND_OFF = 0,
+  COMMAND_ON = 1,
+  COMMAND_DRIVE = 2,
+  COMMAND_ARM_ANGLES = 3,
+  COMMAND_ARM_IK = 4,
+  COMMAND_DISPLAY = 5,
+  COMMAND_DRIVE_SPEED = 6,
+  COMMAND_TELEMETRY_RATE = 7, // In Hz for this client only, 0 stops
+  COMMAND_HEADER = 8,         // Optional first command of a batch
+  COMMAND_DRIVE_AXES = 9,     // Drive joystick, mixed by the rover
+  COMMAND_ARM_JOG = 10,       // Arm velocity, integrated by the rover
+} command_id;
+
+typedef struct __attribute__((__packed__)) {
+  uint8_t id;    // 0 command_id
+  bool override; // 1
+  union {
+    struct __attribute__((__packed__)) {
+      int16_t left;  // 2
+      int16_t right; // 4
+    } drive;
+    struct __attribute__((__packed__)) {
+      uint16_t x;  // 2
+      uint16_t j2; // 4
+      uint16_t j3; // 6
+    } arm_angles;
+    struct __attribute__((__packed__)) {
+      uint16_t x; // 2
+      uint16_t y; // 4
+      uint16_t z; // 6
+    } arm_ik;
+    struct __attribute__((__packed__)) {
+      uint8_t idx; // 2
+    } display;
+    struct __attribute__((__packed__)) {
+      uint16_t speed; // 2
+    } drive_speed;
+    struct __attribute__((__packed__)) {
+      uint16_t rate; // 2
+    } telemetry_rate;
+    struct __attribute__((__packed__)) {
+      uint16_t seq;       // 2
+      uint32_t client_ms; // 4 client time, wraps
+    } header;
+    struct __attribute__((__packed__)) {
+      int16_t x; // 2 right, from -INT16_MAX to INT16_MAX
+      int16_t y; // 4 down
+    } drive_axes;
+    struct __attribute__((__packed__)) {
+      int16_t x; // 2 mm/s forward, see kinematics.h
+      int16_t y; // 4 mm/s left
+      int16_t z; // 6 mm/s up
+    } arm_jog;
+  };
+} command; // 8 bytes
+
+// Broadcast to every client. fd is always -1, each client is sent its own fd
+// first as a telemetry_fd.
+typedef struct __attribute__((__packed__)) {
+  int32_t fd;                // 0
+  int32_t drive_priority_fd; // 4
+  int32_t arm_priority_fd;   // 8
+  int32_t override_fd;       // 12
+  float esc_current;         // 16
+  float cell1;               // 20
+  float cell2;               // 24
+  float cell3;               // 28
+  int16_t l;                 // 32
+  int16_t r;                 // 34
+  uint16_t ax;               // 36
+  uint16_t j2;               // 38
+  uint16_t j3;               // 40
+  int16_t x;                 // 42
+  int16_t y;                 // 44
+  int16_t z;                 // 46
+  uint16_t drive_speed;      // 48
+  int16_t ax_error;          // 50 setpoint less position, in encoder edges
+  int16_t j2_error;          // 52
+  int16_t j3_error;          // 54
+  bool ik_reachable;         // 56 arm_ik target in reach, or arm_jog not held
+} telemetry;                 // 57 bytes
+
+// Sent to a client once, before its first telemetry.
+typedef struct __attribute__((__packed__)) {
+  int32_t fd; // 0
+} telemetry_fd; // 4 bytes
+
+// Sent to a client before the next telemetry after each of its command
+// headers, so it can work out round-trip and one-way latency. All times are in
+// ms and wrap.
+typedef struct __attribute__((__packed__)) {
+  uint16_t seq;         // 0 of the header
+  uint16_t dropped;     // 2 batches from this client dropped so far
+  uint32_t client_ms;   // 4 client time in the header
+  uint32_t received_ms; // 8 time the header was received
+  uint32_t sent_ms;     // 12 time this frame was sent
+} telemetry_echo;       // 16 bytes
+
+// Clients tell the frames they receive apart by length.
+_Static_assert(sizeof(command) == 8, "command layout changed");
+_Static_assert(sizeof(telemetry) == 57, "telemetry layout changed");
+_Static_assert(sizeof(telemetry_fd) == 4, "telemetry_fd layout changed");
+_Static_assert(sizeof(telemetry_echo) == 16, "telemetry_echo layout changed");
+
+typedef enum {
+  PROTOCOL_OK,      // Every command was handled
+  PROTOCOL_DROPPED, // The handler dropped the rest of the frame
+  PROTOCOL_INVALID, // The frame is malformed, no command was handled
+} protocol_status;
+
+// Called for every command of a frame in order. Returns false to drop the rest
+// of the frame. cmd is only valid during the call.
+typedef bool (*protocol_command_handler)(const command *cmd, void *ctx);
+
+// Check the lengths in frame, then call handler for each of its commands. A
+// single command frame of sizeof(command) bytes is passed to handler in place,
+// unless its override byte is not 0 or 1. A shorter one, or a batch entry with
+// a short payload, is zero filled. Any nonzero override byte is true.
+protocol_status protocol_decode(const uint8_t *frame, size_t length,
+                                protocol_command_handler handler, void *ctx);
+
+// Batch being built in a caller supplied buffer by protocol_batch_add.
+typedef struct {
+  uint8_t *frame;
+  size_t capacity;
+  size_t length;
+} protocol_batch;
+
+void protocol_batch_begin(protocol_batch *batch, uint8_t *frame,
+                          size_t capacity, bool override);
+// Append the first payloadBytes of the payload of cmd. Returns false if
+// the batch has no room for it.
+bool protocol_batch_add(protocol_batch *batch, const command *cmd,
+                        size_t payloadBytes);
+
+#endif
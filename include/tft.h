@@ -2,6 +2,7 @@
 #define _TFT_H_
 
 #include <esp_attr.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 #define PIN_TFT_MISO 12
@@ -20,9 +21,15 @@
 // To speed up transfers, every SPI transfer sends a bunch of lines. This define
 // specifies how many. More means more memory use, but less overhead for setting
 // up / finishing transfers. Make sure 240 is dividable by this.
-#define PARALLEL_LINES 60
+#define PARALLEL_LINES 20
+// Pixels are 1 uint16 each, g2 g1 g0 b4 b3 b2 b1 b0 r4 r3 r2 r1 r0 g5 g4 g3.
 #define PIXELS_LENGTH (LCD_WIDTH * (PARALLEL_LINES))
 #define PIXELS_BYTES (PIXELS_LENGTH * sizeof(uint16_t))
+// Number of bands of PARALLEL_LINES lines that make up the screen.
+#define BAND_COUNT (LCD_HEIGHT / PARALLEL_LINES)
+// Number of band buffers. While one band is clocked out by the SPI DMA the next
+// is decoded into the other buffer.
+#define BAND_BUFFERS 2
 
 static const char *TAG_TFT = "main.c";
 
@@ -32,8 +39,57 @@ static const char *TAG_TFT = "main.c";
 extern const char FILE_IMAGES_START[] asm("_binary_images_bin_start");
 extern const char FILE_IMAGES_END[] asm("_binary_images_bin_end");
 
+// Maximum number of separate dirty rectangles tracked by tft_mark_dirty. When
+// one more is marked, it is merged into the pending rectangle whose union with
+// it adds the fewest pixels.
+#define TFT_DIRTY_RECTS 8
+
+typedef struct {
+  uint16_t x;
+  uint16_t y;
+  uint16_t w;
+  uint16_t h;
+} tft_rect;
+
+// Fills pixels with the rect->w * rect->h pixels of rect, row by row, in the
+// format of PIXELS_LENGTH. Called by tft_flush_dirty.
+typedef void (*tft_render_fn)(const tft_rect *rect, uint16_t *pixels,
+                              void *ctx);
+
+// Status strip across the top TFT_STATUS_HEIGHT rows of the screen, split into
+// TFT_STATUS_SEGMENTS colored segments, one per field of tft_status from the
+// left. The render task redraws the segments that change, and the whole strip
+// after every full frame, which covers it.
+#define TFT_STATUS_HEIGHT 8
+#define TFT_STATUS_SEGMENTS 4
+// Time in ms the render task waits for an image request before redrawing the
+// dirty parts of the status strip.
+#define TFT_STATUS_PERIOD_MS 50
+
+typedef struct {
+  bool estop;     // Pressed: red, otherwise green
+  bool drive;     // A client has drive priority: blue, otherwise grey
+  bool arm;       // A client has arm priority: blue, otherwise grey
+  bool overriden; // A client has override: amber, otherwise grey
+} tft_status;
+
+// Called after every full frame drawn by tft_draw_image with the index of the
+// image and the time in us from the start of decoding to the end of the last
+// SPI transfer.
+typedef void (*tft_frame_hook_t)(uint8_t idx, int64_t frameUs);
+
 void tft_init(void);
-void tft_send_image_part(uint8_t part, uint16_t pixels[PIXELS_LENGTH]);
-void tft_draw_image(uint8_t idx, uint16_t pixels[PIXELS_LENGTH]);
+void tft_set_frame_hook(tft_frame_hook_t hook);
+void tft_draw_image(uint8_t idx);
+void tft_request_image(uint8_t idx);
+void tft_stream_begin(void);
+uint16_t *tft_stream_band(void);
+void tft_stream_submit(uint8_t band);
+void tft_stream_end(void);
+void tft_blit_rect(uint16_t x, uint16_t y, uint16_t w, uint16_t h,
+                   const uint16_t *src);
+void tft_mark_dirty(uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+void tft_flush_dirty(tft_render_fn render, void *ctx);
+void tft_status_set(const tft_status *status);
 
 #endif
@@ -10,24 +10,39 @@ static const char *TAG_WEB = "web.c";
 #define OVERRIDE_TIMEOUT 5000000
 // Duration in us of priority
 #define PRIORITY_TIMEOUT 5000000
+// Duration in us an arm_jog velocity applies for, so the arm stops soon after
+// its client does. Clients send it every COMMAND_INTERVAL in main.js.
+#define JOG_TIMEOUT 300000
+
+// Delay in ms between mainloop iterations, which build a telemetry frame.
+#define MAINLOOP_DELAY 20
+// Highest telemetry rate in Hz a client can request.
+#define TELEMETRY_MAX_RATE (1000 / MAINLOOP_DELAY)
+// Telemetry rate in Hz of a client that has not requested one.
+#define TELEMETRY_DEFAULT_RATE 10
+// Telemetry frames that can be queued for the httpd task at once.
+#define TELEMETRY_FRAMES 2
+// Batches with a header delayed more than this many ms beyond the fastest
+// recent batch from the same client are dropped. Can be overridden with a
+// build flag.
+#ifndef COMMAND_MAX_AGE_MS
+#define COMMAND_MAX_AGE_MS 250
+#endif
+// Period in us over which the fastest recent batch is found. Two periods are
+// remembered, so clock drift is followed within twice this.
+#define COMMAND_OFFSET_WINDOW_US 10000000
 
-// Delay in ms between mainloop iterations
-#define MAINLOOP_DELAY 100
-
+// Assets larger than this many bytes are streamed with chunked encoding, one
+// chunk at a time. Can be overridden with a build flag.
+#ifndef SEND_CHUNK_SIZE
 #define SEND_CHUNK_SIZE 8192
-
-extern const char FILE_FONT_START[] asm("_binary_B612Mono_woff2_start");
-extern const char FILE_FONT_END[] asm("_binary_B612Mono_woff2_end");
-extern const char FILE_HTML_START[] asm("_binary_index_html_start");
-extern const char FILE_HTML_END[] asm("_binary_index_html_end");
-extern const char FILE_IMAGE_JS_START[] asm("_binary_images_js_start");
-extern const char FILE_IMAGE_JS_END[] asm("_binary_images_js_end");
-extern const char FILE_JS_START[] asm("_binary_main_js_start");
-extern const char FILE_JS_END[] asm("_binary_main_js_end");
-extern const char FILE_CSS_START[] asm("_binary_style_css_start");
-extern const char FILE_CSS_END[] asm("_binary_style_css_end");
-
-extern uint16_t pixels[PIXELS_LENGTH];
+#endif
+// Sent with every asset. Browsers keep their copy but revalidate it with
+// If-None-Match, which is answered with an empty 304 while it is current.
+#define ASSET_CACHE_CONTROL "no-cache"
+// Bytes of a compact /display upload received at a time before being expanded
+// into a band buffer.
+#define UPLOAD_BUFFER_SIZE 1024
 
 void webserver();
 #endif
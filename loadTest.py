@@ -0,0 +1,410 @@
+#!/bin/python3
+"""Load test the /ws endpoint with simulated operators.
+
+Every operator opens a WebSocket, requests telemetry at --rate and sends a
+batch of header, drive and arm_angles commands every --interval, like the web
+interface. The commands follow a smooth joystick pattern, or are replayed from
+a CSV file with columns time_s,left,right,x,j2,j3 in protocol.h units.
+
+Reported for every number of operators:
+  apply     one-way delay from sending a batch to the rover applying it, from
+            the telemetry_echo of every header with the clock offset of the
+            fastest round trip taken out, so it is exact to about 1 ms
+  rtt       round trip of a header, less the time the echo was held for the
+            next telemetry
+  dropped   batches the rover dropped as stale or out of order
+  telemetry frames received against the number expected at --rate, gaps of
+            more than 1.5 periods, and jitter, the deviation of every
+            inter-arrival time from the period
+
+Commands are applied for real on the rover, so hold the e-stop while testing
+it. Against sim/build/minirover_sim use --host localhost --port 8080.
+"""
+import argparse
+import asyncio
+import base64
+import csv
+import hashlib
+import json
+import math
+import os
+import random
+import struct
+import time
+import urllib.request
+
+from generateProtocol import command_payload_offset, parse_command_ids, parse_defines, parse_structs
+
+# struct format character of every DataView type used in protocol.h.
+FORMATS = {"Uint8": "B", "Int8": "b", "Uint16": "H", "Int16": "h", "Uint32": "I", "Int32": "i", "Float32": "f"}
+
+WS_GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC11B28"
+WS_BINARY = 0x2
+WS_CLOSE = 0x8
+WS_PING = 0x9
+WS_PONG = 0xA
+
+
+class Protocol:
+    """Encoders and decoders for the structs in include/protocol.h."""
+
+    def __init__(self, path: str):
+        with open(path) as f:
+            header = f.read()
+        self.structs = parse_structs(header)
+        self.defines = parse_defines(header)
+        self.ids = parse_command_ids(header)
+        command = self.structs["command"]
+        self.payload_offset = command_payload_offset(command)
+        # Layout of the payload of every command by the name of its member.
+        self.payloads = {
+            name[len("COMMAND_") :].lower(): command["fields"].get(name[len("COMMAND_") :].lower(), {"size": 0, "fields": {}})
+            for name in self.ids
+        }
+        self.sizes = {self.structs[name]["size"]: name for name in ("telemetry", "telemetry_fd", "telemetry_echo")}
+
+    def pack(self, layout: dict, values: dict, base: int = 0) -> bytes:
+        """Pack values into the size bytes of layout, with field offsets from base. Missing fields are zero."""
+        data = bytearray(layout["size"])
+        for name, field in layout["fields"].items():
+            if isinstance(field, tuple):
+                struct.pack_into("<" + FORMATS[field[1]], data, field[0] - base, values.get(name, 0))
+        return bytes(data)
+
+    def unpack(self, layout: dict, data: bytes) -> dict:
+        return {
+            name: struct.unpack_from("<" + FORMATS[field[1]], data, field[0])[0]
+            for name, field in layout["fields"].items()
+            if isinstance(field, tuple)
+        }
+
+    def command(self, name: str, values: dict = None, override: bool = False) -> bytes:
+        """Encode a single command frame."""
+        frame = bytearray(self.structs["command"]["size"])
+        frame[0] = self.ids["COMMAND_" + name.upper()]
+        frame[1] = override
+        payload = self.pack(self.payloads[name], values or {}, self.payload_offset)
+        frame[self.payload_offset : self.payload_offset + len(payload)] = payload
+        return bytes(frame)
+
+    def batch(self, commands: list, override: bool = False) -> bytes:
+        """Encode a batch of (name, values) commands, see COMMAND_BATCH."""
+        frame = bytearray([self.defines["COMMAND_BATCH"], override])
+        for name, values in commands:
+            payload = self.pack(self.payloads[name], values, self.payload_offset)
+            frame += bytes([self.ids["COMMAND_" + name.upper()], len(payload)]) + payload
+        assert len(frame) <= self.defines["COMMAND_FRAME_MAX"]
+        return bytes(frame)
+
+    def decode(self, data: bytes) -> tuple:
+        """Return the name and fields of a frame sent by the rover, told apart by length."""
+        name = self.sizes.get(len(data))
+        return name, self.unpack(self.structs[name], data) if name else {}
+
+
+def percentiles(samples: list) -> dict:
+    """Return the p50, p90, p99 and max of samples, or None for each if there are none."""
+    ordered = sorted(samples)
+    result = {}
+    for name, fraction in (("p50", 0.5), ("p90", 0.9), ("p99", 0.99)):
+        result[name] = ordered[min(len(ordered) - 1, int(fraction * len(ordered)))] if ordered else None
+    result["max"] = ordered[-1] if ordered else None
+    return result
+
+
+def joystick(phase: float, t: float) -> dict:
+    """Drive and arm values of an operator at t seconds, sweeping smoothly like a thumbstick."""
+    return {
+        "left": int(0x7000 * math.sin(0.7 * t + phase)),
+        "right": int(0x7000 * math.sin(0.5 * t + 2 * phase)),
+        "x": int(0x8000 + 0x7FFF * math.sin(0.3 * t + phase)),
+        "j2": int(0x8000 + 0x7FFF * math.sin(0.2 * t + phase)),
+        "j3": int(0x8000 + 0x7FFF * math.cos(0.2 * t + phase)),
+    }
+
+
+def load_replay(path: str) -> list:
+    """Return the rows of a replay CSV as (time_s, values) tuples in time order."""
+    with open(path, newline="") as f:
+        rows = [(float(row.pop("time_s")), {name: int(value) for name, value in row.items()}) for row in csv.DictReader(f)]
+    rows.sort(key=lambda row: row[0])
+    if not rows:
+        raise SystemExit(f"{path} has no rows")
+    return rows
+
+
+def replayed(rows: list, phase: float, t: float) -> dict:
+    """Values of the last row at or before t, looping over the file, started at phase."""
+    length = rows[-1][0] + 1e-3
+    t = (t + phase / (2 * math.pi) * length) % length
+    values = rows[0][1]
+    for time_s, row in rows:
+        if time_s > t:
+            break
+        values = row
+    return values
+
+
+def client_ms() -> float:
+    return time.monotonic() * 1000
+
+
+class Operator:
+    """One simulated web interface."""
+
+    def __init__(self, protocol: Protocol, args: argparse.Namespace, index: int, replay: list):
+        self.protocol = protocol
+        self.args = args
+        self.index = index
+        self.replay = replay
+        self.phase = random.Random(index).uniform(0, 2 * math.pi)
+        self.fd = None
+        self.error = None
+        self.sent = {}  # Client time in ms of every unechoed header by seq
+        self.batches = 0
+        self.late_ms = []  # How late every batch was sent, to tell load generator stalls from rover delays
+        self.echoes = []  # (sent, received, echo sent, echo received) ms of every echoed header
+        self.server_dropped = 0
+        self.telemetry = []  # Receive times in ms, during the run only
+        self.window_ms = (0, 0)  # Start and end of the run
+
+    async def run(self, start: float, duration: float):
+        self.window_ms = (start * 1000, (start + duration) * 1000)
+        try:
+            reader, writer = await asyncio.wait_for(
+                asyncio.open_connection(self.args.host, self.args.port), self.args.connect_timeout
+            )
+        except asyncio.TimeoutError:
+            self.error = "connect timed out"
+            return
+        except OSError as error:
+            self.error = f"connect: {error}"
+            return
+        try:
+            try:
+                await asyncio.wait_for(self.handshake(reader, writer), self.args.connect_timeout)
+            except asyncio.TimeoutError:
+                raise ConnectionError("handshake timed out") from None
+            self.send(writer, self.protocol.command("telemetry_rate", {"rate": self.args.rate}))
+            receiver = asyncio.create_task(self.receive(reader, writer))
+            await self.command(writer, start, duration, receiver)
+            receiver.cancel()
+            self.send(writer, struct.pack(">H", 1000), WS_CLOSE)
+            await writer.drain()
+        except (OSError, asyncio.IncompleteReadError, ConnectionError) as error:
+            self.error = str(error) if type(error) is ConnectionError else f"{type(error).__name__}: {error}"
+        finally:
+            writer.close()
+
+    async def handshake(self, reader: asyncio.StreamReader, writer: asyncio.StreamWriter):
+        key = base64.b64encode(os.urandom(16)).decode()
+        writer.write(
+            (
+                f"GET /ws HTTP/1.1\r\nHost: {self.args.host}\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                f"Sec-WebSocket-Key: {key}\r\nSec-WebSocket-Version: 13\r\n\r\n"
+            ).encode()
+        )
+        response = await reader.readuntil(b"\r\n\r\n")
+        accept = base64.b64encode(hashlib.sha1((key + WS_GUID).encode()).digest())
+        if not response.startswith(b"HTTP/1.1 101") or accept not in response:
+            raise ConnectionError(f"handshake refused: {response.splitlines()[0].decode(errors='replace')}")
+
+    def send(self, writer: asyncio.StreamWriter, payload: bytes, opcode: int = WS_BINARY):
+        """Send a masked frame, as every client frame must be."""
+        mask = os.urandom(4)
+        length = bytes([0x80 | len(payload)]) if len(payload) < 126 else bytes([0x80 | 126]) + struct.pack(">H", len(payload))
+        writer.write(bytes([0x80 | opcode]) + length + mask + bytes(b ^ mask[i % 4] for i, b in enumerate(payload)))
+
+    async def command(self, writer: asyncio.StreamWriter, start: float, duration: float, receiver: asyncio.Task):
+        """Send a batch every interval on a fixed schedule until duration has passed, or receiver fails."""
+        seq = 0
+        due = start
+        while due < start + duration:
+            if receiver.done():
+                receiver.result()
+            await asyncio.sleep(max(0, due - time.monotonic()))
+            now = time.monotonic()
+            self.late_ms.append((now - due) * 1000)
+            t = now - start
+            values = replayed(self.replay, self.phase, t) if self.replay else joystick(self.phase, t)
+            sent_ms = client_ms()
+            commands = [("header", {"seq": seq, "client_ms": int(sent_ms) & 0xFFFFFFFF}), ("drive", values)]
+            if self.args.arm:
+                commands.append(("arm_angles", values))
+            self.send(writer, self.protocol.batch(commands))
+            await writer.drain()
+            self.sent[seq] = sent_ms
+            self.batches += 1
+            seq = (seq + 1) & 0xFFFF
+            due += self.args.interval
+
+    async def receive(self, reader: asyncio.StreamReader, writer: asyncio.StreamWriter):
+        while True:
+            header = await reader.readexactly(2)
+            length = header[1] & 0x7F
+            if length == 126:
+                length = struct.unpack(">H", await reader.readexactly(2))[0]
+            elif length == 127:
+                length = struct.unpack(">Q", await reader.readexactly(8))[0]
+            payload = await reader.readexactly(length)
+            received_ms = client_ms()
+            opcode = header[0] & 0x0F
+            if opcode == WS_PING:
+                self.send(writer, payload, WS_PONG)
+                continue
+            if opcode == WS_CLOSE:
+                raise ConnectionError("closed by the rover")
+            name, fields = self.protocol.decode(payload)
+            if name == "telemetry_fd":
+                self.fd = fields["fd"]
+            elif name == "telemetry_echo":
+                self.echoed(fields, received_ms)
+            elif name == "telemetry" and self.window_ms[0] <= received_ms < self.window_ms[1]:
+                self.telemetry.append(received_ms)
+
+    def echoed(self, echo: dict, received_ms: float):
+        self.server_dropped = echo["dropped"]
+        # Only the last header before each telemetry is echoed.
+        for seq in [seq for seq in self.sent if (echo["seq"] - seq) & 0x8000 == 0 and seq != echo["seq"]]:
+            del self.sent[seq]
+        sent_ms = self.sent.pop(echo["seq"], None)
+        if sent_ms is None or int(sent_ms) & 0xFFFFFFFF != echo["client_ms"]:
+            return
+        self.echoes.append((sent_ms, echo["received_ms"], echo["sent_ms"], received_ms))
+
+    def results(self) -> dict:
+        """Summarize the samples of this operator, see the module docstring."""
+        # The rover clock is in ms and wraps, so differences are taken mod 2^32.
+        def rover_delta(a: int, b: int) -> int:
+            return (a - b + 0x80000000) % 0x100000000 - 0x80000000
+
+        rtts, applies = [], []
+        if self.echoes:
+            first_rover = self.echoes[0][1]
+            samples = [
+                (sent, rover_delta(rover_rx, first_rover), rover_delta(rover_tx, first_rover), rx)
+                for sent, rover_rx, rover_tx, rx in self.echoes
+            ]
+            rtts = [(rx - sent) - (rover_tx - rover_rx) for sent, rover_rx, rover_tx, rx in samples]
+            # Offset of the rover clock from the fastest round trip, whose
+            # delay is split evenly between both directions.
+            sent, rover_rx, rover_tx, rx = samples[rtts.index(min(rtts))]
+            offset = ((rover_rx - sent) + (rover_tx - rx)) / 2
+            applies = [rover_rx - offset - sent for sent, rover_rx, rover_tx, rx in samples]
+
+        period = 1000 / self.args.rate if self.args.rate else None
+        intervals = [b - a for a, b in zip(self.telemetry, self.telemetry[1:])]
+        return {
+            "fd": self.fd,
+            "error": self.error,
+            "batches": self.batches,
+            "echoed": len(self.echoes),
+            "server_dropped": self.server_dropped,
+            "apply_ms": applies,
+            "rtt_ms": rtts,
+            "late_ms": self.late_ms,
+            "telemetry": len(self.telemetry),
+            "gaps": sum(interval > 1.5 * period for interval in intervals) if period else 0,
+            "jitter_ms": [abs(interval - period) for interval in intervals] if period else [],
+        }
+
+
+def fetch_stats(args: argparse.Namespace) -> dict:
+    """Return /stats of the rover, or None if it can not be fetched."""
+    try:
+        with urllib.request.urlopen(f"http://{args.host}:{args.port}/stats", timeout=args.connect_timeout) as response:
+            return json.load(response)
+    except (OSError, ValueError):
+        return None
+
+
+async def run_load(protocol: Protocol, args: argparse.Namespace, count: int, replay: list) -> dict:
+    """Run count operators for args.duration seconds and return the combined results."""
+    operators = [Operator(protocol, args, i, replay) for i in range(count)]
+    # Spread the operators over an interval, as independent browsers would be.
+    start = time.monotonic() + args.connect_timeout
+    await asyncio.gather(
+        *(operator.run(start + i * args.interval / count, args.duration) for i, operator in enumerate(operators))
+    )
+    clients = [operator.results() for operator in operators]
+    connected = [client for client in clients if client["fd"] is not None]
+
+    def combined(key: str) -> list:
+        return [sample for client in connected for sample in client[key]]
+
+    return {
+        "clients": count,
+        "connected": len(connected),
+        "errors": [client["error"] for client in clients if client["error"]],
+        "batches": sum(client["batches"] for client in connected),
+        "server_dropped": sum(client["server_dropped"] for client in connected),
+        "apply_ms": percentiles(combined("apply_ms")),
+        "rtt_ms": percentiles(combined("rtt_ms")),
+        "late_ms": percentiles(combined("late_ms")),
+        "telemetry": sum(client["telemetry"] for client in connected),
+        "telemetry_expected": int(len(connected) * args.rate * args.duration),
+        "gaps": sum(client["gaps"] for client in connected),
+        "jitter_ms": percentiles(combined("jitter_ms")),
+        "per_client": [{key: value for key, value in client.items() if not key.endswith("_ms")} for client in clients],
+        "stats": fetch_stats(args),
+    }
+
+
+def format_ms(values: dict) -> str:
+    return "/".join("-" if values[name] is None else f"{values[name]:.0f}" for name in ("p50", "p99", "max"))
+
+
+def print_table(results: list):
+    print(
+        f"{'ops':>3} {'conn':>4} {'batches':>7} {'dropped':>7} {'apply ms':>12} {'rtt ms':>12}"
+        f" {'telemetry':>11} {'gaps':>4} {'jitter ms':>12} {'overruns':>8}"
+    )
+    for result in results:
+        stats = result["stats"]
+        overruns = stats["control"]["overruns"] if stats else "-"
+        print(
+            f"{result['clients']:>3} {result['connected']:>4} {result['batches']:>7} {result['server_dropped']:>7}"
+            f" {format_ms(result['apply_ms']):>12} {format_ms(result['rtt_ms']):>12}"
+            f" {result['telemetry']:>5}/{result['telemetry_expected']:<5} {result['gaps']:>4}"
+            f" {format_ms(result['jitter_ms']):>12} {overruns:>8}"
+        )
+    print("Latencies are p50/p99/max. overruns is the total from /stats after the run.")
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--host", default="192.168.4.1", help="address of the rover, default %(default)s")
+    parser.add_argument("--port", type=int, default=80)
+    parser.add_argument(
+        "--clients", type=int, nargs="+", default=[1, 2, 4, 6, 8, 10], help="numbers of operators to run in turn"
+    )
+    parser.add_argument("--duration", type=float, default=20, help="seconds to run each number of operators")
+    parser.add_argument("--interval", type=float, default=0.1, help="seconds between batches, as COMMAND_INTERVAL")
+    parser.add_argument("--rate", type=int, default=10, help="telemetry rate in Hz to request")
+    parser.add_argument("--no-arm", dest="arm", action="store_false", help="send only drive commands")
+    parser.add_argument("--replay", help="CSV of commands to replay instead of the joystick pattern")
+    parser.add_argument("--connect-timeout", type=float, default=3)
+    parser.add_argument("--pause", type=float, default=2, help="seconds between runs, for sockets to close")
+    parser.add_argument("--json", help="write the results, including every client, to this file")
+    args = parser.parse_args()
+
+    protocol = Protocol(os.path.join(os.path.dirname(os.path.abspath(__file__)), "include", "protocol.h"))
+    replay = load_replay(args.replay) if args.replay else None
+    results = []
+    for count in args.clients:
+        print(f"{count} operators for {args.duration:g} s...", flush=True)
+        result = asyncio.run(run_load(protocol, args, count, replay))
+        for error in sorted(set(result["errors"])):
+            print(f"  {result['errors'].count(error)} x {error}")
+        if result["late_ms"]["max"] is not None and result["late_ms"]["p99"] > args.interval * 500:
+            print(f"  Batches were sent up to {result['late_ms']['max']:.0f} ms late, this machine is overloaded")
+        results.append(result)
+        time.sleep(args.pause)
+    print_table(results)
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump(results, f, indent=2)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,256 @@
+// Runs the arm position loops against a simulated joint, a DC gearmotor with
+// friction and a gravity load whose single channel encoder feeds the pulse
+// counter, in simulated time. Reports the step response of every joint and
+// how long a control tick spends in arm_step. See the Simulator section of
+// README.md.
+
+#include "arm.h"
+#include "control.h"
+#include "esp_log.h"
+#include "hal.h"
+#include "hardware.h"
+#include "sim.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// The joint is integrated in this many steps per control tick.
+#define PLANT_SUBSTEPS 20
+// Calls of arm_step timed for the loop cost.
+#define COST_ITERATIONS 1000000
+
+// A joint as seen from its PWM input: at full effort it runs up to freeSpeed
+// with time constant tau, less the effort friction and gravity take.
+typedef struct {
+  double freeSpeed; // Edges per second at full effort and no load
+  double tau;       // Mechanical time constant in s
+  double friction;  // Effort share lost to friction, and needed to break away
+  double gravity;   // Effort share the load pulls towards position 0 with
+} plant_config;
+
+typedef struct {
+  plant_config config;
+  double position; // Edges
+  double speed;    // Edges per second
+} plant;
+
+static volatile int32_t sink;
+
+static const uint8_t armChannels[ARM_JOINTS] = {ARM_CHANNEL_X, ARM_CHANNEL_J2,
+                                                ARM_CHANNEL_J3};
+static const char *jointNames[ARM_JOINTS] = {"x", "j2", "j3"};
+
+// Advance joint by dt s driven at effort, from -1 to 1, and return the rising
+// edges its encoder gave, whichever way it turned.
+static uint32_t plant_step(plant *joint, double effort, double dt) {
+  const plant_config *config = &joint->config;
+  double drive = effort - config->gravity;
+  if (joint->speed == 0 && fabs(drive) <= config->friction)
+    return 0; // Held by static friction
+  double direction = joint->speed != 0 ? copysign(1, joint->speed)
+                                       : copysign(1, drive);
+  double accel =
+      ((drive - config->friction * direction) * config->freeSpeed -
+       joint->speed) /
+      config->tau;
+  double speed = joint->speed + accel * dt;
+  // Friction stops the joint rather than reversing it.
+  if (speed * joint->speed < 0)
+    speed = 0;
+  double from = floor(joint->position);
+  joint->speed = speed;
+  joint->position += speed * dt;
+  return fabs(floor(joint->position) - from);
+}
+
+static double duty_effort(uint32_t duty) {
+  return 2.0 * duty / HAL_PWM_DUTY_MAX - 1;
+}
+
+static int64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+typedef struct {
+  double riseS;     // 10% to 90% of the step, -1 if never
+  double overshoot; // Beyond the step, in percent of it
+  double settleS;   // From the step until staying within 2% of it, or 2 edges
+  double finalError;   // Setpoint less the joint position at the end, in edges
+  double countError;   // Counted position less the joint position at the end
+  int32_t worstEffort; // Largest effort
+} response;
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "Steps every arm joint against a simulated gearmotor at %d Hz and\n"
+          "reports its response, then times arm_step.\n"
+          "  --step FRACTION    Step size as a share of the joint range, "
+          "default 0.5\n"
+          "  --duration S       Time to simulate each step for, default 2\n"
+          "  --kp, --ki, --kd G Use gain G, in effort per edge, instead of\n"
+          "                     the one in armJointConfigs\n"
+          "  --free-speed E     Joint speed in edges/s at full effort, "
+          "default 2000\n"
+          "  --tau S            Joint time constant, default 0.03\n"
+          "  --friction F       Friction as a share of full effort, default "
+          "0.15\n"
+          "  --gravity F        Gravity load on j2 and j3 as a share of full\n"
+          "                     effort, default 0.1. Above the friction the\n"
+          "                     load back drives the joint, which the encoder\n"
+          "                     cannot tell\n"
+          "  --timeline PATH    Write every tick to PATH as CSV\n",
+          name, CONTROL_RATE_HZ);
+}
+
+int main(int argc, char **argv) {
+  double step = 0.5, durationS = 2;
+  double gains[3] = {-1, -1, -1}; // kp, ki, kd if set
+  plant_config config = {2000, 0.03, 0.15, 0.1};
+  const char *timelinePath = NULL;
+  for (int i = 1; i < argc; i++) {
+    bool hasValue = i + 1 < argc;
+    if (strcmp(argv[i], "--step") == 0 && hasValue) {
+      step = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--duration") == 0 && hasValue) {
+      durationS = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--kp") == 0 && hasValue) {
+      gains[0] = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--ki") == 0 && hasValue) {
+      gains[1] = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--kd") == 0 && hasValue) {
+      gains[2] = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--free-speed") == 0 && hasValue) {
+      config.freeSpeed = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--tau") == 0 && hasValue) {
+      config.tau = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--friction") == 0 && hasValue) {
+      config.friction = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--gravity") == 0 && hasValue) {
+      config.gravity = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--timeline") == 0 && hasValue) {
+      timelinePath = argv[++i];
+    } else {
+      usage(argv[0]);
+      return strcmp(argv[i], "--help") == 0 ? 0 : 2;
+    }
+  }
+  if (step <= 0 || step > 1 || durationS <= 0) {
+    usage(argv[0]);
+    return 2;
+  }
+  FILE *timeline = NULL;
+  if (timelinePath != NULL) {
+    timeline = fopen(timelinePath, "w");
+    if (timeline == NULL) {
+      ESP_LOGE(TAG_SIM, "Failed to write %s", timelinePath);
+      return 1;
+    }
+    fprintf(timeline, "time_s,joint,setpoint,position,counted,effort\n");
+  }
+
+  // Every joint is stepped from rest at 0 in turn, with the others held at
+  // 0, through the counters, PWM outputs and arm_step as the control task
+  // runs them.
+  sim_time_set(0);
+  pins_init();
+  motor_control_init();
+  plant plants[ARM_JOINTS];
+  for (int i = 0; i < ARM_JOINTS; i++) {
+    plants[i] = (plant){config, 0, 0};
+    // Only the upper arm joints lift a load.
+    if (i == ARM_X)
+      plants[i].config.gravity = 0;
+  }
+  uint32_t edges[ARM_JOINTS];
+  encoder_edges_get(edges);
+  arm_state arm;
+  arm_init(&arm, edges);
+  for (int i = 0; i < ARM_JOINTS; i++) {
+    arm_joint_config *joint = &arm.joints[i].config;
+    int32_t *fields[3] = {&joint->kp, &joint->ki, &joint->kd};
+    for (int j = 0; j < 3; j++)
+      if (gains[j] >= 0)
+        *fields[j] = lround(gains[j] * (1 << ARM_GAIN_SHIFT));
+  }
+
+  size_t ticks = durationS * CONTROL_RATE_HZ;
+  double dt = 1.0 / CONTROL_RATE_HZ / PLANT_SUBSTEPS;
+  int16_t wheels[DRIVE_CHANNEL_LAST - DRIVE_CHANNEL_FIRST + 1] = {0};
+  int64_t nowUs = 0;
+  bool ok = true;
+  printf("%-3s %8s %9s %9s %9s %9s %9s %8s\n", "", "range", "rise_ms",
+         "overshoot", "settle_ms", "error", "miscount", "effort");
+  for (int stepped = 0; stepped < ARM_JOINTS; stepped++) {
+    uint16_t setpoints[ARM_JOINTS] = {0};
+    setpoints[stepped] = lround(step * UINT16_MAX);
+    double target = (double)setpoints[stepped] *
+                    arm.joints[stepped].config.rangeEdges / UINT16_MAX;
+    double start = plants[stepped].position;
+    double size = target - start;
+    response result = {-1, 0, 0, 0, 0, 0};
+    double tenS = -1;
+    for (size_t tick = 0; tick < ticks; tick++) {
+      sim_time_set(nowUs);
+      int16_t efforts[ARM_JOINTS];
+      encoder_edges_get(edges);
+      arm_step(&arm, setpoints, edges, efforts);
+      motor_control_set(wheels, efforts);
+      for (int i = 0; i < ARM_JOINTS; i++) {
+        double effort = duty_effort(sim_pwm_duty(armChannels[i]));
+        for (int s = 0; s < PLANT_SUBSTEPS; s++)
+          sim_counter_add(i, plant_step(&plants[i], effort, dt));
+      }
+      nowUs += CONTROL_PERIOD_US;
+
+      const plant *joint = &plants[stepped];
+      double timeS = (double)(tick + 1) / CONTROL_RATE_HZ;
+      double done = (joint->position - start) / size;
+      if (tenS < 0 && done >= 0.1)
+        tenS = timeS;
+      if (result.riseS < 0 && done >= 0.9)
+        result.riseS = timeS - tenS;
+      if (done * 100 - 100 > result.overshoot)
+        result.overshoot = done * 100 - 100;
+      if (fabs(target - joint->position) > fmax(0.02 * fabs(size), 2))
+        result.settleS = timeS;
+      if (abs(efforts[stepped]) > result.worstEffort)
+        result.worstEffort = abs(efforts[stepped]);
+      if (timeline != NULL)
+        fprintf(timeline, "%.3f,%s,%.0f,%.2f,%d,%d\n", timeS,
+                jointNames[stepped], target, joint->position,
+                (int)arm.joints[stepped].position, efforts[stepped]);
+    }
+    result.finalError = target - plants[stepped].position;
+    result.countError = arm.joints[stepped].position - plants[stepped].position;
+    ok &= result.riseS >= 0 && result.settleS < durationS;
+    printf("%-3s %8d %9.0f %8.1f%% %9.0f %9.1f %9.1f %8d\n",
+           jointNames[stepped], (int)arm.joints[stepped].config.rangeEdges,
+           result.riseS * 1000, result.overshoot, result.settleS * 1000,
+           result.finalError, result.countError, result.worstEffort);
+  }
+  if (timeline != NULL)
+    fclose(timeline);
+
+  // Loop cost: every joint stepped with moving counters.
+  uint16_t setpoints[ARM_JOINTS] = {UINT16_MAX / 2, UINT16_MAX / 3,
+                                    UINT16_MAX / 4};
+  int16_t efforts[ARM_JOINTS];
+  int64_t started = now_ns();
+  for (long i = 0; i < COST_ITERATIONS; i++) {
+    for (int j = 0; j < ARM_JOINTS; j++)
+      edges[j] += i & 3;
+    arm_step(&arm, setpoints, edges, efforts);
+    sink += efforts[0];
+  }
+  double costNs = (double)(now_ns() - started) / COST_ITERATIONS;
+  printf("arm_step %.1f ns, %.4f%% of a %d us tick\n", costNs,
+         costNs / 10 / CONTROL_PERIOD_US, CONTROL_PERIOD_US);
+  if (!ok)
+    printf("a joint did not reach and settle at its setpoint\n");
+  return ok ? 0 : 1;
+}
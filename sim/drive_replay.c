@@ -0,0 +1,327 @@
+// Replays drive setpoints through the drive output stage in simulated time and
+// the wheel mixer, and checks the PWM timeline it records: the acceleration
+// and jerk limits, that every wheel takes its speed for a tick in the same
+// update, and how closely the output follows the setpoints. Frames from other
+// clients, which publish the setpoint again without changing it, must not
+// change the output. See the Simulator section of README.md.
+
+#include "arm.h"
+#include "control.h"
+#include "drive.h"
+#include "esp_log.h"
+#include "hal.h"
+#include "hardware.h"
+#include "mixer.h"
+#include "sim.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Setpoints of the built-in pattern, sent every SETPOINT_INTERVAL_US like the
+// web interface does: a stick pushed fully forward, reversed, swept, released.
+#define SETPOINT_INTERVAL_US 100000
+#define PATTERN_US 8000000
+
+// Acceleration and jerk are measured over this many ticks, so the duty
+// resolution does not swamp them.
+#define WINDOW_TICKS 10
+// Speed units per duty step.
+#define SPEED_PER_DUTY ((double)UINT16_MAX / HAL_PWM_DUTY_MAX)
+
+typedef struct {
+  int64_t timeUs;
+  int16_t left;
+  int16_t right;
+  uint16_t seq; // Numbered as drive_seq in web.c numbers accepted commands
+} setpoint;
+
+static setpoint *setpoints = NULL;
+static size_t setpointCount = 0;
+// Times of the frames from other clients, sorted.
+static int64_t *otherFrames = NULL;
+static size_t otherFrameCount = 0;
+
+static void setpoint_add(int64_t timeUs, int16_t left, int16_t right) {
+  static size_t capacity = 0;
+  if (setpointCount == capacity) {
+    capacity = capacity == 0 ? 256 : capacity * 2;
+    setpoints = realloc(setpoints, capacity * sizeof(setpoint));
+    if (setpoints == NULL)
+      abort();
+  }
+  setpoints[setpointCount] =
+      (setpoint){timeUs, left, right, setpointCount + 1};
+  setpointCount++;
+}
+
+static int time_compare(const void *a, const void *b) {
+  int64_t left = *(const int64_t *)a, right = *(const int64_t *)b;
+  return left < right ? -1 : left > right;
+}
+
+// Frames from clients, every SETPOINT_INTERVAL_US at a random phase until
+// endUs, with commands the rover refuses or that do not drive: priority held
+// by another client, telemetry rate, arm only. Every frame publishes the
+// setpoint again.
+static void other_frames_make(long clients, int64_t endUs) {
+  size_t perClient = endUs / SETPOINT_INTERVAL_US;
+  otherFrameCount = clients * perClient;
+  otherFrames = malloc((otherFrameCount + 1) * sizeof(int64_t));
+  if (otherFrames == NULL)
+    abort();
+  srand(2);
+  for (long client = 0; client < clients; client++) {
+    int64_t phaseUs = rand() % SETPOINT_INTERVAL_US;
+    for (size_t i = 0; i < perClient; i++)
+      otherFrames[client * perClient + i] =
+          phaseUs + i * SETPOINT_INTERVAL_US;
+  }
+  qsort(otherFrames, otherFrameCount, sizeof(int64_t), time_compare);
+}
+
+static int16_t pattern_at(int64_t timeUs) {
+  if (timeUs < 2000000)
+    return INT16_MAX;
+  if (timeUs < 4000000)
+    return INT16_MIN;
+  if (timeUs < 6000000)
+    return (timeUs - 4000000) * UINT16_MAX / 2000000 + INT16_MIN;
+  return 0;
+}
+
+static void setpoints_pattern(int64_t jitterUs) {
+  srand(1);
+  for (int64_t timeUs = 0; timeUs < PATTERN_US;
+       timeUs += SETPOINT_INTERVAL_US) {
+    int64_t sentUs = timeUs + (jitterUs > 0 ? rand() % jitterUs : 0);
+    setpoint_add(sentUs, pattern_at(timeUs), -pattern_at(timeUs));
+  }
+}
+
+// Read time_s,left,right rows from path, the format loadTest.py replays.
+// Further columns are ignored.
+static bool setpoints_read(const char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+    return false;
+  char line[256];
+  if (fgets(line, sizeof(line), file) == NULL ||
+      strncmp(line, "time_s,left,right", 17) != 0) {
+    fclose(file);
+    return false;
+  }
+  double timeS;
+  int left, right;
+  while (fgets(line, sizeof(line), file) != NULL)
+    if (sscanf(line, "%lf,%d,%d", &timeS, &left, &right) == 3)
+      setpoint_add(timeS * 1000000, left, right);
+  fclose(file);
+  return setpointCount > 0;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "Replays drive setpoints through the drive output stage at %d Hz and\n"
+          "checks the recorded PWM timeline against DRIVE_ACCEL_MAX %d and\n"
+          "DRIVE_JERK_MAX %d.\n"
+          "  --setpoints PATH  Replay time_s,left,right rows from PATH instead "
+          "of\n"
+          "                    a built-in pattern\n"
+          "  --jitter MS       Delay pattern setpoints randomly by up to MS\n"
+          "  --other-clients N Mix in frames from N other clients, default 3\n"
+          "  --timeline PATH   Write the PWM timeline to PATH as CSV\n",
+          name, CONTROL_RATE_HZ, DRIVE_ACCEL_MAX, DRIVE_JERK_MAX);
+}
+
+int main(int argc, char **argv) {
+  const char *setpointsPath = NULL;
+  const char *timelinePath = NULL;
+  long jitterMs = 0;
+  long otherClients = 3;
+  for (int i = 1; i < argc; i++) {
+    bool hasValue = i + 1 < argc;
+    if (strcmp(argv[i], "--setpoints") == 0 && hasValue) {
+      setpointsPath = argv[++i];
+    } else if (strcmp(argv[i], "--jitter") == 0 && hasValue) {
+      jitterMs = strtol(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--other-clients") == 0 && hasValue) {
+      otherClients = strtol(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--timeline") == 0 && hasValue) {
+      timelinePath = argv[++i];
+    } else {
+      usage(argv[0]);
+      return strcmp(argv[i], "--help") == 0 ? 0 : 2;
+    }
+  }
+  if (setpointsPath != NULL) {
+    if (!setpoints_read(setpointsPath)) {
+      ESP_LOGE(TAG_SIM, "Failed to read setpoints from %s", setpointsPath);
+      return 1;
+    }
+  } else {
+    setpoints_pattern(jitterMs * 1000);
+  }
+  if (otherClients < 0) {
+    usage(argv[0]);
+    return 2;
+  }
+  int64_t endUs = setpoints[setpointCount - 1].timeUs + 3000000;
+  size_t ticks = endUs / CONTROL_PERIOD_US + 1;
+  other_frames_make(otherClients, endUs);
+
+  // The reference output: the drive stage given each setpoint once, at the
+  // first tick after it arrived, and nothing else.
+  int16_t(*reference)[DRIVE_SIDES] = calloc(ticks, sizeof(*reference));
+  drive_state drive;
+  drive_reset(&drive, 0, 0);
+  size_t next = 0;
+  for (size_t tick = 0; tick < ticks; tick++) {
+    int64_t nowUs = tick * CONTROL_PERIOD_US;
+    bool arrived = false;
+    while (next < setpointCount && setpoints[next].timeUs <= nowUs) {
+      next++;
+      arrived = true;
+    }
+    if (arrived)
+      drive_setpoint(&drive, setpoints[next - 1].left,
+                     setpoints[next - 1].right, setpoints[next - 1].seq,
+                     nowUs);
+    drive_step(&drive, nowUs, reference[tick]);
+  }
+
+  // Run the drive stage, mixer and motor_control_set as control_step does,
+  // one tick past the last setpoint plus the time to settle, and keep the
+  // duty every wheel should have after each tick. Every frame publishes the
+  // setpoint, whichever client sent it, and the control task passes the
+  // newest one to the drive stage.
+  sim_time_set(0);
+  pins_init();
+  motor_control_init();
+  drive_reset(&drive, 0, 0);
+  int16_t(*targets)[DRIVE_SIDES] = calloc(ticks, sizeof(*targets));
+  uint32_t(*expected)[DRIVE_WHEELS] = calloc(ticks, sizeof(*expected));
+  setpoint published = {0};
+  size_t nextOther = 0, offReference = 0;
+  next = 0;
+  for (size_t tick = 0; tick < ticks; tick++) {
+    int64_t nowUs = tick * CONTROL_PERIOD_US;
+    sim_time_set(nowUs);
+    bool arrived = false;
+    while (next < setpointCount && setpoints[next].timeUs <= nowUs) {
+      published = setpoints[next++];
+      arrived = true;
+    }
+    // Another client's frame publishes the setpoint as it was.
+    while (nextOther < otherFrameCount && otherFrames[nextOther] <= nowUs) {
+      nextOther++;
+      arrived = true;
+    }
+    if (arrived)
+      drive_setpoint(&drive, published.left, published.right, published.seq,
+                     nowUs);
+    int16_t sides[DRIVE_SIDES];
+    int16_t wheels[DRIVE_WHEELS];
+    drive_step(&drive, nowUs, sides);
+    offReference += memcmp(sides, reference[tick], sizeof(sides)) != 0;
+    mixer_wheels(sides, wheels);
+    motor_control_set(wheels, (int16_t[ARM_JOINTS]){0});
+    for (int i = 0; i < DRIVE_WHEELS; i++)
+      expected[tick][i] =
+          (uint32_t)(wheels[i] - INT16_MIN) * HAL_PWM_DUTY_MAX / UINT16_MAX;
+    targets[tick][DRIVE_LEFT] = published.left;
+    targets[tick][DRIVE_RIGHT] = published.right;
+  }
+  if (timelinePath != NULL && !sim_timeline_write(timelinePath)) {
+    ESP_LOGE(TAG_SIM, "Failed to write %s", timelinePath);
+    return 1;
+  }
+
+  // Rebuild the duty of every channel at every tick from the timeline, and
+  // check that every wheel had its duty for the tick once the tick's events
+  // were recorded, so none lagged behind the others.
+  static sim_event events[4096];
+  uint32_t(*duties)[DRIVE_WHEELS] = calloc(ticks, sizeof(*duties));
+  uint32_t current[DRIVE_WHEELS] = {0};
+  size_t first = 0, count, tick = 0, unsynced = 0;
+  while ((count = sim_timeline_read(first, events, 4096)) > 0) {
+    for (size_t i = 0; i < count; i++) {
+      const sim_event *event = &events[i];
+      if (event->signal != SIM_SIGNAL_PWM || event->id < DRIVE_CHANNEL_FIRST ||
+          event->id > DRIVE_CHANNEL_LAST)
+        continue;
+      for (; tick < ticks && (int64_t)tick * CONTROL_PERIOD_US < event->timeUs;
+           tick++)
+        memcpy(duties[tick], current, sizeof(current));
+      current[event->id - DRIVE_CHANNEL_FIRST] = event->value;
+    }
+    first += count;
+  }
+  for (; tick < ticks; tick++)
+    memcpy(duties[tick], current, sizeof(current));
+  for (size_t t = 0; t < ticks; t++)
+    unsynced += memcmp(duties[t], expected[t], sizeof(current)) != 0;
+
+  // Measure on the middle wheel of each side, which the curvature correction
+  // leaves at the speed of its side, undoing its trim.
+  static const int16_t trims[DRIVE_WHEELS] = MIXER_TRIM_PERMILLE;
+  double worstAccel = 0, worstJerk = 0, worstStep = 0;
+  double window = WINDOW_TICKS * (double)CONTROL_PERIOD_US / 1000000;
+  uint8_t sideWheel[DRIVE_SIDES];
+  double sideScale[DRIVE_SIDES];
+  for (int wheel = 0; wheel < DRIVE_WHEELS; wheel++) {
+    if (!mixerWheels[wheel].corner) {
+      sideWheel[mixerWheels[wheel].side] = wheel;
+      sideScale[mixerWheels[wheel].side] =
+          SPEED_PER_DUTY * 1000 / trims[wheel];
+    }
+  }
+  for (int side = 0; side < DRIVE_SIDES; side++) {
+    for (size_t t = 2 * WINDOW_TICKS; t < ticks; t++) {
+      double v0 = duties[t - 2 * WINDOW_TICKS][sideWheel[side]] * sideScale[side];
+      double v1 = duties[t - WINDOW_TICKS][sideWheel[side]] * sideScale[side];
+      double v2 = duties[t][sideWheel[side]] * sideScale[side];
+      double accel = (v2 - v1) / window;
+      double jerk = ((v2 - v1) - (v1 - v0)) / window / window;
+      double step = (duties[t][sideWheel[side]] -
+                     (double)duties[t - 1][sideWheel[side]]) *
+                    sideScale[side];
+      if (accel < 0)
+        accel = -accel;
+      if (jerk < 0)
+        jerk = -jerk;
+      if (step < 0)
+        step = -step;
+      worstAccel = accel > worstAccel ? accel : worstAccel;
+      worstJerk = jerk > worstJerk ? jerk : worstJerk;
+      worstStep = step > worstStep ? step : worstStep;
+    }
+  }
+
+  // Tracking: how far the left output lags the setpoints on average.
+  double errorSum = 0;
+  for (size_t t = 0; t < ticks; t++)
+    errorSum += abs((int)(duties[t][sideWheel[DRIVE_LEFT]] * SPEED_PER_DUTY +
+                          INT16_MIN) -
+                    targets[t][DRIVE_LEFT]);
+
+  // Duties only resolve SPEED_PER_DUTY, which adds up to one duty step of
+  // error to every measurement.
+  double accelTolerance = 2 * SPEED_PER_DUTY / window;
+  double jerkTolerance = 4 * SPEED_PER_DUTY / window / window;
+  bool accelOk = worstAccel <= DRIVE_ACCEL_MAX + accelTolerance;
+  bool jerkOk = worstJerk <= DRIVE_JERK_MAX + jerkTolerance;
+  printf("%zu setpoints over %.1f s, %zu ticks\n", setpointCount,
+         endUs / 1e6, ticks);
+  printf("worst acceleration %.0f units/s, limit %d: %s\n", worstAccel,
+         DRIVE_ACCEL_MAX, accelOk ? "ok" : "EXCEEDED");
+  printf("worst jerk %.0f units/s^2, limit %d: %s\n", worstJerk,
+         DRIVE_JERK_MAX, jerkOk ? "ok" : "EXCEEDED");
+  printf("largest change in one tick %.0f units\n", worstStep);
+  printf("mean distance from setpoint %.0f units\n", errorSum / ticks);
+  printf("ticks with a wheel not at its speed: %zu\n", unsynced);
+  printf("ticks off the reference with %zu frames from %ld other clients: "
+         "%zu\n",
+         otherFrameCount, otherClients, offReference);
+  return accelOk && jerkOk && unsynced == 0 && offReference == 0 ? 0 : 1;
+}
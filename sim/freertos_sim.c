@@ -0,0 +1,178 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "hal.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct sim_task {
+  pthread_t thread;
+  TaskFunction_t function;
+  void *parameters;
+  char name[16];
+  UBaseType_t priority;
+};
+
+static void *task_thread(void *arg) {
+  struct sim_task *task = arg;
+  pthread_setname_np(pthread_self(), task->name);
+  task->function(task->parameters);
+  // A FreeRTOS task must never return.
+  abort();
+}
+
+BaseType_t xTaskCreate(TaskFunction_t function, const char *name,
+                       uint32_t stackDepth, void *parameters,
+                       UBaseType_t priority, TaskHandle_t *created) {
+  struct sim_task *task = calloc(1, sizeof(*task));
+  if (task == NULL)
+    return pdFAIL;
+  task->function = function;
+  task->parameters = parameters;
+  task->priority = priority;
+  strncpy(task->name, name, sizeof(task->name) - 1);
+  if (pthread_create(&task->thread, NULL, task_thread, task) != 0) {
+    free(task);
+    return pdFAIL;
+  }
+  pthread_detach(task->thread);
+  if (created != NULL)
+    *created = task;
+  return pdPASS;
+}
+
+TickType_t xTaskGetTickCount(void) {
+  return hal_time_us() * configTICK_RATE_HZ / 1000000;
+}
+
+// Sleep until the time of tick, on the clock of hal_time_us.
+static void sleep_until_tick(int64_t tick) {
+  int64_t waitUs = tick * 1000000 / configTICK_RATE_HZ - hal_time_us();
+  if (waitUs <= 0)
+    return;
+  struct timespec wait = {.tv_sec = waitUs / 1000000,
+                          .tv_nsec = waitUs % 1000000 * 1000};
+  while (nanosleep(&wait, &wait) != 0 && errno == EINTR) {
+  }
+}
+
+void vTaskDelay(TickType_t ticks) {
+  sleep_until_tick((int64_t)xTaskGetTickCount() + ticks);
+}
+
+void vTaskDelayUntil(TickType_t *previousWake, TickType_t period) {
+  *previousWake += period;
+  // Ticks wrap as on the rover.
+  int32_t ahead = (int32_t)(*previousWake - xTaskGetTickCount());
+  if (ahead > 0)
+    sleep_until_tick((int64_t)xTaskGetTickCount() + ahead);
+}
+
+struct sim_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  UBaseType_t length;
+  UBaseType_t itemSize;
+  UBaseType_t count;
+  UBaseType_t head;
+  uint8_t items[];
+};
+
+QueueHandle_t xQueueCreate(UBaseType_t length, UBaseType_t itemSize) {
+  struct sim_queue *queue = calloc(1, sizeof(*queue) + length * itemSize);
+  if (queue == NULL)
+    return NULL;
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&queue->changed, &attr);
+  pthread_condattr_destroy(&attr);
+  queue->length = length;
+  queue->itemSize = itemSize;
+  return queue;
+}
+
+// Wait on queue->changed until the deadline, or forever if until is NULL.
+// Returns false once the deadline has passed.
+static bool queue_wait(struct sim_queue *queue, const struct timespec *until) {
+  if (until == NULL)
+    return pthread_cond_wait(&queue->changed, &queue->lock) == 0;
+  return pthread_cond_timedwait(&queue->changed, &queue->lock, until) == 0;
+}
+
+// Return the deadline wait ticks from now in until, or NULL for
+// portMAX_DELAY.
+static const struct timespec *wait_deadline(TickType_t wait,
+                                            struct timespec *until) {
+  if (wait == portMAX_DELAY)
+    return NULL;
+  clock_gettime(CLOCK_MONOTONIC, until);
+  int64_t ns = until->tv_nsec + (int64_t)wait * 1000000000 / configTICK_RATE_HZ;
+  until->tv_sec += ns / 1000000000;
+  until->tv_nsec = ns % 1000000000;
+  return until;
+}
+
+BaseType_t xQueueSend(QueueHandle_t queue, const void *item,
+                      TickType_t wait) {
+  struct timespec until;
+  const struct timespec *deadline = wait_deadline(wait, &until);
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == queue->length) {
+    if (wait == 0 || !queue_wait(queue, deadline)) {
+      pthread_mutex_unlock(&queue->lock);
+      return pdFAIL;
+    }
+  }
+  UBaseType_t tail = (queue->head + queue->count) % queue->length;
+  if (item != NULL)
+    memcpy(queue->items + tail * queue->itemSize, item, queue->itemSize);
+  queue->count++;
+  pthread_cond_broadcast(&queue->changed);
+  pthread_mutex_unlock(&queue->lock);
+  return pdPASS;
+}
+
+BaseType_t xQueueOverwrite(QueueHandle_t queue, const void *item) {
+  pthread_mutex_lock(&queue->lock);
+  if (queue->count == 0)
+    queue->count = 1;
+  memcpy(queue->items + queue->head * queue->itemSize, item, queue->itemSize);
+  pthread_cond_broadcast(&queue->changed);
+  pthread_mutex_unlock(&queue->lock);
+  return pdPASS;
+}
+
+BaseType_t xQueueReceive(QueueHandle_t queue, void *item, TickType_t wait) {
+  struct timespec until;
+  const struct timespec *deadline = wait_deadline(wait, &until);
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == 0) {
+    if (wait == 0 || !queue_wait(queue, deadline)) {
+      pthread_mutex_unlock(&queue->lock);
+      return pdFAIL;
+    }
+  }
+  if (item != NULL)
+    memcpy(item, queue->items + queue->head * queue->itemSize,
+           queue->itemSize);
+  queue->head = (queue->head + 1) % queue->length;
+  queue->count--;
+  pthread_cond_broadcast(&queue->changed);
+  pthread_mutex_unlock(&queue->lock);
+  return pdPASS;
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void) { return xQueueCreate(1, 0); }
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void) {
+  // A mutex starts out given.
+  SemaphoreHandle_t mutex = xQueueCreate(1, 0);
+  if (mutex != NULL)
+    xSemaphoreGive(mutex);
+  return mutex;
+}
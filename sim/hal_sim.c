@@ -0,0 +1,422 @@
+#include "hal.h"
+
+#include "esp_log.h"
+#include "sim.h"
+#include "tft.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define GPIO_COUNT 64
+
+// Guards every output and the timeline, which are written by the control,
+// httpd, and render threads.
+static pthread_mutex_t halLock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct timespec bootTime;
+
+__attribute__((constructor)) static void boot(void) {
+  clock_gettime(CLOCK_MONOTONIC, &bootTime);
+}
+
+// Set by sim_time_set, -1 while following the monotonic clock.
+static _Atomic int64_t virtualTimeUs = -1;
+
+void sim_time_set(int64_t nowUs) { virtualTimeUs = nowUs; }
+
+int64_t hal_time_us(void) {
+  int64_t virtualUs = virtualTimeUs;
+  if (virtualUs >= 0)
+    return virtualUs;
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)(now.tv_sec - bootTime.tv_sec) * 1000000 +
+         (now.tv_nsec - bootTime.tv_nsec) / 1000;
+}
+
+uint32_t esp_log_timestamp(void) { return hal_time_us() / 1000; }
+
+// Every timer has its own thread, rather than sharing one task as on the
+// rover.
+struct hal_timer {
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  hal_timer_callback callback;
+  void *arg;
+  int64_t dueUs; // hal_time_us of the pending call, -1 if none
+};
+
+static void *timer_thread(void *arg) {
+  struct hal_timer *timer = arg;
+  pthread_mutex_lock(&timer->lock);
+  while (true) {
+    if (timer->dueUs < 0) {
+      pthread_cond_wait(&timer->changed, &timer->lock);
+      continue;
+    }
+    int64_t dueUs = timer->dueUs;
+    if (hal_time_us() < dueUs) {
+      int64_t ns = bootTime.tv_nsec + dueUs % 1000000 * 1000;
+      struct timespec until = {.tv_sec = bootTime.tv_sec + dueUs / 1000000 +
+                                         ns / 1000000000,
+                               .tv_nsec = ns % 1000000000};
+      pthread_cond_timedwait(&timer->changed, &timer->lock, &until);
+      continue;
+    }
+    timer->dueUs = -1;
+    pthread_mutex_unlock(&timer->lock);
+    timer->callback(timer->arg);
+    pthread_mutex_lock(&timer->lock);
+  }
+  return NULL;
+}
+
+hal_timer_handle hal_timer_create(const char *name, hal_timer_callback callback,
+                                  void *arg) {
+  struct hal_timer *timer = calloc(1, sizeof(*timer));
+  assert(timer != NULL);
+  pthread_mutex_init(&timer->lock, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&timer->changed, &attr);
+  pthread_condattr_destroy(&attr);
+  timer->callback = callback;
+  timer->arg = arg;
+  timer->dueUs = -1;
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, timer_thread, timer) != 0)
+    abort();
+  pthread_setname_np(thread, name);
+  pthread_detach(thread);
+  return timer;
+}
+
+void hal_timer_once(hal_timer_handle timer, int64_t delayUs) {
+  pthread_mutex_lock(&timer->lock);
+  timer->dueUs = hal_time_us() + (delayUs > 0 ? delayUs : 0);
+  pthread_cond_signal(&timer->changed);
+  pthread_mutex_unlock(&timer->lock);
+}
+
+void hal_timer_stop(hal_timer_handle timer) {
+  pthread_mutex_lock(&timer->lock);
+  timer->dueUs = -1;
+  pthread_cond_signal(&timer->changed);
+  pthread_mutex_unlock(&timer->lock);
+}
+
+static sim_event *timeline = NULL;
+static size_t timelineLength = 0;
+static size_t timelineCapacity = 0;
+static size_t timelineDropped = 0;
+
+// Record a change of an output at timeUs. Called with halLock held.
+static void timeline_record_at(int64_t timeUs, sim_signal signal, uint8_t id,
+                               uint32_t value) {
+  if (timelineLength == timelineCapacity) {
+    size_t capacity = timelineCapacity == 0 ? 4096 : timelineCapacity * 2;
+    sim_event *grown = capacity <= SIM_TIMELINE_MAX
+                           ? realloc(timeline, capacity * sizeof(sim_event))
+                           : NULL;
+    if (grown == NULL) {
+      timelineDropped++;
+      return;
+    }
+    timeline = grown;
+    timelineCapacity = capacity;
+  }
+  timeline[timelineLength++] =
+      (sim_event){.timeUs = timeUs, .signal = signal, .id = id, .value = value};
+}
+
+static void timeline_record(sim_signal signal, uint8_t id, uint32_t value) {
+  timeline_record_at(hal_time_us(), signal, id, value);
+}
+
+size_t sim_timeline_read(size_t first, sim_event *events, size_t max) {
+  pthread_mutex_lock(&halLock);
+  size_t count = first < timelineLength ? timelineLength - first : 0;
+  if (count > max)
+    count = max;
+  memcpy(events, timeline + first, count * sizeof(sim_event));
+  pthread_mutex_unlock(&halLock);
+  return count;
+}
+
+bool sim_timeline_write(const char *path) {
+  FILE *file = fopen(path, "w");
+  if (file == NULL)
+    return false;
+  pthread_mutex_lock(&halLock);
+  fprintf(file, "time_us,signal,value\n");
+  for (size_t i = 0; i < timelineLength; i++)
+    fprintf(file, "%lld,%s%u,%u\n", (long long)timeline[i].timeUs,
+            timeline[i].signal == SIM_SIGNAL_GPIO ? "gpio" : "pwm",
+            timeline[i].id, timeline[i].value);
+  if (timelineDropped > 0)
+    ESP_LOGW(TAG_SIM, "Timeline full, %zu changes were not recorded",
+             timelineDropped);
+  pthread_mutex_unlock(&halLock);
+  return fclose(file) == 0;
+}
+
+static uint64_t gpioOutputs = 0;
+static uint64_t gpioPullUps = 0;
+static uint64_t gpioDriven = 0; // Inputs set by sim_gpio_drive
+static bool gpioLevels[GPIO_COUNT] = {0};
+
+void hal_gpio_output(uint64_t mask) {
+  pthread_mutex_lock(&halLock);
+  gpioOutputs |= mask;
+  pthread_mutex_unlock(&halLock);
+}
+
+void hal_gpio_input(uint64_t mask, bool pullUp) {
+  pthread_mutex_lock(&halLock);
+  gpioOutputs &= ~mask;
+  gpioPullUps = pullUp ? gpioPullUps | mask : gpioPullUps & ~mask;
+  pthread_mutex_unlock(&halLock);
+}
+
+void hal_gpio_set(int pin, bool level) {
+  assert(pin >= 0 && pin < GPIO_COUNT);
+  pthread_mutex_lock(&halLock);
+  if (gpioOutputs & (1ULL << pin) && gpioLevels[pin] != level) {
+    gpioLevels[pin] = level;
+    timeline_record(SIM_SIGNAL_GPIO, pin, level);
+  }
+  pthread_mutex_unlock(&halLock);
+}
+
+// Called with halLock held.
+static bool hal_gpio_level_locked(int pin) {
+  uint64_t bit = 1ULL << pin;
+  return gpioOutputs & bit || gpioDriven & bit ? gpioLevels[pin]
+                                               : gpioPullUps & bit;
+}
+
+bool hal_gpio_get(int pin) {
+  assert(pin >= 0 && pin < GPIO_COUNT);
+  pthread_mutex_lock(&halLock);
+  bool level = hal_gpio_level_locked(pin);
+  pthread_mutex_unlock(&halLock);
+  return level;
+}
+
+static struct {
+  hal_gpio_isr isr;
+  void *arg;
+  hal_gpio_edge edge;
+} gpioInterrupts[GPIO_COUNT];
+
+void hal_gpio_interrupt(int pin, hal_gpio_edge edge, hal_gpio_isr isr,
+                        void *arg) {
+  assert(pin >= 0 && pin < GPIO_COUNT);
+  pthread_mutex_lock(&halLock);
+  gpioInterrupts[pin].isr = isr;
+  gpioInterrupts[pin].arg = arg;
+  gpioInterrupts[pin].edge = edge;
+  pthread_mutex_unlock(&halLock);
+}
+
+// The handler of an edge runs on the thread driving the input, as if it
+// interrupted whatever the firmware was doing.
+void sim_gpio_drive(int pin, bool level) {
+  assert(pin >= 0 && pin < GPIO_COUNT);
+  pthread_mutex_lock(&halLock);
+  bool was = hal_gpio_level_locked(pin);
+  gpioDriven |= 1ULL << pin;
+  gpioLevels[pin] = level;
+  hal_gpio_isr isr = NULL;
+  if (!(gpioOutputs & (1ULL << pin)) && was != level) {
+    hal_gpio_edge edge = gpioInterrupts[pin].edge;
+    if (edge == HAL_GPIO_EDGE_ANY ||
+        edge == (level ? HAL_GPIO_EDGE_RISING : HAL_GPIO_EDGE_FALLING))
+      isr = gpioInterrupts[pin].isr;
+  }
+  pthread_mutex_unlock(&halLock);
+  if (isr != NULL)
+    isr(gpioInterrupts[pin].arg);
+}
+
+bool sim_gpio_level(int pin) { return hal_gpio_get(pin); }
+
+static uint32_t pwmDuties[HAL_PWM_CHANNELS] = {0};
+
+void hal_pwm_init(void) {}
+
+void hal_pwm_channel_init(uint8_t channel, int pin) {
+  hal_pwm_set(channel, 0);
+}
+
+void hal_pwm_set(uint8_t channel, uint32_t duty) {
+  assert(channel < HAL_PWM_CHANNELS && duty <= HAL_PWM_DUTY_MAX + 1);
+  pthread_mutex_lock(&halLock);
+  if (pwmDuties[channel] != duty) {
+    pwmDuties[channel] = duty;
+    timeline_record(SIM_SIGNAL_PWM, channel, duty);
+  }
+  pthread_mutex_unlock(&halLock);
+}
+
+// Recorded with one timestamp, as the channels change together on the rover.
+void hal_pwm_set_many(uint8_t first, uint8_t count, const uint32_t *duties) {
+  assert(first + count <= HAL_PWM_LEDC_CHANNELS);
+  pthread_mutex_lock(&halLock);
+  int64_t nowUs = hal_time_us();
+  for (uint8_t i = 0; i < count; i++) {
+    assert(duties[i] <= HAL_PWM_DUTY_MAX + 1);
+    if (pwmDuties[first + i] != duties[i]) {
+      pwmDuties[first + i] = duties[i];
+      timeline_record_at(nowUs, SIM_SIGNAL_PWM, first + i, duties[i]);
+    }
+  }
+  pthread_mutex_unlock(&halLock);
+}
+
+void hal_pwm_stop(uint8_t channel) { hal_pwm_set(channel, 0); }
+
+void hal_pwm_set_isr(uint8_t channel, uint32_t duty) {
+  hal_pwm_set(channel, duty);
+}
+
+uint32_t sim_pwm_duty(uint8_t channel) {
+  assert(channel < HAL_PWM_CHANNELS);
+  pthread_mutex_lock(&halLock);
+  uint32_t duty = pwmDuties[channel];
+  pthread_mutex_unlock(&halLock);
+  return duty;
+}
+
+static uint32_t counterEdges[HAL_COUNTERS] = {0};
+
+void hal_counter_init(uint8_t counter, int pin) {
+  assert(counter < HAL_COUNTERS);
+  pthread_mutex_lock(&halLock);
+  counterEdges[counter] = 0;
+  pthread_mutex_unlock(&halLock);
+}
+
+uint32_t hal_counter_get(uint8_t counter) {
+  assert(counter < HAL_COUNTERS);
+  pthread_mutex_lock(&halLock);
+  uint32_t edges = counterEdges[counter];
+  pthread_mutex_unlock(&halLock);
+  return edges;
+}
+
+void sim_counter_add(uint8_t counter, uint32_t edges) {
+  assert(counter < HAL_COUNTERS);
+  pthread_mutex_lock(&halLock);
+  counterEdges[counter] += edges;
+  pthread_mutex_unlock(&halLock);
+}
+
+// The part of the ILI9341 the firmware uses: column and page address set and
+// memory write, which the SPI transfers are decoded into. Guarded by lcdLock
+// so sim_framebuffer_read can copy the framebuffer at any time.
+static pthread_mutex_t lcdLock = PTHREAD_MUTEX_INITIALIZER;
+static uint16_t framebuffer[LCD_HEIGHT][LCD_WIDTH];
+static uint8_t lcdCmd = 0;
+static uint8_t lcdArgs[4];
+static size_t lcdDataBytes = 0; // Since the last command
+static uint16_t columnStart, columnEnd, pageStart, pageEnd;
+static uint16_t cursorX, cursorY;
+static uint8_t rectsQueued = 0;
+
+void hal_lcd_init(void) {}
+
+void hal_lcd_cmd(uint8_t cmd) {
+  pthread_mutex_lock(&lcdLock);
+  lcdCmd = cmd;
+  lcdDataBytes = 0;
+  if (cmd == 0x2C) {
+    cursorX = columnStart;
+    cursorY = pageStart;
+  }
+  pthread_mutex_unlock(&lcdLock);
+}
+
+static void lcd_pixel(uint16_t rgb565) {
+  if (cursorY > pageEnd || cursorY >= LCD_HEIGHT)
+    return;
+  if (cursorX < LCD_WIDTH)
+    framebuffer[cursorY][cursorX] = rgb565;
+  if (++cursorX > columnEnd) {
+    cursorX = columnStart;
+    cursorY++;
+  }
+}
+
+void hal_lcd_data(const uint8_t *data, size_t length) {
+  pthread_mutex_lock(&lcdLock);
+  for (size_t i = 0; i < length; i++, lcdDataBytes++) {
+    if (lcdCmd == 0x2C) {
+      // Pixels are sent high byte first.
+      if (lcdDataBytes % 2 == 1)
+        lcd_pixel(lcdArgs[0] << 8 | data[i]);
+      else
+        lcdArgs[0] = data[i];
+      continue;
+    }
+    if (lcdDataBytes >= sizeof(lcdArgs))
+      continue;
+    lcdArgs[lcdDataBytes] = data[i];
+    if (lcdDataBytes == 3 && lcdCmd == 0x2A) {
+      columnStart = lcdArgs[0] << 8 | lcdArgs[1];
+      columnEnd = lcdArgs[2] << 8 | lcdArgs[3];
+    } else if (lcdDataBytes == 3 && lcdCmd == 0x2B) {
+      pageStart = lcdArgs[0] << 8 | lcdArgs[1];
+      pageEnd = lcdArgs[2] << 8 | lcdArgs[3];
+    }
+  }
+  pthread_mutex_unlock(&lcdLock);
+}
+
+// Sent right away, the host has no DMA to wait for.
+void hal_lcd_queue_rect(uint16_t x, uint16_t y, uint16_t w, uint16_t h,
+                        const uint16_t *pixels) {
+  assert(rectsQueued < BAND_BUFFERS);
+  rectsQueued++;
+  uint8_t columns[] = {x >> 8, x & 0xff, (x + w - 1) >> 8, (x + w - 1) & 0xff};
+  uint8_t pages[] = {y >> 8, y & 0xff, (y + h - 1) >> 8, (y + h - 1) & 0xff};
+  hal_lcd_cmd(0x2A);
+  hal_lcd_data(columns, sizeof(columns));
+  hal_lcd_cmd(0x2B);
+  hal_lcd_data(pages, sizeof(pages));
+  hal_lcd_cmd(0x2C);
+  hal_lcd_data((const uint8_t *)pixels, (size_t)w * h * sizeof(uint16_t));
+}
+
+void hal_lcd_wait_rect(void) {
+  assert(rectsQueued > 0);
+  rectsQueued--;
+}
+
+void sim_framebuffer_read(uint16_t *pixels) {
+  pthread_mutex_lock(&lcdLock);
+  memcpy(pixels, framebuffer, sizeof(framebuffer));
+  pthread_mutex_unlock(&lcdLock);
+}
+
+bool sim_framebuffer_write(const char *path) {
+  static uint16_t pixels[LCD_HEIGHT][LCD_WIDTH];
+  sim_framebuffer_read(&pixels[0][0]);
+  FILE *file = fopen(path, "wb");
+  if (file == NULL)
+    return false;
+  fprintf(file, "P6\n%d %d\n255\n", LCD_WIDTH, LCD_HEIGHT);
+  for (int y = 0; y < LCD_HEIGHT; y++) {
+    for (int x = 0; x < LCD_WIDTH; x++) {
+      uint16_t pixel = pixels[y][x];
+      uint8_t rgb[] = {(pixel >> 11) * 255 / 31, (pixel >> 5 & 0x3f) * 255 / 63,
+                       (pixel & 0x1f) * 255 / 31};
+      fwrite(rgb, 1, sizeof(rgb), file);
+    }
+  }
+  return fclose(file) == 0;
+}
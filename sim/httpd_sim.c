@@ -0,0 +1,770 @@
+#include "esp_http_server.h"
+
+#include "esp_log.h"
+#include "freertos/task.h"
+#include "sim.h"
+#include "socket.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+// Requests are parsed from a per-connection buffer. A request header that
+// does not fit is refused, as are WebSocket frames with larger payloads.
+#define CONNECTION_BUFFER 2048
+#define WS_PAYLOAD_MAX (CONNECTION_BUFFER - 14)
+// Work items queued by httpd_queue_work and not yet run.
+#define WORK_QUEUE_LENGTH 16
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC11B28"
+
+static const char *TAG_HTTPD = "httpd_sim.c";
+
+typedef struct {
+  int fd; // -1 if free
+  const httpd_uri_t *websocket; // Handler after the handshake, or NULL
+  uint8_t in[CONNECTION_BUFFER];
+  size_t inLength;
+} connection;
+
+// Behind httpd_req_t.aux for the duration of one handler call.
+typedef struct {
+  connection *conn;
+  const char *headers; // Header lines of the request, after the request line
+  const char *headersEnd;
+  const uint8_t *body;  // Part of the body already in conn->in
+  size_t bodyBuffered;  // Bytes at body
+  size_t bodyRead;      // Bytes of the body returned by httpd_req_recv
+  const char *status;
+  const char *type;
+  const char *hdrFields[16];
+  const char *hdrValues[16];
+  uint8_t hdrCount;
+  bool chunked; // Whether the chunked headers have been sent
+  httpd_ws_frame_t frame; // Frame passed to a WebSocket handler
+} request_aux;
+
+typedef struct {
+  httpd_work_fn_t work;
+  void *arg;
+} work_item;
+
+static struct {
+  httpd_config_t config;
+  httpd_uri_t *handlers;
+  size_t handlerCount;
+  int listenFd;
+  int wakeFds[2]; // Written by httpd_queue_work to wake the server task
+  pthread_mutex_t workLock;
+  work_item work[WORK_QUEUE_LENGTH];
+  size_t workHead;
+  size_t workCount;
+  connection connections[CONFIG_LWIP_MAX_SOCKETS];
+  size_t openCount;
+} server = {.workLock = PTHREAD_MUTEX_INITIALIZER};
+
+static uint16_t portOverride = 0;
+
+void sim_httpd_set_port(uint16_t port) { portOverride = port; }
+
+static connection *connection_get(int fd) {
+  unsigned index = fd - LWIP_SOCKET_OFFSET;
+  if (index >= CONFIG_LWIP_MAX_SOCKETS ||
+      server.connections[index].fd != fd)
+    return NULL;
+  return &server.connections[index];
+}
+
+static bool send_all(int fd, const void *data, size_t length, int flags) {
+  const uint8_t *bytes = data;
+  while (length > 0) {
+    ssize_t sent = send(fd, bytes, length, flags | MSG_NOSIGNAL);
+    if (sent < 0 && errno == EINTR)
+      continue;
+    if (sent <= 0)
+      return false;
+    bytes += sent;
+    length -= sent;
+  }
+  return true;
+}
+
+static void connection_close(connection *conn) {
+  int fd = conn->fd;
+  conn->fd = -1;
+  conn->websocket = NULL;
+  conn->inLength = 0;
+  server.openCount--;
+  // As in ESP-IDF, close_fn is left to close the socket.
+  if (server.config.close_fn != NULL)
+    server.config.close_fn(&server, fd);
+  else
+    close(fd);
+}
+
+static void connection_accept(void) {
+  int accepted = accept(server.listenFd, NULL, NULL);
+  if (accepted < 0)
+    return;
+  int fd = fcntl(accepted, F_DUPFD_CLOEXEC, LWIP_SOCKET_OFFSET);
+  close(accepted);
+  if (fd < 0)
+    return;
+  if (fd >= LWIP_SOCKET_OFFSET + CONFIG_LWIP_MAX_SOCKETS) {
+    ESP_LOGE(TAG_HTTPD, "No free socket for a new connection");
+    close(fd);
+    return;
+  }
+  struct timeval recvTimeout = {.tv_sec = server.config.recv_wait_timeout};
+  struct timeval sendTimeout = {.tv_sec = server.config.send_wait_timeout};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &recvTimeout, sizeof(recvTimeout));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &sendTimeout, sizeof(sendTimeout));
+  // Latency on the rover comes from Wi-Fi, not from Nagle on loopback.
+  int noDelay = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+  connection *conn = &server.connections[fd - LWIP_SOCKET_OFFSET];
+  *conn = (connection){.fd = fd};
+  server.openCount++;
+  if (server.config.open_fn != NULL &&
+      server.config.open_fn(&server, fd) != ESP_OK)
+    connection_close(conn);
+}
+
+// SHA-1 of data, only used for the WebSocket handshake.
+static void sha1(const uint8_t *data, size_t length, uint8_t digest[20]) {
+  uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476,
+                   0xC3D2E1F0};
+  uint8_t block[64];
+  size_t total = (length + 9 + 63) / 64 * 64;
+  for (size_t offset = 0; offset < total; offset += 64) {
+    for (size_t i = 0; i < 64; i++) {
+      size_t at = offset + i;
+      if (at < length)
+        block[i] = data[at];
+      else if (at == length)
+        block[i] = 0x80;
+      else if (at >= total - 8)
+        block[i] = (uint64_t)length * 8 >> (8 * (total - 1 - at));
+      else
+        block[i] = 0;
+    }
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++)
+      w[i] = (uint32_t)block[4 * i] << 24 | block[4 * i + 1] << 16 |
+             block[4 * i + 2] << 8 | block[4 * i + 3];
+    for (int i = 16; i < 80; i++) {
+      uint32_t x = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+      w[i] = x << 1 | x >> 31;
+    }
+    uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+    for (int i = 0; i < 80; i++) {
+      uint32_t f, k;
+      if (i < 20) {
+        f = (b & c) | (~b & d);
+        k = 0x5A827999;
+      } else if (i < 40) {
+        f = b ^ c ^ d;
+        k = 0x6ED9EBA1;
+      } else if (i < 60) {
+        f = (b & c) | (b & d) | (c & d);
+        k = 0x8F1BBCDC;
+      } else {
+        f = b ^ c ^ d;
+        k = 0xCA62C1D6;
+      }
+      uint32_t t = (a << 5 | a >> 27) + f + e + k + w[i];
+      e = d;
+      d = c;
+      c = b << 30 | b >> 2;
+      b = a;
+      a = t;
+    }
+    h[0] += a;
+    h[1] += b;
+    h[2] += c;
+    h[3] += d;
+    h[4] += e;
+  }
+  for (int i = 0; i < 20; i++)
+    digest[i] = h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+static void base64(const uint8_t *data, size_t length, char *out) {
+  static const char digits[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  for (size_t i = 0; i < length; i += 3) {
+    uint32_t v = data[i] << 16 | (i + 1 < length ? data[i + 1] << 8 : 0) |
+                 (i + 2 < length ? data[i + 2] : 0);
+    *out++ = digits[v >> 18 & 63];
+    *out++ = digits[v >> 12 & 63];
+    *out++ = i + 1 < length ? digits[v >> 6 & 63] : '=';
+    *out++ = i + 2 < length ? digits[v & 63] : '=';
+  }
+  *out = '\0';
+}
+
+bool httpd_uri_match_wildcard(const char *uriTemplate, const char *uriToMatch,
+                              size_t matchUpto) {
+  // A trailing '*' matches anything after the template, and a trailing '?'
+  // makes the character before it optional. "/path?*" has both.
+  size_t templateLength = strlen(uriTemplate);
+  char last = templateLength > 0 ? uriTemplate[templateLength - 1] : 0;
+  char beforeLast = templateLength > 1 ? uriTemplate[templateLength - 2] : 0;
+  bool anyTail = last == '*' || (beforeLast == '*' && last == '?');
+  bool optional = last == '?' || (beforeLast == '?' && last == '*');
+  size_t special = anyTail + optional * 2;
+  if (templateLength < special)
+    return false;
+  size_t exact = templateLength - special;
+  if (matchUpto < exact || strncmp(uriTemplate, uriToMatch, exact) != 0)
+    return false;
+  if (!optional)
+    return anyTail || matchUpto == exact;
+  if (matchUpto > exact && uriToMatch[exact] != uriTemplate[exact])
+    return false;
+  return anyTail || matchUpto <= exact + 1;
+}
+
+static const httpd_uri_t *handler_find(int method, const char *uri,
+                                       size_t matchUpto, bool *otherMethod) {
+  *otherMethod = false;
+  for (size_t i = 0; i < server.handlerCount; i++) {
+    const httpd_uri_t *handler = &server.handlers[i];
+    bool matches =
+        server.config.uri_match_fn != NULL
+            ? server.config.uri_match_fn(handler->uri, uri, matchUpto)
+            : strlen(handler->uri) == matchUpto &&
+                  strncmp(handler->uri, uri, matchUpto) == 0;
+    if (!matches)
+      continue;
+    if ((int)handler->method == method)
+      return handler;
+    *otherMethod = true;
+  }
+  return NULL;
+}
+
+static bool ws_send(int fd, httpd_ws_type_t type, bool final,
+                    const uint8_t *payload, size_t length) {
+  uint8_t header[10] = {(final ? 0x80 : 0) | type};
+  size_t headerBytes = 2;
+  if (length < 126) {
+    header[1] = length;
+  } else if (length <= UINT16_MAX) {
+    header[1] = 126;
+    header[2] = length >> 8;
+    header[3] = length;
+    headerBytes = 4;
+  } else {
+    header[1] = 127;
+    for (int i = 0; i < 8; i++)
+      header[2 + i] = (uint64_t)length >> (56 - 8 * i);
+    headerBytes = 10;
+  }
+  return send_all(fd, header, headerBytes, length > 0 ? MSG_MORE : 0) &&
+         send_all(fd, payload, length, 0);
+}
+
+esp_err_t httpd_ws_send_frame_async(httpd_handle_t hd, int fd,
+                                    httpd_ws_frame_t *frame) {
+  connection *conn = connection_get(fd);
+  if (conn == NULL || conn->websocket == NULL)
+    return ESP_ERR_INVALID_ARG;
+  bool final = !frame->fragmented || frame->final;
+  return ws_send(fd, frame->type, final, frame->payload, frame->len)
+             ? ESP_OK
+             : ESP_FAIL;
+}
+
+esp_err_t httpd_ws_recv_frame(httpd_req_t *req, httpd_ws_frame_t *pkt,
+                              size_t maxLen) {
+  request_aux *aux = req->aux;
+  if (aux->conn->websocket == NULL)
+    return ESP_ERR_INVALID_STATE;
+  pkt->final = aux->frame.final;
+  pkt->fragmented = aux->frame.fragmented;
+  pkt->type = aux->frame.type;
+  pkt->len = aux->frame.len;
+  // With a maxLen of 0 only the length is read, as in ESP-IDF.
+  if (maxLen == 0)
+    return ESP_OK;
+  if (pkt->payload == NULL)
+    return ESP_ERR_INVALID_ARG;
+  if (pkt->len > maxLen)
+    pkt->len = maxLen;
+  memcpy(pkt->payload, aux->frame.payload, pkt->len);
+  return ESP_OK;
+}
+
+int httpd_req_to_sockfd(httpd_req_t *r) {
+  request_aux *aux = r->aux;
+  return aux->conn->fd;
+}
+
+int httpd_req_recv(httpd_req_t *r, char *buf, size_t bufLen) {
+  request_aux *aux = r->aux;
+  size_t remaining = r->content_len - aux->bodyRead;
+  if (bufLen > remaining)
+    bufLen = remaining;
+  if (bufLen == 0)
+    return 0;
+  if (aux->bodyRead < aux->bodyBuffered) {
+    size_t buffered = aux->bodyBuffered - aux->bodyRead;
+    if (bufLen > buffered)
+      bufLen = buffered;
+    memcpy(buf, aux->body + aux->bodyRead, bufLen);
+    aux->bodyRead += bufLen;
+    return bufLen;
+  }
+  ssize_t received = recv(aux->conn->fd, buf, bufLen, 0);
+  if (received < 0)
+    return errno == EAGAIN || errno == EWOULDBLOCK ? HTTPD_SOCK_ERR_TIMEOUT
+                                                   : HTTPD_SOCK_ERR_FAIL;
+  if (received == 0)
+    return HTTPD_SOCK_ERR_FAIL;
+  aux->bodyRead += received;
+  return received;
+}
+
+esp_err_t httpd_req_get_hdr_value_str(httpd_req_t *r, const char *field,
+                                      char *val, size_t valSize) {
+  request_aux *aux = r->aux;
+  size_t fieldLength = strlen(field);
+  for (const char *line = aux->headers; line < aux->headersEnd;) {
+    const char *lineEnd = strstr(line, "\r\n");
+    if (lineEnd == NULL || lineEnd > aux->headersEnd)
+      lineEnd = aux->headersEnd;
+    if ((size_t)(lineEnd - line) > fieldLength && line[fieldLength] == ':' &&
+        strncasecmp(line, field, fieldLength) == 0) {
+      const char *value = line + fieldLength + 1;
+      while (value < lineEnd && *value == ' ')
+        value++;
+      size_t length = lineEnd - value;
+      if (valSize == 0)
+        return ESP_ERR_HTTPD_RESULT_TRUNC;
+      size_t copied = length < valSize - 1 ? length : valSize - 1;
+      memcpy(val, value, copied);
+      val[copied] = '\0';
+      return copied < length ? ESP_ERR_HTTPD_RESULT_TRUNC : ESP_OK;
+    }
+    line = lineEnd + 2;
+  }
+  return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t httpd_resp_set_status(httpd_req_t *r, const char *status) {
+  ((request_aux *)r->aux)->status = status;
+  return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_type(httpd_req_t *r, const char *type) {
+  ((request_aux *)r->aux)->type = type;
+  return ESP_OK;
+}
+
+esp_err_t httpd_resp_set_hdr(httpd_req_t *r, const char *field,
+                             const char *value) {
+  request_aux *aux = r->aux;
+  if (aux->hdrCount == server.config.max_resp_headers ||
+      aux->hdrCount == sizeof(aux->hdrFields) / sizeof(aux->hdrFields[0]))
+    return ESP_ERR_HTTPD_RESP_HDR;
+  aux->hdrFields[aux->hdrCount] = field;
+  aux->hdrValues[aux->hdrCount] = value;
+  aux->hdrCount++;
+  return ESP_OK;
+}
+
+// Send the status line and headers, ending with lengthHeader.
+static bool send_headers(request_aux *aux, const char *lengthHeader) {
+  char headers[1024];
+  int length = snprintf(headers, sizeof(headers),
+                        "HTTP/1.1 %s\r\nContent-Type: %s\r\n", aux->status,
+                        aux->type);
+  for (uint8_t i = 0; i < aux->hdrCount && length < (int)sizeof(headers); i++)
+    length += snprintf(headers + length, sizeof(headers) - length,
+                       "%s: %s\r\n", aux->hdrFields[i], aux->hdrValues[i]);
+  if (length < (int)sizeof(headers))
+    length += snprintf(headers + length, sizeof(headers) - length, "%s\r\n\r\n",
+                       lengthHeader);
+  if (length >= (int)sizeof(headers))
+    return false;
+  return send_all(aux->conn->fd, headers, length, MSG_MORE);
+}
+
+esp_err_t httpd_resp_send(httpd_req_t *r, const char *buf, ssize_t bufLen) {
+  request_aux *aux = r->aux;
+  if (buf == NULL)
+    bufLen = 0;
+  else if (bufLen == HTTPD_RESP_USE_STRLEN)
+    bufLen = strlen(buf);
+  char lengthHeader[40];
+  snprintf(lengthHeader, sizeof(lengthHeader), "Content-Length: %zd", bufLen);
+  return send_headers(aux, lengthHeader) &&
+                 send_all(aux->conn->fd, buf, bufLen, 0)
+             ? ESP_OK
+             : ESP_ERR_HTTPD_RESP_SEND;
+}
+
+esp_err_t httpd_resp_send_chunk(httpd_req_t *r, const char *buf,
+                                ssize_t bufLen) {
+  request_aux *aux = r->aux;
+  if (buf == NULL)
+    bufLen = 0;
+  else if (bufLen == HTTPD_RESP_USE_STRLEN)
+    bufLen = strlen(buf);
+  if (!aux->chunked) {
+    if (!send_headers(aux, "Transfer-Encoding: chunked"))
+      return ESP_ERR_HTTPD_RESP_SEND;
+    aux->chunked = true;
+  }
+  char size[16];
+  int sizeBytes = snprintf(size, sizeof(size), "%zx\r\n", bufLen);
+  return send_all(aux->conn->fd, size, sizeBytes, MSG_MORE) &&
+                 send_all(aux->conn->fd, buf, bufLen, MSG_MORE) &&
+                 send_all(aux->conn->fd, "\r\n", 2, 0)
+             ? ESP_OK
+             : ESP_ERR_HTTPD_RESP_SEND;
+}
+
+esp_err_t httpd_resp_sendstr(httpd_req_t *r, const char *str) {
+  return httpd_resp_send(r, str, HTTPD_RESP_USE_STRLEN);
+}
+
+esp_err_t httpd_resp_send_err(httpd_req_t *r, httpd_err_code_t error,
+                              const char *message) {
+  static const char *statuses[] = {
+      [HTTPD_500_INTERNAL_SERVER_ERROR] = "500 Internal Server Error",
+      [HTTPD_501_METHOD_NOT_IMPLEMENTED] = "501 Method Not Implemented",
+      [HTTPD_505_VERSION_NOT_SUPPORTED] = "505 Version Not Supported",
+      [HTTPD_400_BAD_REQUEST] = "400 Bad Request",
+      [HTTPD_401_UNAUTHORIZED] = "401 Unauthorized",
+      [HTTPD_403_FORBIDDEN] = "403 Forbidden",
+      [HTTPD_404_NOT_FOUND] = "404 Not Found",
+      [HTTPD_405_METHOD_NOT_ALLOWED] = "405 Method Not Allowed",
+      [HTTPD_408_REQ_TIMEOUT] = "408 Request Timeout",
+  };
+  request_aux *aux = r->aux;
+  aux->status = statuses[error];
+  aux->type = "text/html";
+  return httpd_resp_sendstr(r, message != NULL ? message : statuses[error]);
+}
+
+esp_err_t httpd_queue_work(httpd_handle_t handle, httpd_work_fn_t work,
+                           void *arg) {
+  pthread_mutex_lock(&server.workLock);
+  if (server.workCount == WORK_QUEUE_LENGTH) {
+    pthread_mutex_unlock(&server.workLock);
+    return ESP_FAIL;
+  }
+  server.work[(server.workHead + server.workCount) % WORK_QUEUE_LENGTH] =
+      (work_item){.work = work, .arg = arg};
+  server.workCount++;
+  pthread_mutex_unlock(&server.workLock);
+  // Only wakes the server task, so a full pipe is fine.
+  (void)!write(server.wakeFds[1], "", 1);
+  return ESP_OK;
+}
+
+static void work_run(void) {
+  char drained[64];
+  while (read(server.wakeFds[0], drained, sizeof(drained)) > 0) {
+  }
+  while (true) {
+    pthread_mutex_lock(&server.workLock);
+    if (server.workCount == 0) {
+      pthread_mutex_unlock(&server.workLock);
+      return;
+    }
+    work_item item = server.work[server.workHead];
+    server.workHead = (server.workHead + 1) % WORK_QUEUE_LENGTH;
+    server.workCount--;
+    pthread_mutex_unlock(&server.workLock);
+    item.work(item.arg);
+  }
+}
+
+// Drop the first length bytes of conn->in.
+static void connection_consume(connection *conn, size_t length) {
+  memmove(conn->in, conn->in + length, conn->inLength - length);
+  conn->inLength -= length;
+}
+
+static bool ws_handshake(connection *conn, httpd_req_t *req,
+                         const httpd_uri_t *handler) {
+  char key[64 + sizeof(WS_GUID)];
+  char upgrade[16];
+  if (httpd_req_get_hdr_value_str(req, "Upgrade", upgrade, sizeof(upgrade)) !=
+          ESP_OK ||
+      strcasecmp(upgrade, "websocket") != 0 ||
+      httpd_req_get_hdr_value_str(req, "Sec-WebSocket-Key", key, 64) !=
+          ESP_OK) {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, NULL);
+    return false;
+  }
+  strcat(key, WS_GUID);
+  uint8_t digest[20];
+  sha1((const uint8_t *)key, strlen(key), digest);
+  char accept[32];
+  base64(digest, sizeof(digest), accept);
+  char response[160];
+  int length = snprintf(response, sizeof(response),
+                        "HTTP/1.1 101 Switching Protocols\r\n"
+                        "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+                        "Sec-WebSocket-Accept: %s\r\n\r\n",
+                        accept);
+  if (!send_all(conn->fd, response, length, 0))
+    return false;
+  conn->websocket = handler;
+  // The handler sees the handshake as a GET, as in ESP-IDF.
+  return handler->handler(req) == ESP_OK;
+}
+
+// Handle every complete WebSocket frame in conn->in. Returns false to close
+// the connection.
+static bool ws_handle(connection *conn) {
+  while (conn->inLength >= 2) {
+    uint8_t *in = conn->in;
+    bool final = in[0] & 0x80;
+    httpd_ws_type_t type = in[0] & 0x0f;
+    // Clients must mask every frame.
+    if (!(in[1] & 0x80))
+      return false;
+    uint64_t length = in[1] & 0x7f;
+    size_t headerBytes = 2;
+    if (length == 126) {
+      if (conn->inLength < 4)
+        return true;
+      length = in[2] << 8 | in[3];
+      headerBytes = 4;
+    } else if (length == 127) {
+      if (conn->inLength < 10)
+        return true;
+      length = 0;
+      for (int i = 0; i < 8; i++)
+        length = length << 8 | in[2 + i];
+      headerBytes = 10;
+    }
+    if (length > WS_PAYLOAD_MAX)
+      return false;
+    if (conn->inLength < headerBytes + 4 + length)
+      return true;
+    uint8_t *mask = in + headerBytes;
+    uint8_t *payload = mask + 4;
+    for (size_t i = 0; i < length; i++)
+      payload[i] ^= mask[i % 4];
+
+    if (type == HTTPD_WS_TYPE_CLOSE && !conn->websocket->handle_ws_control_frames) {
+      ws_send(conn->fd, HTTPD_WS_TYPE_CLOSE, true, payload,
+              length >= 2 ? 2 : 0);
+      return false;
+    }
+    if (type == HTTPD_WS_TYPE_PING &&
+        !conn->websocket->handle_ws_control_frames) {
+      if (!ws_send(conn->fd, HTTPD_WS_TYPE_PONG, true, payload, length))
+        return false;
+    } else if (type != HTTPD_WS_TYPE_PONG ||
+               conn->websocket->handle_ws_control_frames) {
+      request_aux aux = {
+          .conn = conn,
+          .frame = {.final = final,
+                    .fragmented = !final || type == HTTPD_WS_TYPE_CONTINUE,
+                    .type = type,
+                    .payload = payload,
+                    .len = length},
+      };
+      httpd_req_t req = {
+          .handle = &server,
+          .method = 0,
+          .user_ctx = conn->websocket->user_ctx,
+          .aux = &aux,
+      };
+      if (conn->websocket->handler(&req) != ESP_OK)
+        return false;
+    }
+    connection_consume(conn, headerBytes + 4 + length);
+  }
+  return true;
+}
+
+static int method_parse(const char *method, size_t length) {
+  static const char *methods[] = {
+      [HTTP_DELETE] = "DELETE", [HTTP_GET] = "GET",   [HTTP_HEAD] = "HEAD",
+      [HTTP_POST] = "POST",     [HTTP_PUT] = "PUT",
+  };
+  for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++)
+    if (strlen(methods[i]) == length && strncmp(method, methods[i], length) == 0)
+      return i;
+  return -1;
+}
+
+// Handle every complete request in conn->in. Returns false to close the
+// connection.
+static bool http_handle(connection *conn) {
+  while (conn->websocket == NULL) {
+    // Terminated so the header search below stops at the data.
+    if (conn->inLength == sizeof(conn->in))
+      return false;
+    conn->in[conn->inLength] = '\0';
+    char *text = (char *)conn->in;
+    char *headerEnd = strstr(text, "\r\n\r\n");
+    if (headerEnd == NULL)
+      return true;
+    char *lineEnd = strstr(text, "\r\n");
+    char *methodEnd = memchr(text, ' ', lineEnd - text);
+    char *uriEnd =
+        methodEnd == NULL ? NULL : memchr(methodEnd + 1, ' ', lineEnd - methodEnd - 1);
+    if (uriEnd == NULL)
+      return false;
+    size_t headerBytes = headerEnd + 4 - text;
+
+    request_aux aux = {
+        .conn = conn,
+        .headers = lineEnd + 2,
+        .headersEnd = headerEnd + 2,
+        .status = "200 OK",
+        .type = "text/html",
+    };
+    httpd_req_t req = {.handle = &server, .aux = &aux};
+    req.method = method_parse(text, methodEnd - text);
+    size_t uriLength = uriEnd - methodEnd - 1;
+    if (uriLength > HTTPD_MAX_URI_LEN) {
+      httpd_resp_send_err(&req, HTTPD_400_BAD_REQUEST, "URI is too long");
+      return false;
+    }
+    memcpy((char *)req.uri, methodEnd + 1, uriLength);
+    char contentLength[24];
+    if (httpd_req_get_hdr_value_str(&req, "Content-Length", contentLength,
+                                    sizeof(contentLength)) == ESP_OK)
+      req.content_len = strtoul(contentLength, NULL, 10);
+    aux.body = conn->in + headerBytes;
+    aux.bodyBuffered = conn->inLength - headerBytes;
+    if (aux.bodyBuffered > req.content_len)
+      aux.bodyBuffered = req.content_len;
+
+    // Handlers are matched on the path, without the query.
+    const char *query = strchr(req.uri, '?');
+    size_t pathLength = query != NULL ? (size_t)(query - req.uri) : uriLength;
+    bool otherMethod;
+    const httpd_uri_t *handler =
+        handler_find(req.method, req.uri, pathLength, &otherMethod);
+    bool keep;
+    if (handler == NULL) {
+      httpd_resp_send_err(&req,
+                          otherMethod ? HTTPD_405_METHOD_NOT_ALLOWED
+                                      : HTTPD_404_NOT_FOUND,
+                          NULL);
+      keep = !otherMethod && req.content_len == 0;
+    } else {
+      req.user_ctx = handler->user_ctx;
+      keep = handler->is_websocket ? ws_handshake(conn, &req, handler)
+                                   : handler->handler(&req) == ESP_OK;
+    }
+    if (!keep)
+      return false;
+
+    // Skip whatever the handler left of the body. The buffered part is
+    // dropped with the header.
+    if (aux.bodyRead < aux.bodyBuffered)
+      aux.bodyRead = aux.bodyBuffered;
+    while (aux.bodyRead < req.content_len) {
+      char skipped[256];
+      if (httpd_req_recv(&req, skipped, sizeof(skipped)) <= 0)
+        return false;
+    }
+    connection_consume(conn, headerBytes + aux.bodyBuffered);
+  }
+  return ws_handle(conn);
+}
+
+static void connection_read(connection *conn) {
+  // One byte is kept free for http_handle.
+  ssize_t received = recv(conn->fd, conn->in + conn->inLength,
+                          sizeof(conn->in) - 1 - conn->inLength, 0);
+  if (received <= 0) {
+    connection_close(conn);
+    return;
+  }
+  conn->inLength += received;
+  if (!http_handle(conn))
+    connection_close(conn);
+}
+
+static void server_task(void *arg) {
+  struct pollfd fds[2 + CONFIG_LWIP_MAX_SOCKETS];
+  while (true) {
+    size_t count = 0;
+    fds[count++] = (struct pollfd){.fd = server.wakeFds[0], .events = POLLIN};
+    // Like ESP-IDF, stop accepting while every session is in use, so new
+    // connections wait in the backlog.
+    bool accepting = server.openCount < server.config.max_open_sockets;
+    if (accepting)
+      fds[count++] = (struct pollfd){.fd = server.listenFd, .events = POLLIN};
+    size_t first = count;
+    for (size_t i = 0; i < CONFIG_LWIP_MAX_SOCKETS; i++)
+      if (server.connections[i].fd >= 0)
+        fds[count++] =
+            (struct pollfd){.fd = server.connections[i].fd, .events = POLLIN};
+
+    if (poll(fds, count, -1) < 0)
+      continue;
+    if (fds[0].revents)
+      work_run();
+    if (accepting && fds[1].revents)
+      connection_accept();
+    for (size_t i = first; i < count; i++) {
+      connection *conn = connection_get(fds[i].fd);
+      if (fds[i].revents && conn != NULL)
+        connection_read(conn);
+    }
+  }
+}
+
+esp_err_t httpd_start(httpd_handle_t *handle, const httpd_config_t *config) {
+  server.config = *config;
+  if (portOverride != 0)
+    server.config.server_port = portOverride;
+  server.handlers = calloc(config->max_uri_handlers, sizeof(httpd_uri_t));
+  for (size_t i = 0; i < CONFIG_LWIP_MAX_SOCKETS; i++)
+    server.connections[i].fd = -1;
+  if (server.handlers == NULL ||
+      pipe2(server.wakeFds, O_NONBLOCK | O_CLOEXEC) != 0)
+    return ESP_ERR_NO_MEM;
+
+  server.listenFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  int reuse = 1;
+  setsockopt(server.listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+  struct sockaddr_in address = {
+      .sin_family = AF_INET,
+      .sin_port = htons(server.config.server_port),
+      .sin_addr.s_addr = htonl(INADDR_ANY),
+  };
+  if (bind(server.listenFd, (struct sockaddr *)&address, sizeof(address)) !=
+          0 ||
+      listen(server.listenFd, server.config.backlog_conn) != 0) {
+    ESP_LOGE(TAG_HTTPD, "Failed to listen on port %u: %s",
+             server.config.server_port, strerror(errno));
+    close(server.listenFd);
+    return ESP_FAIL;
+  }
+  ESP_LOGI(TAG_HTTPD, "Listening on http://localhost:%u/",
+           server.config.server_port);
+
+  if (xTaskCreate(server_task, "httpd", server.config.stack_size, NULL,
+                  server.config.task_priority, NULL) != pdPASS)
+    return ESP_ERR_NO_MEM;
+  *handle = &server;
+  return ESP_OK;
+}
+
+esp_err_t httpd_register_uri_handler(httpd_handle_t handle,
+                                     const httpd_uri_t *uri) {
+  if (server.handlerCount == server.config.max_uri_handlers)
+    return ESP_ERR_HTTPD_HANDLERS_FULL;
+  server.handlers[server.handlerCount++] = *uri;
+  return ESP_OK;
+}
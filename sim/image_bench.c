@@ -0,0 +1,267 @@
+// Times the image decoders in src/image.c on the bundled images against the
+// per-pixel loop tft_draw_image used to run, in pixels per second, and checks
+// that they all draw the same pixels. Images the bundle stores raw are
+// compressed here as generateImages.py does, so the RLE decoder is timed
+// against the raw path on every image. A frame of random pixels follows the
+// bundled ones, the worst case for RLE. See the Simulator section of
+// README.md.
+
+#include "image.h"
+#include "tft.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FRAME_PIXELS (LCD_WIDTH * LCD_HEIGHT)
+#define FRAME_BYTES (FRAME_PIXELS / IMAGE_2BPP_PIXELS_PER_BYTE)
+#define BAND_BYTES (PIXELS_LENGTH / IMAGE_2BPP_PIXELS_PER_BYTE)
+// Longest RLE stream of a frame: every byte a literal, plus a control byte
+// per 128 of them.
+#define RLE_BYTES_MAX (FRAME_BYTES + FRAME_BYTES / 128 + 1)
+
+typedef enum {
+  DECODER_PER_PIXEL,
+  DECODER_UNPACK,
+  DECODER_RLE,
+  DECODERS,
+} decoder;
+
+static const char *decoderNames[DECODERS] = {"per-pixel", "unpack", "rle"};
+
+typedef struct {
+  const uint16_t *palette;
+  const uint8_t *packed; // FRAME_BYTES raw packed pixels
+  const uint8_t *rle;    // The same pixels compressed
+  size_t rleBytes;
+} image;
+
+static volatile uint32_t sink;
+static uint16_t band[PIXELS_LENGTH] __attribute__((aligned(4)));
+static uint16_t frames[DECODERS][FRAME_PIXELS];
+static image_lut lut;
+
+static int64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// The loop of tft_draw_image before image_unpack: the source byte read and a
+// shift and mask for every pixel.
+static void per_pixel_band(const uint16_t *colors, const uint8_t *src,
+                           uint16_t *pixels) {
+  size_t position = 0;
+  size_t offset = 0;
+  while (position < PIXELS_LENGTH) {
+    pixels[position++] = colors[src[offset] & 0b00000011];
+    pixels[position++] = colors[(src[offset] >> 2) & 0b00000011];
+    pixels[position++] = colors[(src[offset] >> 4) & 0b00000011];
+    pixels[position++] = colors[(src[offset] >> 6) & 0b00000011];
+    offset++;
+  }
+}
+
+// Compress packed as rle_encode in generateImages.py does, into encoded of
+// RLE_BYTES_MAX bytes. Returns the length of the stream.
+static size_t rle_encode(const uint8_t *packed, size_t bytes,
+                         uint8_t *encoded) {
+  size_t length = 0, literalStart = 0, literal = 0;
+  for (size_t i = 0; i <= bytes;) {
+    size_t run = 1;
+    while (i < bytes && i + run < bytes && run < 129 &&
+           packed[i + run] == packed[i])
+      run++;
+    // Literals are flushed at the end, before a run, or once 128 long.
+    if (i == bytes || run >= 3 || literal == 128) {
+      if (literal > 0) {
+        encoded[length++] = literal - 1;
+        memcpy(encoded + length, packed + literalStart, literal);
+        length += literal;
+        literal = 0;
+      }
+      if (i == bytes)
+        break;
+    }
+    if (run >= 3) {
+      encoded[length++] = 0x80 | (run - 2);
+      encoded[length++] = packed[i];
+      i += run;
+    } else {
+      if (literal == 0)
+        literalStart = i;
+      literal++;
+      i++;
+    }
+  }
+  return length;
+}
+
+// Expand an RLE stream back to FRAME_BYTES packed bytes. Returns false if it
+// is malformed or does not fill exactly a frame.
+static bool rle_expand(const uint8_t *src, size_t length, uint8_t *packed) {
+  size_t in = 0, out = 0;
+  while (in < length) {
+    uint8_t control = src[in++];
+    size_t count = control < 0x80 ? control + 1u : (control & 0x7fu) + 2;
+    if (out + count > FRAME_BYTES ||
+        in + (control < 0x80 ? count : 1) > length)
+      return false;
+    if (control < 0x80) {
+      memcpy(packed + out, src + in, count);
+      in += count;
+    } else {
+      memset(packed + out, src[in++], count);
+    }
+    out += count;
+  }
+  return out == FRAME_BYTES;
+}
+
+// Decode a whole frame band by band as tft_draw_image does, and copy every
+// band to frame if it is not NULL. Returns false if the RLE stream ran out.
+static bool draw(const image *img, decoder kind, uint16_t *frame) {
+  image_lut_build(&lut, img->palette, PALATTE_SIZE, 2);
+  const uint8_t *rle = img->rle;
+  image_rle_state state;
+  image_rle_begin(&state);
+  bool ok = true;
+  for (int part = 0; part < BAND_COUNT; part++) {
+    const uint8_t *packed = img->packed + part * BAND_BYTES;
+    switch (kind) {
+    case DECODER_PER_PIXEL:
+      per_pixel_band(img->palette, packed, band);
+      break;
+    case DECODER_UNPACK:
+      image_unpack(&lut, packed, band, BAND_BYTES);
+      break;
+    default:
+      ok &= image_rle_decode(&state, &lut, &rle, img->rle + img->rleBytes,
+                             band, BAND_BYTES) == BAND_BYTES;
+      break;
+    }
+    if (frame != NULL)
+      memcpy(frame + part * PIXELS_LENGTH, band, sizeof(band));
+    sink += band[part];
+  }
+  return ok;
+}
+
+// Pixels per second of decoder kind over frames frames of img.
+static double pixel_rate(const image *img, decoder kind, long frames) {
+  int64_t start = now_ns();
+  for (long i = 0; i < frames; i++)
+    draw(img, kind, NULL);
+  return (double)frames * FRAME_PIXELS * 1e9 / (now_ns() - start);
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "Times the per-pixel loop, image_unpack and image_rle_decode on\n"
+          "every image in images.bin, a %dx%d frame in bands of %d lines.\n"
+          "  --frames N  Time N frames of each, default 500\n",
+          name, LCD_WIDTH, LCD_HEIGHT, PARALLEL_LINES);
+}
+
+int main(int argc, char **argv) {
+  long frameCount = 500;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      frameCount = strtol(argv[++i], NULL, 10);
+    } else {
+      usage(argv[0]);
+      return strcmp(argv[i], "--help") == 0 ? 0 : 2;
+    }
+  }
+  if (frameCount <= 0) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  const uint8_t *bundle = (const uint8_t *)FILE_IMAGES_START;
+  size_t bundleLength = FILE_IMAGES_END - FILE_IMAGES_START;
+  const image_bundle_header *header = (const image_bundle_header *)bundle;
+  uint16_t count =
+      image_bundle_find(bundle, bundleLength, 0) != NULL ? header->count : 0;
+  if (count == 0) {
+    fprintf(stderr, "images.bin has no images\n");
+    return 1;
+  }
+
+  static const uint16_t noisePalette[PALATTE_SIZE] = {0x0000, 0x1f00, 0xe007,
+                                                      0x00f8};
+  bool ok = true;
+  double totals[DECODERS] = {0};
+  printf("%-5s %7s %7s %6s %11s %11s %11s\n", "image", "raw", "rle", "ratio",
+         "per-pixel", "unpack", "rle");
+  srand(1);
+  for (uint16_t idx = 0; idx <= count; idx++) {
+    static uint8_t packed[FRAME_BYTES] __attribute__((aligned(4)));
+    static uint8_t rle[RLE_BYTES_MAX];
+    image img = {noisePalette, packed, rle, 0};
+    const image_bundle_entry *entry = NULL;
+    size_t pixelsLength = FRAME_BYTES;
+    const uint8_t *pixels = packed;
+    if (idx < count) {
+      entry = image_bundle_find(bundle, bundleLength, idx);
+      img.palette = (const uint16_t *)(bundle + entry->offset);
+      pixelsLength = entry->length - PALATTE_SIZE * sizeof(uint16_t);
+      pixels = bundle + entry->offset + PALATTE_SIZE * sizeof(uint16_t);
+    } else {
+      for (size_t i = 0; i < FRAME_BYTES; i++)
+        packed[i] = rand();
+    }
+    if (entry != NULL && entry->encoding == IMAGE_ENCODING_RLE) {
+      if (!rle_expand(pixels, pixelsLength, packed)) {
+        printf("%-5u malformed RLE stream\n", idx);
+        ok = false;
+        continue;
+      }
+      memcpy(rle, pixels, pixelsLength);
+      img.rleBytes = pixelsLength;
+    } else {
+      if (pixelsLength != FRAME_BYTES) {
+        printf("%-5u %zu bytes of pixels, not %d\n", idx, pixelsLength,
+               FRAME_BYTES);
+        ok = false;
+        continue;
+      }
+      memmove(packed, pixels, FRAME_BYTES);
+      img.rleBytes = rle_encode(packed, FRAME_BYTES, rle);
+    }
+
+    for (int kind = 0; kind < DECODERS; kind++)
+      ok &= draw(&img, kind, frames[kind]);
+    for (int kind = 1; kind < DECODERS; kind++) {
+      if (memcmp(frames[kind], frames[DECODER_PER_PIXEL],
+                 sizeof(frames[kind])) != 0) {
+        printf("%-5u %s does not draw what the per-pixel loop does\n", idx,
+               decoderNames[kind]);
+        ok = false;
+      }
+    }
+
+    double rates[DECODERS];
+    for (int kind = 0; kind < DECODERS; kind++) {
+      rates[kind] = pixel_rate(&img, kind, frameCount);
+      totals[kind] += rates[kind];
+    }
+    char name[8];
+    snprintf(name, sizeof(name), idx < count ? "%u" : "noise", idx);
+    printf("%-5s %7d %7zu %6.2f %8.1f Mp %8.1f Mp %8.1f Mp\n", name,
+           FRAME_BYTES, img.rleBytes, (double)FRAME_BYTES / img.rleBytes,
+           rates[DECODER_PER_PIXEL] / 1e6, rates[DECODER_UNPACK] / 1e6,
+           rates[DECODER_RLE] / 1e6);
+  }
+  printf("mean pixels/s: per-pixel %.1f M, unpack %.1f M (%.2fx), rle %.1f M "
+         "(%.2fx)\n",
+         totals[DECODER_PER_PIXEL] / (count + 1) / 1e6,
+         totals[DECODER_UNPACK] / (count + 1) / 1e6,
+         totals[DECODER_UNPACK] / totals[DECODER_PER_PIXEL],
+         totals[DECODER_RLE] / (count + 1) / 1e6,
+         totals[DECODER_RLE] / totals[DECODER_PER_PIXEL]);
+  if (!ok)
+    printf("a decoder failed\n");
+  return ok ? 0 : 1;
+}
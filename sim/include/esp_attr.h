@@ -0,0 +1,9 @@
+#ifndef _ESP_ATTR_H_
+#define _ESP_ATTR_H_
+
+// Memory placement does not matter on the host.
+#define DRAM_ATTR
+#define DMA_ATTR
+#define IRAM_ATTR
+
+#endif
@@ -0,0 +1,6 @@
+#ifndef _ESP_CHECK_H_
+#define _ESP_CHECK_H_
+
+#include "esp_err.h"
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef _ESP_LOG_H_
+#define _ESP_LOG_H_
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Every log line goes to stderr with the time in ms since start, like the
+// serial monitor. Debug and verbose logs are compiled out unless
+// LOG_LOCAL_LEVEL is raised, as with the default ESP-IDF log level.
+#define ESP_LOG_NONE 0
+#define ESP_LOG_ERROR 1
+#define ESP_LOG_WARN 2
+#define ESP_LOG_INFO 3
+#define ESP_LOG_DEBUG 4
+#define ESP_LOG_VERBOSE 5
+
+#ifndef LOG_LOCAL_LEVEL
+#define LOG_LOCAL_LEVEL ESP_LOG_INFO
+#endif
+
+uint32_t esp_log_timestamp(void);
+
+#define ESP_LOG_LEVEL(level, letter, tag, format, ...)                         \
+  do {                                                                         \
+    if (LOG_LOCAL_LEVEL >= (level))                                            \
+      fprintf(stderr, letter " (%u) %s: " format "\n", esp_log_timestamp(),    \
+              tag, ##__VA_ARGS__);                                             \
+  } while (0)
+
+#define ESP_LOGE(tag, format, ...)                                             \
+  ESP_LOG_LEVEL(ESP_LOG_ERROR, "E", tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...)                                             \
+  ESP_LOG_LEVEL(ESP_LOG_WARN, "W", tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...)                                             \
+  ESP_LOG_LEVEL(ESP_LOG_INFO, "I", tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...)                                             \
+  ESP_LOG_LEVEL(ESP_LOG_DEBUG, "D", tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...)                                             \
+  ESP_LOG_LEVEL(ESP_LOG_VERBOSE, "V", tag, format, ##__VA_ARGS__)
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef _SEMPHR_H_
+#define _SEMPHR_H_
+
+#include "queue.h"
+
+// Semaphores are queues of length 1 with no items, as in FreeRTOS. Mutexes
+// have no priority inheritance, which the host does not need.
+typedef QueueHandle_t SemaphoreHandle_t;
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void);
+SemaphoreHandle_t xSemaphoreCreateBinary(void);
+#define xSemaphoreTake(semaphore, wait) xQueueReceive(semaphore, NULL, wait)
+#define xSemaphoreGive(semaphore) xQueueSend(semaphore, NULL, 0)
+
+#endif
@@ -0,0 +1,13 @@
+#ifndef _NVS_FLASH_H_
+#define _NVS_FLASH_H_
+
+#include "esp_err.h"
+
+// The simulator has no flash to keep settings in.
+#define ESP_ERR_NVS_NO_FREE_PAGES 0x110d
+#define ESP_ERR_NVS_NEW_VERSION_FOUND 0x1110
+
+static inline esp_err_t nvs_flash_init(void) { return ESP_OK; }
+static inline esp_err_t nvs_flash_erase(void) { return ESP_OK; }
+
+#endif
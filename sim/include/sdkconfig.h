@@ -0,0 +1,10 @@
+#ifndef _SDKCONFIG_H_
+#define _SDKCONFIG_H_
+
+// The options from sdkconfig.defaults and the ESP-IDF defaults that the
+// firmware reads, for the simulator.
+#define CONFIG_FREERTOS_HZ 1000
+#define CONFIG_LWIP_MAX_SOCKETS 10
+#define CONFIG_HTTPD_WS_SUPPORT 1
+
+#endif
@@ -0,0 +1,12 @@
+#ifndef _SOCKET_H_
+#define _SOCKET_H_
+
+#include "sdkconfig.h"
+#include <sys/socket.h>
+
+// lwIP numbers its sockets from LWIP_SOCKET_OFFSET. The simulated httpd moves
+// every connection into the CONFIG_LWIP_MAX_SOCKETS descriptors from here, so
+// fds look and run out the same way as on the rover.
+#define LWIP_SOCKET_OFFSET 64
+
+#endif
@@ -0,0 +1,461 @@
+// Checks the fixed point arm kinematics against the same closed form in double
+// precision, over the joint range and a grid of the workspace, and times them
+// on the host. See the Simulator section of README.md.
+
+#include "arm.h"
+#include "control.h"
+#include "kinematics.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Setpoints checked along each joint for forward kinematics.
+#define JOINT_STEPS 129
+// Workspace checked for inverse kinematics, in mm.
+#define GRID_MM 10
+#define GRID_XY_MM 500
+#define GRID_Z_MIN_MM -100
+#define GRID_Z_MAX_MM 550
+// Most distance from the reference position, in mm. Positions are whole mm,
+// so forward kinematics are half of this off on an axis by rounding alone.
+#define ERROR_MAX_MM 1.0
+// Most share of the grid whose reachability may differ from the reference,
+// all of it within rounding of the edge of the workspace.
+#define MISMATCH_MAX_PERCENT 0.5
+// Inputs cycled through while timing, so the calls cannot be folded away or
+// answered from the last result.
+#define INPUTS 1024
+// Jogs checked: from every pose of a grid with this many steps on each joint,
+// along each axis at JOG_SPEED_MM_S for JOG_TICKS control ticks.
+#define JOG_POSES 9
+#define JOG_SPEED_MM_S 50
+#define JOG_TICKS 250
+// The jog is only held to JOG_ERROR_MAX_PERCENT of its length where the
+// damping barely acts all the way: with the elbow bent by more than asin of
+// JOG_CONDITIONED_SIN and the end out from the axis of X by
+// JOG_CONDITIONED_REACH_MM.
+#define JOG_CONDITIONED_SIN 0.3
+#define JOG_CONDITIONED_REACH_MM 100
+#define JOG_ERROR_MAX_PERCENT 5.0
+// Ticks every full speed push lasts, long enough to reach the jog box or a
+// joint limit.
+#define JOG_PUSH_TICKS (5 * CONTROL_RATE_HZ)
+
+static volatile int32_t sink;
+
+static const double limitsDeg[ARM_JOINTS][2] = {
+    [ARM_X] = {KINEMATICS_X_MIN_DEG, KINEMATICS_X_MAX_DEG},
+    [ARM_J2] = {KINEMATICS_J2_MIN_DEG, KINEMATICS_J2_MAX_DEG},
+    [ARM_J3] = {KINEMATICS_J3_MIN_DEG, KINEMATICS_J3_MAX_DEG},
+};
+
+static double radians(double degrees) { return degrees * M_PI / 180; }
+
+static double setpoint_angle(int joint, double setpoint) {
+  double min = radians(limitsDeg[joint][0]), max = radians(limitsDeg[joint][1]);
+  return min + setpoint / UINT16_MAX * (max - min);
+}
+
+static double angle_setpoint(int joint, double angle) {
+  double min = radians(limitsDeg[joint][0]), max = radians(limitsDeg[joint][1]);
+  return (angle - min) / (max - min) * UINT16_MAX;
+}
+
+// As limit_angle in kinematics.c.
+static double limit_angle(int joint, double angle, bool *limited) {
+  double min = radians(limitsDeg[joint][0]), max = radians(limitsDeg[joint][1]);
+  angle = remainder(angle, 2 * M_PI);
+  if (angle >= min && angle <= max)
+    return angle;
+  *limited = true;
+  double pastMax = fmod(angle - max + 4 * M_PI, 2 * M_PI);
+  double beforeMin = fmod(min - angle + 4 * M_PI, 2 * M_PI);
+  return pastMax < beforeMin ? max : min;
+}
+
+static void reference_fk(const double setpoints[ARM_JOINTS],
+                         double position[3]) {
+  double base = setpoint_angle(ARM_X, setpoints[ARM_X]);
+  double shoulder = setpoint_angle(ARM_J2, setpoints[ARM_J2]);
+  double elbow = shoulder + setpoint_angle(ARM_J3, setpoints[ARM_J3]);
+  double reach = KINEMATICS_UPPER_ARM_MM * cos(shoulder) +
+                 KINEMATICS_FOREARM_MM * cos(elbow);
+  position[0] = reach * cos(base);
+  position[1] = reach * sin(base);
+  position[2] = KINEMATICS_SHOULDER_MM +
+                KINEMATICS_UPPER_ARM_MM * sin(shoulder) +
+                KINEMATICS_FOREARM_MM * sin(elbow);
+}
+
+// The closed form of ik_calculate_angles.
+static bool reference_ik(double x, double y, double z,
+                         double setpoints[ARM_JOINTS]) {
+  const double upper = KINEMATICS_UPPER_ARM_MM, fore = KINEMATICS_FOREARM_MM;
+  bool limited = false;
+  double base = limit_angle(ARM_X, atan2(y, x), &limited);
+  // Rounded as the fixed point is, and never -0, so a target on the axis of X
+  // at shoulder height, where the shoulder angle could be anything, gives the
+  // same one.
+  double reach = round((x * cos(base) + y * sin(base)) * 1e9) / 1e9 + 0.0;
+  double height = z - KINEMATICS_SHOULDER_MM;
+  double cosElbow = (reach * reach + height * height - upper * upper -
+                     fore * fore) /
+                    (2 * upper * fore);
+  if (fabs(cosElbow) > 1) {
+    cosElbow = copysign(1, cosElbow);
+    limited = true;
+  }
+  double elbow = limit_angle(ARM_J3, -acos(cosElbow), &limited);
+  double shoulder =
+      limit_angle(ARM_J2,
+                  atan2(height, reach) -
+                      atan2(fore * sin(elbow), upper + fore * cos(elbow)),
+                  &limited);
+  setpoints[ARM_X] = angle_setpoint(ARM_X, base);
+  setpoints[ARM_J2] = angle_setpoint(ARM_J2, shoulder);
+  setpoints[ARM_J3] = angle_setpoint(ARM_J3, elbow);
+  return !limited;
+}
+
+static double distance(const double a[3], const double b[3]) {
+  return sqrt((a[0] - b[0]) * (a[0] - b[0]) + (a[1] - b[1]) * (a[1] - b[1]) +
+              (a[2] - b[2]) * (a[2] - b[2]));
+}
+
+// Worst error of kinematics_sin and kinematics_cos over every angle, as a
+// share of 1, and of kinematics_atan2 around a circle, in degrees.
+static void trig_errors(double *sinCos, double *atan2Deg) {
+  *sinCos = 0;
+  for (int32_t angle = 0; angle < KINEMATICS_TURN; angle++) {
+    double radians = angle * 2 * M_PI / KINEMATICS_TURN;
+    *sinCos = fmax(*sinCos, fabs((double)kinematics_sin(angle) /
+                                     KINEMATICS_ONE -
+                                 sin(radians)));
+    *sinCos = fmax(*sinCos, fabs((double)kinematics_cos(angle) /
+                                     KINEMATICS_ONE -
+                                 cos(radians)));
+  }
+  *atan2Deg = 0;
+  const double radii[] = {10, 1000, 100000};
+  for (size_t r = 0; r < sizeof(radii) / sizeof(radii[0]); r++) {
+    for (int i = 0; i < 3600; i++) {
+      double radians = i * 2 * M_PI / 3600;
+      int32_t y = lround(radii[r] * sin(radians));
+      int32_t x = lround(radii[r] * cos(radians));
+      double error = kinematics_atan2(y, x) * 2 * M_PI / KINEMATICS_TURN -
+                     atan2(y, x);
+      *atan2Deg = fmax(*atan2Deg, fabs(remainder(error, 2 * M_PI)) * 180 /
+                                      M_PI);
+    }
+  }
+}
+
+// Worst error in mm of fk_calculate_position from the reference on any axis
+// over the joint grid.
+static double fk_error(void) {
+  double worst = 0;
+  for (int i = 0; i < JOINT_STEPS; i++) {
+    for (int j = 0; j < JOINT_STEPS; j++) {
+      for (int k = 0; k < JOINT_STEPS; k++) {
+        uint16_t setpoints[ARM_JOINTS] = {
+            (uint32_t)i * UINT16_MAX / (JOINT_STEPS - 1),
+            (uint32_t)j * UINT16_MAX / (JOINT_STEPS - 1),
+            (uint32_t)k * UINT16_MAX / (JOINT_STEPS - 1),
+        };
+        double exact[ARM_JOINTS] = {setpoints[0], setpoints[1], setpoints[2]};
+        double expected[3];
+        reference_fk(exact, expected);
+        int16_t x, y, z;
+        fk_calculate_position(setpoints[ARM_X], setpoints[ARM_J2],
+                              setpoints[ARM_J3], &x, &y, &z);
+        double position[3] = {x, y, z};
+        for (int axis = 0; axis < 3; axis++)
+          worst = fmax(worst, fabs(position[axis] - expected[axis]));
+      }
+    }
+  }
+  return worst;
+}
+
+typedef struct {
+  long points;
+  long reachable;  // Points the reference reaches
+  long mismatched; // Points whose reachability differs from the reference
+  double reached;  // Worst distance from a target the reference reaches
+  double pose;     // Worst distance from the pose of the reference
+} ik_result;
+
+// ik_calculate_angles over the workspace grid, with the pose its setpoints
+// give found by the reference forward kinematics.
+static ik_result ik_errors(void) {
+  ik_result result = {0};
+  for (int x = -GRID_XY_MM; x <= GRID_XY_MM; x += GRID_MM) {
+    for (int y = -GRID_XY_MM; y <= GRID_XY_MM; y += GRID_MM) {
+      for (int z = GRID_Z_MIN_MM; z <= GRID_Z_MAX_MM; z += GRID_MM) {
+        double target[3] = {x, y, z};
+        double expectedSetpoints[ARM_JOINTS], expected[3];
+        bool expectedReachable =
+            reference_ik(x, y, z, expectedSetpoints);
+        reference_fk(expectedSetpoints, expected);
+        uint16_t ax, j2, j3;
+        bool reachable = ik_calculate_angles(x, y, z, &ax, &j2, &j3);
+        double setpoints[ARM_JOINTS] = {ax, j2, j3}, position[3];
+        reference_fk(setpoints, position);
+        result.points++;
+        result.reachable += expectedReachable;
+        result.mismatched += reachable != expectedReachable;
+        if (expectedReachable)
+          result.reached = fmax(result.reached, distance(position, target));
+        result.pose = fmax(result.pose, distance(position, expected));
+      }
+    }
+  }
+  return result;
+}
+
+typedef struct {
+  long jogs;
+  long held;            // Jogs the jog box or a joint limit held back
+  double worstPercent;  // Worst distance from the jog, in percent of it
+  double worstSpeedDeg; // Fastest joint in degrees per second
+  double worstOutMm;    // Furthest beyond the jog box
+} jog_result;
+
+// Degrees the joint turns for a setpoint change.
+static double setpoint_degrees(int joint, double setpoints) {
+  return setpoints / UINT16_MAX * (limitsDeg[joint][1] - limitsDeg[joint][0]);
+}
+
+// Jog from start at velocity for ticks, keeping the fastest joint and the
+// furthest beyond the jog box in result, and leave the setpoints in end.
+// Returns whether the jog was held back, and in conditioned whether the arm
+// stayed where the damping barely acts.
+static bool jog_path(const uint16_t start[ARM_JOINTS],
+                     const int16_t velocity[3], int ticks, jog_result *result,
+                     bool *conditioned, uint16_t end[ARM_JOINTS]) {
+  const double box[3][2] = {
+      {KINEMATICS_JOG_X_MIN_MM, KINEMATICS_JOG_X_MAX_MM},
+      {KINEMATICS_JOG_Y_MIN_MM, KINEMATICS_JOG_Y_MAX_MM},
+      {KINEMATICS_JOG_Z_MIN_MM, KINEMATICS_JOG_Z_MAX_MM},
+  };
+  double startSetpoints[ARM_JOINTS] = {start[0], start[1], start[2]};
+  double from[3];
+  reference_fk(startSetpoints, from);
+  kinematics_jog jog;
+  kinematics_jog_start(&jog, start);
+  memcpy(end, start, sizeof(uint16_t) * ARM_JOINTS);
+  bool held = false;
+  *conditioned = true;
+  for (int tick = 0; tick < ticks; tick++) {
+    uint16_t setpoints[ARM_JOINTS];
+    held |= kinematics_jog_step(&jog, velocity, setpoints);
+    for (int i = 0; i < ARM_JOINTS; i++) {
+      double speed = fabs(setpoint_degrees(i, (double)setpoints[i] - end[i])) *
+                     CONTROL_RATE_HZ;
+      result->worstSpeedDeg = fmax(result->worstSpeedDeg, speed);
+      end[i] = setpoints[i];
+    }
+    double reached[ARM_JOINTS] = {setpoints[0], setpoints[1], setpoints[2]};
+    double position[3];
+    reference_fk(reached, position);
+    double elbow = setpoint_angle(ARM_J3, setpoints[ARM_J3]);
+    *conditioned &= fabs(sin(elbow)) >= JOG_CONDITIONED_SIN &&
+                    hypot(position[0], position[1]) >=
+                        JOG_CONDITIONED_REACH_MM;
+    // Only on axes the jog started inside of the box on.
+    for (int i = 0; i < 3; i++)
+      if (from[i] >= box[i][0] && from[i] <= box[i][1])
+        result->worstOutMm =
+            fmax(result->worstOutMm,
+                 fmax(box[i][0] - position[i], position[i] - box[i][1]));
+  }
+  return held;
+}
+
+// Jogs from a grid of poses along every axis, checking how closely the end
+// follows where the arm is well away from the poses the damping is for, then
+// pushes from the middle of the grid along every axis at full speed until it
+// is held, checking that the joints and the jog box are respected.
+static jog_result jog_errors(void) {
+  jog_result result = {0};
+  for (int pose = 0; pose < JOG_POSES * JOG_POSES * JOG_POSES; pose++) {
+    int steps[ARM_JOINTS] = {pose % JOG_POSES, pose / JOG_POSES % JOG_POSES,
+                             pose / JOG_POSES / JOG_POSES};
+    uint16_t start[ARM_JOINTS];
+    for (int i = 0; i < ARM_JOINTS; i++)
+      start[i] = lround((steps[i] + 0.5) / JOG_POSES * UINT16_MAX);
+    double startSetpoints[ARM_JOINTS] = {start[0], start[1], start[2]};
+    double from[3];
+    reference_fk(startSetpoints, from);
+    double length = (double)JOG_SPEED_MM_S * JOG_TICKS / CONTROL_RATE_HZ;
+
+    for (int direction = 0; direction < 6; direction++) {
+      int16_t velocity[3] = {0};
+      int axis = direction / 2;
+      velocity[axis] = direction % 2 ? -JOG_SPEED_MM_S : JOG_SPEED_MM_S;
+      uint16_t end[ARM_JOINTS];
+      bool conditioned;
+      bool held =
+          jog_path(start, velocity, JOG_TICKS, &result, &conditioned, end);
+      result.jogs++;
+      result.held += held;
+      if (held || !conditioned)
+        continue;
+      double reached[ARM_JOINTS] = {end[0], end[1], end[2]};
+      double to[3], expected[3] = {from[0], from[1], from[2]};
+      reference_fk(reached, to);
+      expected[axis] += velocity[axis] > 0 ? length : -length;
+      result.worstPercent =
+          fmax(result.worstPercent, distance(to, expected) / length * 100);
+    }
+  }
+
+  const uint16_t middle[ARM_JOINTS] = {UINT16_MAX / 2, UINT16_MAX / 2,
+                                       UINT16_MAX / 2};
+  for (int direction = 0; direction < 6; direction++) {
+    int16_t velocity[3] = {0};
+    velocity[direction / 2] = direction % 2 ? -KINEMATICS_JOG_SPEED_MAX_MM_S
+                                            : KINEMATICS_JOG_SPEED_MAX_MM_S;
+    uint16_t end[ARM_JOINTS];
+    bool conditioned;
+    jog_path(middle, velocity, JOG_PUSH_TICKS, &result, &conditioned, end);
+  }
+  return result;
+}
+
+static int64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "Compares the arm kinematics with double precision over the joint\n"
+          "range and the workspace, and times them.\n"
+          "  --iterations N  Time N calls of each, default 1000000\n",
+          name);
+}
+
+int main(int argc, char **argv) {
+  long iterations = 1000000;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+      iterations = strtol(argv[++i], NULL, 10);
+    } else {
+      usage(argv[0]);
+      return strcmp(argv[i], "--help") == 0 ? 0 : 2;
+    }
+  }
+  if (iterations <= 0) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  double sinCosError, atan2Error;
+  trig_errors(&sinCosError, &atan2Error);
+  printf("worst sin and cos error %.6f, atan2 error %.4f degrees\n",
+         sinCosError, atan2Error);
+
+  double fkError = fk_error();
+  bool fkOk = fkError <= ERROR_MAX_MM;
+  printf("forward: worst error from double precision %.2f mm over %d "
+         "poses, limit %.2f: %s\n",
+         fkError, JOINT_STEPS * JOINT_STEPS * JOINT_STEPS, ERROR_MAX_MM,
+         fkOk ? "ok" : "EXCEEDED");
+
+  ik_result ik = ik_errors();
+  double mismatchPercent = 100.0 * ik.mismatched / ik.points;
+  bool ikOk = ik.reached <= ERROR_MAX_MM && ik.pose <= ERROR_MAX_MM &&
+              mismatchPercent <= MISMATCH_MAX_PERCENT;
+  printf("inverse: %ld targets, %ld reachable\n", ik.points, ik.reachable);
+  printf("  worst distance from a reachable target %.2f mm\n", ik.reached);
+  printf("  worst distance from the double precision pose %.2f mm\n", ik.pose);
+  printf("  reachability differs for %ld targets, %.3f%%, limit %.1f%%\n",
+         ik.mismatched, mismatchPercent, MISMATCH_MAX_PERCENT);
+  printf("  limit %.2f mm: %s\n", ERROR_MAX_MM, ikOk ? "ok" : "EXCEEDED");
+
+  jog_result jogged = jog_errors();
+  // Setpoints round the joint speed by up to a setpoint a tick.
+  double speedMaxDeg = KINEMATICS_JOG_JOINT_SPEED_MAX_DEG_S;
+  for (int i = 0; i < ARM_JOINTS; i++)
+    speedMaxDeg = fmax(speedMaxDeg, KINEMATICS_JOG_JOINT_SPEED_MAX_DEG_S +
+                                        setpoint_degrees(i, 1) *
+                                            CONTROL_RATE_HZ);
+  // One tick of the fastest jog beyond the box, before it is seen.
+  double outMaxMm = (double)KINEMATICS_JOG_SPEED_MAX_MM_S / CONTROL_RATE_HZ;
+  bool jogOk =
+      jogged.worstPercent <= JOG_ERROR_MAX_PERCENT &&
+      jogged.worstSpeedDeg <= speedMaxDeg &&
+      jogged.worstOutMm <= outMaxMm;
+  printf("jog: %ld jogs of %.0f mm, %ld held by a limit\n", jogged.jogs,
+         (double)JOG_SPEED_MM_S * JOG_TICKS / CONTROL_RATE_HZ, jogged.held);
+  printf("  worst distance from the jog away from singular poses %.2f%%, "
+         "limit %.1f%%\n",
+         jogged.worstPercent, JOG_ERROR_MAX_PERCENT);
+  printf("  fastest joint %.1f deg/s, limit %.1f\n", jogged.worstSpeedDeg,
+         speedMaxDeg);
+  printf("  furthest beyond the jog box %.2f mm, limit %.2f: %s\n",
+         jogged.worstOutMm, outMaxMm, jogOk ? "ok" : "EXCEEDED");
+
+  static uint16_t angles[INPUTS][ARM_JOINTS];
+  static int16_t targets[INPUTS][3];
+  srand(1);
+  for (int i = 0; i < INPUTS; i++) {
+    for (int j = 0; j < ARM_JOINTS; j++)
+      angles[i][j] = rand() % (UINT16_MAX + 1);
+    fk_calculate_position(angles[i][ARM_X], angles[i][ARM_J2],
+                          angles[i][ARM_J3], &targets[i][0], &targets[i][1],
+                          &targets[i][2]);
+  }
+
+  int16_t x, y, z;
+  int64_t start = now_ns();
+  for (long i = 0; i < iterations; i++) {
+    const uint16_t *in = angles[i % INPUTS];
+    fk_calculate_position(in[ARM_X], in[ARM_J2], in[ARM_J3], &x, &y, &z);
+    sink += x;
+  }
+  double fkNs = (double)(now_ns() - start) / iterations;
+
+  // The web interface sends telemetry far more often than the arm moves.
+  start = now_ns();
+  for (long i = 0; i < iterations; i++) {
+    fk_calculate_position(angles[0][ARM_X], angles[0][ARM_J2],
+                          angles[0][ARM_J3], &x, &y, &z);
+    sink += x;
+  }
+  double fkCachedNs = (double)(now_ns() - start) / iterations;
+
+  uint16_t ax, j2, j3;
+  start = now_ns();
+  for (long i = 0; i < iterations; i++) {
+    const int16_t *in = targets[i % INPUTS];
+    sink += ik_calculate_angles(in[0], in[1], in[2], &ax, &j2, &j3);
+    sink += ax;
+  }
+  double ikNs = (double)(now_ns() - start) / iterations;
+
+  kinematics_jog jog;
+  kinematics_jog_start(&jog, angles[0]);
+  uint16_t setpoints[ARM_JOINTS];
+  start = now_ns();
+  for (long i = 0; i < iterations; i++) {
+    sink += kinematics_jog_step(&jog, targets[i % INPUTS], setpoints);
+    sink += setpoints[ARM_X];
+  }
+  double jogNs = (double)(now_ns() - start) / iterations;
+
+  printf("fk_calculate_position %8.1f ns per call, %.0f calls/s\n", fkNs,
+         1e9 / fkNs);
+  printf("  unchanged angles    %8.1f ns per call, %.0f calls/s\n", fkCachedNs,
+         1e9 / fkCachedNs);
+  printf("ik_calculate_angles   %8.1f ns per call, %.0f calls/s\n", ikNs,
+         1e9 / ikNs);
+  printf("kinematics_jog_step   %8.1f ns, %.4f%% of a %d us tick\n", jogNs,
+         jogNs / 10 / CONTROL_PERIOD_US, CONTROL_PERIOD_US);
+  return fkOk && ikOk && jogOk ? 0 : 1;
+}
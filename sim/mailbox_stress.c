@@ -0,0 +1,128 @@
+// Hammers the mailbox control_set passes setpoints through from two threads,
+// a writer publishing numbered values as fast as it can and a reader reading
+// them as fast as it can, and checks that the reader never sees a torn value,
+// never goes back to an older one, and gets the last one written. See the
+// Simulator section of README.md.
+
+#include "mailbox.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Words of a value after its number, each derived from it, so a value made
+// of parts of two writes shows.
+#define VALUE_WORDS 15
+
+typedef struct {
+  uint32_t seq;
+  uint32_t words[VALUE_WORDS];
+} value;
+
+static value values[3] = {0};
+static mailbox box = MAILBOX_INIT(values);
+static atomic_bool writing = true;
+
+typedef struct {
+  uint64_t reads;
+  uint64_t torn;      // Reads whose words do not match their number
+  uint64_t backwards; // Reads older than one read before
+  uint64_t distinct;  // Different values seen
+  uint32_t last;      // Number of the last value read
+} read_stats;
+
+static int64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static uint32_t word_of(uint32_t seq, int word) {
+  return seq * 2654435761u + word;
+}
+
+static void *writer(void *arg) {
+  uint32_t writes = *(const uint32_t *)arg;
+  for (uint32_t seq = 1; seq <= writes; seq++) {
+    value next = {.seq = seq};
+    for (int i = 0; i < VALUE_WORDS; i++)
+      next.words[i] = word_of(seq, i);
+    mailbox_write(&box, &next);
+  }
+  atomic_store(&writing, false);
+  return NULL;
+}
+
+static void check(read_stats *stats, const value *read) {
+  stats->reads++;
+  for (int i = 0; i < VALUE_WORDS; i++) {
+    if (read->words[i] != (read->seq == 0 ? 0 : word_of(read->seq, i))) {
+      stats->torn++;
+      break;
+    }
+  }
+  if (read->seq < stats->last)
+    stats->backwards++;
+  else if (read->seq > stats->last)
+    stats->distinct++;
+  stats->last = read->seq;
+}
+
+static void *reader(void *arg) {
+  read_stats *stats = arg;
+  while (atomic_load(&writing))
+    check(stats, mailbox_read(&box));
+  // Everything is written, so this read must get the last value.
+  check(stats, mailbox_read(&box));
+  return NULL;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "Writes numbered values to a mailbox from one thread while another\n"
+          "reads them, and checks every read.\n"
+          "  --writes N  Write N values, default 20000000\n",
+          name);
+}
+
+int main(int argc, char **argv) {
+  long writes = 20000000;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--writes") == 0 && i + 1 < argc) {
+      writes = strtol(argv[++i], NULL, 10);
+    } else {
+      usage(argv[0]);
+      return strcmp(argv[i], "--help") == 0 ? 0 : 2;
+    }
+  }
+  if (writes <= 0 || writes > UINT32_MAX) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  uint32_t writeCount = writes;
+  read_stats stats = {0};
+  pthread_t writerThread, readerThread;
+  int64_t start = now_ns();
+  if (pthread_create(&readerThread, NULL, reader, &stats) != 0 ||
+      pthread_create(&writerThread, NULL, writer, &writeCount) != 0) {
+    fprintf(stderr, "Failed to start the threads\n");
+    return 1;
+  }
+  pthread_join(writerThread, NULL);
+  pthread_join(readerThread, NULL);
+  double seconds = (now_ns() - start) / 1e9;
+
+  bool ok = stats.torn == 0 && stats.backwards == 0 && stats.last == writeCount;
+  printf("%u writes and %llu reads in %.2f s, %llu different values read\n",
+         writeCount, (unsigned long long)stats.reads, seconds,
+         (unsigned long long)stats.distinct);
+  printf("torn reads %llu, reads older than the one before %llu\n",
+         (unsigned long long)stats.torn, (unsigned long long)stats.backwards);
+  printf("last value read %u of %u: %s\n", stats.last, writeCount,
+         ok ? "ok" : "FAILED");
+  return ok ? 0 : 1;
+}
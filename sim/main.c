@@ -0,0 +1,126 @@
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "hardware.h"
+#include "net.h"
+#include "sim.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SIM_DEFAULT_PORT 8080
+
+void app_main(void);
+
+// The simulator has no Wi-Fi, clients connect to the host instead.
+void wifi_init_softap(void) {
+  ESP_LOGI(TAG_NET, "No Wi-Fi in the simulator, connect to this host.");
+}
+
+// Runs app_main like the ESP-IDF main task.
+static void main_task(void *arg) {
+  app_main();
+  while (true)
+    vTaskDelay(portMAX_DELAY);
+}
+
+// Wait for a signal in stop, or until seconds have passed if positive.
+// Returns whether a signal was taken.
+static bool wait_for_stop(const sigset_t *stop, double seconds) {
+  struct timespec timeout = {.tv_sec = (time_t)seconds,
+                             .tv_nsec = (seconds - (time_t)seconds) * 1e9};
+  int signal;
+  while ((signal = sigtimedwait(stop, NULL, seconds > 0 ? &timeout : NULL)) <
+             0 &&
+         errno == EINTR) {
+  }
+  return signal >= 0;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "Runs the firmware on the host, serving the web interface.\n"
+          "  --port PORT      Serve on PORT instead of %d\n"
+          "  --seconds S      Exit after S seconds instead of on Ctrl-C\n"
+          "  --estop          Hold the e-stop pressed\n"
+          "  --estop-at S     Press the e-stop S seconds after starting\n"
+          "  --frame PATH     Write the LCD contents to PATH as PPM on exit\n"
+          "  --timeline PATH  Write every GPIO and PWM change to PATH as CSV on "
+          "exit\n",
+          name, SIM_DEFAULT_PORT);
+}
+
+int main(int argc, char **argv) {
+  long port = SIM_DEFAULT_PORT;
+  double seconds = 0;
+  bool estop = false;
+  double estopAt = 0;
+  const char *framePath = NULL;
+  const char *timelinePath = NULL;
+  for (int i = 1; i < argc; i++) {
+    bool hasValue = i + 1 < argc;
+    if (strcmp(argv[i], "--port") == 0 && hasValue) {
+      port = strtol(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--seconds") == 0 && hasValue) {
+      seconds = strtod(argv[++i], NULL);
+    } else if (strcmp(argv[i], "--estop") == 0) {
+      estop = true;
+    } else if (strcmp(argv[i], "--estop-at") == 0 && hasValue) {
+      estopAt = strtod(argv[++i], NULL);
+    } else if (strcmp(argv[i], "--frame") == 0 && hasValue) {
+      framePath = argv[++i];
+    } else if (strcmp(argv[i], "--timeline") == 0 && hasValue) {
+      timelinePath = argv[++i];
+    } else if (strcmp(argv[i], "--help") == 0) {
+      usage(argv[0]);
+      return 0;
+    } else {
+      usage(argv[0]);
+      return 2;
+    }
+  }
+  if (port <= 0 || port > UINT16_MAX) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  // Only this thread takes the signals to stop, every task inherits the mask.
+  sigset_t stop;
+  sigemptyset(&stop);
+  sigaddset(&stop, SIGINT);
+  sigaddset(&stop, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stop, NULL);
+
+  sim_httpd_set_port(port);
+  if (estop)
+    sim_gpio_drive(PIN_ESTOP, 0);
+  if (xTaskCreate(main_task, "main", 3584, NULL, 1, NULL) != pdPASS)
+    return 1;
+
+  bool stopped = false;
+  if (estopAt > 0 && (seconds <= 0 || estopAt < seconds)) {
+    stopped = wait_for_stop(&stop, estopAt);
+    if (!stopped) {
+      ESP_LOGI(TAG_SIM, "Pressing the e-stop");
+      sim_gpio_drive(PIN_ESTOP, 0);
+      seconds = seconds > 0 ? seconds - estopAt : 0;
+    }
+  }
+  if (!stopped)
+    wait_for_stop(&stop, seconds);
+
+  int status = 0;
+  if (framePath != NULL && !sim_framebuffer_write(framePath)) {
+    ESP_LOGE(TAG_SIM, "Failed to write %s", framePath);
+    status = 1;
+  }
+  if (timelinePath != NULL && !sim_timeline_write(timelinePath)) {
+    ESP_LOGE(TAG_SIM, "Failed to write %s", timelinePath);
+    status = 1;
+  }
+  return status;
+}
@@ -0,0 +1,137 @@
+// Checks the wheel mixer against the floating point mixing the web interface
+// used to do, and times it and the drive stage on the host to show how much of
+// a control tick they take. See the Simulator section of README.md.
+
+#include "control.h"
+#include "drive.h"
+#include "mixer.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Joystick positions checked along each axis.
+#define GRID_STEPS 257
+// Most distance from the reference, in percent of MIXER_SPEED_MAX.
+#define ERROR_MAX_PERCENT 0.5
+// Inputs cycled through while timing, so the calls cannot be folded away.
+#define INPUTS 1024
+
+static volatile int32_t sink;
+
+// The mixing main.js did before the rover mixed: each axis raised to
+// MIXER_GAMMA, rotated by 45 degrees, clamped and scaled by the drive speed.
+static void reference_sides(double x, double y, double speed,
+                            double sides[DRIVE_SIDES]) {
+  x = x < 0 ? -pow(-x, MIXER_GAMMA) : pow(x, MIXER_GAMMA);
+  y = y < 0 ? -pow(-y, MIXER_GAMMA) : pow(y, MIXER_GAMMA);
+  double mixed[DRIVE_SIDES] = {[DRIVE_LEFT] = y + x, [DRIVE_RIGHT] = y - x};
+  for (int i = 0; i < DRIVE_SIDES; i++)
+    sides[i] = fmax(-1, fmin(1, mixed[i])) * speed * MIXER_SPEED_MAX;
+}
+
+static double worst_error(void) {
+  const double speeds[] = {1, 0.5, 0.1};
+  double worst = 0;
+  for (size_t s = 0; s < sizeof(speeds) / sizeof(speeds[0]); s++) {
+    for (int i = 0; i < GRID_STEPS; i++) {
+      for (int j = 0; j < GRID_STEPS; j++) {
+        double x = 2.0 * i / (GRID_STEPS - 1) - 1;
+        double y = 2.0 * j / (GRID_STEPS - 1) - 1;
+        double expected[DRIVE_SIDES];
+        int16_t sides[DRIVE_SIDES];
+        reference_sides(x, y, speeds[s], expected);
+        mixer_sides(lround(x * INT16_MAX), lround(y * INT16_MAX),
+                    lround(speeds[s] * UINT16_MAX), sides);
+        for (int k = 0; k < DRIVE_SIDES; k++)
+          worst = fmax(worst, fabs(sides[k] - expected[k]));
+      }
+    }
+  }
+  return worst;
+}
+
+static int64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "Compares the wheel mixer with floating point mixing, and times it\n"
+          "and the drive stage against a %d us control tick.\n"
+          "  --iterations N  Time N calls of each, default 1000000\n",
+          name, CONTROL_PERIOD_US);
+}
+
+int main(int argc, char **argv) {
+  long iterations = 1000000;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+      iterations = strtol(argv[++i], NULL, 10);
+    } else {
+      usage(argv[0]);
+      return strcmp(argv[i], "--help") == 0 ? 0 : 2;
+    }
+  }
+  if (iterations <= 0) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  double error = worst_error();
+  double errorMax = MIXER_SPEED_MAX * ERROR_MAX_PERCENT / 100;
+  bool errorOk = error <= errorMax;
+  printf("worst distance from floating point mixing %.1f units, limit %.1f: "
+         "%s\n",
+         error, errorMax, errorOk ? "ok" : "EXCEEDED");
+
+  static int16_t axes[INPUTS][2];
+  static int16_t sidesIn[INPUTS][DRIVE_SIDES];
+  srand(1);
+  for (int i = 0; i < INPUTS; i++) {
+    axes[i][0] = rand() % UINT16_MAX - INT16_MAX;
+    axes[i][1] = rand() % UINT16_MAX - INT16_MAX;
+    mixer_sides(axes[i][0], axes[i][1], UINT16_MAX, sidesIn[i]);
+  }
+
+  int16_t sides[DRIVE_SIDES];
+  int16_t wheels[DRIVE_WHEELS];
+  int64_t start = now_ns();
+  for (long i = 0; i < iterations; i++) {
+    mixer_sides(axes[i % INPUTS][0], axes[i % INPUTS][1], UINT16_MAX, sides);
+    sink += sides[DRIVE_LEFT];
+  }
+  double sidesNs = (double)(now_ns() - start) / iterations;
+
+  start = now_ns();
+  for (long i = 0; i < iterations; i++) {
+    mixer_wheels(sidesIn[i % INPUTS], wheels);
+    sink += wheels[0];
+  }
+  double wheelsNs = (double)(now_ns() - start) / iterations;
+
+  // The drive work of one control tick: a new setpoint every tick, which is
+  // more than the web interface sends, then the drive stage and the mixer.
+  drive_state drive;
+  drive_reset(&drive, 0, 0);
+  start = now_ns();
+  for (long i = 0; i < iterations; i++) {
+    int64_t tickUs = (i + 1) * (int64_t)CONTROL_PERIOD_US;
+    drive_setpoint(&drive, sidesIn[i % INPUTS][DRIVE_LEFT],
+                   sidesIn[i % INPUTS][DRIVE_RIGHT], i + 1, tickUs);
+    drive_step(&drive, tickUs, sides);
+    mixer_wheels(sides, wheels);
+    sink += wheels[0];
+  }
+  double tickNs = (double)(now_ns() - start) / iterations;
+
+  printf("mixer_sides  %8.1f ns per call\n", sidesNs);
+  printf("mixer_wheels %8.1f ns per call\n", wheelsNs);
+  printf("drive tick   %8.1f ns, %.4f%% of a %d us tick at %d Hz\n", tickNs,
+         tickNs / 10 / CONTROL_PERIOD_US, CONTROL_PERIOD_US, CONTROL_RATE_HZ);
+  return errorOk ? 0 : 1;
+}
@@ -0,0 +1,109 @@
+// Times protocol_decode on the frames the web interface sends: a single
+// command, the batch it sends every COMMAND_INTERVAL, and the longest batch a
+// frame holds. See the Simulator section of README.md.
+
+#include "protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+  const char *name;
+  uint8_t frame[COMMAND_FRAME_MAX];
+  size_t length;
+  size_t commands;
+} bench_frame;
+
+static volatile uint32_t sink;
+
+static int64_t now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Stands in for apply_command in web.c, reading a field of every command.
+static bool handler(const command *cmd, void *ctx) {
+  *(uint32_t *)ctx += cmd->id + cmd->drive.left;
+  return true;
+}
+
+static void batch_frame(bench_frame *out, const char *name,
+                        const command *commands, const size_t *payloads,
+                        size_t count) {
+  protocol_batch batch;
+  out->name = name;
+  protocol_batch_begin(&batch, out->frame, sizeof(out->frame), false);
+  out->commands = 0;
+  for (size_t i = 0; i < count; i++)
+    out->commands += protocol_batch_add(&batch, &commands[i], payloads[i]);
+  out->length = batch.length;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [options]\n"
+          "Times protocol_decode on typical frames.\n"
+          "  --iterations N  Decode every frame N times, default 10000000\n",
+          name);
+}
+
+int main(int argc, char **argv) {
+  long iterations = 10000000;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+      iterations = strtol(argv[++i], NULL, 10);
+    } else {
+      usage(argv[0]);
+      return strcmp(argv[i], "--help") == 0 ? 0 : 2;
+    }
+  }
+  if (iterations <= 0) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  bench_frame frames[3];
+  command drive = {.id = COMMAND_DRIVE, .drive = {1000, -1000}};
+  frames[0] = (bench_frame){"single drive", {0}, sizeof(command), 1};
+  memcpy(frames[0].frame, &drive, sizeof(command));
+
+  const command typical[] = {
+      {.id = COMMAND_HEADER, .header = {1, 123456}},
+      {.id = COMMAND_DRIVE_AXES, .drive_axes = {1000, -2000}},
+      {.id = COMMAND_ARM_JOG, .arm_jog = {50, 0, -50}},
+  };
+  const size_t typicalPayloads[] = {6, 4, 6};
+  batch_frame(&frames[1], "header, drive_axes, arm_jog", typical,
+              typicalPayloads, 3);
+
+  command longest[COMMAND_FRAME_MAX / 2];
+  size_t longestPayloads[COMMAND_FRAME_MAX / 2];
+  for (size_t i = 0; i < COMMAND_FRAME_MAX / 2; i++) {
+    longest[i] = (command){.id = COMMAND_DRIVE_SPEED, .drive_speed = {i}};
+    longestPayloads[i] = 2;
+  }
+  batch_frame(&frames[2], "longest drive_speed batch", longest,
+              longestPayloads, COMMAND_FRAME_MAX / 2);
+
+  bool ok = true;
+  for (size_t f = 0; f < sizeof(frames) / sizeof(frames[0]); f++) {
+    const bench_frame *frame = &frames[f];
+    uint32_t sum = 0;
+    ok &= protocol_decode(frame->frame, frame->length, handler, &sum) ==
+          PROTOCOL_OK;
+    int64_t start = now_ns();
+    for (long i = 0; i < iterations; i++)
+      protocol_decode(frame->frame, frame->length, handler, &sum);
+    double frameNs = (double)(now_ns() - start) / iterations;
+    sink += sum;
+    printf("%-28s %2zu bytes %2zu commands %7.1f ns per frame, %5.1f ns per "
+           "command\n",
+           frame->name, frame->length, frame->commands, frameNs,
+           frameNs / frame->commands);
+  }
+  if (!ok)
+    printf("a frame did not decode\n");
+  return ok ? 0 : 1;
+}
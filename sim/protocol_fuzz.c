@@ -0,0 +1,195 @@
+// Fuzz target for protocol_decode. Every frame is also parsed by a plain
+// reading of the format in include/protocol.h, and the commands the handler
+// gets, the status, and for a batch the frame protocol_batch_add rebuilds
+// from them must all match it; any difference aborts. Built for libFuzzer
+// with Clang, and otherwise with a driver that feeds it random frames. See
+// the Simulator section of README.md.
+
+#include "protocol.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// More than a frame of COMMAND_FRAME_MAX bytes can hold.
+#define ENTRIES_MAX (COMMAND_FRAME_MAX / 2)
+#define PAYLOAD_OFFSET 2
+
+typedef struct {
+  command commands[ENTRIES_MAX];
+  size_t count;  // Commands handled
+  size_t dropAt; // Handler returns false for this command
+} decoded;
+
+static bool handler(const command *cmd, void *ctx) {
+  decoded *out = ctx;
+  if (out->count >= ENTRIES_MAX)
+    abort();
+  command *copy = &out->commands[out->count++];
+  *copy = *cmd;
+  // Read as bool, so the sanitizer sees an override that is not 0 or 1.
+  copy->override = cmd->override ? true : false;
+  return out->count - 1 != out->dropAt;
+}
+
+// The commands in frame, with their payload lengths, by the format. Returns
+// false if frame is malformed.
+static bool reference_parse(const uint8_t *frame, size_t length,
+                            command *commands, size_t *payloads,
+                            size_t *count) {
+  *count = 0;
+  if (length < PAYLOAD_OFFSET || length > COMMAND_FRAME_MAX)
+    return false;
+  if (frame[0] != COMMAND_BATCH) {
+    if (length > sizeof(command))
+      return false;
+    commands[0] = (command){.id = frame[0], .override = frame[1] != 0};
+    memcpy((uint8_t *)&commands[0] + PAYLOAD_OFFSET, frame + PAYLOAD_OFFSET,
+           length - PAYLOAD_OFFSET);
+    payloads[0] = length - PAYLOAD_OFFSET;
+    *count = 1;
+    return true;
+  }
+  size_t offset = PAYLOAD_OFFSET;
+  while (offset < length) {
+    if (offset + 2 > length)
+      return false;
+    size_t payload = frame[offset + 1];
+    if (payload > COMMAND_PAYLOAD_MAX || offset + 2 + payload > length)
+      return false;
+    // A header is only allowed as the first entry.
+    if (frame[offset] == COMMAND_HEADER && *count > 0)
+      return false;
+    commands[*count] =
+        (command){.id = frame[offset], .override = frame[1] != 0};
+    memcpy((uint8_t *)&commands[*count] + PAYLOAD_OFFSET, frame + offset + 2,
+           payload);
+    payloads[(*count)++] = payload;
+    offset += 2 + payload;
+  }
+  return true;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  // The last byte picks the command the handler drops, if any.
+  if (size == 0)
+    return 0;
+  size_t length = size - 1;
+  uint8_t *frame = malloc(length > 0 ? length : 1);
+  memcpy(frame, data, length);
+  decoded out = {.dropAt = data[length] & 0x0f};
+
+  command expected[ENTRIES_MAX];
+  size_t payloads[ENTRIES_MAX];
+  size_t count;
+  bool valid = reference_parse(frame, length, expected, payloads, &count);
+  protocol_status status = protocol_decode(frame, length, handler, &out);
+
+  if (!valid) {
+    if (status != PROTOCOL_INVALID || out.count != 0)
+      abort();
+    free(frame);
+    return 0;
+  }
+  bool dropped = out.dropAt < count;
+  if (status != (dropped ? PROTOCOL_DROPPED : PROTOCOL_OK) ||
+      out.count != (dropped ? out.dropAt + 1 : count))
+    abort();
+  for (size_t i = 0; i < out.count; i++)
+    if (memcmp(&out.commands[i], &expected[i], sizeof(command)) != 0)
+      abort();
+
+  if (frame[0] == COMMAND_BATCH) {
+    uint8_t rebuilt[COMMAND_FRAME_MAX];
+    protocol_batch batch;
+    protocol_batch_begin(&batch, rebuilt, sizeof(rebuilt), frame[1] != 0);
+    for (size_t i = 0; i < count; i++)
+      if (!protocol_batch_add(&batch, &expected[i], payloads[i]))
+        abort();
+    if (batch.length != length || rebuilt[1] != (frame[1] != 0) ||
+        memcmp(rebuilt + PAYLOAD_OFFSET, frame + PAYLOAD_OFFSET,
+               length - PAYLOAD_OFFSET) != 0)
+      abort();
+  }
+  free(frame);
+  return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+// Frames that are mostly well formed, so the checks past the length checks
+// are reached: a batch or single command of random entries, then a random
+// byte or length changed now and then.
+static size_t random_frame(uint8_t *data) {
+  size_t length = 0;
+  if (rand() % 2) {
+    data[length++] = COMMAND_BATCH;
+    data[length++] = rand() % 4 == 0 ? rand() : rand() % 2;
+    int entries = rand() % 12;
+    for (int i = 0; i < entries && length + 2 < COMMAND_FRAME_MAX + 4; i++) {
+      uint8_t payload = rand() % (COMMAND_PAYLOAD_MAX + 1);
+      data[length++] = rand() % 12;
+      data[length++] = payload;
+      for (uint8_t j = 0; j < payload && length < COMMAND_FRAME_MAX + 8; j++)
+        data[length++] = rand();
+    }
+  } else {
+    size_t commandLength = rand() % (sizeof(command) + 2);
+    for (size_t i = 0; i < commandLength; i++)
+      data[length++] = rand();
+  }
+  if (rand() % 4 == 0 && length > 0)
+    data[rand() % length] = rand();
+  if (rand() % 8 == 0)
+    length = rand() % (length + 1);
+  data[length++] = rand(); // Picks the dropped command
+  return length;
+}
+
+static void usage(const char *name) {
+  fprintf(stderr,
+          "Usage: %s [options] [FILE...]\n"
+          "Runs the protocol_decode fuzz target on every FILE, or on random\n"
+          "frames without any. Build with Clang for a libFuzzer binary.\n"
+          "  --iterations N  Random frames to run, default 10000000\n"
+          "  --seed N        Seed of the random frames, default 1\n",
+          name);
+}
+
+int main(int argc, char **argv) {
+  long iterations = 10000000;
+  unsigned seed = 1;
+  int files = 0;
+  for (int i = 1; i < argc; i++) {
+    bool hasValue = i + 1 < argc;
+    if (strcmp(argv[i], "--iterations") == 0 && hasValue) {
+      iterations = strtol(argv[++i], NULL, 10);
+    } else if (strcmp(argv[i], "--seed") == 0 && hasValue) {
+      seed = strtoul(argv[++i], NULL, 10);
+    } else if (argv[i][0] == '-') {
+      usage(argv[0]);
+      return strcmp(argv[i], "--help") == 0 ? 0 : 2;
+    } else {
+      FILE *file = fopen(argv[i], "rb");
+      if (file == NULL) {
+        fprintf(stderr, "Failed to read %s\n", argv[i]);
+        return 1;
+      }
+      uint8_t data[4096];
+      size_t size = fread(data, 1, sizeof(data), file);
+      fclose(file);
+      LLVMFuzzerTestOneInput(data, size);
+      files++;
+    }
+  }
+  if (files > 0) {
+    printf("%d files ok\n", files);
+    return 0;
+  }
+  srand(seed);
+  for (long i = 0; i < iterations; i++) {
+    uint8_t data[COMMAND_FRAME_MAX + 16];
+    LLVMFuzzerTestOneInput(data, random_frame(data));
+  }
+  printf("%ld random frames ok\n", iterations);
+  return 0;
+}
+#endif
@@ -0,0 +1,58 @@
+#ifndef _SIM_H_
+#define _SIM_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+static const char *TAG_SIM = "sim";
+
+// Host side of the simulator: inputs to drive, and what the firmware did to
+// its outputs.
+
+// Serve on port instead of the one in the httpd config, which is 80. Must be
+// called before webserver.
+void sim_httpd_set_port(uint16_t port);
+
+// Stop hal_time_us following the clock and return nowUs from then on, for
+// tools that call firmware modules directly in simulated time. Tasks and
+// timers still run in real time, so they must not be started.
+void sim_time_set(int64_t nowUs);
+
+// Drive input pin to level, as if from outside the board. Inputs with a
+// pull-up read 1 until driven.
+void sim_gpio_drive(int pin, bool level);
+bool sim_gpio_level(int pin);
+uint32_t sim_pwm_duty(uint8_t channel);
+// Count edges on the input of counter, as if from an encoder.
+void sim_counter_add(uint8_t counter, uint32_t edges);
+
+typedef enum {
+  SIM_SIGNAL_GPIO,
+  SIM_SIGNAL_PWM,
+} sim_signal;
+
+// One change of an output, recorded by hal_sim.c. Setting an output to the
+// value it already has is not a change.
+typedef struct {
+  int64_t timeUs; // hal_time_us of the change
+  uint8_t signal; // sim_signal
+  uint8_t id;     // GPIO or PWM channel number
+  uint32_t value; // Level or duty
+} sim_event;
+
+// Changes beyond this many are counted but not kept.
+#define SIM_TIMELINE_MAX (1 << 20)
+
+// Copy up to max recorded changes from index first on into events, and return
+// the number copied.
+size_t sim_timeline_read(size_t first, sim_event *events, size_t max);
+// Write every recorded change to path as CSV. Returns false on error.
+bool sim_timeline_write(const char *path);
+
+// Copy the LCD contents, LCD_HEIGHT rows of LCD_WIDTH RGB565 pixels.
+void sim_framebuffer_read(uint16_t *pixels);
+// Write the LCD contents to path as a binary PPM. Returns false on error.
+bool sim_framebuffer_write(const char *path);
+
+#endif
@@ -0,0 +1,90 @@
+#include "arm.h"
+
+#include "control.h"
+#include <stdbool.h>
+
+#define GAIN(value) ((int32_t)((value) * (1 << ARM_GAIN_SHIFT)))
+
+// Gains tuned against the default joint of sim/arm_sim.c, until they can be
+// tuned on the arm.
+const arm_joint_config armJointConfigs[ARM_JOINTS] = {
+    [ARM_X] = {4000, GAIN(800), GAIN(4000), GAIN(12), INT16_MAX},
+    [ARM_J2] = {4000, GAIN(800), GAIN(4000), GAIN(12), INT16_MAX},
+    [ARM_J3] = {4000, GAIN(800), GAIN(4000), GAIN(12), INT16_MAX},
+};
+
+static int64_t clamp64(int64_t value, int64_t min, int64_t max) {
+  return value < min ? min : value > max ? max : value;
+}
+
+// Count the edges since the last step in the direction the joint is moving,
+// and update the velocity and error from them. Returns whether the joint was
+// still.
+static bool joint_track(arm_joint *joint, uint16_t setpoint, uint32_t edges) {
+  // Unsigned, so the difference is right across the counter wrapping.
+  int32_t moved = (int32_t)(edges - joint->edges) * joint->direction;
+  joint->edges = edges;
+  joint->position += moved;
+  joint->velocity +=
+      (moved * CONTROL_RATE_HZ - joint->velocity) >> ARM_VELOCITY_FILTER_SHIFT;
+  int32_t target =
+      (int64_t)setpoint * joint->config.rangeEdges / UINT16_MAX;
+  joint->error = target - joint->position;
+  return moved == 0;
+}
+
+// PID on the error, with the derivative taken from the velocity so a setpoint
+// change does not kick the output. still: whether no edges came this tick
+static void joint_step(arm_joint *joint, bool still) {
+  const arm_joint_config *config = &joint->config;
+  int64_t max = (int64_t)config->effortMax << ARM_GAIN_SHIFT;
+  int64_t proportional = (int64_t)config->kp * joint->error;
+  int64_t damping = -(int64_t)config->kd * joint->velocity;
+  // Stop integrating while the output is saturated the way the error pushes
+  // it, so the integral does not wind up.
+  int64_t unlimited = proportional + joint->integral + damping;
+  bool saturated = (unlimited >= max && joint->error > 0) ||
+                   (unlimited <= -max && joint->error < 0);
+  if (!saturated)
+    joint->integral =
+        clamp64(joint->integral +
+                    (int64_t)config->ki * joint->error / CONTROL_RATE_HZ,
+                -max, max);
+  joint->effort =
+      clamp64(proportional + joint->integral + damping, -max, max) >>
+      ARM_GAIN_SHIFT;
+  // A joint has to stop before it can turn back, so it keeps its direction
+  // while it coasts against the effort, and takes the direction of the
+  // effort from a tick it was still in.
+  if (still && joint->effort != 0)
+    joint->direction = joint->effort > 0 ? 1 : -1;
+}
+
+void arm_init(arm_state *arm, const uint32_t edges[ARM_JOINTS]) {
+  for (int i = 0; i < ARM_JOINTS; i++)
+    arm->joints[i] = (arm_joint){
+        .config = armJointConfigs[i],
+        .edges = edges[i],
+        .direction = 1,
+    };
+}
+
+void arm_step(arm_state *arm, const uint16_t setpoints[ARM_JOINTS],
+              const uint32_t edges[ARM_JOINTS], int16_t efforts[ARM_JOINTS]) {
+  for (int i = 0; i < ARM_JOINTS; i++) {
+    arm_joint *joint = &arm->joints[i];
+    joint_step(joint, joint_track(joint, setpoints[i], edges[i]));
+    efforts[i] = joint->effort;
+  }
+}
+
+void arm_stop(arm_state *arm, const uint16_t setpoints[ARM_JOINTS],
+              const uint32_t edges[ARM_JOINTS], int16_t efforts[ARM_JOINTS]) {
+  for (int i = 0; i < ARM_JOINTS; i++) {
+    arm_joint *joint = &arm->joints[i];
+    joint_track(joint, setpoints[i], edges[i]);
+    joint->integral = 0;
+    joint->effort = 0;
+    efforts[i] = 0;
+  }
+}
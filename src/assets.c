@@ -0,0 +1,58 @@
+// Generated by generateAssets.py from the data folder, do not edit.
+#include "assets.h"
+
+const asset assets[] = {
+    {
+        .path = "/B612Mono.woff2",
+        .type = "font/woff2",
+        .encoding = NULL,
+        .etag = "\"ae141108\"",
+        .start = FILE_ASSETS_START + 0,
+        .end = FILE_ASSETS_START + 19048,
+    },
+    {
+        .path = "/index.html",
+        .type = "text/html",
+        .encoding = "gzip",
+        .etag = "\"2979b8fa\"",
+        .start = FILE_ASSETS_START + 19048,
+        .end = FILE_ASSETS_START + 19783,
+    },
+    {
+        .path = "/main.js",
+        .type = "text/javascript",
+        .encoding = "gzip",
+        .etag = "\"89905f72\"",
+        .start = FILE_ASSETS_START + 19784,
+        .end = FILE_ASSETS_START + 26602,
+    },
+    {
+        .path = "/protocol.js",
+        .type = "text/javascript",
+        .encoding = "gzip",
+        .etag = "\"153739b4\"",
+        .start = FILE_ASSETS_START + 26604,
+        .end = FILE_ASSETS_START + 27608,
+    },
+    {
+        .path = "/style.css",
+        .type = "text/css",
+        .encoding = "gzip",
+        .etag = "\"9676bb9d\"",
+        .start = FILE_ASSETS_START + 27608,
+        .end = FILE_ASSETS_START + 28903,
+    },
+};
+
+const uint32_t assetHashSeed = 0;
+const uint32_t assetSlotMask = 7;
+const asset_slot assetSlots[] = {
+    {.path = "/main.js", .asset = 2},
+    {.path = "/index.html", .asset = 1},
+    {.path = "/style.css", .asset = 4},
+    {.path = NULL, .asset = -1},
+    {.path = "/B612Mono.woff2", .asset = 0},
+    {.path = NULL, .asset = -1},
+    {.path = "/", .asset = 1},
+    {.path = "/protocol.js", .asset = 3},
+};
@@ -0,0 +1,76 @@
+#include "buzzer.h"
+
+#include "hal.h"
+#include "hardware.h"
+#include <assert.h>
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+const buzzer_pattern_info buzzerPatterns[BUZZER_PATTERNS] = {
+    [BUZZER_OFF] = {"off", {0}},
+    [BUZZER_LOW_VOLTAGE] = {"low voltage", {250, 250, 250, 250, 250, 1750}},
+    [BUZZER_OVERCURRENT] = {"overcurrent", {100, 100}},
+    [BUZZER_COMMS_LOSS] = {"comms loss", {1000, 1000}},
+};
+
+// Guards the state below, written by buzzer_play and the timer callback.
+static portMUX_TYPE buzzerLock = portMUX_INITIALIZER_UNLOCKED;
+static hal_timer_handle stepTimer = NULL;
+static buzzer_pattern playing = BUZZER_OFF;
+static uint8_t step = 0;
+static int64_t stepEndUs = 0; // Time the current step ends
+
+// Read without the lock by buzzer_play, so a repeated call is only a load.
+static atomic_int playingPattern = BUZZER_OFF;
+
+// Start step of the playing pattern at startUs and schedule its end. Called
+// with buzzerLock held.
+static void step_start(uint8_t next, int64_t startUs) {
+  const uint16_t *stepsMs = buzzerPatterns[playing].stepsMs;
+  if (next == BUZZER_STEPS_MAX || stepsMs[next] == 0)
+    next = 0;
+  step = next;
+  hal_gpio_set(PIN_BUZZER, step % 2 == 0);
+  // Ends are counted from the start of the pattern rather than from when the
+  // callback ran, so callback latency never adds up.
+  stepEndUs = startUs + stepsMs[step] * 1000LL;
+  hal_timer_once(stepTimer, stepEndUs - hal_time_us());
+}
+
+static void step_end(void *arg) {
+  portENTER_CRITICAL(&buzzerLock);
+  // A callback that was already running when buzzer_play changed the pattern
+  // finds the new step not yet due.
+  if (playing != BUZZER_OFF && hal_time_us() >= stepEndUs)
+    step_start(step + 1, stepEndUs);
+  portEXIT_CRITICAL(&buzzerLock);
+}
+
+void buzzer_init(void) {
+  stepTimer = hal_timer_create("buzzer", step_end, NULL);
+  hal_gpio_set(PIN_BUZZER, 0);
+}
+
+void buzzer_play(buzzer_pattern pattern) {
+  assert(pattern < BUZZER_PATTERNS);
+  if ((buzzer_pattern)atomic_load(&playingPattern) == pattern)
+    return;
+
+  portENTER_CRITICAL(&buzzerLock);
+  playing = pattern;
+  atomic_store(&playingPattern, pattern);
+  if (pattern == BUZZER_OFF) {
+    hal_timer_stop(stepTimer);
+    hal_gpio_set(PIN_BUZZER, 0);
+  } else {
+    step_start(0, hal_time_us());
+  }
+  portEXIT_CRITICAL(&buzzerLock);
+  ESP_LOGI(TAG_BUZZER, "Playing %s", buzzerPatterns[pattern].name);
+}
+
+buzzer_pattern buzzer_playing(void) {
+  return (buzzer_pattern)atomic_load(&playingPattern);
+}
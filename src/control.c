@@ -0,0 +1,174 @@
+#include "control.h"
+
+#include "arm.h"
+#include "buzzer.h"
+#include "drive.h"
+#include "hal.h"
+#include "hardware.h"
+#include "kinematics.h"
+#include "mailbox.h"
+#include "mixer.h"
+#include <assert.h>
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+_Static_assert(configTICK_RATE_HZ % CONTROL_RATE_HZ == 0,
+               "CONTROL_RATE_HZ must divide CONFIG_FREERTOS_HZ");
+#define CONTROL_PERIOD_TICKS (configTICK_RATE_HZ / CONTROL_RATE_HZ)
+
+// Setpoints are passed from control_set to the control task through a
+// mailbox, so neither side waits. Only one task may call control_set.
+static control_setpoint setpoints[3] = {0};
+static mailbox setpointMailbox = MAILBOX_INIT(setpoints);
+
+// Guards stats and armStatus, written by the control task and read by the
+// httpd task.
+static portMUX_TYPE controlLock = portMUX_INITIALIZER_UNLOCKED;
+static control_stats stats = {0};
+static control_arm_status armStatus = {0};
+
+// Only used by the control task.
+static drive_state drive = {0};
+static arm_state arm = {0};
+static uint16_t armSetpoints[ARM_JOINTS] = {0}; // Applied at the last tick
+static kinematics_jog jog = {0};
+static bool jogging = false;
+static bool jogHeld = false;
+
+// Update armSetpoints from target: its joint positions, or a jog from where
+// they were. The jog stops with the outputs, so the setpoints do not run away
+// from a stopped arm. stopped: whether the outputs are stopped this tick
+static void arm_setpoints_update(const control_setpoint *target, bool stopped,
+                                 int64_t now) {
+  if (!target->jogging) {
+    jogging = false;
+    jogHeld = false;
+    armSetpoints[ARM_X] = target->x;
+    armSetpoints[ARM_J2] = target->j2;
+    armSetpoints[ARM_J3] = target->j3;
+    return;
+  }
+  if (!jogging)
+    kinematics_jog_start(&jog, armSetpoints);
+  jogging = true;
+  int16_t velocity[3] = {0};
+  if (!stopped && now < target->jogUntilUs)
+    memcpy(velocity, target->jog, sizeof(velocity));
+  jogHeld = kinematics_jog_step(&jog, velocity, armSetpoints);
+}
+
+// Check for an e-stop fault and apply setpoint, or stop every output. The
+// e-stop interrupt has already stopped the outputs by the time a fault is
+// seen here.
+static void control_step(const control_setpoint *target, int64_t now) {
+  bool estop = estop_fault_update();
+  bool pms_stop = true; // TODO: set based on cell_sense_get
+  buzzer_play(pms_stop ? BUZZER_LOW_VOLTAGE : BUZZER_OFF);
+  int16_t sides[DRIVE_SIDES];
+  int16_t wheels[DRIVE_WHEELS];
+  arm_setpoints_update(target, estop || pms_stop, now);
+  uint32_t edges[ARM_JOINTS];
+  int16_t efforts[ARM_JOINTS];
+  encoder_edges_get(edges);
+  if (estop || pms_stop) {
+    esc_enabled_set(false);
+    // Start from standstill, and only at the next setpoint, once enabled.
+    drive_reset(&drive, target->driveSeq, now);
+    drive_step(&drive, now, sides);
+    mixer_wheels(sides, wheels);
+    arm_stop(&arm, armSetpoints, edges, efforts);
+    motor_control_set(wheels, efforts);
+  } else {
+    drive_setpoint(&drive, target->left, target->right, target->driveSeq,
+                   now);
+    drive_step(&drive, now, sides);
+    mixer_wheels(sides, wheels);
+    arm_step(&arm, armSetpoints, edges, efforts);
+    esc_enabled_set(true);
+    motor_control_set(wheels, efforts);
+  }
+
+  portENTER_CRITICAL(&controlLock);
+  for (int i = 0; i < ARM_JOINTS; i++) {
+    armStatus.setpoint[i] = armSetpoints[i];
+    armStatus.position[i] = arm.joints[i].position;
+    armStatus.error[i] = arm.joints[i].error;
+  }
+  armStatus.jogHeld = jogHeld;
+  portEXIT_CRITICAL(&controlLock);
+}
+
+// periodUs: time since the start of the previous tick
+// tickUs: time spent in this tick
+static void record_tick(int64_t periodUs, int64_t tickUs) {
+  int64_t jitterUs = llabs(periodUs - CONTROL_PERIOD_US);
+  int64_t bucket = jitterUs / CONTROL_JITTER_BUCKET_US;
+  if (bucket >= CONTROL_JITTER_BUCKETS)
+    bucket = CONTROL_JITTER_BUCKETS - 1;
+
+  portENTER_CRITICAL(&controlLock);
+  stats.ticks++;
+  stats.jitter[bucket]++;
+  if (jitterUs > stats.worstJitterUs)
+    stats.worstJitterUs = jitterUs;
+  if (tickUs > stats.worstTickUs)
+    stats.worstTickUs = tickUs;
+  if (tickUs > CONTROL_PERIOD_US) {
+    stats.overruns++;
+    if (tickUs - CONTROL_PERIOD_US > stats.worstOverrunUs)
+      stats.worstOverrunUs = tickUs - CONTROL_PERIOD_US;
+  }
+  portEXIT_CRITICAL(&controlLock);
+}
+
+// Runs control_step every CONTROL_PERIOD_TICKS. vTaskDelayUntil keeps the
+// period fixed however long the step takes, as long as it fits.
+static void control_task(void *arg) {
+  uint32_t edges[ARM_JOINTS];
+  encoder_edges_get(edges);
+  arm_init(&arm, edges);
+
+  TickType_t lastWake = xTaskGetTickCount();
+  int64_t lastStart = hal_time_us();
+  bool first = true;
+  while (true) {
+    vTaskDelayUntil(&lastWake, CONTROL_PERIOD_TICKS);
+    int64_t start = hal_time_us();
+
+    control_step(mailbox_read(&setpointMailbox), start);
+
+    // The first period includes task startup.
+    if (!first)
+      record_tick(start - lastStart, hal_time_us() - start);
+    first = false;
+    lastStart = start;
+  }
+}
+
+void control_init(void) {
+  BaseType_t created =
+      xTaskCreate(control_task, "control", CONTROL_TASK_STACK, NULL,
+                  CONTROL_TASK_PRIORITY, NULL);
+  assert(created == pdPASS);
+  ESP_LOGI(TAG_CONTROL, "Control task running at %d Hz.", CONTROL_RATE_HZ);
+}
+
+void control_set(const control_setpoint *setpoint) {
+  mailbox_write(&setpointMailbox, setpoint);
+}
+
+void control_stats_get(control_stats *out) {
+  portENTER_CRITICAL(&controlLock);
+  *out = stats;
+  portEXIT_CRITICAL(&controlLock);
+}
+
+void control_arm_get(control_arm_status *status) {
+  portENTER_CRITICAL(&controlLock);
+  *status = armStatus;
+  portEXIT_CRITICAL(&controlLock);
+}
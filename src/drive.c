@@ -0,0 +1,111 @@
+#include "drive.h"
+
+#include <stdlib.h>
+
+#define SPEED_MIN ((int64_t)INT16_MIN * (1 << DRIVE_FRACTION_BITS))
+#define SPEED_MAX ((int64_t)INT16_MAX * (1 << DRIVE_FRACTION_BITS))
+#define ACCEL_MAX ((int64_t)DRIVE_ACCEL_MAX << DRIVE_FRACTION_BITS)
+#define JERK_MAX ((int64_t)DRIVE_JERK_MAX << DRIVE_FRACTION_BITS)
+// Longest step drive_step integrates over, so a stalled control task does not
+// produce one huge step.
+#define STEP_MAX_US 50000
+
+static uint32_t isqrt64(uint64_t value) {
+  uint64_t root = 0;
+  for (uint64_t bit = 1ULL << 62; bit != 0; bit >>= 2) {
+    if (value >= root + bit) {
+      value -= root + bit;
+      root = (root >> 1) + bit;
+    } else {
+      root >>= 1;
+    }
+  }
+  return root;
+}
+
+static int64_t clamp64(int64_t value, int64_t min, int64_t max) {
+  return value < min ? min : value > max ? max : value;
+}
+
+// Point of the ramp of side at nowUs.
+static int32_t ramp_at(const drive_side *side, int64_t nowUs) {
+  int64_t elapsedUs = nowUs - side->rampStartUs;
+  if (side->rampUs == 0 || elapsedUs >= side->rampUs)
+    return side->rampTo;
+  return side->rampFrom +
+         (int64_t)(side->rampTo - side->rampFrom) * elapsedUs / side->rampUs;
+}
+
+// Move side towards target over dtUs. The acceleration aimed for is the most
+// from which it can still fall to 0 at JERK_MAX, in steps of dtUs, by the time
+// the speed reaches target: a^2 / 2j + a dt / 2 = error, so the speed settles
+// without overshoot.
+static void side_step(drive_side *side, int32_t target, int64_t dtUs) {
+  int64_t error = target - side->speed;
+  int64_t accelMaxStep = JERK_MAX * dtUs / 1000000;
+  if (llabs(error) <= accelMaxStep * dtUs / 2000000 &&
+      llabs(side->accel) <= accelMaxStep / 2) {
+    // Close enough to land on target within the limits this step.
+    side->speed = target;
+    side->accel = 0;
+    return;
+  }
+
+  int64_t wanted = isqrt64(accelMaxStep * accelMaxStep / 4 +
+                           2 * JERK_MAX * (uint64_t)llabs(error)) -
+                   accelMaxStep / 2;
+  if (wanted > ACCEL_MAX)
+    wanted = ACCEL_MAX;
+  if (error < 0)
+    wanted = -wanted;
+  int64_t accel = side->accel + clamp64(wanted - side->accel, -accelMaxStep,
+                                        accelMaxStep);
+  side->accel = clamp64(accel, -ACCEL_MAX, ACCEL_MAX);
+  side->speed = clamp64(side->speed + side->accel * dtUs / 1000000, SPEED_MIN,
+                        SPEED_MAX);
+}
+
+void drive_reset(drive_state *drive, uint16_t seq, int64_t nowUs) {
+  for (int i = 0; i < DRIVE_SIDES; i++)
+    drive->sides[i] = (drive_side){0};
+  drive->seq = seq;
+  drive->lastSetpointUs = 0;
+  drive->lastStepUs = nowUs;
+}
+
+void drive_setpoint(drive_state *drive, int16_t left, int16_t right,
+                    uint16_t seq, int64_t nowUs) {
+  if (seq == drive->seq)
+    return;
+  drive->seq = seq;
+
+  // Expect the next setpoint after as long as this one took.
+  int64_t rampUs = drive->lastSetpointUs == 0 ? 0 : nowUs - drive->lastSetpointUs;
+  if (rampUs > DRIVE_RAMP_MAX_US)
+    rampUs = DRIVE_RAMP_MAX_US;
+  drive->lastSetpointUs = nowUs;
+
+  int16_t setpoints[DRIVE_SIDES] = {[DRIVE_LEFT] = left, [DRIVE_RIGHT] = right};
+  for (int i = 0; i < DRIVE_SIDES; i++) {
+    drive_side *side = &drive->sides[i];
+    side->rampFrom = ramp_at(side, nowUs);
+    side->rampTo = setpoints[i] * (1 << DRIVE_FRACTION_BITS);
+    side->rampStartUs = nowUs;
+    side->rampUs = rampUs;
+  }
+}
+
+void drive_step(drive_state *drive, int64_t nowUs,
+                int16_t speeds[DRIVE_SIDES]) {
+  int64_t dtUs = nowUs - drive->lastStepUs;
+  if (dtUs > STEP_MAX_US)
+    dtUs = STEP_MAX_US;
+  drive->lastStepUs = nowUs;
+
+  for (int i = 0; i < DRIVE_SIDES; i++) {
+    drive_side *side = &drive->sides[i];
+    if (dtUs > 0)
+      side_step(side, ramp_at(side, nowUs), dtUs);
+    speeds[i] = side->speed >> DRIVE_FRACTION_BITS;
+  }
+}
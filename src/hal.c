@@ -0,0 +1,416 @@
+#include "hal.h"
+
+#include "driver/gpio.h"
+#include "driver/ledc.h"
+#include "driver/pulse_cnt.h"
+#include "driver/rmt.h"
+#include "driver/spi_master.h"
+#include "soc/soc.h"
+#include "tft.h"
+#include <assert.h>
+#include <esp_err.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <string.h>
+
+_Static_assert(HAL_PWM_BITS <= SOC_LEDC_TIMER_BIT_WIDTH,
+               "HAL_PWM_BITS is wider than the LEDC timer");
+_Static_assert(HAL_PWM_LEDC_CHANNELS == SOC_LEDC_CHANNEL_NUM,
+               "HAL_PWM_LEDC_CHANNELS must be every LEDC channel");
+_Static_assert(HAL_PWM_CHANNELS - HAL_PWM_LEDC_CHANNELS <=
+                   SOC_RMT_TX_CANDIDATES_PER_GROUP,
+               "More PWM channels than LEDC and RMT channels");
+_Static_assert(HAL_COUNTERS <= SOC_PCNT_UNITS_PER_GROUP,
+               "HAL_COUNTERS is more than the pulse counter units");
+
+int64_t hal_time_us(void) { return esp_timer_get_time(); }
+
+// hal_timer_handle is an esp_timer_handle_t, and callbacks run on the
+// esp_timer task.
+hal_timer_handle hal_timer_create(const char *name, hal_timer_callback callback,
+                                  void *arg) {
+  esp_timer_create_args_t args = {
+      .callback = callback,
+      .arg = arg,
+      .dispatch_method = ESP_TIMER_TASK,
+      .name = name,
+  };
+  esp_timer_handle_t timer;
+  ESP_ERROR_CHECK(esp_timer_create(&args, &timer));
+  return (hal_timer_handle)timer;
+}
+
+void hal_timer_once(hal_timer_handle timer, int64_t delayUs) {
+  // Fails harmlessly if the timer is not running.
+  esp_timer_stop((esp_timer_handle_t)timer);
+  ESP_ERROR_CHECK(
+      esp_timer_start_once((esp_timer_handle_t)timer, delayUs > 0 ? delayUs : 0));
+}
+
+void hal_timer_stop(hal_timer_handle timer) {
+  esp_timer_stop((esp_timer_handle_t)timer);
+}
+
+void hal_gpio_output(uint64_t mask) {
+  gpio_config_t config = {
+      .pin_bit_mask = mask,
+      .mode = GPIO_MODE_OUTPUT,
+      .pull_up_en = GPIO_PULLUP_DISABLE,
+      .pull_down_en = GPIO_PULLDOWN_DISABLE,
+      .intr_type = GPIO_INTR_DISABLE,
+  };
+  ESP_ERROR_CHECK(gpio_config(&config));
+}
+
+void hal_gpio_input(uint64_t mask, bool pullUp) {
+  gpio_config_t config = {
+      .pin_bit_mask = mask,
+      .mode = GPIO_MODE_INPUT,
+      .pull_up_en = pullUp ? GPIO_PULLUP_ENABLE : GPIO_PULLUP_DISABLE,
+      .pull_down_en = GPIO_PULLDOWN_DISABLE,
+      .intr_type = GPIO_INTR_DISABLE,
+  };
+  ESP_ERROR_CHECK(gpio_config(&config));
+}
+
+void hal_gpio_set(int pin, bool level) { gpio_set_level(pin, level); }
+
+bool hal_gpio_get(int pin) { return gpio_get_level(pin); }
+
+static const gpio_int_type_t gpioEdges[] = {
+    [HAL_GPIO_EDGE_FALLING] = GPIO_INTR_NEGEDGE,
+    [HAL_GPIO_EDGE_RISING] = GPIO_INTR_POSEDGE,
+    [HAL_GPIO_EDGE_ANY] = GPIO_INTR_ANYEDGE,
+};
+
+// The ISR service is not allocated in IRAM, so handlers are held off while
+// the flash cache is disabled. The firmware only writes flash in nvs_flash_init
+// at boot, before any handler is added.
+void hal_gpio_interrupt(int pin, hal_gpio_edge edge, hal_gpio_isr isr,
+                        void *arg) {
+  static bool serviceInstalled = false;
+  if (!serviceInstalled) {
+    ESP_ERROR_CHECK(gpio_install_isr_service(0));
+    serviceInstalled = true;
+  }
+  ESP_ERROR_CHECK(gpio_set_intr_type(pin, gpioEdges[edge]));
+  ESP_ERROR_CHECK(gpio_isr_handler_add(pin, isr, arg));
+  ESP_ERROR_CHECK(gpio_intr_enable(pin));
+}
+
+void hal_pwm_init(void) {
+  ledc_timer_config_t timer = {
+      .speed_mode = LEDC_LOW_SPEED_MODE,
+      .duty_resolution = HAL_PWM_BITS,
+      .timer_num = LEDC_TIMER_0,
+      .freq_hz = HAL_PWM_FREQ_HZ,
+      .clk_cfg = LEDC_AUTO_CLK,
+  };
+  ESP_ERROR_CHECK(ledc_timer_config(&timer));
+}
+
+// RMT ticks in a PWM period at the undivided APB clock, which must fit the 15
+// bit durations of an RMT item.
+#define RMT_PERIOD_TICKS (APB_CLK_FREQ / HAL_PWM_FREQ_HZ)
+_Static_assert(RMT_PERIOD_TICKS < (1 << 15),
+               "A PWM period is too long for an RMT item");
+
+// Channels from HAL_PWM_LEDC_CHANNELS on are RMT channels from 0 on. Each
+// loops over one item, a period high for the duty and then low, followed by
+// an end marker, so a new duty is one word written to the RMT memory and takes
+// effect at the start of the next period. No RMT driver is installed, so no
+// interrupt is taken per loop. Set by hal_pwm_stop for a channel it stopped,
+// which the next set starts again.
+static volatile bool rmtStopped[HAL_PWM_CHANNELS - HAL_PWM_LEDC_CHANNELS];
+
+// A duration of 0 would end the loop, so a duty of 0 or all of a period is two
+// halves of the same level.
+static rmt_item32_t rmt_period(uint32_t duty) {
+  uint32_t high = duty * RMT_PERIOD_TICKS / (HAL_PWM_DUTY_MAX + 1);
+  if (high == 0 || high >= RMT_PERIOD_TICKS) {
+    uint32_t level = high != 0;
+    return (rmt_item32_t){.duration0 = RMT_PERIOD_TICKS / 2,
+                          .level0 = level,
+                          .duration1 = RMT_PERIOD_TICKS - RMT_PERIOD_TICKS / 2,
+                          .level1 = level};
+  }
+  return (rmt_item32_t){.duration0 = high,
+                        .level0 = 1,
+                        .duration1 = RMT_PERIOD_TICKS - high,
+                        .level1 = 0};
+}
+
+// rmt_fill_tx_items, rmt_tx_start and rmt_tx_stop only take the RMT spinlock,
+// which is safe to take in an ISR.
+static esp_err_t rmt_set(uint8_t channel, uint32_t duty) {
+  rmt_channel_t rmtChannel = channel - HAL_PWM_LEDC_CHANNELS;
+  rmt_item32_t period = rmt_period(duty);
+  esp_err_t err = rmt_fill_tx_items(rmtChannel, &period, 1, 0);
+  if (err == ESP_OK && rmtStopped[rmtChannel]) {
+    rmtStopped[rmtChannel] = false;
+    err = rmt_tx_start(rmtChannel, true);
+  }
+  return err;
+}
+
+void hal_pwm_channel_init(uint8_t channel, int pin) {
+  assert(channel < HAL_PWM_CHANNELS);
+  if (channel >= HAL_PWM_LEDC_CHANNELS) {
+    rmt_channel_t rmtChannel = channel - HAL_PWM_LEDC_CHANNELS;
+    rmt_config_t config = RMT_DEFAULT_CONFIG_TX(pin, rmtChannel);
+    config.clk_div = 1;
+    config.tx_config.loop_en = true;
+    config.tx_config.idle_output_en = true;
+    config.tx_config.idle_level = RMT_IDLE_LEVEL_LOW;
+    ESP_ERROR_CHECK(rmt_config(&config));
+    rmt_item32_t items[] = {rmt_period(0), {.val = 0}};
+    ESP_ERROR_CHECK(rmt_fill_tx_items(rmtChannel, items, 2, 0));
+    ESP_ERROR_CHECK(rmt_tx_start(rmtChannel, true));
+    return;
+  }
+  ledc_channel_config_t config = {
+      .speed_mode = LEDC_LOW_SPEED_MODE,
+      .channel = channel,
+      .timer_sel = LEDC_TIMER_0,
+      .intr_type = LEDC_INTR_DISABLE,
+      .gpio_num = pin,
+      .duty = 0,
+      .hpoint = 0,
+  };
+  ESP_ERROR_CHECK(ledc_channel_config(&config));
+}
+
+void hal_pwm_set(uint8_t channel, uint32_t duty) {
+  if (channel >= HAL_PWM_LEDC_CHANNELS) {
+    ESP_ERROR_CHECK(rmt_set(channel, duty));
+    return;
+  }
+  ESP_ERROR_CHECK(ledc_set_duty(LEDC_LOW_SPEED_MODE, channel, duty));
+  ESP_ERROR_CHECK(ledc_update_duty(LEDC_LOW_SPEED_MODE, channel));
+}
+
+// The new duties are written first, then latched together in a critical
+// section. Every channel runs off LEDC_TIMER_0, so they all take effect at its
+// next overflow, unless one falls within the few us the latching takes.
+static portMUX_TYPE pwmLock = portMUX_INITIALIZER_UNLOCKED;
+
+void hal_pwm_set_many(uint8_t first, uint8_t count, const uint32_t *duties) {
+  assert(first + count <= HAL_PWM_LEDC_CHANNELS);
+  for (uint8_t i = 0; i < count; i++)
+    ESP_ERROR_CHECK(ledc_set_duty(LEDC_LOW_SPEED_MODE, first + i, duties[i]));
+  portENTER_CRITICAL(&pwmLock);
+  for (uint8_t i = 0; i < count; i++)
+    ledc_update_duty(LEDC_LOW_SPEED_MODE, first + i);
+  portEXIT_CRITICAL(&pwmLock);
+}
+
+// ledc_stop disables the channel's output straight away, and the next
+// ledc_update_duty enables it again. Its only lock is a spinlock, which is
+// safe to take in an ISR. rmt_tx_stop leaves an RMT channel at its idle level,
+// low, until rmt_set starts it again.
+void hal_pwm_stop(uint8_t channel) {
+  if (channel >= HAL_PWM_LEDC_CHANNELS) {
+    rmtStopped[channel - HAL_PWM_LEDC_CHANNELS] = true;
+    rmt_tx_stop(channel - HAL_PWM_LEDC_CHANNELS);
+  } else {
+    ledc_stop(LEDC_LOW_SPEED_MODE, channel, 0);
+  }
+}
+
+// ledc_set_duty and ledc_update_duty take the same spinlock as ledc_stop.
+void hal_pwm_set_isr(uint8_t channel, uint32_t duty) {
+  if (channel >= HAL_PWM_LEDC_CHANNELS) {
+    rmt_set(channel, duty);
+    return;
+  }
+  ledc_set_duty(LEDC_LOW_SPEED_MODE, channel, duty);
+  ledc_update_duty(LEDC_LOW_SPEED_MODE, channel);
+}
+
+static pcnt_unit_handle_t counters[HAL_COUNTERS];
+
+// Each unit only counts to INT16_MAX, so a watch point there makes the driver
+// add the count up in software as the unit wraps.
+void hal_counter_init(uint8_t counter, int pin) {
+  assert(counter < HAL_COUNTERS);
+  pcnt_unit_config_t unitConfig = {
+      .low_limit = -1,
+      .high_limit = INT16_MAX,
+      .flags.accum_count = true,
+  };
+  pcnt_unit_handle_t unit;
+  ESP_ERROR_CHECK(pcnt_new_unit(&unitConfig, &unit));
+  pcnt_glitch_filter_config_t filter = {
+      .max_glitch_ns = HAL_COUNTER_GLITCH_NS,
+  };
+  ESP_ERROR_CHECK(pcnt_unit_set_glitch_filter(unit, &filter));
+  pcnt_chan_config_t channelConfig = {
+      .edge_gpio_num = pin,
+      .level_gpio_num = -1,
+  };
+  pcnt_channel_handle_t channel;
+  ESP_ERROR_CHECK(pcnt_new_channel(unit, &channelConfig, &channel));
+  ESP_ERROR_CHECK(pcnt_channel_set_edge_action(
+      channel, PCNT_CHANNEL_EDGE_ACTION_INCREASE, PCNT_CHANNEL_EDGE_ACTION_HOLD));
+  ESP_ERROR_CHECK(pcnt_unit_add_watch_point(unit, INT16_MAX));
+  ESP_ERROR_CHECK(pcnt_unit_enable(unit));
+  ESP_ERROR_CHECK(pcnt_unit_clear_count(unit));
+  ESP_ERROR_CHECK(pcnt_unit_start(unit));
+  counters[counter] = unit;
+}
+
+uint32_t hal_counter_get(uint8_t counter) {
+  int count;
+  ESP_ERROR_CHECK(pcnt_unit_get_count(counters[counter], &count));
+  return (uint32_t)count;
+}
+
+static spi_device_handle_t spi;
+// Transactions of every queued rectangle, used in turn. The SPI driver reads
+// them until the matching hal_lcd_wait_rect returns.
+static spi_transaction_t rectTrans[BAND_BUFFERS][6];
+static uint8_t nextRect = 0;
+
+// This function is called (in irq context!) just before a transmission starts.
+// It will set the D/C line to the value indicated in the user field.
+static void lcd_spi_pre_transfer_callback(spi_transaction_t *t) {
+  int dc = (int)t->user;
+  gpio_set_level(PIN_TFT_DC, dc);
+}
+
+void hal_lcd_init(void) {
+  esp_err_t ret;
+  spi_bus_config_t buscfg = {.miso_io_num = PIN_TFT_MISO,
+                             .mosi_io_num = PIN_TFT_MOSI,
+                             .sclk_io_num = PIN_TFT_CLK,
+                             .quadwp_io_num = -1,
+                             .quadhd_io_num = -1,
+                             .max_transfer_sz = PARALLEL_LINES * 320 * 2 + 8};
+  spi_device_interface_config_t devcfg = {
+      .clock_speed_hz = 10 * 1000 * 1000, // Clock out at 10 MHz
+      .mode = 0,                          // SPI mode 0
+      .spics_io_num = PIN_TFT_CS,         // CS pin
+      // We want to be able to queue the 6 transactions of every rectangle
+      .queue_size = 6 * BAND_BUFFERS,
+      .pre_cb = lcd_spi_pre_transfer_callback, // Specify pre-transfer callback
+                                               // to handle D/C line
+  };
+  // Initialize the SPI bus
+  ret = spi_bus_initialize(LCD_HOST, &buscfg, SPI_DMA_CH_AUTO);
+  ESP_ERROR_CHECK(ret);
+  // Attach the LCD to the SPI bus
+  ret = spi_bus_add_device(LCD_HOST, &devcfg, &spi);
+  ESP_ERROR_CHECK(ret);
+}
+
+/* Send a command to the LCD. Uses spi_device_polling_transmit, which waits
+ * until the transfer is complete.
+ *
+ * Since command transactions are usually small, they are handled in polling
+ * mode for higher speed. The overhead of interrupt transactions is more than
+ * just waiting for the transaction to complete.
+ */
+void hal_lcd_cmd(uint8_t cmd) {
+  esp_err_t ret;
+  spi_transaction_t t;
+  memset(&t, 0, sizeof(t)); // Zero out the transaction
+  t.length = 8;             // Command is 8 bits
+  t.tx_buffer = &cmd;       // The data is the cmd itself
+  t.user = (void *)0;       // D/C needs to be set to 0
+  ret = spi_device_polling_transmit(spi, &t); // Transmit!
+  assert(ret == ESP_OK);                      // Should have had no issues.
+}
+
+/* Send data to the LCD. Uses spi_device_polling_transmit, which waits until the
+ * transfer is complete.
+ *
+ * Since data transactions are usually small, they are handled in polling
+ * mode for higher speed. The overhead of interrupt transactions is more than
+ * just waiting for the transaction to complete.
+ */
+void hal_lcd_data(const uint8_t *data, size_t length) {
+  esp_err_t ret;
+  spi_transaction_t t;
+  if (length == 0) {
+    return; // no need to send anything
+  }
+  memset(&t, 0, sizeof(t)); // Zero out the transaction
+  t.length = length * 8;    // Len is in bytes, transaction length is in bits.
+  t.tx_buffer = data;       // Data
+  t.user = (void *)1;       // D/C needs to be set to 1
+  ret = spi_device_polling_transmit(spi, &t); // Transmit!
+  assert(ret == ESP_OK);                      // Should have had no issues.
+}
+
+/* To send a rectangle we have to send a command, 2 data bytes, another
+ * command, 2 more data bytes and another command before sending the pixels
+ * themselves; a total of 6 transactions. (We can't put all of this in just one
+ * transaction because the D/C line needs to be toggled in the middle.) This
+ * routine queues these commands up as interrupt transactions so they get sent
+ * faster (compared to calling spi_device_transmit several times), and at the
+ * mean while the next rectangle can get calculated.
+ *
+ * The column and page windows are set to exactly the w by h rectangle at x, y,
+ * so pixels holds w * h pixels row by row and only those are clocked out.
+ */
+void hal_lcd_queue_rect(uint16_t x, uint16_t y, uint16_t w, uint16_t h,
+                        const uint16_t *pixels) {
+  esp_err_t ret;
+  spi_transaction_t *trans = rectTrans[nextRect];
+  nextRect = (nextRect + 1) % BAND_BUFFERS;
+  // In theory, it's better to initialize trans and data only once and hang on
+  // to the initialized variables. Every rectangle has its own set, so we
+  // re-init them each call.
+  for (int i = 0; i < 6; i++) {
+    memset(&trans[i], 0, sizeof(spi_transaction_t));
+    if ((i & 1) == 0) {
+      // Even transfers are commands
+      trans[i].length = 8;
+      trans[i].user = (void *)0;
+    } else {
+      // Odd transfers are data
+      trans[i].length = 8 * 4;
+      trans[i].user = (void *)1;
+    }
+    trans[i].flags = SPI_TRANS_USE_TXDATA;
+  }
+  trans[0].tx_data[0] = 0x2A;               // Column Address Set
+  trans[1].tx_data[0] = x >> 8;             // Start Col High
+  trans[1].tx_data[1] = x & 0xff;           // Start Col Low
+  trans[1].tx_data[2] = (x + w - 1) >> 8;   // End Col High
+  trans[1].tx_data[3] = (x + w - 1) & 0xff; // End Col Low
+  trans[2].tx_data[0] = 0x2B;               // Page address set
+  trans[3].tx_data[0] = y >> 8;             // Start page high
+  trans[3].tx_data[1] = y & 0xff;           // start page low
+  trans[3].tx_data[2] = (y + h - 1) >> 8;   // end page high
+  trans[3].tx_data[3] = (y + h - 1) & 0xff; // end page low
+  trans[4].tx_data[0] = 0x2C;               // memory write
+  trans[5].tx_buffer = pixels;              // finally send the pixels
+  trans[5].length = w * h * 2 * 8;          // Data length, in bits
+  trans[5].flags = 0; // undo SPI_TRANS_USE_TXDATA flag
+
+  // Queue all transactions.
+  for (int i = 0; i < 6; i++) {
+    ret = spi_device_queue_trans(spi, &trans[i], portMAX_DELAY);
+    assert(ret == ESP_OK);
+  }
+
+  // When we are here, the SPI driver is busy (in the background) getting the
+  // transactions sent. That happens mostly using DMA, so the CPU doesn't have
+  // much to do here. We're not going to wait for the transaction to finish
+  // because we may as well spend the time calculating the next rectangle.
+  // When that is done, we can call hal_lcd_wait_rect, which will wait for the
+  // transfers to be done and check their status.
+}
+
+void hal_lcd_wait_rect(void) {
+  spi_transaction_t *rtrans;
+  esp_err_t ret;
+  // Wait for all 6 transactions to be done and get back the results.
+  for (int x = 0; x < 6; x++) {
+    ret = spi_device_get_trans_result(spi, &rtrans, portMAX_DELAY);
+    assert(ret == ESP_OK);
+    // We could inspect rtrans now if we received any info back. The LCD is
+    // treated as write-only, though.
+  }
+}
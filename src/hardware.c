@@ -1,14 +1,45 @@
 #include "hardware.h"
 
-#include "driver/ledc.h"
-#include "esp_err.h"
-#include "freertos/FreeRTOS.h"
+#include "arm.h"
+#include "hal.h"
 #include "stdint.h"
-#include "esp_timer.h"
+#include <freertos/FreeRTOS.h>
+
+// Guards the e-stop state below, written by estop_isr and the control task.
+// Also held while driving PIN_ESC_ENABLE, so the control task can never enable
+// the ESC between the interrupt latching a fault and it being seen.
+static portMUX_TYPE estopLock = portMUX_INITIALIZER_UNLOCKED;
+static bool estopFault = false;
+static int64_t estopPressedUs = 0; // Last time the e-stop was seen pressed
+static bool estopTripSeen = true;  // Whether the control task saw the last trip
+static estop_stats estopStats = {0};
+
+static const uint8_t armChannels[ARM_JOINTS] = {
+    [ARM_X] = ARM_CHANNEL_X,
+    [ARM_J2] = ARM_CHANNEL_J2,
+    [ARM_J3] = ARM_CHANNEL_J3,
+};
+static const int armPwmPins[ARM_JOINTS] = {
+    [ARM_X] = PIN_ARM_PWM_X,
+    [ARM_J2] = PIN_ARM_PWM_J2,
+    [ARM_J3] = PIN_ARM_PWM_J3,
+};
+static const int armEncoderPins[ARM_JOINTS] = {
+    [ARM_X] = PIN_ARM_ENCODER_X,
+    [ARM_J2] = PIN_ARM_ENCODER_J2,
+    [ARM_J3] = PIN_ARM_ENCODER_J3,
+};
+
+// Speeds and efforts are scaled from [INT16_MIN, INT16_MAX] to
+// [0, HAL_PWM_DUTY_MAX], so a stopped motor is at half duty.
+static uint32_t motor_duty(int16_t speed)
+{
+  return (uint32_t)(speed - INT16_MIN) * HAL_PWM_DUTY_MAX / UINT16_MAX;
+}
 
 bool estop_get(void)
 {
-  if (gpio_get_level(PIN_ESTOP) == 0)
+  if (hal_gpio_get(PIN_ESTOP) == 0)
   {
     return true;
   }
@@ -18,186 +49,162 @@ bool estop_get(void)
   }
 }
 
-void pins_init()
+// Runs on the falling edge of PIN_ESTOP, which is pressed when low. The drive
+// ESCs lose power with PIN_ESC_ENABLE, so their outputs are just stopped. The
+// arm drivers do not, and a duty of 0 is full reverse to them, so the arm
+// outputs are set to the neutral duty a stopped joint gets instead.
+static void estop_isr(void *arg)
 {
-  gpio_config_t GPIO_config = {
-      .pin_bit_mask = (1ULL << PIN_BUZZER) |
-                      (1ULL << PIN_ARM_PWM_X) |
-                      (1ULL << PIN_ARM_PWM_J2) |
-                      (1ULL << PIN_ARM_PWM_J3) |
-                      (1ULL << PIN_DRIVE_MID_LEFT_6) |
-                      (1ULL << PIN_DRIVE_MID_RIGHT_5) |
-                      (1ULL << PIN_DRIVE_FRONT_LEFT_4) |
-                      (1ULL << PIN_DRIVE_BACK_LEFT_3) |
-                      (1ULL << PIN_DRIVE_FRONT_RIGHT_2) |
-                      (1ULL << PIN_DRIVE_BACK_RIGHT_1) |
-                      (1ULL << PIN_CURRENT_ESC),
-      .mode = GPIO_MODE_OUTPUT,              /*!< GPIO mode: set input/output mode                     */
-      .pull_up_en = GPIO_PULLUP_DISABLE,     /*!< GPIO pull-up                                         */
-      .pull_down_en = GPIO_PULLDOWN_DISABLE, /*!< GPIO pull-down                                       */
-      .intr_type = GPIO_INTR_DISABLE,
-  };
-
-  gpio_config(&GPIO_config);
-
-  GPIO_config.pin_bit_mask = (1ULL << PIN_CURRENT_CELL_1) |
-                             (1ULL << PIN_CURRENT_CELL_2) |
-                             (1ULL << PIN_CURRENT_CELL_3) |
-                             (1ULL << PIN_CURRENT_ESC) |
-                             (1ULL << PIN_ARM_ENCODER_X) |
-                             (1ULL << PIN_ARM_ENCODER_J2) |
-                             (1ULL << PIN_ARM_ENCODER_J3);
-  GPIO_config.mode = GPIO_MODE_INPUT;               /*!< GPIO mode: set input/output mode                     */
-  GPIO_config.pull_up_en = GPIO_PULLUP_DISABLE;     /*!< GPIO pull-up                                         */
-  GPIO_config.pull_down_en = GPIO_PULLDOWN_DISABLE; /*!< GPIO pull-down                                       */
-  GPIO_config.intr_type = GPIO_INTR_DISABLE;
-
-  gpio_config(&GPIO_config);
-
-  GPIO_config.pin_bit_mask = (1ULL << PIN_ESTOP);
-  GPIO_config.mode = GPIO_MODE_INPUT;               /*!< GPIO mode: set input/output mode                     */
-  GPIO_config.pull_up_en = GPIO_PULLUP_ENABLE;      /*!< GPIO pull-up                                         */
-  GPIO_config.pull_down_en = GPIO_PULLDOWN_DISABLE; /*!< GPIO pull-down                                       */
-  GPIO_config.intr_type = GPIO_INTR_DISABLE;
-
-  gpio_config(&GPIO_config);
-}
+  portENTER_CRITICAL_ISR(&estopLock);
+  int64_t start = hal_time_us();
+  hal_gpio_set(PIN_ESC_ENABLE, 0);
+  for (uint8_t channel = DRIVE_CHANNEL_FIRST; channel <= DRIVE_CHANNEL_LAST;
+       channel++)
+  {
+    hal_pwm_stop(channel);
+  }
+  for (int joint = 0; joint < ARM_JOINTS; joint++)
+  {
+    hal_pwm_set_isr(armChannels[joint], motor_duty(0));
+  }
+  int64_t stopped = hal_time_us();
 
-void buzzer_set(bool on)
-{
-  // Set time variable
-  int64_t now = esp_timer_get_time();
-  // check if buzzer on
-  // if buzzer on: turn on
-  // check time using module operator to set buzz pattern
-  if (on)
+  estopPressedUs = start;
+  if (!estopFault)
   {
-    if (now % 3000000 < 250000)
-    {
-      gpio_set_level(PIN_BUZZER, 1);
-    }
-    else if (now % 3000000 < 500000)
-    {
-      gpio_set_level(PIN_BUZZER, 0);
-    }
-    else if (now % 3000000 < 750000)
-    {
-      gpio_set_level(PIN_BUZZER, 1);
-    }
-    else if (now % 3000000 < 1000000)
+    estopFault = true;
+    estopTripSeen = false;
+    estopStats.trips++;
+    estopStats.lastTripUs = start;
+    estopStats.lastLatencyUs = stopped - start;
+    if (stopped - start > estopStats.worstLatencyUs)
     {
-      gpio_set_level(PIN_BUZZER, 0);
+      estopStats.worstLatencyUs = stopped - start;
     }
-    else if (now % 3000000 < 1250000)
-    {
-      gpio_set_level(PIN_BUZZER, 1);
-    }
-    else if (now % 3000000 < 3000000)
+  }
+  portEXIT_CRITICAL_ISR(&estopLock);
+}
+
+void estop_init(void)
+{
+  hal_gpio_interrupt(PIN_ESTOP, HAL_GPIO_EDGE_FALLING, estop_isr, NULL);
+}
+
+bool estop_fault_update(void)
+{
+  // Polling also latches a press the interrupt missed, such as one held since
+  // boot.
+  bool pressed = estop_get();
+  portENTER_CRITICAL(&estopLock);
+  int64_t now = hal_time_us();
+  if (pressed)
+  {
+    estopPressedUs = now;
+    estopFault = true;
+  }
+  else if (estopFault && now - estopPressedUs >= ESTOP_RELEASE_US)
+  {
+    estopFault = false;
+  }
+  if (!estopTripSeen)
+  {
+    estopTripSeen = true;
+    if (now - estopStats.lastTripUs > estopStats.worstControlUs)
     {
-      gpio_set_level(PIN_BUZZER, 0);
+      estopStats.worstControlUs = now - estopStats.lastTripUs;
     }
-    // TODO: turn on and off buzer
-    // TODO: differnt buzzing patterns for low voltage vs low current
   }
+  bool fault = estopFault;
+  portEXIT_CRITICAL(&estopLock);
+  return fault;
+}
+
+void estop_stats_get(estop_stats *stats)
+{
+  portENTER_CRITICAL(&estopLock);
+  *stats = estopStats;
+  portEXIT_CRITICAL(&estopLock);
+}
+
+void pins_init()
+{
+  hal_gpio_output((1ULL << PIN_BUZZER) |
+                  (1ULL << PIN_ESC_ENABLE) |
+                  (1ULL << PIN_ARM_PWM_X) |
+                  (1ULL << PIN_ARM_PWM_J2) |
+                  (1ULL << PIN_ARM_PWM_J3) |
+                  (1ULL << PIN_DRIVE_MID_LEFT_6) |
+                  (1ULL << PIN_DRIVE_MID_RIGHT_5) |
+                  (1ULL << PIN_DRIVE_FRONT_LEFT_4) |
+                  (1ULL << PIN_DRIVE_BACK_LEFT_3) |
+                  (1ULL << PIN_DRIVE_FRONT_RIGHT_2) |
+                  (1ULL << PIN_DRIVE_BACK_RIGHT_1) |
+                  (1ULL << PIN_CURRENT_ESC));
+
+  hal_gpio_input((1ULL << PIN_CURRENT_CELL_1) |
+                     (1ULL << PIN_CURRENT_CELL_2) |
+                     (1ULL << PIN_CURRENT_CELL_3) |
+                     (1ULL << PIN_CURRENT_ESC) |
+                     (1ULL << PIN_ARM_ENCODER_X) |
+                     (1ULL << PIN_ARM_ENCODER_J2) |
+                     (1ULL << PIN_ARM_ENCODER_J3),
+                 false);
+
+  hal_gpio_input(1ULL << PIN_ESTOP, true);
 }
 
 void esc_enabled_set(bool enabled)
 {
-  // TODO: enable and disable ESC
-  if (enabled)
+  portENTER_CRITICAL(&estopLock);
+  if (enabled && !estopFault)
   {
-    gpio_set_level(PIN_ESC_ENABLE, 1);
+    hal_gpio_set(PIN_ESC_ENABLE, 1);
   }
   else
   {
-    gpio_set_level(PIN_ESC_ENABLE, 0);
+    hal_gpio_set(PIN_ESC_ENABLE, 0);
   }
+  portEXIT_CRITICAL(&estopLock);
 }
 
 void motor_control_init(void)
 {
-  // TODO: Initialize timers and channels for every PWM output.
-  ledc_timer_config_t ledc_timer = {
-      .speed_mode = LEDC_LOW_SPEED_MODE,
-      .duty_resolution = SOC_LEDC_TIMER_BIT_WIDTH,
-      .timer_num = LEDC_TIMER_0,
-      .freq_hz = 4000, // Set output frequency at 4 kHz
-      .clk_cfg = LEDC_AUTO_CLK,
-  };
-  ESP_ERROR_CHECK(ledc_timer_config(&ledc_timer));
-
-  ledc_channel_config_t ledc_channel = {
-      .speed_mode = LEDC_LOW_SPEED_MODE,
-      .channel = LEDC_CHANNEL_1,
-      .timer_sel = LEDC_TIMER_0,
-      .intr_type = LEDC_INTR_DISABLE,
-      .gpio_num = PIN_DRIVE_BACK_RIGHT_1,
-      .duty = 0, // Set duty to 0%
-      .hpoint = 0,
-  };
-
-  ESP_ERROR_CHECK(ledc_channel_config(&ledc_channel));
-
-  ledc_channel.speed_mode = LEDC_LOW_SPEED_MODE;
-  ledc_channel.channel = LEDC_CHANNEL_2;
-  ledc_channel.timer_sel = LEDC_TIMER_0;
-  ledc_channel.intr_type = LEDC_INTR_DISABLE;
-  ledc_channel.gpio_num = PIN_DRIVE_FRONT_RIGHT_2;
-  ledc_channel.duty = 0; // Set duty to 0%
-  ledc_channel.hpoint = 0;
-
-  ESP_ERROR_CHECK(ledc_channel_config(&ledc_channel));
-
-  ledc_channel.speed_mode = LEDC_LOW_SPEED_MODE;
-  ledc_channel.channel = LEDC_CHANNEL_3;
-  ledc_channel.timer_sel = LEDC_TIMER_0;
-  ledc_channel.intr_type = LEDC_INTR_DISABLE;
-  ledc_channel.gpio_num = PIN_DRIVE_BACK_LEFT_3;
-  ledc_channel.duty = 0; // Set duty to 0%
-  ledc_channel.hpoint = 0;
-
-  ESP_ERROR_CHECK(ledc_channel_config(&ledc_channel));
-
-  ledc_channel.speed_mode = LEDC_LOW_SPEED_MODE;
-  ledc_channel.channel = LEDC_CHANNEL_4;
-  ledc_channel.timer_sel = LEDC_TIMER_0;
-  ledc_channel.intr_type = LEDC_INTR_DISABLE;
-  ledc_channel.gpio_num = PIN_DRIVE_FRONT_LEFT_4;
-  ledc_channel.duty = 0; // Set duty to 0%
-  ledc_channel.hpoint = 0;
-
-  ESP_ERROR_CHECK(ledc_channel_config(&ledc_channel));
-
-  ledc_channel.speed_mode = LEDC_LOW_SPEED_MODE;
-  ledc_channel.channel = LEDC_CHANNEL_5;
-  ledc_channel.timer_sel = LEDC_TIMER_0;
-  ledc_channel.intr_type = LEDC_INTR_DISABLE;
-  ledc_channel.gpio_num = PIN_DRIVE_MID_RIGHT_5;
-  ledc_channel.duty = 0; // Set duty to 0%
-  ledc_channel.hpoint = 0;
-
-  ESP_ERROR_CHECK(ledc_channel_config(&ledc_channel));
-
-  ledc_channel.speed_mode = LEDC_LOW_SPEED_MODE;
-  ledc_channel.channel = LEDC_CHANNEL_6;
-  ledc_channel.timer_sel = LEDC_TIMER_0;
-  ledc_channel.intr_type = LEDC_INTR_DISABLE;
-  ledc_channel.gpio_num = PIN_DRIVE_MID_LEFT_6;
-  ledc_channel.duty = 0; // Set duty to 0%
-  ledc_channel.hpoint = 0;
-
-  ESP_ERROR_CHECK(ledc_channel_config(&ledc_channel));
+  hal_pwm_init();
+  hal_pwm_channel_init(1, PIN_DRIVE_BACK_RIGHT_1);
+  hal_pwm_channel_init(2, PIN_DRIVE_FRONT_RIGHT_2);
+  hal_pwm_channel_init(3, PIN_DRIVE_BACK_LEFT_3);
+  hal_pwm_channel_init(4, PIN_DRIVE_FRONT_LEFT_4);
+  hal_pwm_channel_init(5, PIN_DRIVE_MID_RIGHT_5);
+  hal_pwm_channel_init(6, PIN_DRIVE_MID_LEFT_6);
+  for (int joint = 0; joint < ARM_JOINTS; joint++)
+  {
+    hal_pwm_channel_init(armChannels[joint], armPwmPins[joint]);
+    hal_counter_init(joint, armEncoderPins[joint]);
+  }
 }
 
-void motor_control_set(int16_t left, int16_t right, uint16_t x, uint16_t j2,
-                       uint16_t j3)
+void motor_control_set(const int16_t *wheels, const int16_t *joints)
 {
-  // TODO: Set PWM duty cycles.
-  // scale ledc_set_duty parameter 3 from [INT16_MIN, INT16_MAX] or
-  // [0, UINT16_MAX] to [0, (1 << SOC_LEDC_TIMER_BIT_WIDTH) - 1]
+  uint32_t duties[DRIVE_CHANNEL_LAST - DRIVE_CHANNEL_FIRST + 1];
+  for (int i = 0; i < DRIVE_CHANNEL_LAST - DRIVE_CHANNEL_FIRST + 1; i++)
+  {
+    duties[i] = motor_duty(wheels[i]);
+  }
+  hal_pwm_set_many(DRIVE_CHANNEL_FIRST,
+                   DRIVE_CHANNEL_LAST - DRIVE_CHANNEL_FIRST + 1, duties);
 
-  // ESP_ERROR_CHECK(ledc_set_duty(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0, 0));
-  // ESP_ERROR_CHECK(ledc_update_duty(LEDC_LOW_SPEED_MODE, LEDC_CHANNEL_0));
+  for (int joint = 0; joint < ARM_JOINTS; joint++)
+  {
+    hal_pwm_set(armChannels[joint], motor_duty(joints[joint]));
+  }
+}
+
+void encoder_edges_get(uint32_t *edges)
+{
+  for (int joint = 0; joint < ARM_JOINTS; joint++)
+  {
+    edges[joint] = hal_counter_get(joint);
+  }
 }
 
 void current_sense_get(float *esc, float *cell1, float *cell2, float *cell3)
@@ -0,0 +1,225 @@
+#include "image.h"
+
+#include <string.h>
+
+// lut: table to fill
+// palette: RGB565 colors in the byte order they are sent to the display
+// colors: number of colors in palette, at most 1 << bpp
+// bpp: bits per palette index, 2, 4 or 8
+// Returns false if bpp or colors are invalid. Does nothing if lut was already
+// built from the same palette, so it is cheap to call once per image. Indices
+// past the end of the palette are black.
+bool image_lut_build(image_lut *lut, const uint16_t *palette, uint16_t colors,
+                     uint8_t bpp) {
+  if ((bpp != 2 && bpp != 4 && bpp != 8) || colors > (1 << bpp)) {
+    return false;
+  }
+  if (lut->valid && lut->bpp == bpp && lut->colors == colors &&
+      memcmp(lut->palette, palette, colors * sizeof(uint16_t)) == 0) {
+    return true;
+  }
+  memcpy(lut->palette, palette, colors * sizeof(uint16_t));
+  lut->colors = colors;
+  lut->bpp = bpp;
+  lut->pixelsPerByte = 8 / bpp;
+  uint8_t mask = (1 << bpp) - 1;
+  for (int byte = 0; byte < 256; byte++) {
+    for (uint8_t pixel = 0; pixel < lut->pixelsPerByte; pixel++) {
+      uint8_t index = (byte >> (pixel * bpp)) & mask;
+      lut->pixels[byte][pixel] = index < colors ? palette[index] : 0;
+    }
+  }
+  lut->valid = true;
+  return true;
+}
+
+// Write the pixelsPerByte pixels of byte to dst. dst points to a multiple of
+// pixelsPerByte pixels in a 4 byte aligned buffer, so this compiles to at most
+// two 32 bit copies once pixelsPerByte is a constant.
+static inline __attribute__((always_inline)) void
+unpack_byte(const image_lut *lut, uint8_t byte, uint16_t *dst,
+            uint8_t pixelsPerByte) {
+  if (pixelsPerByte == 4) {
+    memcpy(__builtin_assume_aligned(dst, 4), lut->pixels[byte],
+           4 * sizeof(uint16_t));
+  } else if (pixelsPerByte == 2) {
+    memcpy(__builtin_assume_aligned(dst, 4), lut->pixels[byte],
+           2 * sizeof(uint16_t));
+  } else {
+    *dst = lut->pixels[byte][0];
+  }
+}
+
+// Reads src a 32 bit word at a time, as every access to memory-mapped flash
+// costs a cache lookup no matter how many bytes it reads. Inlined into
+// image_unpack once per pixelsPerByte.
+static inline __attribute__((always_inline)) void
+unpack_words(const image_lut *lut, const uint8_t *src, uint16_t *dst,
+             size_t bytes, uint8_t pixelsPerByte) {
+  // Single bytes until src is word aligned.
+  while (bytes > 0 && ((uintptr_t)src & 0b11) != 0) {
+    unpack_byte(lut, *src++, dst, pixelsPerByte);
+    dst += pixelsPerByte;
+    bytes--;
+  }
+  const uint32_t *words = (const uint32_t *)src;
+  for (; bytes >= sizeof(uint32_t); bytes -= sizeof(uint32_t)) {
+    uint32_t word = *words++;
+    unpack_byte(lut, word & 0xff, dst, pixelsPerByte);
+    unpack_byte(lut, (word >> 8) & 0xff, dst + pixelsPerByte, pixelsPerByte);
+    unpack_byte(lut, (word >> 16) & 0xff, dst + 2 * pixelsPerByte,
+                pixelsPerByte);
+    unpack_byte(lut, word >> 24, dst + 3 * pixelsPerByte, pixelsPerByte);
+    dst += 4 * pixelsPerByte;
+  }
+  // Remaining bytes of a length that is not a multiple of 4.
+  src = (const uint8_t *)words;
+  while (bytes > 0) {
+    unpack_byte(lut, *src++, dst, pixelsPerByte);
+    dst += pixelsPerByte;
+    bytes--;
+  }
+}
+
+// lut: table built by image_lut_build
+// src: packed pixels, may be in memory-mapped flash
+// dst: buffer of bytes * lut->pixelsPerByte pixels, 4 byte aligned unless
+// lut->bpp is 8
+void image_unpack(const image_lut *lut, const uint8_t *src, uint16_t *dst,
+                  size_t bytes) {
+  switch (lut->pixelsPerByte) {
+  case 4:
+    unpack_words(lut, src, dst, bytes, 4);
+    break;
+  case 2:
+    unpack_words(lut, src, dst, bytes, 2);
+    break;
+  default:
+    unpack_words(lut, src, dst, bytes, 1);
+    break;
+  }
+}
+
+// Write the pixels of byte to count consecutive groups of lut->pixelsPerByte
+// pixels at dst.
+static void unpack_run(const image_lut *lut, uint8_t byte, uint16_t *dst,
+                       size_t count) {
+  switch (lut->pixelsPerByte) {
+  case 4:
+    for (size_t i = 0; i < count; i++, dst += 4) {
+      unpack_byte(lut, byte, dst, 4);
+    }
+    break;
+  case 2:
+    for (size_t i = 0; i < count; i++, dst += 2) {
+      unpack_byte(lut, byte, dst, 2);
+    }
+    break;
+  default:
+    for (size_t i = 0; i < count; i++, dst++) {
+      unpack_byte(lut, byte, dst, 1);
+    }
+    break;
+  }
+}
+
+// bundle: images.bin
+// idx: number of the image
+// Returns the index entry of image idx, or NULL if idx is out of range or the
+// bundle is malformed. The entry's offset and length are within the bundle.
+const image_bundle_entry *image_bundle_find(const uint8_t *bundle,
+                                            size_t bundleLength, uint8_t idx) {
+  const image_bundle_header *header = (const image_bundle_header *)bundle;
+  if (bundleLength < sizeof(image_bundle_header) ||
+      memcmp(header->magic, IMAGE_BUNDLE_MAGIC, sizeof(header->magic)) != 0 ||
+      idx >= header->count ||
+      sizeof(image_bundle_header) +
+              header->count * sizeof(image_bundle_entry) >
+          bundleLength) {
+    return NULL;
+  }
+  const image_bundle_entry *entry =
+      (const image_bundle_entry *)(bundle + sizeof(image_bundle_header)) + idx;
+  if ((uint64_t)entry->offset + entry->length > bundleLength ||
+      entry->length < 4 * sizeof(uint16_t)) {
+    return NULL;
+  }
+  return entry;
+}
+
+// image_rle_state.mode
+#define RLE_CONTROL 0   // Next input byte is a control byte
+#define RLE_RUN_VALUE 1 // Next input byte is the value of a run
+#define RLE_RUN 2       // Repeating value
+#define RLE_LITERAL 3   // Copying input bytes
+
+void image_rle_begin(image_rle_state *state) {
+  state->mode = RLE_CONTROL;
+  state->value = 0;
+  state->remaining = 0;
+}
+
+// state: position in the stream, set up by image_rle_begin
+// lut: table built by image_lut_build
+// src: next input byte, advanced past everything consumed
+// srcEnd: end of the available input
+// dst: buffer of bytes * lut->pixelsPerByte pixels, aligned as for image_unpack
+// bytes: number of packed bytes to decode
+// Returns the number of packed bytes decoded, which is less than bytes only if
+// the input ran out. The stream is a sequence of a control byte c followed by
+//   c < 0x80: c + 1 literal packed bytes,
+//   c >= 0x80: one packed byte repeated (c & 0x7f) + 2 times.
+// Runs and literals may span calls, so input and output can both be fed in
+// arbitrary pieces.
+size_t image_rle_decode(image_rle_state *state, const image_lut *lut,
+                        const uint8_t **src, const uint8_t *srcEnd,
+                        uint16_t *dst, size_t bytes) {
+  const uint8_t *in = *src;
+  size_t decoded = 0;
+  while (decoded < bytes) {
+    if (state->mode == RLE_CONTROL) {
+      if (in == srcEnd) {
+        break;
+      }
+      uint8_t control = *in++;
+      if (control < 0x80) {
+        state->mode = RLE_LITERAL;
+        state->remaining = control + 1;
+      } else {
+        state->mode = RLE_RUN_VALUE;
+        state->remaining = (control & 0x7f) + 2;
+      }
+    } else if (state->mode == RLE_RUN_VALUE) {
+      if (in == srcEnd) {
+        break;
+      }
+      state->value = *in++;
+      state->mode = RLE_RUN;
+    } else {
+      size_t count = bytes - decoded;
+      if (count > state->remaining) {
+        count = state->remaining;
+      }
+      if (state->mode == RLE_LITERAL) {
+        if (count > (size_t)(srcEnd - in)) {
+          count = srcEnd - in;
+        }
+        if (count == 0) {
+          break;
+        }
+        image_unpack(lut, in, dst, count);
+        in += count;
+      } else {
+        unpack_run(lut, state->value, dst, count);
+      }
+      dst += count * lut->pixelsPerByte;
+      decoded += count;
+      state->remaining -= count;
+      if (state->remaining == 0) {
+        state->mode = RLE_CONTROL;
+      }
+    }
+  }
+  *src = in;
+  return decoded;
+}
@@ -1,11 +1,424 @@
 #include "kinematics.h"
 
+#include "control.h"
+#include <stdlib.h>
+
+#define PI 3.14159265358979323846
+#define ONE_SHIFT 15
+_Static_assert(KINEMATICS_ONE == 1 << ONE_SHIFT, "ONE_SHIFT must match");
+
+// Lengths are worked in 1 / (1 << LENGTH_SHIFT) mm, and a length times a sine
+// or cosine in 1 / (1 << PRODUCT_SHIFT) mm.
+#define LENGTH_SHIFT 4
+#define PRODUCT_SHIFT (LENGTH_SHIFT + ONE_SHIFT)
+#define SHOULDER ((int32_t)KINEMATICS_SHOULDER_MM << LENGTH_SHIFT)
+#define UPPER_ARM ((int32_t)KINEMATICS_UPPER_ARM_MM << LENGTH_SHIFT)
+#define FOREARM ((int32_t)KINEMATICS_FOREARM_MM << LENGTH_SHIFT)
+// Near full stretch the elbow angle turns a lot for a little distance, so the
+// inverse kinematics keep FINE_SHIFT more bits of the distance to the target.
+#define FINE_SHIFT 4
+_Static_assert(UPPER_ARM > 0 && FOREARM > 0, "the arm must have a length");
+_Static_assert((int64_t)(SHOULDER + UPPER_ARM + FOREARM) * KINEMATICS_ONE <=
+                   INT32_MAX,
+               "the arm is too long for the products to fit");
+
+typedef struct {
+  int32_t min; // Angle at setpoint 0
+  int32_t max; // Angle at setpoint UINT16_MAX
+} joint_limits;
+
+#define DEGREES(deg) ((int32_t)((deg) * KINEMATICS_TURN / 360))
+static const joint_limits jointLimits[ARM_JOINTS] = {
+    [ARM_X] = {DEGREES(KINEMATICS_X_MIN_DEG), DEGREES(KINEMATICS_X_MAX_DEG)},
+    [ARM_J2] = {DEGREES(KINEMATICS_J2_MIN_DEG),
+                DEGREES(KINEMATICS_J2_MAX_DEG)},
+    [ARM_J3] = {DEGREES(KINEMATICS_J3_MIN_DEG),
+                DEGREES(KINEMATICS_J3_MAX_DEG)},
+};
+#define LIMITS_VALID(joint)                                                    \
+  (KINEMATICS_##joint##_MIN_DEG < KINEMATICS_##joint##_MAX_DEG &&              \
+   KINEMATICS_##joint##_MIN_DEG >= -180 && KINEMATICS_##joint##_MAX_DEG <= 180)
+_Static_assert(LIMITS_VALID(X) && LIMITS_VALID(J2) && LIMITS_VALID(J3),
+               "joint limits must be increasing, from -180 to 180 degrees");
+
+// The tables below are constant expressions: GCC folds __builtin_sin and
+// __builtin_atan of constants, so nothing is computed at run time and no
+// floating point code is linked. Each has one entry past the end, so the
+// interpolation of the last segment can read it.
+#define TABLE4(f, i) f(i), f(i + 1), f(i + 2), f(i + 3)
+#define TABLE16(f, i)                                                          \
+  TABLE4(f, i), TABLE4(f, i + 4), TABLE4(f, i + 8), TABLE4(f, i + 12)
+#define TABLE64(f, i)                                                          \
+  TABLE16(f, i), TABLE16(f, i + 16), TABLE16(f, i + 32), TABLE16(f, i + 48)
+#define TABLE256(f)                                                            \
+  TABLE64(f, 0), TABLE64(f, 64), TABLE64(f, 128), TABLE64(f, 192)
+
+// Quarter turn of sine in SINE_SEGMENTS segments, each covering
+// 1 << SINE_SHIFT of the angle, interpolated linearly.
+#define SINE_SEGMENTS 256
+#define SINE_SHIFT 6
+#define SINE(i)                                                                \
+  (uint16_t)(__builtin_sin((i) * PI / 2 / SINE_SEGMENTS) * KINEMATICS_ONE + 0.5)
+static const uint16_t sine[SINE_SEGMENTS + 2] = {TABLE256(SINE), SINE(256),
+                                                 SINE(257)};
+_Static_assert(SINE_SEGMENTS << SINE_SHIFT == KINEMATICS_TURN / 4,
+               "the sine segments must cover a quarter turn");
+
+// Arctangent of ratios from 0 to 1 in ATAN_SEGMENTS segments, each covering
+// 1 << ATAN_SHIFT of a ratio in 1 / (1 << ATAN_RATIO_SHIFT).
+#define ATAN_SEGMENTS 256
+#define ATAN_SHIFT 8
+#define ATAN_RATIO_SHIFT 16
+#define ATAN(i)                                                                \
+  (uint16_t)(__builtin_atan((double)(i) / ATAN_SEGMENTS) * KINEMATICS_TURN /   \
+                 (2 * PI) +                                                    \
+             0.5)
+static const uint16_t arctan[ATAN_SEGMENTS + 2] = {TABLE256(ATAN), ATAN(256),
+                                                   ATAN(257)};
+_Static_assert(ATAN_SEGMENTS << ATAN_SHIFT == 1 << ATAN_RATIO_SHIFT,
+               "the arctangent segments must cover ratios up to 1");
+
+// Interpolate table at value, which has shift bits of fraction.
+static int32_t interpolate(const uint16_t *table, uint32_t value, int shift) {
+  uint32_t i = value >> shift;
+  int32_t fraction = value & ((1 << shift) - 1);
+  return table[i] +
+         (((table[i + 1] - table[i]) * fraction + (1 << (shift - 1))) >> shift);
+}
+
+int32_t kinematics_sin(int32_t angle) {
+  uint32_t phase = (uint32_t)angle % KINEMATICS_TURN;
+  // Fold the turn onto the first quarter, the second half negated.
+  uint32_t folded = phase % (KINEMATICS_TURN / 2);
+  if (folded > KINEMATICS_TURN / 4)
+    folded = KINEMATICS_TURN / 2 - folded;
+  int32_t value = interpolate(sine, folded, SINE_SHIFT);
+  return phase >= KINEMATICS_TURN / 2 ? -value : value;
+}
+
+int32_t kinematics_cos(int32_t angle) {
+  return kinematics_sin(angle + KINEMATICS_TURN / 4);
+}
+
+int32_t kinematics_atan2(int32_t y, int32_t x) {
+  uint32_t absX = x < 0 ? -(uint32_t)x : (uint32_t)x;
+  uint32_t absY = y < 0 ? -(uint32_t)y : (uint32_t)y;
+  // Fold onto the first eighth of a turn, where the ratio is at most 1.
+  bool steep = absY > absX;
+  uint32_t opposite = steep ? absX : absY;
+  uint32_t adjacent = steep ? absY : absX;
+  if (adjacent == 0)
+    return 0;
+  // Only 16 bits of the ratio are used, so drop the bits below them to keep
+  // the division in 32 bits.
+  if (adjacent >= 1u << ATAN_RATIO_SHIFT) {
+    int shift = 32 - ATAN_RATIO_SHIFT - __builtin_clz(adjacent);
+    opposite >>= shift;
+    adjacent >>= shift;
+  }
+  uint32_t ratio = (opposite << ATAN_RATIO_SHIFT) / adjacent;
+  int32_t angle = interpolate(arctan, ratio, ATAN_SHIFT);
+  if (steep)
+    angle = KINEMATICS_TURN / 4 - angle;
+  if (x < 0)
+    angle = KINEMATICS_TURN / 2 - angle;
+  return y < 0 ? -angle : angle;
+}
+
+static uint32_t isqrt32(uint32_t value) {
+  uint32_t root = 0;
+  for (uint32_t bit = 1u << 30; bit != 0; bit >>= 2) {
+    if (value >= root + bit) {
+      value -= root + bit;
+      root = (root >> 1) + bit;
+    } else {
+      root >>= 1;
+    }
+  }
+  return root;
+}
+
+static int32_t setpoint_angle(arm_joint_index joint, uint16_t setpoint) {
+  const joint_limits *limits = &jointLimits[joint];
+  uint32_t range = limits->max - limits->min;
+  return limits->min +
+         (int32_t)(((uint32_t)setpoint * range + UINT16_MAX / 2) / UINT16_MAX);
+}
+
+// angle: within the limits of joint
+static uint16_t angle_setpoint(arm_joint_index joint, int32_t angle) {
+  const joint_limits *limits = &jointLimits[joint];
+  uint32_t range = limits->max - limits->min;
+  return ((uint32_t)(angle - limits->min) * UINT16_MAX + range / 2) / range;
+}
+
+// The angle within the limits of joint nearest to angle, going round either
+// way, setting limited if it is not angle itself.
+static int32_t limit_angle(arm_joint_index joint, int32_t angle,
+                           bool *limited) {
+  const joint_limits *limits = &jointLimits[joint];
+  angle = (int32_t)(((uint32_t)angle + KINEMATICS_TURN / 2) %
+                    KINEMATICS_TURN) -
+          KINEMATICS_TURN / 2;
+  if (angle >= limits->min && angle <= limits->max)
+    return angle;
+  *limited = true;
+  uint32_t pastMax = (uint32_t)(angle - limits->max) % KINEMATICS_TURN;
+  uint32_t beforeMin = (uint32_t)(limits->min - angle) % KINEMATICS_TURN;
+  return pastMax < beforeMin ? limits->max : limits->min;
+}
+
+// Position of the end of the arm for the joint angles, in
+// 1 / (1 << PRODUCT_SHIFT) mm.
+static void forward(const int32_t angles[ARM_JOINTS], int32_t position[3]) {
+  int32_t elbow = angles[ARM_J2] + angles[ARM_J3];
+  int32_t reach = UPPER_ARM * kinematics_cos(angles[ARM_J2]) +
+                  FOREARM * kinematics_cos(elbow);
+  int32_t height = UPPER_ARM * kinematics_sin(angles[ARM_J2]) +
+                   FOREARM * kinematics_sin(elbow);
+  position[0] =
+      ((int64_t)reach * kinematics_cos(angles[ARM_X])) >> ONE_SHIFT;
+  position[1] =
+      ((int64_t)reach * kinematics_sin(angles[ARM_X])) >> ONE_SHIFT;
+  position[2] = (SHOULDER << ONE_SHIFT) + height;
+}
+
+// Last result of fk_calculate_position.
+static struct {
+  bool valid;
+  uint16_t setpoints[ARM_JOINTS];
+  int16_t position[3];
+} lastFk;
+
 void fk_calculate_position(uint16_t ax, uint16_t j2, uint16_t j3, int16_t *x,
                            int16_t *y, int16_t *z) {
-  // TODO: set x, y, z based on FK from ax, j2, j3
+  if (!lastFk.valid || lastFk.setpoints[ARM_X] != ax ||
+      lastFk.setpoints[ARM_J2] != j2 || lastFk.setpoints[ARM_J3] != j3) {
+    int32_t angles[ARM_JOINTS] = {
+        [ARM_X] = setpoint_angle(ARM_X, ax),
+        [ARM_J2] = setpoint_angle(ARM_J2, j2),
+        [ARM_J3] = setpoint_angle(ARM_J3, j3),
+    };
+    int32_t position[3];
+    forward(angles, position);
+    for (int i = 0; i < 3; i++)
+      lastFk.position[i] =
+          (position[i] + (1 << (PRODUCT_SHIFT - 1))) >> PRODUCT_SHIFT;
+    lastFk.setpoints[ARM_X] = ax;
+    lastFk.setpoints[ARM_J2] = j2;
+    lastFk.setpoints[ARM_J3] = j3;
+    lastFk.valid = true;
+  }
+  *x = lastFk.position[0];
+  *y = lastFk.position[1];
+  *z = lastFk.position[2];
 }
 
-void ik_calculate_angles(int16_t x, int16_t y, int16_t z, uint16_t *ax,
+bool ik_calculate_angles(int16_t x, int16_t y, int16_t z, uint16_t *ax,
                          uint16_t *j2, uint16_t *j3) {
-  // TODO: set ax, j2, j3 based on IK from x, y, z
+  bool limited = false;
+  int32_t targetX = (int32_t)x * (1 << LENGTH_SHIFT);
+  int32_t targetY = (int32_t)y * (1 << LENGTH_SHIFT);
+  int32_t base =
+      limit_angle(ARM_X, kinematics_atan2(targetY, targetX), &limited);
+  // Distance out from the X axis in the plane the arm turned to, and height
+  // above the shoulder. With X at a limit the target is off that plane, and
+  // the arm reaches for the nearest point on it.
+  // Both in 1 / (1 << (LENGTH_SHIFT + FINE_SHIFT)) mm.
+  int32_t reach = ((int64_t)targetX * kinematics_cos(base) +
+                   (int64_t)targetY * kinematics_sin(base) +
+                   (1 << (ONE_SHIFT - FINE_SHIFT - 1))) >>
+                  (ONE_SHIFT - FINE_SHIFT);
+  int32_t height = (int32_t)z * (1 << (LENGTH_SHIFT + FINE_SHIFT)) -
+                   (SHOULDER << FINE_SHIFT);
+
+  // The elbow angle from the distance to the target, by the law of cosines.
+  // Out of reach the arm is stretched or folded towards it.
+  int64_t upper = (int64_t)UPPER_ARM << FINE_SHIFT;
+  int64_t fore = (int64_t)FOREARM << FINE_SHIFT;
+  int64_t distance2 = (int64_t)reach * reach + (int64_t)height * height;
+  int64_t cosElbow;
+  if (distance2 >= (upper + fore) * (upper + fore)) {
+    cosElbow = KINEMATICS_ONE;
+    limited |= distance2 > (upper + fore) * (upper + fore);
+  } else if (distance2 <= (upper - fore) * (upper - fore)) {
+    cosElbow = -KINEMATICS_ONE;
+    limited |= distance2 < (upper - fore) * (upper - fore);
+  } else {
+    cosElbow = (distance2 - upper * upper - fore * fore) * KINEMATICS_ONE /
+               (2 * upper * fore);
+  }
+  // Bent downwards, with the elbow up.
+  int32_t sinElbow =
+      -(int32_t)isqrt32((uint32_t)KINEMATICS_ONE * KINEMATICS_ONE -
+                        cosElbow * cosElbow);
+  bool elbowLimited = false;
+  int32_t elbow = limit_angle(
+      ARM_J3, kinematics_atan2(sinElbow, cosElbow), &elbowLimited);
+  if (elbowLimited) {
+    sinElbow = kinematics_sin(elbow);
+    cosElbow = kinematics_cos(elbow);
+    limited = true;
+  }
+
+  // The shoulder points at the target, less the angle the forearm takes the
+  // end off that line by.
+  int32_t shoulder = limit_angle(
+      ARM_J2,
+      kinematics_atan2(height, reach) -
+          kinematics_atan2(FOREARM * sinElbow,
+                           UPPER_ARM * KINEMATICS_ONE + FOREARM * cosElbow),
+      &limited);
+
+  *ax = angle_setpoint(ARM_X, base);
+  *j2 = angle_setpoint(ARM_J2, shoulder);
+  *j3 = angle_setpoint(ARM_J3, elbow);
+  return !limited;
+}
+
+// Jog angles per radian.
+#define JOG_PER_RADIAN                                                         \
+  ((int64_t)((double)KINEMATICS_TURN * (1 << KINEMATICS_JOG_SHIFT) /           \
+                 (2 * PI) +                                                    \
+             0.5))
+// Fastest joint speed in jog angles per second.
+#define JOG_RATE_MAX                                                           \
+  ((int64_t)KINEMATICS_JOG_JOINT_SPEED_MAX_DEG_S * KINEMATICS_TURN *           \
+   (1 << KINEMATICS_JOG_SHIFT) / 360)
+#define JOG_DAMPING ((int64_t)KINEMATICS_JOG_DAMPING_MM << LENGTH_SHIFT)
+_Static_assert(KINEMATICS_JOG_DAMPING_MM > 0,
+               "jogging needs damping to stay finite");
+_Static_assert(KINEMATICS_JOG_SPEED_MAX_MM_S > 0 &&
+                   KINEMATICS_JOG_SPEED_MAX_MM_S <= 1000,
+               "KINEMATICS_JOG_SPEED_MAX_MM_S must be from 1 to 1000");
+
+// The jog box in 1 / (1 << LENGTH_SHIFT) mm, min and max on each axis.
+#define LENGTH(mm) ((int32_t)(mm) * (1 << LENGTH_SHIFT))
+static const int32_t jogBox[3][2] = {
+    {LENGTH(KINEMATICS_JOG_X_MIN_MM), LENGTH(KINEMATICS_JOG_X_MAX_MM)},
+    {LENGTH(KINEMATICS_JOG_Y_MIN_MM), LENGTH(KINEMATICS_JOG_Y_MAX_MM)},
+    {LENGTH(KINEMATICS_JOG_Z_MIN_MM), LENGTH(KINEMATICS_JOG_Z_MAX_MM)},
+};
+
+static int32_t clamp32(int32_t value, int32_t min, int32_t max) {
+  return value < min ? min : value > max ? max : value;
+}
+
+// num * scale / den, dropping low bits of num and den when the product would
+// not fit in 64 bits. scale, den: above 0
+static int64_t scale_divide(int64_t num, int64_t scale, int64_t den) {
+  uint64_t magnitude = num < 0 ? -(uint64_t)num : (uint64_t)num;
+  if (magnitude == 0)
+    return 0;
+  int bits = 128 - __builtin_clzll(magnitude) - __builtin_clzll(scale);
+  if (bits > 62) {
+    num /= 1LL << (bits - 62);
+    den = den >> (bits - 62) > 0 ? den >> (bits - 62) : 1;
+  }
+  return num * scale / den;
+}
+
+void kinematics_jog_start(kinematics_jog *jog,
+                          const uint16_t setpoints[ARM_JOINTS]) {
+  for (int i = 0; i < ARM_JOINTS; i++)
+    jog->angles[i] =
+        setpoint_angle(i, setpoints[i]) * (1 << KINEMATICS_JOG_SHIFT);
+}
+
+bool kinematics_jog_step(kinematics_jog *jog, const int16_t velocity[3],
+                         uint16_t setpoints[ARM_JOINTS]) {
+  bool limited = false;
+  int32_t angles[ARM_JOINTS];
+  for (int i = 0; i < ARM_JOINTS; i++)
+    angles[i] = jog->angles[i] >> KINEMATICS_JOG_SHIFT;
+  int32_t cosBase = kinematics_cos(angles[ARM_X]);
+  int32_t sinBase = kinematics_sin(angles[ARM_X]);
+  int32_t elbow = angles[ARM_J2] + angles[ARM_J3];
+  // Distance out from the axis of X and height above the shoulder, and the
+  // part of each the forearm adds, all in 1 / (1 << LENGTH_SHIFT) mm.
+  int32_t foreReach = (FOREARM * kinematics_cos(elbow)) >> ONE_SHIFT;
+  int32_t foreHeight = (FOREARM * kinematics_sin(elbow)) >> ONE_SHIFT;
+  int32_t reach =
+      ((UPPER_ARM * kinematics_cos(angles[ARM_J2])) >> ONE_SHIFT) + foreReach;
+  int32_t height =
+      ((UPPER_ARM * kinematics_sin(angles[ARM_J2])) >> ONE_SHIFT) + foreHeight;
+  int32_t position[3] = {
+      ((int64_t)reach * cosBase) >> ONE_SHIFT,
+      ((int64_t)reach * sinBase) >> ONE_SHIFT,
+      SHOULDER + height,
+  };
+
+  // Velocity in 1 / (1 << LENGTH_SHIFT) mm/s, stopped on every axis it would
+  // take the end further out of the jog box on.
+  int32_t moving[3];
+  for (int i = 0; i < 3; i++) {
+    moving[i] = clamp32(velocity[i], -KINEMATICS_JOG_SPEED_MAX_MM_S,
+                        KINEMATICS_JOG_SPEED_MAX_MM_S) *
+                (1 << LENGTH_SHIFT);
+    if ((moving[i] < 0 && position[i] <= jogBox[i][0]) ||
+        (moving[i] > 0 && position[i] >= jogBox[i][1])) {
+      moving[i] = 0;
+      limited = true;
+    }
+  }
+  // Out from the axis of X and sideways to the left of the arm.
+  int32_t outwards =
+      ((int64_t)moving[0] * cosBase + (int64_t)moving[1] * sinBase) >>
+      ONE_SHIFT;
+  int32_t sideways =
+      ((int64_t)moving[1] * cosBase - (int64_t)moving[0] * sinBase) >>
+      ONE_SHIFT;
+
+  // Joint speeds in jog angles per second, by damped least squares: the
+  // joint speeds q minimising |J q - v|^2 + damping^2 |q|^2, which is
+  // q = (J^T J + damping^2 I)^-1 J^T v. X alone moves the end sideways, by
+  // reach per radian, so it is solved apart from J2 and J3.
+  int64_t damping2 = JOG_DAMPING * JOG_DAMPING;
+  int64_t rates[ARM_JOINTS];
+  rates[ARM_X] = scale_divide((int64_t)reach * sideways, JOG_PER_RADIAN,
+                              (int64_t)reach * reach + damping2);
+  // J2 and J3 move the end out and up. Their Jacobian has columns
+  // (-height, reach) and (-foreHeight, foreReach), so J^T J + damping^2 I is
+  // a 2 by 2 matrix m, in 1 / (1 << LENGTH_SHIFT) mm^2, inverted by its
+  // adjugate.
+  int64_t m11 = ((int64_t)height * height + (int64_t)reach * reach +
+                 damping2) >>
+                LENGTH_SHIFT;
+  int64_t m12 = ((int64_t)height * foreHeight + (int64_t)reach * foreReach) >>
+                LENGTH_SHIFT;
+  int64_t m22 = ((int64_t)foreHeight * foreHeight +
+                 (int64_t)foreReach * foreReach + damping2) >>
+                LENGTH_SHIFT;
+  int64_t determinant = m11 * m22 - m12 * m12;
+  int64_t shoulderPull =
+      -(int64_t)height * outwards + (int64_t)reach * moving[2];
+  int64_t elbowPull =
+      -(int64_t)foreHeight * outwards + (int64_t)foreReach * moving[2];
+  rates[ARM_J2] = scale_divide(m22 * shoulderPull - m12 * elbowPull,
+                               JOG_PER_RADIAN, determinant << LENGTH_SHIFT);
+  rates[ARM_J3] = scale_divide(m11 * elbowPull - m12 * shoulderPull,
+                               JOG_PER_RADIAN, determinant << LENGTH_SHIFT);
+
+  // Slow every joint alike, so the end keeps its direction.
+  int64_t fastest = 0;
+  for (int i = 0; i < ARM_JOINTS; i++)
+    if (llabs(rates[i]) > fastest)
+      fastest = llabs(rates[i]);
+  for (int i = 0; i < ARM_JOINTS; i++) {
+    if (fastest > JOG_RATE_MAX)
+      rates[i] = rates[i] * JOG_RATE_MAX / fastest;
+    const joint_limits *limits = &jointLimits[i];
+    int32_t min = limits->min * (1 << KINEMATICS_JOG_SHIFT);
+    int32_t max = limits->max * (1 << KINEMATICS_JOG_SHIFT);
+    int32_t angle = jog->angles[i] + rates[i] / CONTROL_RATE_HZ;
+    if (angle < min || angle > max) {
+      angle = clamp32(angle, min, max);
+      limited = true;
+    }
+    jog->angles[i] = angle;
+    // Straight from the jog angle, rounding once.
+    uint64_t range = (uint64_t)(max - min);
+    setpoints[i] = ((uint64_t)(angle - min) * UINT16_MAX + range / 2) / range;
+  }
+  return limited;
 }
@@ -0,0 +1,22 @@
+#include "mailbox.h"
+
+#include <string.h>
+
+// spareIndex holds the index of the spare buffer and, in SPARE_FRESH, whether
+// the writer put it there since the reader last took it.
+#define SPARE_INDEX 0x03
+#define SPARE_FRESH 0x04
+
+void mailbox_write(mailbox *box, const void *value) {
+  memcpy(box->buffers + box->writeIndex * box->size, value, box->size);
+  box->writeIndex = atomic_exchange(&box->spareIndex,
+                                    box->writeIndex | SPARE_FRESH) &
+                    SPARE_INDEX;
+}
+
+const void *mailbox_read(mailbox *box) {
+  if (atomic_load(&box->spareIndex) & SPARE_FRESH)
+    box->readIndex =
+        atomic_exchange(&box->spareIndex, box->readIndex) & SPARE_INDEX;
+  return box->buffers + box->readIndex * box->size;
+}
@@ -1,13 +1,21 @@
+#include "buzzer.h"
+#include "control.h"
 #include "hardware.h"
 #include "net.h"
 #include "tft.h"
 #include "web.h"
-#include "driver/gpio.h"
 #include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 #include <nvs_flash.h>
 
 static const char *TAG_MAIN = "main.c";
 
+static void log_frame_time(uint8_t idx, int64_t frameUs)
+{
+  ESP_LOGI(TAG_MAIN, "Drew image %u in %lld us", idx, (long long)frameUs);
+}
+
 void app_main(void)
 {
   // Initialize NVS
@@ -21,14 +29,20 @@ void app_main(void)
   ESP_ERROR_CHECK(ret);
 
   ESP_LOGI(TAG_MAIN, "ESP_WIFI_MODE_AP");
-  motor_control_init();
+  // pins_init configures the drive pins as plain GPIO, so the PWM channels
+  // must be attached after it.
   pins_init();
+  buzzer_init();
+  motor_control_init();
+  estop_init();
+  control_init();
 
   wifi_init_softap();
   tft_init();
-  tft_draw_image(1, pixels);
+  tft_set_frame_hook(log_frame_time);
+  tft_draw_image(1);
   vTaskDelay(10000 / portTICK_PERIOD_MS);
-  tft_draw_image(0, pixels);
+  tft_draw_image(0);
 
   // Will not return.
   webserver();
@@ -0,0 +1,103 @@
+#include "mixer.h"
+
+#include "hardware.h"
+
+_Static_assert(DRIVE_CHANNEL_LAST - DRIVE_CHANNEL_FIRST + 1 == DRIVE_WHEELS,
+               "every drive channel is a wheel");
+_Static_assert(MIXER_SPEED_MAX > 0 && MIXER_SPEED_MAX <= INT16_MAX,
+               "MIXER_SPEED_MAX must be a positive speed");
+
+const mixer_wheel mixerWheels[DRIVE_WHEELS] = {
+    {DRIVE_RIGHT, true},  // PIN_DRIVE_BACK_RIGHT_1
+    {DRIVE_RIGHT, true},  // PIN_DRIVE_FRONT_RIGHT_2
+    {DRIVE_LEFT, true},   // PIN_DRIVE_BACK_LEFT_3
+    {DRIVE_LEFT, true},   // PIN_DRIVE_FRONT_LEFT_4
+    {DRIVE_RIGHT, false}, // PIN_DRIVE_MID_RIGHT_5
+    {DRIVE_LEFT, false},  // PIN_DRIVE_MID_LEFT_6
+};
+
+static const int16_t trimPermille[DRIVE_WHEELS] = MIXER_TRIM_PERMILLE;
+
+// The tables below are constant expressions: GCC folds __builtin_pow and
+// __builtin_sqrt of constants, so nothing is computed at run time and no
+// floating point code is linked.
+
+// MIXER_GAMMA curve from 0 to INT16_MAX in CURVE_SEGMENTS segments, each
+// covering 1 << CURVE_SHIFT of the input, interpolated linearly.
+#define CURVE_SEGMENTS 64
+#define CURVE_SHIFT 9
+#define CURVE(i)                                                               \
+  (int16_t)(__builtin_pow((double)(i) / CURVE_SEGMENTS, MIXER_GAMMA) *         \
+                INT16_MAX +                                                    \
+            0.5)
+#define CURVE4(i) CURVE(i), CURVE(i + 1), CURVE(i + 2), CURVE(i + 3)
+#define CURVE16(i) CURVE4(i), CURVE4(i + 4), CURVE4(i + 8), CURVE4(i + 12)
+static const int16_t curve[CURVE_SEGMENTS + 1] = {
+    CURVE16(0), CURVE16(16), CURVE16(32), CURVE16(48), CURVE(64)};
+_Static_assert(CURVE_SEGMENTS << CURVE_SHIFT == INT16_MAX + 1,
+               "the curve segments must cover the axis");
+
+// Turn gain of the middle and corner wheels, in 1 / TURN_GAIN_ONE: the ratio
+// of their distances from the centre of a turn on the spot, less the share
+// MIXER_CURVATURE_PERCENT leaves out.
+#define TURN_GAIN_SHIFT 12
+#define TURN_GAIN_ONE (1 << TURN_GAIN_SHIFT)
+#define CORNER_RATIO                                                           \
+  __builtin_sqrt(1.0 + (2.0 * MIXER_CORNER_OFFSET_MM / MIXER_TRACK_MM) *       \
+                           (2.0 * MIXER_CORNER_OFFSET_MM / MIXER_TRACK_MM))
+static const int32_t turnGains[2] = {
+    [false] = TURN_GAIN_ONE,
+    [true] = (int32_t)(((CORNER_RATIO - 1) * MIXER_CURVATURE_PERCENT / 100 +
+                        1) *
+                           TURN_GAIN_ONE +
+                       0.5),
+};
+
+static int32_t clamp32(int32_t value, int32_t min, int32_t max) {
+  return value < min ? min : value > max ? max : value;
+}
+
+// axis: from -INT16_MAX to INT16_MAX, INT16_MIN is taken as -INT16_MAX
+static int32_t curve_at(int16_t axis) {
+  int32_t magnitude = axis < 0 ? -(int32_t)axis : axis;
+  if (magnitude > INT16_MAX)
+    magnitude = INT16_MAX;
+  int32_t segment = magnitude >> CURVE_SHIFT;
+  int32_t offset = magnitude & ((1 << CURVE_SHIFT) - 1);
+  int32_t value = curve[segment] + (((curve[segment + 1] - curve[segment]) *
+                                     offset) >> CURVE_SHIFT);
+  return axis < 0 ? -value : value;
+}
+
+void mixer_sides(int16_t x, int16_t y, uint16_t speed,
+                 int16_t sides[DRIVE_SIDES]) {
+  // The joystick rotated by 45 degrees and scaled so that pushing it
+  // straight runs both sides at full speed.
+  int32_t turn = curve_at(x);
+  int32_t drive = curve_at(y);
+  int32_t mixed[DRIVE_SIDES] = {
+      [DRIVE_LEFT] = drive + turn,
+      [DRIVE_RIGHT] = drive - turn,
+  };
+  for (int i = 0; i < DRIVE_SIDES; i++) {
+    int32_t side = clamp32(mixed[i], -INT16_MAX, INT16_MAX) * speed /
+                   UINT16_MAX;
+    sides[i] = side * MIXER_SPEED_MAX / INT16_MAX;
+  }
+}
+
+void mixer_wheels(const int16_t sides[DRIVE_SIDES],
+                  int16_t wheels[DRIVE_WHEELS]) {
+  // Each side is its forward speed plus half the difference between the
+  // sides, which the corner wheels take more of.
+  int32_t difference = sides[DRIVE_LEFT] - sides[DRIVE_RIGHT];
+  for (int i = 0; i < DRIVE_WHEELS; i++) {
+    const mixer_wheel *wheel = &mixerWheels[i];
+    int32_t extra = (difference * (turnGains[wheel->corner] - TURN_GAIN_ONE)) >>
+                    (TURN_GAIN_SHIFT + 1);
+    int32_t speed =
+        wheel->side == DRIVE_LEFT ? sides[DRIVE_LEFT] + extra
+                                  : sides[DRIVE_RIGHT] - extra;
+    wheels[i] = clamp32(speed * trimPermille[i] / 1000, INT16_MIN, INT16_MAX);
+  }
+}
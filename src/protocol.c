@@ -0,0 +1,84 @@
+#include "protocol.h"
+
+#include <string.h>
+
+// Offset of the payload in command and of the first entry in a batch.
+#define COMMAND_PAYLOAD_OFFSET 2
+
+// Whether every entry of the batch in frame fits within length, and a header
+// is at most the first entry.
+static bool batch_valid(const uint8_t *frame, size_t length) {
+  size_t offset = COMMAND_PAYLOAD_OFFSET;
+  while (offset < length) {
+    if (length - offset < 2)
+      return false;
+    if (frame[offset] == COMMAND_HEADER && offset != COMMAND_PAYLOAD_OFFSET)
+      return false;
+    uint8_t payloadBytes = frame[offset + 1];
+    if (payloadBytes > COMMAND_PAYLOAD_MAX ||
+        payloadBytes > length - offset - 2)
+      return false;
+    offset += 2 + payloadBytes;
+  }
+  return true;
+}
+
+protocol_status protocol_decode(const uint8_t *frame, size_t length,
+                                protocol_command_handler handler, void *ctx) {
+  if (length < COMMAND_PAYLOAD_OFFSET || length > COMMAND_FRAME_MAX)
+    return PROTOCOL_INVALID;
+
+  if (frame[0] != COMMAND_BATCH) {
+    if (length > sizeof(command))
+      return PROTOCOL_INVALID;
+    // In place only if override is a valid bool, 0 or 1.
+    if (length == sizeof(command) && frame[1] <= 1)
+      return handler((const command *)frame, ctx) ? PROTOCOL_OK
+                                                  : PROTOCOL_DROPPED;
+    command cmd = {0};
+    memcpy(&cmd, frame, length);
+    cmd.override = frame[1] != 0;
+    return handler(&cmd, ctx) ? PROTOCOL_OK : PROTOCOL_DROPPED;
+  }
+
+  // Checked up front so a malformed batch is not half applied.
+  if (!batch_valid(frame, length))
+    return PROTOCOL_INVALID;
+  bool override = frame[1];
+  for (size_t offset = COMMAND_PAYLOAD_OFFSET; offset < length;) {
+    uint8_t payloadBytes = frame[offset + 1];
+    command cmd = {.id = frame[offset], .override = override};
+    memcpy((uint8_t *)&cmd + COMMAND_PAYLOAD_OFFSET, frame + offset + 2,
+           payloadBytes);
+    if (!handler(&cmd, ctx))
+      return PROTOCOL_DROPPED;
+    offset += 2 + payloadBytes;
+  }
+  return PROTOCOL_OK;
+}
+
+void protocol_batch_begin(protocol_batch *batch, uint8_t *frame,
+                          size_t capacity, bool override) {
+  batch->frame = frame;
+  batch->capacity = capacity;
+  batch->length = 0;
+  if (capacity >= COMMAND_PAYLOAD_OFFSET) {
+    frame[0] = COMMAND_BATCH;
+    frame[1] = override;
+    batch->length = COMMAND_PAYLOAD_OFFSET;
+  }
+}
+
+bool protocol_batch_add(protocol_batch *batch, const command *cmd,
+                        size_t payloadBytes) {
+  if (batch->length < COMMAND_PAYLOAD_OFFSET ||
+      payloadBytes > COMMAND_PAYLOAD_MAX ||
+      batch->capacity - batch->length < 2 + payloadBytes)
+    return false;
+  batch->frame[batch->length] = cmd->id;
+  batch->frame[batch->length + 1] = payloadBytes;
+  memcpy(batch->frame + batch->length + 2,
+         (const uint8_t *)cmd + COMMAND_PAYLOAD_OFFSET, payloadBytes);
+  batch->length += 2 + payloadBytes;
+  return true;
+}
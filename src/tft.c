@@ -1,10 +1,12 @@
 #include "tft.h"
 
-#include "driver/gpio.h"
-#include "driver/spi_master.h"
-#include "esp_system.h"
 #include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "freertos/task.h"
+#include "hal.h"
+#include "image.h"
+#include <assert.h>
 #include <esp_log.h>
 #include <inttypes.h>
 #include <stdio.h>
@@ -96,241 +98,418 @@ DRAM_ATTR static const lcd_init_cmd_t lcdInitCmds[] = {
     {0, {0}, 0xff},
 };
 
-/* Send a command to the LCD. Uses spi_device_polling_transmit, which waits
- * until the transfer is complete.
- *
- * Since command transactions are usually small, they are handled in polling
- * mode for higher speed. The overhead of interrupt transactions is more than
- * just waiting for the transaction to complete.
- */
-void lcd_cmd(spi_device_handle_t spi, const uint8_t cmd, bool keepCSActive) {
-  esp_err_t ret;
-  spi_transaction_t t;
-  memset(&t, 0, sizeof(t)); // Zero out the transaction
-  t.length = 8;             // Command is 8 bits
-  t.tx_buffer = &cmd;       // The data is the cmd itself
-  t.user = (void *)0;       // D/C needs to be set to 0
-  if (keepCSActive) {
-    t.flags = SPI_TRANS_CS_KEEP_ACTIVE; // Keep CS active after data transfer
+// Initialize the display
+static void lcd_init(void) {
+  int cmd = 0;
+
+  // Initialize non-SPI GPIOs
+  hal_gpio_output((1ULL << PIN_TFT_DC) | (1ULL << PIN_TFT_RST) |
+                  (1ULL << PIN_TFT_BCKL));
+
+  // Reset the display
+  hal_gpio_set(PIN_TFT_RST, 0);
+  vTaskDelay(100 / portTICK_PERIOD_MS);
+  hal_gpio_set(PIN_TFT_RST, 1);
+  vTaskDelay(100 / portTICK_PERIOD_MS);
+
+  // Send all the commands
+  ESP_LOGI(TAG_TFT, "LCD ILI9341 initialization.");
+  while (lcdInitCmds[cmd].databytes != 0xff) {
+    hal_lcd_cmd(lcdInitCmds[cmd].cmd);
+    hal_lcd_data(lcdInitCmds[cmd].data, lcdInitCmds[cmd].databytes & 0x1F);
+    if (lcdInitCmds[cmd].databytes & 0x80) {
+      vTaskDelay(100 / portTICK_PERIOD_MS);
+    }
+    cmd++;
   }
-  ret = spi_device_polling_transmit(spi, &t); // Transmit!
-  assert(ret == ESP_OK);                      // Should have had no issues.
+
+  /// Enable backlight
+  hal_gpio_set(PIN_TFT_BCKL, LCD_BK_LIGHT_ON_LEVEL);
+}
+
+// Queue PARALLEL_LINES full lines starting at line ypos.
+static void send_lines(int ypos, const uint16_t *linedata) {
+  hal_lcd_queue_rect(0, ypos, LCD_WIDTH, PARALLEL_LINES, linedata);
 }
 
-/* Send data to the LCD. Uses spi_device_polling_transmit, which waits until the
- * transfer is complete.
- *
- * Since data transactions are usually small, they are handled in polling
- * mode for higher speed. The overhead of interrupt transactions is more than
- * just waiting for the transaction to complete.
- */
-void lcd_data(spi_device_handle_t spi, const uint8_t *data, int len) {
-  esp_err_t ret;
-  spi_transaction_t t;
-  if (len == 0) {
-    return; // no need to send anything
+// Ping-pong band buffers. Bands are sent in the order they are submitted, so
+// when all buffers are in flight the oldest one, bands[nextBand], is the first
+// to finish. Only touched while holding tftMutex, and no band is in flight
+// while tftMutex is free.
+DMA_ATTR static uint16_t bands[BAND_BUFFERS][PIXELS_LENGTH];
+static uint8_t nextBand = 0;
+static uint8_t bandsInFlight = 0;
+// Expands the palette of the last drawn image. Only touched while holding
+// tftMutex.
+static image_lut imageLut;
+
+// Return the next band buffer to decode into, waiting for the transfer that
+// last used it to finish.
+static uint16_t *band_acquire(void) {
+  if (bandsInFlight == BAND_BUFFERS) {
+    hal_lcd_wait_rect();
+    bandsInFlight--;
   }
-  memset(&t, 0, sizeof(t)); // Zero out the transaction
-  t.length = len * 8;       // Len is in bytes, transaction length is in bits.
-  t.tx_buffer = data;       // Data
-  t.user = (void *)1;       // D/C needs to be set to 1
-  ret = spi_device_polling_transmit(spi, &t); // Transmit!
-  assert(ret == ESP_OK);                      // Should have had no issues.
+  return bands[nextBand];
 }
 
-// This function is called (in irq context!) just before a transmission starts.
-// It will set the D/C line to the value indicated in the user field.
-void lcd_spi_pre_transfer_callback(spi_transaction_t *t) {
-  int dc = (int)t->user;
-  gpio_set_level(PIN_TFT_DC, dc);
+// Queue the buffer returned by band_acquire to be drawn as band without
+// waiting for the transfer to finish.
+static void band_submit(uint8_t band) {
+  send_lines(band * PARALLEL_LINES, bands[nextBand]);
+  bandsInFlight++;
+  nextBand = (nextBand + 1) % BAND_BUFFERS;
 }
 
-uint32_t lcd_get_id(spi_device_handle_t spi) {
-  // When using SPI_TRANS_CS_KEEP_ACTIVE, bus must be locked/acquired
-  spi_device_acquire_bus(spi, portMAX_DELAY);
+// Queue the buffer returned by band_acquire to be drawn as rect, which must
+// have at most PIXELS_LENGTH pixels.
+static void band_submit_rect(const tft_rect *rect) {
+  hal_lcd_queue_rect(rect->x, rect->y, rect->w, rect->h, bands[nextBand]);
+  bandsInFlight++;
+  nextBand = (nextBand + 1) % BAND_BUFFERS;
+}
 
-  // get_id cmd
-  lcd_cmd(spi, 0x04, true);
+// Wait for every submitted band to finish.
+static void band_flush(void) {
+  while (bandsInFlight > 0) {
+    hal_lcd_wait_rect();
+    bandsInFlight--;
+  }
+}
 
-  spi_transaction_t t;
-  memset(&t, 0, sizeof(t));
-  t.length = 8 * 3;
-  t.flags = SPI_TRANS_USE_RXDATA;
-  t.user = (void *)1;
+// Serializes access to the LCD and the band buffers between the render
+// task, the httpd task and app_main.
+static SemaphoreHandle_t tftMutex;
+// Holds the index of the next image for the render task. Has a length of 1 and
+// is written with xQueueOverwrite so only the latest request is drawn.
+static QueueHandle_t renderQueue;
+static tft_frame_hook_t frameHook = NULL;
 
-  esp_err_t ret = spi_device_polling_transmit(spi, &t);
-  assert(ret == ESP_OK);
+#define RENDER_TASK_STACK 3072
+// Below the httpd task so decoding never delays drive commands.
+#define RENDER_TASK_PRIORITY 2
 
-  // Release bus
-  spi_device_release_bus(spi);
+static void status_render(const tft_rect *rect, uint16_t *pixels, void *ctx);
 
-  return *(uint32_t *)t.rx_data;
+// Draws requested images, and the dirty parts of the status strip at least
+// every TFT_STATUS_PERIOD_MS.
+static void render_task(void *arg) {
+  uint8_t idx;
+  while (1) {
+    if (xQueueReceive(renderQueue, &idx,
+                      TFT_STATUS_PERIOD_MS / portTICK_PERIOD_MS) == pdTRUE) {
+      tft_draw_image(idx);
+    }
+    tft_flush_dirty(status_render, NULL);
+  }
 }
 
-// Initialize the display
-void lcd_init(spi_device_handle_t spi) {
-  int cmd = 0;
+void tft_init() {
+  ESP_LOGI(TAG_TFT, "TFT initializing.");
+  hal_lcd_init();
+  lcd_init();
 
-  // Initialize non-SPI GPIOs
-  gpio_config_t ioConf = {};
-  ioConf.pin_bit_mask =
-      ((1ULL << PIN_TFT_DC) | (1ULL << PIN_TFT_RST) | (1ULL << PIN_TFT_BCKL));
-  ioConf.mode = GPIO_MODE_OUTPUT;
-  ioConf.pull_up_en = GPIO_PULLUP_ENABLE;
-  gpio_config(&ioConf);
+  tftMutex = xSemaphoreCreateMutex();
+  assert(tftMutex != NULL);
+  renderQueue = xQueueCreate(1, sizeof(uint8_t));
+  assert(renderQueue != NULL);
+  BaseType_t created = xTaskCreate(render_task, "tft_render", RENDER_TASK_STACK,
+                                   NULL, RENDER_TASK_PRIORITY, NULL);
+  assert(created == pdPASS);
+  ESP_LOGI(TAG_TFT, "TFT initialized.");
+}
 
-  // Reset the display
-  gpio_set_level(PIN_TFT_RST, 0);
-  vTaskDelay(100 / portTICK_PERIOD_MS);
-  gpio_set_level(PIN_TFT_RST, 1);
-  vTaskDelay(100 / portTICK_PERIOD_MS);
+void tft_set_frame_hook(tft_frame_hook_t hook) { frameHook = hook; }
 
-  // Send all the commands
-  ESP_LOGI(TAG_TFT, "LCD ILI9341 initialization.");
-  while (lcdInitCmds[cmd].databytes != 0xff) {
-    lcd_cmd(spi, lcdInitCmds[cmd].cmd, false);
-    lcd_data(spi, lcdInitCmds[cmd].data, lcdInitCmds[cmd].databytes & 0x1F);
-    if (lcdInitCmds[cmd].databytes & 0x80) {
-      vTaskDelay(100 / portTICK_PERIOD_MS);
+// idx: number of the image to draw
+// Decodes band N + 1 while band N is clocked out and blocks until the whole
+// frame is on the screen.
+void tft_draw_image(uint8_t idx) {
+  const uint8_t *bundle = (const uint8_t *)FILE_IMAGES_START;
+  const image_bundle_entry *entry =
+      image_bundle_find(bundle, FILE_IMAGES_END - FILE_IMAGES_START, idx);
+  if (entry == NULL ||
+      (entry->encoding == IMAGE_ENCODING_RAW && entry->length != IMAGE_BYTES) ||
+      entry->encoding > IMAGE_ENCODING_RLE) {
+    ESP_LOGE(TAG_TFT, "Image %u does not exist.", idx);
+    return;
+  }
+  xSemaphoreTake(tftMutex, portMAX_DELAY);
+  int64_t start = hal_time_us();
+  const uint8_t *image = bundle + entry->offset;
+  const uint8_t *imageEnd = image + entry->length;
+  image_lut_build(&imageLut, (const uint16_t *)image, PALATTE_SIZE, 2);
+  image += PALATTE_SIZE * sizeof(uint16_t);
+  image_rle_state rle;
+  image_rle_begin(&rle);
+  for (uint8_t part = 0; part < BAND_COUNT; part++) {
+    uint16_t *pixels = band_acquire();
+    size_t bytes = PIXELS_LENGTH / IMAGE_2BPP_PIXELS_PER_BYTE;
+    if (entry->encoding == IMAGE_ENCODING_RAW) {
+      image_unpack(&imageLut, image, pixels, bytes);
+      image += bytes;
+    } else {
+      // Decodes straight into the band, picking up where the last band left
+      // off.
+      size_t decoded = image_rle_decode(&rle, &imageLut, &image, imageEnd,
+                                        pixels, bytes);
+      if (decoded < bytes) {
+        ESP_LOGE(TAG_TFT, "Image %u is truncated.", idx);
+        memset(pixels + decoded * IMAGE_2BPP_PIXELS_PER_BYTE, 0,
+               (bytes - decoded) * IMAGE_2BPP_PIXELS_PER_BYTE *
+                   sizeof(uint16_t));
+      }
     }
-    cmd++;
+    band_submit(part);
+  }
+  band_flush();
+  int64_t frameUs = hal_time_us() - start;
+  xSemaphoreGive(tftMutex);
+  tft_mark_dirty(0, 0, LCD_WIDTH, TFT_STATUS_HEIGHT);
+  if (frameHook != NULL) {
+    frameHook(idx, frameUs);
   }
+}
 
-  /// Enable backlight
-  gpio_set_level(PIN_TFT_BCKL, LCD_BK_LIGHT_ON_LEVEL);
+// idx: number of the image to draw
+// Hands the image to the render task and returns immediately. A request that
+// has not started drawing yet is replaced by the newer one.
+void tft_request_image(uint8_t idx) { xQueueOverwrite(renderQueue, &idx); }
+
+// Start drawing a frame that is produced band by band elsewhere, such as an
+// upload. Every band is filled in the buffer returned by tft_stream_band and
+// queued by tft_stream_submit, which returns without waiting so the next band
+// can be filled while the last one is clocked out. Holds the display until
+// tft_stream_end.
+void tft_stream_begin(void) { xSemaphoreTake(tftMutex, portMAX_DELAY); }
+
+// Return the buffer to fill with the next band of PIXELS_LENGTH pixels,
+// waiting for the transfer that last used it to finish.
+uint16_t *tft_stream_band(void) { return band_acquire(); }
+
+// band: 0-BAND_COUNT top to bottom slice of the screen to draw the buffer
+// returned by the last tft_stream_band to
+void tft_stream_submit(uint8_t band) {
+  if (band < BAND_COUNT) {
+    band_submit(band);
+  }
+}
+
+// Wait for every submitted band to be drawn and release the display.
+void tft_stream_end(void) {
+  band_flush();
+  xSemaphoreGive(tftMutex);
+  tft_mark_dirty(0, 0, LCD_WIDTH, TFT_STATUS_HEIGHT);
+}
+
+// Clip rect to the screen and return false if nothing is left.
+static bool clip_rect(tft_rect *rect) {
+  if (rect->x >= LCD_WIDTH || rect->y >= LCD_HEIGHT || rect->w == 0 ||
+      rect->h == 0) {
+    return false;
+  }
+  if (rect->w > LCD_WIDTH - rect->x) {
+    rect->w = LCD_WIDTH - rect->x;
+  }
+  if (rect->h > LCD_HEIGHT - rect->y) {
+    rect->h = LCD_HEIGHT - rect->y;
+  }
+  return true;
 }
 
-/* To send a set of lines we have to send a command, 2 data bytes, another
- * command, 2 more data bytes and another command before sending the line data
- * itself; a total of 6 transactions. (We can't put all of this in just one
- * transaction because the D/C line needs to be toggled in the middle.) This
- * routine queues these commands up as interrupt transactions so they get sent
- * faster (compared to calling spi_device_transmit several times), and at the
- * mean while the lines for next transactions can get calculated.
- */
-static void send_lines(spi_device_handle_t spi, int ypos, uint16_t *linedata) {
-  esp_err_t ret;
-  int x;
-  // Transaction descriptors. Declared static so they're not allocated on the
-  // stack; we need this memory even when this function is finished because the
-  // SPI driver needs access to it even while we're already calculating the next
-  // line.
-  static spi_transaction_t trans[6];
-
-  // In theory, it's better to initialize trans and data only once and hang on
-  // to the initialized variables. We allocate them on the stack, so we need to
-  // re-init them each call.
-  for (x = 0; x < 6; x++) {
-    memset(&trans[x], 0, sizeof(spi_transaction_t));
-    if ((x & 1) == 0) {
-      // Even transfers are commands
-      trans[x].length = 8;
-      trans[x].user = (void *)0;
+// x, y: top left corner on the screen
+// w, h: size of the rectangle
+// src: w * h pixels row by row in the format of PIXELS_LENGTH, does not need
+// DMA_ATTR
+// Only the rectangle is sent, in slices of as many rows as fit in a band
+// buffer. Parts outside of the screen are skipped.
+void tft_blit_rect(uint16_t x, uint16_t y, uint16_t w, uint16_t h,
+                   const uint16_t *src) {
+  tft_rect rect = {.x = x, .y = y, .w = w, .h = h};
+  if (!clip_rect(&rect)) {
+    return;
+  }
+  uint16_t sliceRows = PIXELS_LENGTH / rect.w;
+  xSemaphoreTake(tftMutex, portMAX_DELAY);
+  for (uint16_t row = 0; row < rect.h; row += sliceRows) {
+    tft_rect slice = {.x = rect.x,
+                      .y = rect.y + row,
+                      .w = rect.w,
+                      .h = rect.h - row < sliceRows ? rect.h - row : sliceRows};
+    uint16_t *pixels = band_acquire();
+    for (uint16_t sliceRow = 0; sliceRow < slice.h; sliceRow++) {
+      // Rows of src are w long even if the rectangle was clipped.
+      memcpy(pixels + sliceRow * slice.w, src + (row + sliceRow) * w,
+             slice.w * sizeof(uint16_t));
+    }
+    band_submit_rect(&slice);
+  }
+  band_flush();
+  xSemaphoreGive(tftMutex);
+}
+
+// Rectangles marked by tft_mark_dirty and not yet flushed. Guarded by
+// dirtyLock rather than tftMutex so marking never waits for a frame to draw.
+static tft_rect dirtyRects[TFT_DIRTY_RECTS];
+static uint8_t dirtyCount = 0;
+static portMUX_TYPE dirtyLock = portMUX_INITIALIZER_UNLOCKED;
+
+static tft_rect rect_union(const tft_rect *a, const tft_rect *b) {
+  uint16_t left = a->x < b->x ? a->x : b->x;
+  uint16_t top = a->y < b->y ? a->y : b->y;
+  uint16_t right = a->x + a->w > b->x + b->w ? a->x + a->w : b->x + b->w;
+  uint16_t bottom = a->y + a->h > b->y + b->h ? a->y + a->h : b->y + b->h;
+  return (tft_rect){.x = left, .y = top, .w = right - left, .h = bottom - top};
+}
+
+static uint32_t rect_area(const tft_rect *rect) {
+  return (uint32_t)rect->w * rect->h;
+}
+
+// True if a and b overlap or touch, so their union costs no extra pixels
+// beyond the corners.
+static bool rect_touches(const tft_rect *a, const tft_rect *b) {
+  return a->x <= b->x + b->w && b->x <= a->x + a->w && a->y <= b->y + b->h &&
+         b->y <= a->y + a->h;
+}
+
+// Remove dirtyRects[idx], keeping the rest packed.
+static void dirty_remove(uint8_t idx) {
+  dirtyRects[idx] = dirtyRects[--dirtyCount];
+}
+
+// x, y: top left corner on the screen
+// w, h: size of the rectangle
+// Record that the rectangle changed and must be sent by the next
+// tft_flush_dirty. Touching rectangles are merged, and when more than
+// TFT_DIRTY_RECTS are pending the pair with the smallest union is merged.
+void tft_mark_dirty(uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+  tft_rect rect = {.x = x, .y = y, .w = w, .h = h};
+  if (!clip_rect(&rect)) {
+    return;
+  }
+  portENTER_CRITICAL(&dirtyLock);
+  // Absorb every pending rectangle the new one touches. Absorbing one can make
+  // the union touch an earlier one, so start over after every merge.
+  for (uint8_t i = 0; i < dirtyCount;) {
+    if (rect_touches(&rect, &dirtyRects[i])) {
+      rect = rect_union(&rect, &dirtyRects[i]);
+      dirty_remove(i);
+      i = 0;
     } else {
-      // Odd transfers are data
-      trans[x].length = 8 * 4;
-      trans[x].user = (void *)1;
+      i++;
     }
-    trans[x].flags = SPI_TRANS_USE_TXDATA;
   }
-  trans[0].tx_data[0] = 0x2A;                             // Column Address Set
-  trans[1].tx_data[0] = 0;                                // Start Col High
-  trans[1].tx_data[1] = 0;                                // Start Col Low
-  trans[1].tx_data[2] = (320 - 1) >> 8;                   // End Col High
-  trans[1].tx_data[3] = (320 - 1) & 0xff;                 // End Col Low
-  trans[2].tx_data[0] = 0x2B;                             // Page address set
-  trans[3].tx_data[0] = ypos >> 8;                        // Start page high
-  trans[3].tx_data[1] = ypos & 0xff;                      // start page low
-  trans[3].tx_data[2] = (ypos + PARALLEL_LINES - 1) >> 8; // end page high
-  trans[3].tx_data[3] = (ypos + PARALLEL_LINES - 1) & 0xff; // end page low
-  trans[4].tx_data[0] = 0x2C;                               // memory write
-  trans[5].tx_buffer = linedata;                  // finally send the line data
-  trans[5].length = 320 * 2 * 8 * PARALLEL_LINES; // Data length, in bits
-  trans[5].flags = 0; // undo SPI_TRANS_USE_TXDATA flag
-
-  // Queue all transactions.
-  for (x = 0; x < 6; x++) {
-    ret = spi_device_queue_trans(spi, &trans[x], portMAX_DELAY);
-    assert(ret == ESP_OK);
+  if (dirtyCount == TFT_DIRTY_RECTS) {
+    // Merge the new rectangle into the pending one that wastes the fewest
+    // pixels.
+    uint8_t best = 0;
+    uint32_t bestWaste = UINT32_MAX;
+    for (uint8_t i = 0; i < dirtyCount; i++) {
+      tft_rect merged = rect_union(&rect, &dirtyRects[i]);
+      uint32_t waste = rect_area(&merged) - rect_area(&dirtyRects[i]);
+      if (waste < bestWaste) {
+        best = i;
+        bestWaste = waste;
+      }
+    }
+    rect = rect_union(&rect, &dirtyRects[best]);
+    dirty_remove(best);
   }
-
-  // When we are here, the SPI driver is busy (in the background) getting the
-  // transactions sent. That happens mostly using DMA, so the CPU doesn't have
-  // much to do here. We're not going to wait for the transaction to finish
-  // because we may as well spend the time calculating the next line. When that
-  // is done, we can call send_line_finish, which will wait for the transfers to
-  // be done and check their status.
+  dirtyRects[dirtyCount++] = rect;
+  portEXIT_CRITICAL(&dirtyLock);
 }
 
-static void send_line_finish(spi_device_handle_t spi) {
-  spi_transaction_t *rtrans;
-  esp_err_t ret;
-  // Wait for all 6 transactions to be done and get back the results.
-  for (int x = 0; x < 6; x++) {
-    ret = spi_device_get_trans_result(spi, &rtrans, portMAX_DELAY);
-    assert(ret == ESP_OK);
-    // We could inspect rtrans now if we received any info back. The LCD is
-    // treated as write-only, though.
+// render: fills the pixels of a part of a dirty rectangle
+// ctx: passed to render
+// Send every rectangle marked by tft_mark_dirty since the last flush. render
+// draws straight into the band buffers, one slice of as many rows as fit at a
+// time, while the previous slice is clocked out.
+void tft_flush_dirty(tft_render_fn render, void *ctx) {
+  tft_rect rects[TFT_DIRTY_RECTS];
+  portENTER_CRITICAL(&dirtyLock);
+  uint8_t count = dirtyCount;
+  memcpy(rects, dirtyRects, count * sizeof(tft_rect));
+  dirtyCount = 0;
+  portEXIT_CRITICAL(&dirtyLock);
+  if (count == 0) {
+    return;
   }
+
+  xSemaphoreTake(tftMutex, portMAX_DELAY);
+  for (uint8_t i = 0; i < count; i++) {
+    uint16_t sliceRows = PIXELS_LENGTH / rects[i].w;
+    for (uint16_t row = 0; row < rects[i].h; row += sliceRows) {
+      tft_rect slice = {.x = rects[i].x,
+                        .y = rects[i].y + row,
+                        .w = rects[i].w,
+                        .h = rects[i].h - row < sliceRows ? rects[i].h - row
+                                                          : sliceRows};
+      uint16_t *pixels = band_acquire();
+      render(&slice, pixels, ctx);
+      band_submit_rect(&slice);
+    }
+  }
+  band_flush();
+  xSemaphoreGive(tftMutex);
 }
 
-spi_device_handle_t spi;
-void tft_init() {
-  ESP_LOGI(TAG_TFT, "TFT initializing.");
-  esp_err_t ret;
-  spi_bus_config_t buscfg = {.miso_io_num = PIN_TFT_MISO,
-                             .mosi_io_num = PIN_TFT_MOSI,
-                             .sclk_io_num = PIN_TFT_CLK,
-                             .quadwp_io_num = -1,
-                             .quadhd_io_num = -1,
-                             .max_transfer_sz = PARALLEL_LINES * 320 * 2 + 8};
-  spi_device_interface_config_t devcfg = {
-      .clock_speed_hz = 10 * 1000 * 1000, // Clock out at 10 MHz
-      .mode = 0,                          // SPI mode 0
-      .spics_io_num = PIN_TFT_CS,         // CS pin
-      .queue_size = 7, // We want to be able to queue 7 transactions at a time
-      .pre_cb = lcd_spi_pre_transfer_callback, // Specify pre-transfer callback
-                                               // to handle D/C line
-  };
-  // Initialize the SPI bus
-  ret = spi_bus_initialize(LCD_HOST, &buscfg, SPI_DMA_CH_AUTO);
-  ESP_ERROR_CHECK(ret);
-  // Attach the LCD to the SPI bus
-  ret = spi_bus_add_device(LCD_HOST, &devcfg, &spi);
-  ESP_ERROR_CHECK(ret);
-  // Initialize the LCD
-  lcd_init(spi);
-  ESP_LOGI(TAG_TFT, "TFT initialized.");
+// Shown in the status strip. Guarded by dirtyLock, like the rectangles
+// tft_status_set marks when it changes.
+static tft_status shownStatus = {0};
+
+#define STATUS_SEGMENT_WIDTH (LCD_WIDTH / TFT_STATUS_SEGMENTS)
+// Columns at the right of every segment left black to tell them apart.
+#define STATUS_SEGMENT_GAP 2
+
+// Convert 8 bit channels to a pixel in the format of PIXELS_LENGTH.
+static uint16_t pixel_rgb(uint8_t r, uint8_t g, uint8_t b) {
+  uint16_t rgb565 = (r >> 3) << 11 | (g >> 2) << 5 | b >> 3;
+  return (uint16_t)(rgb565 << 8 | rgb565 >> 8);
 }
 
-// part: 0-4 top to bottom quarter slices of the screen
-// pixels: 1 uint16 per pixel g2 g1 g0 b4 b3 b2 b1 b0 r4 r3 r2 r1 r0 g5 g4 g3,
-// must have DMA_ATTR
-void tft_send_image_part(uint8_t part, uint16_t pixels[PIXELS_LENGTH]) {
-  if (part < 4) {
-    send_lines(spi, part * PARALLEL_LINES, pixels);
-    send_line_finish(spi);
+// Draws the status strip as of now. The render task flushes every dirty
+// rectangle with it, as only the strip is ever marked.
+static void status_render(const tft_rect *rect, uint16_t *pixels, void *ctx) {
+  portENTER_CRITICAL(&dirtyLock);
+  tft_status status = shownStatus;
+  portEXIT_CRITICAL(&dirtyLock);
+  uint16_t grey = pixel_rgb(64, 64, 64);
+  uint16_t colors[TFT_STATUS_SEGMENTS] = {
+      status.estop ? pixel_rgb(255, 0, 0) : pixel_rgb(0, 192, 0),
+      status.drive ? pixel_rgb(0, 96, 255) : grey,
+      status.arm ? pixel_rgb(0, 96, 255) : grey,
+      status.overriden ? pixel_rgb(255, 160, 0) : grey,
+  };
+  // Every row of the strip is the same.
+  for (uint16_t col = 0; col < rect->w; col++) {
+    uint16_t x = rect->x + col;
+    uint16_t segment = x / STATUS_SEGMENT_WIDTH;
+    bool gap = segment >= TFT_STATUS_SEGMENTS ||
+               x % STATUS_SEGMENT_WIDTH >=
+                   STATUS_SEGMENT_WIDTH - STATUS_SEGMENT_GAP;
+    pixels[col] = gap ? 0 : colors[segment];
+  }
+  for (uint16_t row = 1; row < rect->h; row++) {
+    memcpy(pixels + row * rect->w, pixels, rect->w * sizeof(uint16_t));
   }
 }
 
-// idx: number of the iamge to draw
-// pixels: buffer to do calculations in, must have DMA_ATTR
-void tft_draw_image(uint8_t idx, uint16_t pixels[PIXELS_LENGTH]) {
-  size_t offset = IMAGE_BYTES * idx; // within logo data
-  uint16_t *colors = (uint16_t *)(FILE_IMAGES_START + offset);
-  offset += PALATTE_SIZE * sizeof(uint16_t);
-  for (uint8_t part = 0; part < 4; part++) {
-    size_t position = 0; // within pixels
-    while (position < PIXELS_LENGTH) {
-      pixels[position++] = colors[FILE_IMAGES_START[offset] & 0b00000011];
-      pixels[position++] =
-          colors[(FILE_IMAGES_START[offset] >> 2) & 0b00000011];
-      pixels[position++] =
-          colors[(FILE_IMAGES_START[offset] >> 4) & 0b00000011];
-      pixels[position++] =
-          colors[(FILE_IMAGES_START[offset] >> 6) & 0b00000011];
-      offset++;
+// Show status in the status strip. Only marks the segments that changed, for
+// the render task to redraw, so it never waits for the display.
+void tft_status_set(const tft_status *status) {
+  bool changed[TFT_STATUS_SEGMENTS];
+  portENTER_CRITICAL(&dirtyLock);
+  changed[0] = status->estop != shownStatus.estop;
+  changed[1] = status->drive != shownStatus.drive;
+  changed[2] = status->arm != shownStatus.arm;
+  changed[3] = status->overriden != shownStatus.overriden;
+  shownStatus = *status;
+  portEXIT_CRITICAL(&dirtyLock);
+  for (uint8_t segment = 0; segment < TFT_STATUS_SEGMENTS; segment++) {
+    if (changed[segment]) {
+      tft_mark_dirty(segment * STATUS_SEGMENT_WIDTH, 0, STATUS_SEGMENT_WIDTH,
+                     TFT_STATUS_HEIGHT);
     }
-    tft_send_image_part(part, pixels);
   }
 }
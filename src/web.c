@@ -1,21 +1,31 @@
 #include "web.h"
 
+#include "assets.h"
+#include "control.h"
+#include "hal.h"
 #include "hardware.h"
+#include "image.h"
 #include "kinematics.h"
+#include "mixer.h"
+#include "protocol.h"
 #include "tft.h"
 #include <esp_check.h>
 #include <esp_err.h>
 #include <esp_http_server.h>
 #include <esp_log.h>
-#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
 #include <socket.h>
+#include <stdatomic.h>
 #include <string.h>
+#include <unistd.h>
 
 typedef struct web_state
 {
   bool off;
   int16_t left;
   int16_t right;
+  uint16_t drive_seq;
   uint16_t x;
   uint16_t j2;
   uint16_t j3;
@@ -26,12 +36,17 @@ typedef struct web_state
   int32_t override_fd;
   int64_t overriden_until;
   uint16_t drive_speed;
+  bool ik_reachable;
+  bool jogging;
+  int16_t jog[3];
+  int64_t jog_until;
 } web_state;
 
 static web_state webState = {
     .off = false,
     .left = 0,
     .right = 0,
+    .drive_seq = 0,
     .x = 0,
     .j2 = 0,
     .j3 = 0,
@@ -42,50 +57,240 @@ static web_state webState = {
     .override_fd = 0,
     .overriden_until = 0,
     .drive_speed = UINT16_MAX,
+    .ik_reachable = true,
+    .jogging = false,
+    .jog = {0, 0, 0},
+    .jog_until = 0,
 };
 
-DMA_ATTR uint16_t pixels[PIXELS_LENGTH];
-static esp_err_t display_handler(httpd_req_t *req)
+// State of every open connection, indexed by fd - LWIP_SOCKET_OFFSET. Filled
+// in by session_open and cleared by session_close. Only used on the httpd
+// task.
+typedef struct session
 {
-  ESP_LOGI(TAG_WEB, "/upload %i", req->content_len);
-  if (req->content_len > LCD_WIDTH * LCD_HEIGHT * 2)
-    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "File too large.");
+  uint32_t id;           // Unique for every connection, 0 if closed
+  bool websocket;        // Whether the connection is a WebSocket
+  int64_t lastCommandUs; // Time the last command was received
+  uint16_t rate;         // Telemetry frames per second, 0 for none
+  int64_t nextSendUs;    // Time the next telemetry frame is due
+  bool fdSent;           // Whether the client has been sent its fd
+  bool seqValid;         // Whether a header has been received
+  uint16_t lastSeq;      // Sequence number of the last header
+  // Smallest difference between the receive and client time of a header in
+  // the current and previous COMMAND_OFFSET_WINDOW_US
+  int32_t offsetMinMs[2];
+  int64_t offsetWindowUs; // Start of the current window
+  telemetry_echo echo;    // Echo of the last header
+  bool echoPending;       // Whether echo is yet to be sent
+} session;
+
+static session sessions[CONFIG_LWIP_MAX_SOCKETS] = {0};
+static uint32_t lastSessionId = 0;
+
+// Return the session of fd, or NULL if fd is not a socket.
+static session *session_get(int fd)
+{
+  unsigned index = fd - LWIP_SOCKET_OFFSET;
+  return index < CONFIG_LWIP_MAX_SOCKETS ? &sessions[index] : NULL;
+}
 
+// Receive exactly length bytes of the request body into buffer, retrying on
+// timeouts. Returns the number of bytes received, or -1 if the connection
+// failed.
+static int receive_fully(httpd_req_t *req, char *buffer, size_t length)
+{
+  size_t offset = 0;
+  while (offset < length)
+  {
+    int receivedBytes = httpd_req_recv(req, buffer + offset, length - offset);
+    if (receivedBytes <= 0)
+    {
+      if (receivedBytes == HTTPD_SOCK_ERR_TIMEOUT)
+        continue; // Retry read
+      return -1;
+    }
+    offset += receivedBytes;
+  }
+  return offset;
+}
+
+// Draw a body of up to LCD_WIDTH * LCD_HEIGHT RGB565 pixels in the format of
+// PIXELS_LENGTH in tft.h, top to bottom. Missing pixels at the end are black.
+// prefix: the first prefixBytes of the body, already received
+// Every band is received straight into a band buffer of the display while the
+// previous band is clocked out.
+static esp_err_t display_raw(httpd_req_t *req, const uint8_t *prefix,
+                             size_t prefixBytes)
+{
   size_t remainingBytes = req->content_len;
-  int receivedBytes;
-  uint8_t part = 0;
-  while (remainingBytes > 0)
-  {
-    size_t bytesInPart = PIXELS_BYTES - (remainingBytes % PIXELS_BYTES);
-    size_t pixelOffset = 0;
-    ESP_LOGI(TAG_WEB, "Remaining bytes: %zu, bytes in part: %zu",
-             remainingBytes, bytesInPart);
-    while (pixelOffset < bytesInPart)
+  tft_stream_begin();
+  for (uint8_t part = 0; part < BAND_COUNT; part++)
+  {
+    char *pixels = (char *)tft_stream_band();
+    size_t bytesInPart =
+        remainingBytes < PIXELS_BYTES ? remainingBytes : PIXELS_BYTES;
+    size_t receivedBytes = 0;
+    if (part == 0)
+    {
+      memcpy(pixels, prefix, prefixBytes);
+      receivedBytes = prefixBytes;
+    }
+    ESP_LOGD(TAG_WEB, "Remaining bytes: %zu, receiving part %u",
+             remainingBytes, part);
+    if (receive_fully(req, pixels + receivedBytes,
+                      bytesInPart - receivedBytes) < 0)
     {
-      ESP_LOGI(TAG_WEB,
-               "Remaining bytes: %zu, reading %zu bytes into pixels + %zu",
-               remainingBytes, bytesInPart - pixelOffset, pixelOffset);
-      receivedBytes = httpd_req_recv(req, (char *)&pixels + pixelOffset,
-                                     bytesInPart - pixelOffset);
-      if (receivedBytes <= 0)
+      tft_stream_end();
+      httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR,
+                          "Failed to receive file.");
+      return ESP_FAIL;
+    }
+    memset(pixels + bytesInPart, 0, PIXELS_BYTES - bytesInPart);
+    remainingBytes -= bytesInPart;
+    tft_stream_submit(part);
+  }
+  tft_stream_end();
+  return ESP_OK;
+}
+
+// Palette and expansion table of the last compact upload. Only used by
+// display_compact, which runs on the httpd task.
+static uint16_t uploadPalette[IMAGE_MAX_COLORS];
+static image_lut uploadLut;
+static uint8_t uploadBuffer[UPLOAD_BUFFER_SIZE];
+
+// Draw the rest of a body in the image_upload_header format described in
+// image.h. The palette indices are received UPLOAD_BUFFER_SIZE bytes at a time
+// and expanded straight into the band buffers while the previous band is
+// clocked out. Missing pixels at the end are black.
+static esp_err_t display_compact(httpd_req_t *req,
+                                 const image_upload_header *header)
+{
+  size_t paletteBytes = header->colors * sizeof(uint16_t);
+  if (header->encoding > IMAGE_ENCODING_RLE || header->colors == 0 ||
+      header->colors > IMAGE_MAX_COLORS ||
+      sizeof(image_upload_header) + paletteBytes > req->content_len)
+  {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid image header.");
+    return ESP_FAIL;
+  }
+  if (receive_fully(req, (char *)uploadPalette, paletteBytes) < 0)
+  {
+    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR,
+                        "Failed to receive file.");
+    return ESP_FAIL;
+  }
+  if (!image_lut_build(&uploadLut, uploadPalette, header->colors, header->bpp))
+  {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Invalid image header.");
+    return ESP_FAIL;
+  }
+
+  size_t remainingBytes =
+      req->content_len - sizeof(image_upload_header) - paletteBytes;
+  const uint8_t *in = uploadBuffer;
+  const uint8_t *inEnd = uploadBuffer;
+  image_rle_state rle;
+  image_rle_begin(&rle);
+  size_t bandBytes = PIXELS_LENGTH / uploadLut.pixelsPerByte;
+  tft_stream_begin();
+  for (uint8_t part = 0; part < BAND_COUNT; part++)
+  {
+    uint16_t *pixels = tft_stream_band();
+    size_t decodedBytes = 0;
+    while (decodedBytes < bandBytes)
+    {
+      if (in == inEnd)
+      {
+        if (remainingBytes == 0)
+        {
+          // Truncated, fill the rest of the screen with black.
+          memset(pixels + decodedBytes * uploadLut.pixelsPerByte, 0,
+                 (bandBytes - decodedBytes) * uploadLut.pixelsPerByte *
+                     sizeof(uint16_t));
+          break;
+        }
+        size_t chunkBytes = remainingBytes < UPLOAD_BUFFER_SIZE
+                                ? remainingBytes
+                                : UPLOAD_BUFFER_SIZE;
+        if (receive_fully(req, (char *)uploadBuffer, chunkBytes) < 0)
+        {
+          tft_stream_end();
+          httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR,
+                              "Failed to receive file.");
+          return ESP_FAIL;
+        }
+        remainingBytes -= chunkBytes;
+        in = uploadBuffer;
+        inEnd = uploadBuffer + chunkBytes;
+      }
+      uint16_t *out = pixels + decodedBytes * uploadLut.pixelsPerByte;
+      if (header->encoding == IMAGE_ENCODING_RAW)
       {
-        if (receivedBytes == HTTPD_SOCK_ERR_TIMEOUT)
-          continue; // Retry read
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR,
-                            "Failed to receive file.");
-        return ESP_FAIL;
+        size_t count = bandBytes - decodedBytes;
+        if (count > (size_t)(inEnd - in))
+          count = inEnd - in;
+        image_unpack(&uploadLut, in, out, count);
+        in += count;
+        decodedBytes += count;
+      }
+      else
+      {
+        decodedBytes += image_rle_decode(&rle, &uploadLut, &in, inEnd, out,
+                                         bandBytes - decodedBytes);
       }
-      pixelOffset += receivedBytes;
-      remainingBytes -= receivedBytes;
     }
-    ESP_LOGI(TAG_WEB, "Sending part %i", part);
-    tft_send_image_part(part, pixels);
-    part++;
+    tft_stream_submit(part);
   }
-
+  tft_stream_end();
   return ESP_OK;
 }
 
+// Body: either raw pixels as described by display_raw, or a compact paletted
+// image as described by display_compact, told apart by IMAGE_UPLOAD_MAGIC.
+// The response reports throughput and the time from the request to the last
+// band being drawn.
+static esp_err_t display_handler(httpd_req_t *req)
+{
+  int64_t start = hal_time_us();
+  ESP_LOGI(TAG_WEB, "/display %zu", req->content_len);
+  if (req->content_len > LCD_WIDTH * LCD_HEIGHT * 2)
+  {
+    httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "File too large.");
+    return ESP_FAIL;
+  }
+
+  image_upload_header header;
+  size_t headerBytes = req->content_len < sizeof(header) ? req->content_len
+                                                         : sizeof(header);
+  if (receive_fully(req, (char *)&header, headerBytes) < 0)
+  {
+    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR,
+                        "Failed to receive file.");
+    return ESP_FAIL;
+  }
+  esp_err_t ret;
+  if (headerBytes == sizeof(header) &&
+      memcmp(header.magic, IMAGE_UPLOAD_MAGIC, sizeof(header.magic)) == 0)
+    ret = display_compact(req, &header);
+  else
+    ret = display_raw(req, (const uint8_t *)&header, headerBytes);
+  if (ret != ESP_OK)
+    return ret;
+
+  int64_t elapsed = hal_time_us() - start;
+  char response[96];
+  snprintf(response, sizeof(response),
+           "%zu bytes in %lld us, %lld KB/s", req->content_len,
+           (long long)elapsed,
+           elapsed > 0 ? (long long)(req->content_len * 1000000LL / 1024 /
+                                     elapsed)
+                       : 0LL);
+  ESP_LOGI(TAG_WEB, "/display %s", response);
+  httpd_resp_set_type(req, "text/plain");
+  return httpd_resp_sendstr(req, response);
+}
+
 httpd_uri_t displayConfig = {
     .uri = "/display",
     .method = HTTP_POST,
@@ -93,54 +298,153 @@ httpd_uri_t displayConfig = {
     .user_ctx = NULL,
 };
 
-static esp_err_t root_handler(httpd_req_t *req)
+// Report the control task timing statistics, e-stop trips and stop latency,
+// and open WebSockets as JSON.
+static esp_err_t stats_handler(httpd_req_t *req)
 {
-  ESP_LOGI(TAG_WEB, "Request %s", req->uri);
-
-  const char *fileStart = NULL;
-  const char *fileEnd = NULL;
-  if (strcmp(req->uri, "/") == 0 || strcmp(req->uri, "/index.html") == 0)
-  {
-    fileStart = FILE_HTML_START;
-    fileEnd = FILE_HTML_END;
-    httpd_resp_set_type(req, "text/html");
-  }
-  else if (strcmp(req->uri, "/B612Mono.woff2") == 0)
-  {
-    fileStart = FILE_FONT_START;
-    fileEnd = FILE_FONT_END;
-    httpd_resp_set_type(req, "font/woff2");
-  }
-  else if (strcmp(req->uri, "/images.js") == 0)
+  control_stats stats;
+  control_stats_get(&stats);
+  estop_stats estop;
+  estop_stats_get(&estop);
+
+  char body[1536];
+  int length = snprintf(
+      body, sizeof(body),
+      "{\"control\":{\"rate_hz\":%d,\"ticks\":%lu,\"overruns\":%lu,"
+      "\"worst_overrun_us\":%lld,\"worst_tick_us\":%lld,"
+      "\"worst_jitter_us\":%lld,\"jitter_bucket_us\":%d,\"jitter\":[",
+      CONTROL_RATE_HZ, (unsigned long)stats.ticks,
+      (unsigned long)stats.overruns, (long long)stats.worstOverrunUs,
+      (long long)stats.worstTickUs, (long long)stats.worstJitterUs,
+      CONTROL_JITTER_BUCKET_US);
+  for (int i = 0; i < CONTROL_JITTER_BUCKETS; i++)
+    length += snprintf(body + length, sizeof(body) - length, "%s%lu",
+                       i == 0 ? "" : ",", (unsigned long)stats.jitter[i]);
+  length += snprintf(
+      body + length, sizeof(body) - length,
+      "]},\"estop\":{\"pressed\":%s,\"trips\":%lu,\"last_trip_ms\":%lld,"
+      "\"latency_us\":%lld,\"worst_latency_us\":%lld,"
+      "\"worst_control_us\":%lld},\"sessions\":[",
+      estop_get() ? "true" : "false", (unsigned long)estop.trips,
+      (long long)estop.lastTripUs / 1000, (long long)estop.lastLatencyUs,
+      (long long)estop.worstLatencyUs, (long long)estop.worstControlUs);
+
+  int64_t now = hal_time_us();
+  bool first = true;
+  for (int i = 0; i < CONFIG_LWIP_MAX_SOCKETS; i++)
   {
-    fileStart = FILE_IMAGE_JS_START;
-    fileEnd = FILE_IMAGE_JS_END;
-    httpd_resp_set_type(req, "text/javascript");
+    const session *client = &sessions[i];
+    if (client->id == 0 || !client->websocket)
+      continue;
+    length += snprintf(
+        body + length, sizeof(body) - length,
+        "%s{\"id\":%lu,\"fd\":%d,\"rate\":%u,\"idle_ms\":%lld,"
+        "\"dropped\":%u}",
+        first ? "" : ",", (unsigned long)client->id, i + LWIP_SOCKET_OFFSET,
+        client->rate,
+        client->lastCommandUs ? (long long)(now - client->lastCommandUs) / 1000
+                              : -1LL,
+        client->echo.dropped);
+    first = false;
   }
-  else if (strcmp(req->uri, "/main.js") == 0)
-  {
-    fileStart = FILE_JS_START;
-    fileEnd = FILE_JS_END;
-    httpd_resp_set_type(req, "text/javascript");
-  }
-  else if (strcmp(req->uri, "/style.css") == 0)
+  length += snprintf(body + length, sizeof(body) - length, "]}");
+
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  return httpd_resp_send(req, body, length);
+}
+
+static const httpd_uri_t statsConfig = {
+    .uri = "/stats",
+    .method = HTTP_GET,
+    .handler = stats_handler,
+    .user_ctx = NULL,
+};
+
+// FNV-1a of uri, seeded so every asset path hashes to its own slot. Must match
+// fnv1a in generateAssets.py.
+static uint32_t asset_hash(const char *uri, uint32_t seed)
+{
+  uint32_t hash = 2166136261 ^ seed;
+  for (const char *c = uri; *c != '\0'; c++)
+    hash = (hash ^ (uint8_t)*c) * 16777619;
+  return hash;
+}
+
+// Return the asset served for uri, or NULL if there is none.
+static const asset *asset_find(const char *uri)
+{
+  const asset_slot *slot =
+      &assetSlots[asset_hash(uri, assetHashSeed) & assetSlotMask];
+  if (slot->path == NULL || strcmp(slot->path, uri) != 0)
+    return NULL;
+  return &assets[slot->asset];
+}
+
+// Send length bytes straight from their flash mapping. Anything larger than
+// SEND_CHUNK_SIZE is sent with chunked encoding, one chunk at a time, so the
+// httpd task never has more than a chunk queued in lwIP. The time to send every
+// chunk is logged at debug level and the slowest one at info level.
+static esp_err_t send_asset(httpd_req_t *req, const char *start, size_t length)
+{
+  if (length <= SEND_CHUNK_SIZE)
+    return httpd_resp_send(req, start, length);
+
+  int64_t slowestUs = 0;
+  size_t chunks = 0;
+  for (size_t offset = 0; offset < length; offset += SEND_CHUNK_SIZE)
   {
-    fileStart = FILE_CSS_START;
-    fileEnd = FILE_CSS_END;
-    httpd_resp_set_type(req, "text/css");
+    size_t chunkBytes = length - offset < SEND_CHUNK_SIZE ? length - offset
+                                                          : SEND_CHUNK_SIZE;
+    int64_t chunkStart = hal_time_us();
+    if (httpd_resp_send_chunk(req, start + offset, chunkBytes) != ESP_OK)
+      return ESP_FAIL;
+    int64_t chunkUs = hal_time_us() - chunkStart;
+    ESP_LOGD(TAG_WEB, "Chunk %zu: %zu bytes in %lld us", chunks, chunkBytes,
+             (long long)chunkUs);
+    if (chunkUs > slowestUs)
+      slowestUs = chunkUs;
+    chunks++;
   }
-  else
+  ESP_LOGI(TAG_WEB, "Sent %zu chunks, slowest %lld us", chunks,
+           (long long)slowestUs);
+  return httpd_resp_send_chunk(req, NULL, 0);
+}
+
+// Serve a file from the data folder as packed by generateAssets.py. Every
+// asset is sent with an ETag, and a request whose If-None-Match matches it
+// gets an empty 304.
+static esp_err_t root_handler(httpd_req_t *req)
+{
+  ESP_LOGI(TAG_WEB, "Request %s", req->uri);
+
+  const asset *file = asset_find(req->uri);
+  if (file == NULL)
   {
     ESP_LOGE(TAG_WEB, "Failed to find %s", req->uri);
     httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "File does not exist");
     return ESP_FAIL;
   }
 
-  if (httpd_resp_send(req, fileStart, fileEnd - fileStart) != ESP_OK)
+  httpd_resp_set_type(req, file->type);
+  httpd_resp_set_hdr(req, "Cache-Control", ASSET_CACHE_CONTROL);
+  httpd_resp_set_hdr(req, "ETag", file->etag);
+  char ifNoneMatch[16];
+  if (httpd_req_get_hdr_value_str(req, "If-None-Match", ifNoneMatch,
+                                  sizeof(ifNoneMatch)) == ESP_OK &&
+      strcmp(ifNoneMatch, file->etag) == 0)
+  {
+    ESP_LOGI(TAG_WEB, "Not modified");
+    httpd_resp_set_status(req, "304 Not Modified");
+    return httpd_resp_send(req, NULL, 0);
+  }
+  if (file->encoding != NULL)
+    httpd_resp_set_hdr(req, "Content-Encoding", file->encoding);
+
+  if (send_asset(req, file->start, file->end - file->start) != ESP_OK)
   {
+    // Headers may already be sent, so just drop the connection.
     ESP_LOGE(TAG_WEB, "File sending failed!");
-    httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR,
-                        "Failed to send file");
     return ESP_FAIL;
   }
   ESP_LOGI(TAG_WEB, "File sending complete");
@@ -201,162 +505,279 @@ static bool handle_priority(int32_t fd, int32_t *priorityFD,
   return true;
 }
 
-// id: union
-// 0: off
-// 1: on
-// 2: drive [i16 left, i16 right]
-// 3: arm target angles [u16 x, u16 j1, u16 j2, u16 j3]
-// 4: arm IK [u16 x, u16 y, u16 z]
-// 5: display image [u8 idx]
-// 6: drive speed [u16 speed]
-typedef struct __attribute__((__packed__)) command
+// Telemetry frames waiting for or being sent by send_telemetry. The main loop
+// only fills a frame that is not queued, so a frame is never rewritten while
+// it is being sent.
+typedef struct telemetry_frame
 {
-  uint8_t id;    // 0
-  bool override; // 1
-  union
-  {
-    struct __attribute__((__packed__))
-    {
-      int16_t left;  // 2
-      int16_t right; // 4
-    } drive;
-    struct __attribute__((__packed__))
-    {
-      uint16_t x;  // 2
-      uint16_t j2; // 4
-      uint16_t j3; // 6
-    } arm_angles;
-    struct __attribute__((__packed__))
-    {
-      uint16_t x; // 2
-      uint16_t y; // 4
-      uint16_t z; // 6
-    } arm_ik;
-    struct __attribute__((__packed__))
-    {
-      uint8_t idx; // 2
-    } display;
-    struct __attribute__((__packed__))
-    {
-      uint16_t speed; // 2
-    } drive_speed;
-  };
-} command; // 8 bytes
-
-typedef struct __attribute__((__packed__)) telemetry
+  telemetry data;
+  atomic_bool queued;
+} telemetry_frame;
+
+// Check a command header from client received at now. Returns false if the
+// rest of its batch is out of order or stale and must be dropped.
+// The difference between the receive time and the client time of a header is
+// the offset between the clocks plus the delay of the frame. Its minimum over
+// recent headers is taken as the offset, so the excess is how much longer than
+// the fastest recent frame this one took.
+static bool check_header(session *client, uint16_t seq, uint32_t clientMs,
+                         int64_t now)
 {
-  int32_t fd;                // 0
-  int32_t drive_priority_fd; // 4
-  int32_t arm_priority_fd;   // 8
-  int32_t override_fd;       // 12
-  float esc_current;         // 16
-  float cell1;               // 20
-  float cell2;               // 24
-  float cell3;               // 28
-  int16_t l;                 // 32
-  int16_t r;                 // 34
-  uint16_t ax;               // 36
-  uint16_t j2;               // 38
-  uint16_t j3;               // 40
-  int16_t x;                 // 42
-  int16_t y;                 // 44
-  int16_t z;                 // 46
-  uint16_t drive_speed;      // 48
-} telemetry;                 // 50 bytes
-
-static esp_err_t websocket_handler(httpd_req_t *req)
-{
-  httpd_ws_frame_t pkt = {0};
-  command rxData = {0};
-  esp_err_t ret;
-
-  int32_t fd = httpd_req_to_sockfd(req);
-  char tag[20];
-  snprintf(tag, sizeof(tag), "%s fd%ld", TAG_WEB, fd);
-
-  if (req->method == HTTP_GET)
+  if (client == NULL)
+    return true;
+  if (client->seqValid && (int16_t)(seq - client->lastSeq) <= 0)
   {
-    ESP_LOGI(tag, "Handshake done, the new connection was opened");
-    return ESP_OK;
+    client->echo.dropped++;
+    return false;
   }
 
-  pkt.payload = (uint8_t *)&rxData;
-  ret = httpd_ws_recv_frame(req, &pkt, 0);
-  if (ret != ESP_OK)
+  uint32_t nowMs = now / 1000;
+  int32_t offsetMs = (int32_t)(nowMs - clientMs);
+  if (!client->seqValid ||
+      now - client->offsetWindowUs > COMMAND_OFFSET_WINDOW_US)
   {
-    ESP_LOGE(tag, "httpd_ws_recv_frame failed with %d", ret);
-    return ret;
+    client->offsetMinMs[1] =
+        client->seqValid ? client->offsetMinMs[0] : offsetMs;
+    client->offsetMinMs[0] = offsetMs;
+    client->offsetWindowUs = now;
   }
-  ret = httpd_ws_recv_frame(req, &pkt, sizeof(command));
-  if (ret != ESP_OK)
+  if (offsetMs < client->offsetMinMs[0])
+    client->offsetMinMs[0] = offsetMs;
+  int32_t minOffsetMs = client->offsetMinMs[0] < client->offsetMinMs[1]
+                            ? client->offsetMinMs[0]
+                            : client->offsetMinMs[1];
+
+  client->seqValid = true;
+  client->lastSeq = seq;
+  client->echo.seq = seq;
+  client->echo.client_ms = clientMs;
+  client->echo.received_ms = nowMs;
+  client->echoPending = true;
+
+  if (offsetMs - minOffsetMs > COMMAND_MAX_AGE_MS)
   {
-    ESP_LOGE(tag, "httpd_ws_recv_frame failed with %d", ret);
-    return ret;
+    client->echo.dropped++;
+    return false;
   }
+  return true;
+}
 
-  // rx_data[0]: name [rx_data[1...], ...]
-  // 0: off
-  // 1: on
-  // 2: drive [bool override, i16 left, i16 right]
-  // 3: arm angles [u16 x, u16 j1, u16 j2, u16 j3]
-  // 4: arm IK [u16 x, u16 y, u16 z]
-  int64_t now = esp_timer_get_time();
-  bool accept_based_on_override =
-      handle_override(fd, rxData.override, &webState.override_fd,
-                      &webState.overriden_until, now);
+// State of the frame being decoded by websocket_handler.
+typedef struct command_frame
+{
+  int32_t fd;
+  session *client;
+  int64_t now;
+  const char *tag;
+  bool overrideChecked;
+  // Whether fd may command while override is active, the same for every
+  // command of a frame.
+  bool accept_based_on_override;
+} command_frame;
+
+// Apply one command of a frame. Returns false if the rest of the frame must be
+// dropped. Called by protocol_decode.
+static bool apply_command(const command *rxData, void *ctx)
+{
+  command_frame *frame = ctx;
+  int32_t fd = frame->fd;
+  session *client = frame->client;
+  int64_t now = frame->now;
+  if (!frame->overrideChecked)
+  {
+    frame->accept_based_on_override =
+        handle_override(fd, rxData->override, &webState.override_fd,
+                        &webState.overriden_until, now);
+    frame->overrideChecked = true;
+  }
+  bool accept_based_on_override = frame->accept_based_on_override;
 
-  switch (rxData.id)
+  switch (rxData->id)
   {
-  case 0:
+  case COMMAND_OFF:
     if (accept_based_on_override)
       webState.off = true;
     break;
-  case 1:
+  case COMMAND_ON:
     if (accept_based_on_override)
       webState.off = false;
     break;
-  case 2:
+  case COMMAND_DRIVE:
+    // Update priority only if override inactive.
+    if (accept_based_on_override &&
+        (rxData->override ||
+         handle_priority(fd, &webState.drive_priority_fd,
+                         &webState.drive_priority_until, now)))
+    {
+      webState.left = rxData->drive.left;
+      webState.right = rxData->drive.right;
+      webState.drive_seq++;
+    }
+    break;
+  case COMMAND_DRIVE_AXES:
     // Update priority only if override inactive.
     if (accept_based_on_override &&
-        (rxData.override ||
+        (rxData->override ||
          handle_priority(fd, &webState.drive_priority_fd,
                          &webState.drive_priority_until, now)))
     {
-      webState.left = rxData.drive.left;
-      webState.right = rxData.drive.right;
+      int16_t sides[DRIVE_SIDES];
+      mixer_sides(rxData->drive_axes.x, rxData->drive_axes.y,
+                  webState.drive_speed, sides);
+      webState.left = sides[DRIVE_LEFT];
+      webState.right = sides[DRIVE_RIGHT];
+      webState.drive_seq++;
     }
     break;
-  case 3:
+  case COMMAND_ARM_ANGLES:
     // Update priority only if override inactive.
     if (accept_based_on_override &&
-        (rxData.override ||
+        (rxData->override ||
          handle_priority(fd, &webState.arm_priority_fd,
                          &webState.arm_priority_until, now)))
     {
-      webState.x = rxData.arm_angles.x;
-      webState.j2 = rxData.arm_angles.j3;
-      webState.j3 = rxData.arm_angles.j3;
+      webState.x = rxData->arm_angles.x;
+      webState.j2 = rxData->arm_angles.j2;
+      webState.j3 = rxData->arm_angles.j3;
+      webState.ik_reachable = true;
+      webState.jogging = false;
     }
     break;
-  case 4:
+  case COMMAND_ARM_IK:
     // Update priority only if override inactive.
     if (accept_based_on_override &&
-        (rxData.override ||
+        (rxData->override ||
          handle_priority(fd, &webState.arm_priority_fd,
                          &webState.arm_priority_until, now)))
     {
-      ik_calculate_angles(rxData.arm_ik.x, rxData.arm_ik.y, rxData.arm_ik.z,
-                          &webState.x, &webState.j2, &webState.j3);
+      webState.ik_reachable = ik_calculate_angles(
+          rxData->arm_ik.x, rxData->arm_ik.y, rxData->arm_ik.z, &webState.x,
+          &webState.j2, &webState.j3);
+      webState.jogging = false;
     }
     break;
-  case 5:
+  case COMMAND_ARM_JOG:
+    // Update priority only if override inactive.
+    if (accept_based_on_override &&
+        (rxData->override ||
+         handle_priority(fd, &webState.arm_priority_fd,
+                         &webState.arm_priority_until, now)))
+    {
+      webState.jogging = true;
+      webState.jog[0] = rxData->arm_jog.x;
+      webState.jog[1] = rxData->arm_jog.y;
+      webState.jog[2] = rxData->arm_jog.z;
+      webState.jog_until = now + JOG_TIMEOUT;
+    }
+    break;
+  case COMMAND_DISPLAY:
     if (accept_based_on_override)
-      tft_draw_image(rxData.display.idx, pixels);
+      tft_request_image(rxData->display.idx);
+    break;
+  case COMMAND_DRIVE_SPEED:
+    webState.drive_speed = rxData->drive_speed.speed;
+    break;
+  case COMMAND_TELEMETRY_RATE:
+    if (client != NULL)
+    {
+      client->rate = rxData->telemetry_rate.rate < TELEMETRY_MAX_RATE
+                         ? rxData->telemetry_rate.rate
+                         : TELEMETRY_MAX_RATE;
+      client->nextSendUs = now;
+      ESP_LOGI(frame->tag, "Telemetry rate %u Hz", client->rate);
+    }
+    break;
+  case COMMAND_HEADER:
+    return check_header(client, rxData->header.seq, rxData->header.client_ms,
+                        now);
+  }
+  return true;
+}
+
+// Pass the drive and arm outputs in webState on to the control task. The drive
+// only takes left and right again when drive_seq changed.
+static void setpoint_send(void)
+{
+  control_setpoint setpoint = {
+      .left = webState.left,
+      .right = webState.right,
+      .driveSeq = webState.drive_seq,
+      .x = webState.x,
+      .j2 = webState.j2,
+      .j3 = webState.j3,
+      .jogging = webState.jogging,
+      .jog = {webState.jog[0], webState.jog[1], webState.jog[2]},
+      .jogUntilUs = webState.jog_until,
+  };
+  control_set(&setpoint);
+}
+
+static esp_err_t websocket_handler(httpd_req_t *req)
+{
+  httpd_ws_frame_t pkt = {0};
+  esp_err_t ret;
+
+  int32_t fd = httpd_req_to_sockfd(req);
+  char tag[20];
+  snprintf(tag, sizeof(tag), "%s fd%d", TAG_WEB, (int)fd);
+
+  if (req->method == HTTP_GET)
+  {
+    ESP_LOGI(tag, "Handshake done, the new connection was opened");
+    session *client = session_get(fd);
+    if (client != NULL)
+    {
+      client->websocket = true;
+      client->rate = TELEMETRY_DEFAULT_RATE;
+      client->nextSendUs = hal_time_us();
+    }
+    return ESP_OK;
+  }
+
+  uint8_t frame[COMMAND_FRAME_MAX];
+  pkt.payload = frame;
+  ret = httpd_ws_recv_frame(req, &pkt, 0);
+  if (ret != ESP_OK)
+  {
+    ESP_LOGE(tag, "httpd_ws_recv_frame failed with %d", ret);
+    return ret;
+  }
+  if (pkt.len > sizeof(frame))
+  {
+    ESP_LOGE(tag, "Invalid frame length %zu", pkt.len);
+    return ESP_ERR_INVALID_SIZE;
+  }
+  ret = httpd_ws_recv_frame(req, &pkt, pkt.len);
+  if (ret != ESP_OK)
+  {
+    ESP_LOGE(tag, "httpd_ws_recv_frame failed with %d", ret);
+    return ret;
+  }
+
+  int64_t now = hal_time_us();
+  session *client = session_get(fd);
+  if (client != NULL)
+    client->lastCommandUs = now;
+  command_frame decoded = {
+      .fd = fd,
+      .client = client,
+      .now = now,
+      .tag = tag,
+  };
+  switch (protocol_decode(frame, pkt.len, apply_command, &decoded))
+  {
+  case PROTOCOL_OK:
+    break;
+  case PROTOCOL_DROPPED:
+    ESP_LOGW(tag, "Dropped stale or out of order batch");
     break;
-  case 6:
-    webState.drive_speed = rxData.drive_speed.speed;
+  case PROTOCOL_INVALID:
+    ESP_LOGE(tag, "Invalid frame of %zu bytes", pkt.len);
+    return ESP_ERR_INVALID_SIZE;
   }
 
+  setpoint_send();
+
   return ESP_OK;
 }
 
@@ -368,40 +789,136 @@ static const httpd_uri_t websocketConfig = {
     .is_websocket = true,
 };
 
-static telemetry txData = {0};
-void send_telemetry(httpd_handle_t server)
+static httpd_handle_t server = NULL;
+static telemetry_frame telemetryFrames[TELEMETRY_FRAMES];
+
+static int16_t saturate_int16(int32_t value)
+{
+  return value < INT16_MIN ? INT16_MIN : value > INT16_MAX ? INT16_MAX : value;
+}
+
+// Send frame to every WebSocket client that is due one at its own rate.
+// Runs on the httpd task through httpd_queue_work.
+static void send_telemetry(void *arg)
 {
+  telemetry_frame *frame = arg;
   httpd_ws_frame_t pkt = {
-      .final = false,
+      .final = true,
       .fragmented = false,
       .type = HTTPD_WS_TYPE_BINARY,
-      .payload = (uint8_t *)&txData,
+      .payload = (uint8_t *)&frame->data,
       .len = sizeof(telemetry),
   };
 
-  int fds[CONFIG_LWIP_MAX_LISTENING_TCP] = {0};
-  size_t fdCount;
-  char tag[20];
-  if (httpd_get_client_list(server, &fdCount, fds) == ESP_OK)
+  int64_t now = hal_time_us();
+  for (int i = 0; i < CONFIG_LWIP_MAX_SOCKETS; i++)
   {
-    for (size_t i = 0; i < fdCount; i++)
+    session *client = &sessions[i];
+    if (client->id == 0 || !client->websocket || client->rate == 0 ||
+        now < client->nextSendUs)
+      continue;
+
+    int32_t fd = i + LWIP_SOCKET_OFFSET;
+    if (!client->fdSent)
     {
-      if (httpd_ws_get_fd_info(server, fds[i]) == HTTPD_WS_CLIENT_WEBSOCKET)
-      {
-        snprintf(tag, sizeof(tag), "%s fd%d", TAG_WEB, fds[i]);
-        txData.fd = fds[i];
-        httpd_ws_send_frame_async(server, fds[i], &pkt);
-      }
+      telemetry_fd fdData = {.fd = fd};
+      httpd_ws_frame_t fdPkt = {
+          .final = true,
+          .fragmented = false,
+          .type = HTTPD_WS_TYPE_BINARY,
+          .payload = (uint8_t *)&fdData,
+          .len = sizeof(telemetry_fd),
+      };
+      client->fdSent =
+          httpd_ws_send_frame_async(server, fd, &fdPkt) == ESP_OK;
     }
+    if (client->echoPending)
+    {
+      client->echo.sent_ms = now / 1000;
+      httpd_ws_frame_t echoPkt = {
+          .final = true,
+          .fragmented = false,
+          .type = HTTPD_WS_TYPE_BINARY,
+          .payload = (uint8_t *)&client->echo,
+          .len = sizeof(telemetry_echo),
+      };
+      client->echoPending =
+          httpd_ws_send_frame_async(server, fd, &echoPkt) != ESP_OK;
+    }
+    httpd_ws_send_frame_async(server, fd, &pkt);
+
+    // Stay on the client's schedule, but don't send a burst to catch up.
+    client->nextSendUs += 1000000 / client->rate;
+    if (client->nextSendUs < now)
+      client->nextSendUs = now;
   }
+  atomic_store(&frame->queued, false);
+}
+
+// Called by httpd for every new connection.
+static esp_err_t session_open(httpd_handle_t hd, int fd)
+{
+  session *client = session_get(fd);
+  if (client == NULL)
+    return ESP_FAIL;
+  *client = (session){.id = ++lastSessionId};
+  ESP_LOGI(TAG_WEB, "Session %lu opened on fd%d", (unsigned long)client->id,
+           fd);
+  return ESP_OK;
+}
+
+// Called by httpd when a connection closes, for any reason. Priority and
+// override held by the connection are released immediately rather than when
+// they time out, and the drive and arm jog are stopped if the connection had
+// priority.
+static void session_close(httpd_handle_t hd, int fd)
+{
+  int64_t now = hal_time_us();
+  session *client = session_get(fd);
+  if (client != NULL)
+  {
+    ESP_LOGI(TAG_WEB, "Session %lu closed on fd%d",
+             (unsigned long)client->id, fd);
+    *client = (session){0};
+  }
+
+  if (webState.drive_priority_fd == fd &&
+      now <= webState.drive_priority_until)
+  {
+    webState.drive_priority_fd = -1;
+    webState.drive_priority_until = 0;
+    webState.left = 0;
+    webState.right = 0;
+    webState.drive_seq++;
+    setpoint_send();
+  }
+  if (webState.arm_priority_fd == fd)
+  {
+    webState.arm_priority_fd = -1;
+    webState.arm_priority_until = 0;
+    if (webState.jogging)
+    {
+      webState.jog_until = 0;
+      setpoint_send();
+    }
+  }
+  if (webState.override_fd == fd)
+  {
+    webState.override_fd = -1;
+    webState.overriden_until = 0;
+  }
+
+  // httpd leaves closing the socket to close_fn.
+  close(fd);
 }
 
 void webserver()
 {
-  httpd_handle_t server = NULL;
   httpd_config_t config = HTTPD_DEFAULT_CONFIG();
   config.backlog_conn = 10;
   config.uri_match_fn = httpd_uri_match_wildcard;
+  config.open_fn = session_open;
+  config.close_fn = session_close;
 
   ESP_LOGI(TAG_WEB, "Starting webserver on port %d.", config.server_port);
   if (httpd_start(&server, &config) == ESP_OK)
@@ -409,61 +926,86 @@ void webserver()
     ESP_LOGI(TAG_WEB, "Registering URI handlers.");
     ESP_ERROR_CHECK(httpd_register_uri_handler(server, &websocketConfig));
     ESP_ERROR_CHECK(httpd_register_uri_handler(server, &displayConfig));
+    // Before rootConfig, which matches every URI.
+    ESP_ERROR_CHECK(httpd_register_uri_handler(server, &statsConfig));
     ESP_ERROR_CHECK(httpd_register_uri_handler(server, &rootConfig));
 
-    // Send telemetry every 100ms.
+    // Build telemetry every MAINLOOP_DELAY, the period of the fastest rate a
+    // client can request.
     while (server != NULL)
     {
-      int64_t now = esp_timer_get_time();
+      telemetry_frame *frame = NULL;
+      for (int i = 0; i < TELEMETRY_FRAMES && frame == NULL; i++)
+        if (!atomic_load(&telemetryFrames[i].queued))
+          frame = &telemetryFrames[i];
+      if (frame == NULL)
+      {
+        // The httpd task is behind, skip this tick.
+        vTaskDelay(MAINLOOP_DELAY / portTICK_PERIOD_MS);
+        continue;
+      }
+      telemetry *txData = &frame->data;
+
+      int64_t now = hal_time_us();
       // Send file descriptor(s) with priority and override unless they are
       // expired.
-      txData.drive_priority_fd = now <= webState.drive_priority_until
-                                     ? webState.drive_priority_fd
-                                     : -1;
-      txData.arm_priority_fd =
+      txData->drive_priority_fd = now <= webState.drive_priority_until
+                                      ? webState.drive_priority_fd
+                                      : -1;
+      txData->arm_priority_fd =
           now <= webState.arm_priority_until ? webState.arm_priority_fd : -1;
-      txData.override_fd =
+      txData->override_fd =
           now <= webState.overriden_until ? webState.override_fd : -1;
 
+      tft_status status = {
+          .estop = estop_get(),
+          .drive = txData->drive_priority_fd != -1,
+          .arm = txData->arm_priority_fd != -1,
+          .overriden = txData->override_fd != -1,
+      };
+      tft_status_set(&status);
+
       // Needed because txData is packed and pointers may be unaligned.
       float escCurrent, cell1, cell2, cell3;
       current_sense_get(&escCurrent, &cell1, &cell2, &cell3);
-      txData.esc_current = escCurrent;
-      txData.cell1 = cell1;
-      txData.cell2 = cell2;
-      txData.cell3 = cell3;
-
-      txData.l = webState.left;
-      txData.r = webState.right;
-      txData.ax = webState.x;
-      txData.j2 = webState.j2;
-      txData.j3 = webState.j3;
+      txData->esc_current = escCurrent;
+      txData->cell1 = cell1;
+      txData->cell2 = cell2;
+      txData->cell3 = cell3;
+
+      control_arm_status arm;
+      control_arm_get(&arm);
+      // While jogging the control task moves the arm setpoints.
+      bool jogging = webState.jogging;
+      uint16_t ax = jogging ? arm.setpoint[ARM_X] : webState.x;
+      uint16_t j2 = jogging ? arm.setpoint[ARM_J2] : webState.j2;
+      uint16_t j3 = jogging ? arm.setpoint[ARM_J3] : webState.j3;
+
+      txData->l = webState.left;
+      txData->r = webState.right;
+      txData->ax = ax;
+      txData->j2 = j2;
+      txData->j3 = j3;
 
       // Needed because txData is packed and pointers may be unaligned.
       int16_t x, y, z;
-      fk_calculate_position(webState.x, webState.j2, webState.j3, &x, &y, &z);
-      txData.x = x;
-      txData.y = y;
-      txData.z = z;
-
-      txData.drive_speed = webState.drive_speed;
-
-      bool estop = estop_get();
-      bool pms_stop = true; // TODO: set based on cell_sense_get
-      buzzer_set(pms_stop);
-      if (estop || pms_stop)
-      {
-        esc_enabled_set(false);
-        motor_control_set(0, 0, 0, 0, 0);
-      }
-      else
-      {
-        esc_enabled_set(true);
-        motor_control_set(webState.left, webState.right, webState.x,
-                          webState.j2, webState.j3);
-      }
-
-      httpd_queue_work(server, send_telemetry, server);
+      fk_calculate_position(ax, j2, j3, &x, &y, &z);
+      txData->x = x;
+      txData->y = y;
+      txData->z = z;
+
+      txData->drive_speed = webState.drive_speed;
+      txData->ik_reachable =
+          jogging ? !arm.jogHeld : webState.ik_reachable;
+
+      txData->ax_error = saturate_int16(arm.error[ARM_X]);
+      txData->j2_error = saturate_int16(arm.error[ARM_J2]);
+      txData->j3_error = saturate_int16(arm.error[ARM_J3]);
+
+      txData->fd = -1;
+      atomic_store(&frame->queued, true);
+      if (httpd_queue_work(server, send_telemetry, frame) != ESP_OK)
+        atomic_store(&frame->queued, false);
       vTaskDelay(MAINLOOP_DELAY / portTICK_PERIOD_MS);
     }
     ESP_LOGE(TAG_WEB, "Main loop exited!");